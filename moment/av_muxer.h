@@ -36,12 +36,38 @@ protected:
     Sender *sender;
 
 public:
+    // Data which becomes known only at the end of the file.
+    struct FinalData
+    {
+        // Contents of the seek index file to be written next to the recording.
+        Ref<String> index;
+        // To be written over the file at 'patch_offset' once all muxed data
+        // has been written.
+        Ref<String> patch;
+        Uint64      patch_offset;
+        // If set, the file is to be rewritten once it has been closed:
+        // the result is 'rewrite_header' followed by 'rewrite_data_len' bytes
+        // of the original file starting at 'rewrite_data_offset'.
+        Ref<String> rewrite_header;
+        Uint64      rewrite_data_offset;
+        Uint64      rewrite_data_len;
+
+        FinalData ()
+            : patch_offset (0),
+              rewrite_data_offset (0),
+              rewrite_data_len (0)
+        {}
+    };
+
     virtual mt_throws Result beginMuxing () = 0;
     virtual mt_throws Result muxAudioMessage (VideoStream::AudioMessage * mt_nonnull msg) = 0;
     virtual mt_throws Result muxVideoMessage (VideoStream::VideoMessage * mt_nonnull msg) = 0;
     virtual mt_throws Result endMuxing () = 0;
     virtual void reset () = 0;
 
+    // Should be called before endMuxing(). The default is no final data.
+    virtual void getFinalData (FinalData * const mt_nonnull /* ret_data */) {}
+
     void setSender (Sender * const sender) { this->sender = sender; }
 
     AvMuxer () : sender (NULL) {}
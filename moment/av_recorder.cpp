@@ -17,6 +17,11 @@
 */
 
 
+#include <unistd.h>
+#include <errno.h>
+
+#include <moment/util_moment.h>
+
 #include <moment/av_recorder.h>
 
 
@@ -27,16 +32,53 @@ namespace Moment {
 static LogGroup libMary_logGroup_recorder ("av_recorder", LogLevel::I);
 static LogGroup libMary_logGroup_recorder_frames ("av_recorder_frames", LogLevel::I);
 
+Mutex AvRecorder::recorder_list_mutex;
+AvRecorder::RecorderList AvRecorder::recorder_list;
+
 Sender::Frontend const AvRecorder::sender_frontend = {
     senderSendStateChanged,
     senderClosed
 };
 
+RecordingWriter::CloseFrontend const AvRecorder::writer_close_frontend = {
+    writerClosed
+};
+
 VideoStream::FrameSaver::FrameHandler const AvRecorder::saved_frame_handler = {
     savedAudioFrame,
     savedVideoFrame
 };
 
+static ConstMemory
+stripDirectory (ConstMemory const path)
+{
+    for (Size i = path.len(); i > 0; --i) {
+        if (path.mem() [i - 1] == '/')
+            return path.region (i);
+    }
+
+    return path;
+}
+
+// Splits "dir/name.ext" into "dir/name" and ".ext".
+static void
+splitExtension (ConstMemory   const path,
+                ConstMemory * const mt_nonnull ret_name,
+                ConstMemory * const mt_nonnull ret_ext)
+{
+    Size const name_pos = path.len() - stripDirectory (path).len();
+    for (Size i = path.len(); i > name_pos; --i) {
+        if (path.mem() [i - 1] == '.') {
+            *ret_name = path.region (0, i - 1);
+            *ret_ext  = path.region (i - 1);
+            return;
+        }
+    }
+
+    *ret_name = path;
+    *ret_ext  = ConstMemory();
+}
+
 Result
 AvRecorder::savedAudioFrame (VideoStream::AudioMessage * const mt_nonnull audio_msg,
                              void                      * const _self)
@@ -99,19 +141,346 @@ mt_mutex (mutex) void
 AvRecorder::doStop ()
 {
     cur_stream_ticket = NULL;
+    ++recording_seq;
+
+    if (next_recording) {
+        discardRecording (next_recording);
+        next_recording = NULL;
+    }
 
     if (recording) {
-	// Note that muxer->endMuxing() implies recording->sender.closeAfterFlush().
-	if (!muxer->endMuxing ())
-	    logE (recorder, _func, "muxer->endMuxing() failed: ", exc->toString());
+        finishRecording ();
 
       // The file can't be released at this point, because it is used by
       // deferred sender. The file is released later in senderClosed().
 
+        if (segment_params.isEnabled())
+            addManifestEntry (recording, cur_frame_time);
+
 	recording = NULL;
     }
 }
 
+mt_mutex (mutex) void
+AvRecorder::finishRecording ()
+{
+    // Final data is taken before endMuxing() so that it is known
+    // by the time the file gets closed.
+    AvMuxer::FinalData final_data;
+    muxer->getFinalData (&final_data);
+
+    if (final_data.index) {
+        queueFileWrite (makeString (recording->filename->mem(), ".idx"), final_data.index);
+        final_data.index = NULL;
+    }
+
+    recording->mutex.lock ();
+    recording->final_data = final_data;
+    recording->mutex.unlock ();
+
+    // Note that muxer->endMuxing() implies recording->sender.closeAfterFlush().
+    if (!muxer->endMuxing ())
+        logE (recorder, _func, "muxer->endMuxing() failed: ", exc->toString());
+}
+
+Ref<AvRecorder::Recording>
+AvRecorder::openRecording (ConstMemory const filename)
+{
+    Ref<Recording> const recording = grab (new Recording);
+
+    recording->weak_av_recorder = this;
+    recording->unsafe_av_recorder = this;
+    recording->filename = grab (new (std::nothrow) String (filename));
+
+    if (writer_params.buffer_size > 0) {
+        if (!recording->writer.open (filename,
+                                     writer_params,
+                                     storage,
+                                     thread_ctx->getDeferredProcessor(),
+                                     thread_ctx->getTimers(),
+                                     thread_ctx->getPollGroup()))
+        {
+            logE (recorder, _func, "writer.open() failed for filename ",
+                  filename, ": ", exc->toString());
+            return NULL;
+        }
+
+        recording->writer.setCloseFrontend (
+                CbDesc<RecordingWriter::CloseFrontend> (&writer_close_frontend,
+                                                        recording /* cb_data */,
+                                                        recording /* coderef_container */));
+        recording->use_writer = true;
+    } else {
+        recording->storage_file = storage->openFile (filename, thread_ctx->getDeferredProcessor());
+        if (!recording->storage_file) {
+            logE (recorder, _func, "storage->openFile() failed for filename ",
+                  filename, ": ", exc->toString());
+            return NULL;
+        }
+        recording->conn = recording->storage_file->getConnection();
+
+        recording->sender.setConnection (recording->conn);
+        recording->sender.setQueue (thread_ctx->getDeferredConnectionSenderQueue());
+        recording->sender.setFrontend (
+                CbDesc<Sender::Frontend> (&sender_frontend,
+                                          recording /* cb_data */,
+                                          recording /* coderef_container */));
+    }
+
+    return recording;
+}
+
+// Closes a pre-opened segment which has never been written to.
+void
+AvRecorder::discardRecording (Recording * const mt_nonnull recording)
+{
+    getRecordingSender (recording)->closeAfterFlush ();
+
+    if (unlink (recording->filename->cstr()) == -1)
+        logE (recorder, _func, "unlink() failed for ", recording->filename->mem(), ": ", errnoString (errno));
+}
+
+Sender*
+AvRecorder::getRecordingSender (Recording * const mt_nonnull recording)
+{
+    if (recording->use_writer)
+        return &recording->writer;
+
+    return &recording->sender;
+}
+
+mt_mutex (mutex) Ref<String>
+AvRecorder::makeSegmentFilename (Count const segment_no)
+{
+    return makeString (segment_base_name->mem(), "_", segment_no, segment_ext->mem());
+}
+
+mt_mutex (mutex) bool
+AvRecorder::segmentLimitReached (Time const segment_time_nanosec)
+{
+    if (segment_params.segment_duration_sec > 0
+        && segment_time_nanosec >= segment_params.segment_duration_sec * 1000000000)
+    {
+        return true;
+    }
+
+    if (segment_params.segment_size > 0
+        && segment_bytes >= segment_params.segment_size)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+// Called on a video keyframe, which becomes the first frame of the new segment.
+mt_mutex (mutex) void
+AvRecorder::switchSegment (Time const segment_time_nanosec)
+{
+    if (!next_recording) {
+        // Extending the current segment is better than blocking the stream
+        // on opening a file.
+        logD (recorder, _func, "next segment is not ready");
+        if (!opening_next_recording) {
+            opening_next_recording = true;
+            deferred_reg.scheduleTask (&open_task, false /* permanent */);
+        }
+        return;
+    }
+
+    finishRecording ();
+
+    addManifestEntry (recording, segment_time_nanosec);
+
+    recording = next_recording;
+    next_recording = NULL;
+    ++segment_no;
+    segment_bytes = 0;
+
+    logD (recorder, _func, "segment ", segment_no, ": ", recording->filename->mem());
+
+    muxer->setSender (getRecordingSender (recording));
+    if (!muxer->beginMuxing ())
+        logE (recorder, _func, "muxer->beginMuxing() failed: ", exc->toString());
+
+    // Timestamps start from zero in every segment.
+    got_first_frame = false;
+    first_frame_time = 0;
+    cur_frame_time = 0;
+
+    muxInitialMessages ();
+
+    if (recording) {
+        opening_next_recording = true;
+        deferred_reg.scheduleTask (&open_task, false /* permanent */);
+    }
+}
+
+// The manifest is a plain extended M3U playlist. HLS tags are not written:
+// segments are FLV or self-contained MP4 files, which HLS clients can't play.
+mt_mutex (mutex) void
+AvRecorder::addManifestEntry (Recording * const mt_nonnull recording,
+                              Time        const segment_time_nanosec)
+{
+    if (!manifest_filename)
+        return;
+
+    {
+        ManifestEntry * const entry = &manifest_entries.appendEmpty()->data;
+        entry->filename = recording->filename;
+        entry->duration_millisec = segment_time_nanosec / 1000000;
+    }
+
+    // 'segment_no' is the number of the segment which has just been added.
+    while (segment_no + 1 - manifest_first_no > segment_params.manifest_length) {
+        manifest_entries.remove (manifest_entries.getFirstElement());
+        ++manifest_first_no;
+    }
+
+    PagePool::PageListHead page_list;
+    page_pool->printToPages (&page_list, "#EXTM3U\n");
+    {
+        List<ManifestEntry>::iter iter (manifest_entries);
+        while (!manifest_entries.iter_done (iter)) {
+            ManifestEntry * const entry = &manifest_entries.iter_next (iter)->data;
+            page_pool->printToPages (&page_list,
+                                     "#EXTINF:", (entry->duration_millisec + 999) / 1000, ",\n",
+                                     stripDirectory (entry->filename->mem()), "\n");
+        }
+    }
+
+    queueFileWrite (manifest_filename, page_list.first);
+}
+
+mt_mutex (mutex) void
+AvRecorder::queueFileWrite (String * const mt_nonnull filename,
+                            String * const mt_nonnull data)
+{
+    PendingFile * const pending_file = &pending_files.appendEmpty()->data;
+    pending_file->filename = filename;
+    pending_file->data = data;
+
+    deferred_reg.scheduleTask (&file_task, false /* permanent */);
+}
+
+mt_mutex (mutex) void
+AvRecorder::queueFileWrite (String         * const mt_nonnull filename,
+                            PagePool::Page * const first_page)
+{
+    PendingFile * const pending_file = &pending_files.appendEmpty()->data;
+    pending_file->filename = filename;
+    pending_file->first_page = first_page;
+
+    deferred_reg.scheduleTask (&file_task, false /* permanent */);
+}
+
+bool
+AvRecorder::openTask (void * const _self)
+{
+    AvRecorder * const self = static_cast <AvRecorder*> (_self);
+
+    self->mutex.lock ();
+    if (!self->recording || self->next_recording) {
+        self->opening_next_recording = false;
+        self->mutex.unlock ();
+        return false /* Do not reschedule */;
+    }
+
+    Count const recording_seq = self->recording_seq;
+    Ref<String> const filename = self->makeSegmentFilename (self->segment_no + 1);
+    self->mutex.unlock ();
+
+    Ref<Recording> const next_recording = self->openRecording (filename->mem());
+
+    self->mutex.lock ();
+    self->opening_next_recording = false;
+
+    if (!next_recording) {
+        // Retried on the next keyframe.
+        self->mutex.unlock ();
+        return false /* Do not reschedule */;
+    }
+
+    if (recording_seq != self->recording_seq) {
+        self->mutex.unlock ();
+        discardRecording (next_recording);
+        return false /* Do not reschedule */;
+    }
+
+    self->next_recording = next_recording;
+    self->mutex.unlock ();
+
+    return false /* Do not reschedule */;
+}
+
+bool
+AvRecorder::fileTask (void * const _self)
+{
+    AvRecorder * const self = static_cast <AvRecorder*> (_self);
+
+    for (;;) {
+        self->mutex.lock ();
+        if (self->pending_files.isEmpty()) {
+            self->mutex.unlock ();
+            break;
+        }
+
+        PendingFile const pending_file = self->pending_files.getFirst();
+        self->pending_files.remove (self->pending_files.getFirstElement());
+        self->mutex.unlock ();
+
+        Result res = Result::Success;
+        if (pending_file.data) {
+            res = writeFileAtomically (pending_file.filename->mem(), pending_file.data->mem());
+        } else {
+            res = writeFileAtomically (pending_file.filename->mem(), pending_file.first_page);
+            self->page_pool->msgUnref (pending_file.first_page);
+        }
+
+        if (!res)
+            logE (recorder, _func, "writeFileAtomically() failed: ", exc->toString());
+    }
+
+    return false /* Do not reschedule */;
+}
+
+// Called from the recorder thread when all data has been written to the file.
+void
+AvRecorder::recordingClosed (Recording * const mt_nonnull recording,
+                             bool        const write_error)
+{
+    recording->mutex.lock ();
+    AvMuxer::FinalData const final_data = recording->final_data;
+    recording->final_data = AvMuxer::FinalData ();
+    recording->mutex.unlock ();
+
+    if (write_error)
+        return;
+
+    if (final_data.patch) {
+        if (!patchFile (recording->filename->mem(), final_data.patch_offset, final_data.patch->mem()))
+            logE (recorder, _func, "patchFile() failed: ", exc->toString());
+    }
+
+    if (final_data.rewrite_header) {
+        if (!rewriteFileWithHeader (recording->filename->mem(),
+                                    final_data.rewrite_header->mem(),
+                                    final_data.rewrite_data_offset,
+                                    final_data.rewrite_data_len))
+        {
+            logE (recorder, _func, "rewriteFileWithHeader() failed: ", exc->toString());
+        }
+    }
+}
+
+void
+AvRecorder::writerClosed (bool   const write_error,
+                          void * const _recording)
+{
+    Recording * const recording = static_cast <Recording*> (_recording);
+    recordingClosed (recording, write_error);
+}
+
 void
 AvRecorder::senderSendStateChanged (Sender::SendState   const send_state,
 				    void              * const _recording)
@@ -130,6 +499,8 @@ AvRecorder::senderClosed (Exception * const exc_,
     if (exc_)
 	logE (recorder, _func, "exception: ", exc_->toString());
 
+    recordingClosed (recording, exc_ != NULL /* write_error */);
+
     CodeRef const self_ref = recording->weak_av_recorder;
     if (!self_ref) {
 	return;
@@ -191,6 +562,7 @@ AvRecorder::streamAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg
     }
 
     self->total_bytes_recorded += alt_msg.msg_len;
+    self->segment_bytes += alt_msg.msg_len;
 
     self->mutex.unlock ();
 }
@@ -219,6 +591,20 @@ AvRecorder::streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg
 	return;
     }
 
+    if (self->segment_params.isEnabled()
+        && self->got_first_frame
+        && msg->frame_type.isKeyFrame())
+    {
+        Time const segment_time = msg->timestamp_nanosec - self->first_frame_time;
+        if (self->segmentLimitReached (segment_time)) {
+            self->switchSegment (segment_time);
+            if (!self->recording) {
+                self->mutex.unlock ();
+                return;
+            }
+        }
+    }
+
     if (!self->got_first_frame && msg->frame_type.isVideoData()) {
 	logD (recorder_frames, _func, "first frame (video)");
 	self->got_first_frame = true;
@@ -237,6 +623,7 @@ AvRecorder::streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg
     }
 
     self->total_bytes_recorded += alt_msg.msg_len;
+    self->segment_bytes += alt_msg.msg_len;
 
     self->mutex.unlock ();
 }
@@ -273,28 +660,37 @@ AvRecorder::start (ConstMemory const filename)
     first_frame_time = 0;
     cur_frame_time = 0;
 
-    recording = grab (new Recording);
-    muxer->setSender (&recording->sender);
-
-    recording->storage_file = storage->openFile (filename, thread_ctx->getDeferredProcessor());
-    if (!recording->storage_file) {
-	logE (recorder, _func, "storage->openFile() failed for filename ",
-	      filename, ": ", exc->toString());
-	recording = NULL;
-	mutex.unlock ();
-	return;
+    ++recording_seq;
+    segment_no = 0;
+    segment_bytes = 0;
+    opening_next_recording = false;
+    manifest_entries.clear ();
+    manifest_first_no = 0;
+    manifest_filename = NULL;
+
+    Ref<String> cur_filename;
+    if (segment_params.isEnabled()) {
+        ConstMemory base_name;
+        ConstMemory ext;
+        splitExtension (filename, &base_name, &ext);
+
+        segment_base_name = grab (new (std::nothrow) String (base_name));
+        segment_ext = grab (new (std::nothrow) String (ext));
+        if (segment_params.manifest_length > 0)
+            manifest_filename = makeString (base_name, ".m3u");
+
+        cur_filename = makeSegmentFilename (0);
+    } else {
+        cur_filename = grab (new (std::nothrow) String (filename));
     }
-    recording->conn = recording->storage_file->getConnection();
 
-    recording->weak_av_recorder = this;
-    recording->unsafe_av_recorder = this;
+    recording = openRecording (cur_filename->mem());
+    if (!recording) {
+        mutex.unlock ();
+        return;
+    }
 
-    recording->sender.setConnection (recording->conn);
-    recording->sender.setQueue (thread_ctx->getDeferredConnectionSenderQueue());
-    recording->sender.setFrontend (
-	    CbDesc<Sender::Frontend> (&sender_frontend,
-				      recording /* cb_data */,
-				      recording /* coderef_container */));
+    muxer->setSender (getRecordingSender (recording));
 
     paused = false;
 
@@ -305,6 +701,11 @@ AvRecorder::start (ConstMemory const filename)
 
     muxInitialMessages ();
 
+    if (recording && segment_params.isEnabled()) {
+        opening_next_recording = true;
+        deferred_reg.scheduleTask (&open_task, false /* permanent */);
+    }
+
     mutex.unlock ();
 }
 
@@ -333,6 +734,55 @@ AvRecorder::stop ()
     mutex.unlock ();
 }
 
+bool
+AvRecorder::getWriterStats (RecordingWriter::Stats * const mt_nonnull ret_stats,
+                            Ref<String>            * const ret_filename)
+{
+    mutex.lock ();
+    if (!recording || !recording->use_writer) {
+        mutex.unlock ();
+        return false;
+    }
+
+    recording->writer.getStats (ret_stats);
+    if (ret_filename)
+        *ret_filename = recording->filename;
+    mutex.unlock ();
+    return true;
+}
+
+void
+AvRecorder::printWriterStats (PagePool               * const mt_nonnull page_pool,
+                              PagePool::PageListHead * const mt_nonnull page_list)
+{
+    recorder_list_mutex.lock ();
+
+    RecorderList::iterator iter (recorder_list);
+    while (!iter.done()) {
+        AvRecorder * const av_recorder = iter.next ();
+
+        RecordingWriter::Stats stats;
+        Ref<String> filename;
+        if (!av_recorder->getWriterStats (&stats, &filename))
+            continue;
+
+        page_pool->printToPages (
+                page_list,
+                "<tr>"
+                "<td>", filename, "</td>"
+                "<td>", stats.bytes_written, "</td>"
+                "<td>", stats.num_writes, "</td>"
+                "<td>", stats.queue_depth, "</td>"
+                "<td>", stats.max_queue_depth, "</td>"
+                "<td>", stats.last_write_latency_microsec, "</td>"
+                "<td>", stats.avg_write_latency_microsec, "</td>"
+                "<td>", stats.max_write_latency_microsec, "</td>"
+                "</tr>");
+    }
+
+    recorder_list_mutex.unlock ();
+}
+
 void
 AvRecorder::setVideoStream (VideoStream * const stream)
 {
@@ -365,29 +815,65 @@ AvRecorder::setMuxer (AvMuxer * const muxer)
 
 mt_const void
 AvRecorder::init (ServerThreadContext * const thread_ctx,
-		  Storage             * const storage)
+		  Storage             * const storage,
+		  PagePool            * const page_pool)
 {
     this->thread_ctx = thread_ctx;
     this->storage = storage;
+    this->page_pool = page_pool;
+
+    deferred_reg.setDeferredProcessor (thread_ctx->getDeferredProcessor());
+
+    recorder_list_mutex.lock ();
+    recorder_list.append (this);
+    in_recorder_list = true;
+    recorder_list_mutex.unlock ();
 }
 
 AvRecorder::AvRecorder (Object * const coderef_container)
     : DependentCodeReferenced (coderef_container),
       thread_ctx (NULL),
       storage (NULL),
+      page_pool (NULL),
       paused (false),
       got_first_frame (false),
       first_frame_time (0),
       cur_frame_time (0),
-      total_bytes_recorded (0)
+      recording_seq (0),
+      segment_no (0),
+      segment_bytes (0),
+      opening_next_recording (false),
+      manifest_first_no (0),
+      total_bytes_recorded (0),
+      in_recorder_list (false)
 {
+    open_task.cb = CbDesc<DeferredProcessor::TaskCallback> (openTask, this, coderef_container);
+    file_task.cb = CbDesc<DeferredProcessor::TaskCallback> (fileTask, this, coderef_container);
 }
 
 AvRecorder::~AvRecorder ()
 {
+    if (in_recorder_list) {
+        recorder_list_mutex.lock ();
+        recorder_list.remove (this);
+        recorder_list_mutex.unlock ();
+    }
+
     mutex.lock ();
     doStop ();
     mutex.unlock ();
+
+    deferred_reg.release ();
+
+    mutex.lock ();
+    while (!pending_files.isEmpty()) {
+        PendingFile * const pending_file = &pending_files.getFirst();
+        if (pending_file->first_page)
+            page_pool->msgUnref (pending_file->first_page);
+
+        pending_files.remove (pending_files.getFirstElement());
+    }
+    mutex.unlock ();
 }
 
 }
@@ -25,13 +25,15 @@
 
 #include <moment/storage.h>
 #include <moment/av_muxer.h>
+#include <moment/recording_writer.h>
 
 
 namespace Moment {
 
 using namespace M;
 
-class AvRecorder : public DependentCodeReferenced
+class AvRecorder : public DependentCodeReferenced,
+                   public IntrusiveListElement<>
 {
 private:
     Mutex mutex;
@@ -42,6 +44,29 @@ public:
 		       void      *cb_data);
     };
 
+    // Segmented recording: the recording is split into a series of files,
+    // a new segment begins on a video keyframe once the current segment
+    // reaches 'segment_duration_sec' or 'segment_size' bytes. Segment files
+    // are named "<name>_<n><ext>", a rolling manifest "<name>.m3u" lists
+    // the latest 'manifest_length' segments.
+    struct SegmentParams
+    {
+        // 0 - no limit. Both 0 means that segmentation is disabled.
+        Time   segment_duration_sec;
+        Uint64 segment_size;
+        // 0 - no manifest.
+        Count  manifest_length;
+
+        bool isEnabled () const
+            { return segment_duration_sec > 0 || segment_size > 0; }
+
+        SegmentParams ()
+            : segment_duration_sec (0),
+              segment_size (0),
+              manifest_length (10)
+        {}
+    };
+
 private:
     // Tickets help to distinguish asynchronous messages from different streams.
     // The allows to ignore messages from the old stream when switching streams.
@@ -64,13 +89,25 @@ private:
 	WeakCodeRef weak_av_recorder;
 	AvRecorder *unsafe_av_recorder;
 
+	mt_const Ref<String> filename;
+
 	Connection *conn;
 	mt_mutex (mutex) Ref<Storage::StorageFile> storage_file;
 
+        // Applied to the file once it is closed, see recordingClosed().
+        mt_mutex (mutex) AvMuxer::FinalData final_data;
+
 	DeferredConnectionSender sender;
 
+        // Used instead of 'storage_file' and 'sender' when write coalescing
+        // is enabled.
+        mt_const bool use_writer;
+        RecordingWriter writer;
+
 	Recording ()
-	    : sender (this /* coderef_container */)
+	    : sender (this /* coderef_container */),
+              use_writer (false),
+              writer (this /* coderef_container */)
 	{
 //	    logD_ (_func, "0x", fmt_hex, (UintPtr) this);
 	}
@@ -87,6 +124,7 @@ private:
 
     mt_const ServerThreadContext *thread_ctx;
     mt_const Storage *storage;
+    mt_const PagePool *page_pool;
 
     // Muxer operations should be synchronized with 'mutex'.
     mt_const AvMuxer *muxer;
@@ -98,11 +136,69 @@ private:
     mt_mutex (mutex) Time first_frame_time;
     mt_mutex (mutex) Time cur_frame_time;
 
+    mt_const RecordingWriter::Params writer_params;
+    mt_const SegmentParams segment_params;
+
+    struct PendingFile
+    {
+        Ref<String> filename;
+        // Either 'data' or 'first_page' is set. Pages are owned by
+        // the entry and come from 'page_pool'.
+        Ref<String> data;
+        PagePool::Page *first_page;
+
+        PendingFile ()
+            : first_page (NULL)
+        {}
+    };
+
+    struct ManifestEntry
+    {
+        Ref<String> filename;
+        Time duration_millisec;
+    };
+
+  mt_mutex (mutex)
+  mt_begin
+    // Incremented on every start()/stop() to discard stale asynchronous
+    // results of openTask.
+    Count recording_seq;
+
+    Ref<String> segment_base_name;
+    Ref<String> segment_ext;
+    Count       segment_no;
+    Uint64      segment_bytes;
+
+    // Next segment's file is opened in advance in the recorder thread,
+    // so that switching segments never blocks the stream.
+    Ref<Recording> next_recording;
+    bool           opening_next_recording;
+
+    List<ManifestEntry> manifest_entries;
+    Count               manifest_first_no;
+    Ref<String>         manifest_filename;
+
+    // Manifests and seek indexes to be written from the recorder thread.
+    List<PendingFile> pending_files;
+  mt_end
+
+    DeferredProcessor::Task open_task;
+    DeferredProcessor::Task file_task;
+    DeferredProcessor::Registration deferred_reg;
+
     mt_const Uint64 recording_limit;
     mt_mutex (mutex) Uint64 total_bytes_recorded;
 
     mt_const Cb<Frontend> frontend;
 
+    typedef IntrusiveList<AvRecorder> RecorderList;
+
+    // All initialized recorders, for printWriterStats().
+    static Mutex recorder_list_mutex;
+    static mt_mutex (recorder_list_mutex) RecorderList recorder_list;
+
+    mt_const bool in_recorder_list;
+
   mt_iface (VideoStream::FrameSaver::FrameHandler)
     static VideoStream::FrameSaver::FrameHandler const saved_frame_handler;
 
@@ -117,6 +213,43 @@ private:
 
     mt_mutex (mutex) void doStop ();
 
+    mt_mutex (mutex) void finishRecording ();
+
+    Ref<Recording> openRecording (ConstMemory filename);
+
+    static void discardRecording (Recording * mt_nonnull recording);
+
+    static Sender* getRecordingSender (Recording * mt_nonnull recording);
+
+    mt_mutex (mutex) Ref<String> makeSegmentFilename (Count segment_no);
+
+    mt_mutex (mutex) bool segmentLimitReached (Time segment_time_nanosec);
+
+    mt_mutex (mutex) void switchSegment (Time segment_time_nanosec);
+
+    mt_mutex (mutex) void addManifestEntry (Recording * mt_nonnull recording,
+                                            Time        segment_time_nanosec);
+
+    static bool openTask (void *_self);
+
+    mt_mutex (mutex) void queueFileWrite (String * mt_nonnull filename,
+                                          String * mt_nonnull data);
+
+    mt_mutex (mutex) void queueFileWrite (String         * mt_nonnull filename,
+                                          PagePool::Page *first_page);
+
+    static bool fileTask (void *_self);
+
+    static void recordingClosed (Recording * mt_nonnull recording,
+                                 bool        write_error);
+
+  mt_iface (RecordingWriter::CloseFrontend)
+    static RecordingWriter::CloseFrontend const writer_close_frontend;
+
+    static void writerClosed (bool  write_error,
+                              void *_recording);
+  mt_iface_end
+
   mt_iface (Sender::Frontend)
     static Sender::Frontend const sender_frontend;
 
@@ -155,8 +288,24 @@ public:
     mt_const void setRecordingLimit (Uint64 recording_limit)
         { this->recording_limit = recording_limit; }
 
+    mt_const void setWriterParams (RecordingWriter::Params const &writer_params)
+        { this->writer_params = writer_params; }
+
+    mt_const void setSegmentParams (SegmentParams const &segment_params)
+        { this->segment_params = segment_params; }
+
+    // Returns 'false' if there's no active recording going through
+    // a RecordingWriter. 'ret_filename' may be NULL.
+    bool getWriterStats (RecordingWriter::Stats * mt_nonnull ret_stats,
+                         Ref<String>            *ret_filename = NULL);
+
+    // Prints writer stats of all active recordings as HTML table rows.
+    static void printWriterStats (PagePool               * mt_nonnull page_pool,
+                                  PagePool::PageListHead * mt_nonnull page_list);
+
     mt_const void init (ServerThreadContext *thread_ctx,
-			Storage             *storage);
+			Storage             *storage,
+			PagePool            * mt_nonnull page_pool);
 
      AvRecorder (Object *coderef_container);
     ~AvRecorder ();
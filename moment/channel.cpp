@@ -28,7 +28,8 @@ static LogGroup libMary_logGroup_ctl ("moment.channel", LogLevel::I);
 
 Playback::Frontend Channel::playback_frontend = {
     startPlaybackItem,
-    stopPlaybackItem
+    stopPlaybackItem,
+    prerollPlaybackItem
 };
 
 void
@@ -56,6 +57,15 @@ Channel::stopPlaybackItem (void * const _self)
     self->endVideoStream ();
 }
 
+void
+Channel::prerollPlaybackItem (Playlist::Item * const item,
+                              Time             const seek,
+                              void           * const _self)
+{
+    Channel * const self = static_cast <Channel*> (_self);
+    self->prerollVideoStream (item ? item->playback_item.ptr() : NULL, seek);
+}
+
 VideoStream::EventHandler const Channel::stream_event_handler = {
     NULL /* audioMessage */,
     NULL /* videoMessage */,
@@ -223,6 +233,9 @@ Channel::createStream (Time const initial_seek)
 
 	logD_ (_func, "Calling moment->addVideoStream, stream_name: ", channel_opts->channel_name->mem());
 	video_stream_key = moment->addVideoStream (video_stream, channel_opts->channel_name->mem());
+
+        if (timeshift_buffer)
+            timeshift_buffer->setVideoStream (video_stream);
     }
 
     Ref<VideoStream> bind_stream = video_stream;
@@ -231,37 +244,64 @@ Channel::createStream (Time const initial_seek)
         video_stream->bindToStream (bind_stream, bind_stream, true, true);
     }
 
-    beginConnectOnDemand (true /* start_timer */);
+    // With 'connect_on_demand', the media source is not created until
+    // the first watcher appears (see numWatchersChanged()).
+    bool defer_media_source = false;
+    if (channel_opts->connect_on_demand) {
+        video_stream->lock ();
+        defer_media_source = !video_stream->getNumWatchers_unlocked();
+        video_stream->unlock ();
+    }
+
+    beginConnectOnDemand (!defer_media_source /* start_timer */);
 
     if (stream_start_time == 0)
 	stream_start_time = getTime();
 
-    media_source = moment->createMediaSource (
-                           CbDesc<MediaSource::Frontend> (
-                                   &media_source_frontend,
-                                   cur_stream_data /* cb_data */,
-                                   this            /* coderef_container */,
-                                   cur_stream_data /* ref_data */),
-                           timers,
-                           deferred_processor,
-                           page_pool,
-                           bind_stream,
-                           moment->getMixVideoStream(),
-                           initial_seek,
-                           channel_opts,
-                           cur_item);
-    if (media_source) {
-	media_source->ref ();
+    if (defer_media_source) {
+        logD (ctl, _this_func, "no watchers, deferring media source creation");
+        deferred_initial_seek = initial_seek;
+        return;
+    }
+
+    media_source = startMediaSource (cur_stream_data, bind_stream, initial_seek, cur_item);
+}
+
+mt_mutex (mutex) Ref<MediaSource>
+Channel::startMediaSource (StreamData   * const mt_nonnull stream_data,
+                           VideoStream  * const mt_nonnull bind_stream,
+                           Time           const initial_seek,
+                           PlaybackItem * const mt_nonnull item)
+{
+    Ref<MediaSource> const new_media_source =
+            moment->createMediaSource (
+                    CbDesc<MediaSource::Frontend> (
+                            &media_source_frontend,
+                            stream_data /* cb_data */,
+                            this        /* coderef_container */,
+                            stream_data /* ref_data */),
+                    timers,
+                    deferred_processor,
+                    page_pool,
+                    bind_stream,
+                    moment->getMixVideoStream(),
+                    initial_seek,
+                    channel_opts,
+                    item);
+    if (new_media_source) {
+	new_media_source->ref ();
 	GThread * const thread = g_thread_create (
 #warning Not joinable?
-		streamThreadFunc, media_source, FALSE /* joinable */, NULL /* error */);
+		streamThreadFunc, new_media_source, FALSE /* joinable */, NULL /* error */);
 	if (thread == NULL) {
 	    logE_ (_func, "g_thread_create() failed");
-	    media_source->unref ();
+	    new_media_source->unref ();
 	}
     } else {
 #warning Handle !media_source case
     }
+
+    return new_media_source;
 }
 
 gpointer
@@ -305,6 +345,11 @@ Channel::closeStream (Ref<VideoStream> * const mt_nonnull ret_old_stream)
     }
     cur_stream_data = NULL;
 
+    if (cur_preroll_buffer) {
+        cur_preroll_buffer->release ();
+        cur_preroll_buffer = NULL;
+    }
+
 //    logD_ (_func, "video_stream: 0x", fmt_hex, (UintPtr) video_stream.ptr(), ", "
 //           "keep_video_stream: ", channel_opts->keep_video_stream, ", "
 //           "continuous_playback: ", channel_opts->continuous_playback);
@@ -336,6 +381,9 @@ Channel::closeStream (Ref<VideoStream> * const mt_nonnull ret_old_stream)
 //            logD_ (_func, "calling moment->addVideoStream, stream_name: ", channel_opts->channel_name->mem());
             video_stream_key = moment->addVideoStream (video_stream, channel_opts->channel_name->mem());
 
+            if (timeshift_buffer)
+                timeshift_buffer->setVideoStream (video_stream);
+
             // Note: This is correct and essential for connect_on_demand.
             beginConnectOnDemand (false /* start_timer */);
         }
@@ -357,8 +405,13 @@ Channel::doRestartStream (bool const from_ondemand_reconnect)
         new_video_stream = true;
     }
 
-    // TODO FIXME Set correct initial seek
-    createStream (0 /* initial_seek */);
+    // TODO FIXME Set correct initial seek for restarts after errors.
+    Time initial_seek = 0;
+    if (from_ondemand_reconnect)
+        initial_seek = deferred_initial_seek;
+    deferred_initial_seek = 0;
+
+    createStream (initial_seek);
 
     Ref<VideoStream> const new_stream = video_stream;
     mutex.unlock ();
@@ -456,6 +509,12 @@ Channel::gotVideo (void * const _stream_data)
     logD (ctl, _self_func_);
 
     self->mutex.lock ();
+    if (stream_data == self->preroll_stream_data) {
+        self->preroll_got_video = true;
+        self->mutex.unlock ();
+        return;
+    }
+
     if (stream_data != self->cur_stream_data ||
 	stream_data->stream_closed)
     {
@@ -467,6 +526,101 @@ Channel::gotVideo (void * const _stream_data)
     self->mutex.unlock ();
 }
 
+mt_mutex (mutex) void
+Channel::releasePreroll ()
+{
+    if (preroll_media_source)
+        preroll_media_source->releasePipeline ();
+
+    if (preroll_buffer)
+        preroll_buffer->release ();
+
+    preroll_item = NULL;
+    preroll_media_source = NULL;
+    preroll_stream = NULL;
+    preroll_buffer = NULL;
+    preroll_stream_data = NULL;
+    preroll_got_video = false;
+}
+
+mt_mutex (mutex) void
+Channel::splicePreroll ()
+{
+    logD (ctl, _this_func_);
+
+    assert (video_stream && preroll_media_source && preroll_buffer);
+
+    stream_stopped = false;
+    got_video = preroll_got_video;
+
+    preroll_stream_data->stream_ticket = stream_ticket;
+    preroll_stream_data->stream_ticket_ref = stream_ticket_ref;
+
+    cur_stream_data = preroll_stream_data;
+    media_source = preroll_media_source;
+    cur_preroll_buffer = preroll_buffer;
+
+    if (video_stream_events_sbn) {
+        video_stream->getEventInformer()->unsubscribe (video_stream_events_sbn);
+        video_stream_events_sbn = NULL;
+    }
+
+    // A fresh bind stream keeps the last GOP of the previous item from being
+    // replayed, and gives a new timestamp offset.
+    Ref<VideoStream> const bind_stream = grab (new (std::nothrow) VideoStream);
+    video_stream->bindToStream (bind_stream, bind_stream, true, true);
+    cur_preroll_buffer->start (bind_stream);
+
+    beginConnectOnDemand (true /* start_timer */);
+
+    if (stream_start_time == 0)
+	stream_start_time = getTime();
+
+    preroll_item = NULL;
+    preroll_media_source = NULL;
+    preroll_stream = NULL;
+    preroll_buffer = NULL;
+    preroll_stream_data = NULL;
+    preroll_got_video = false;
+}
+
+void
+Channel::prerollVideoStream (PlaybackItem * const item,
+                             Time           const seek)
+{
+    mutex.lock ();
+
+    releasePreroll ();
+
+    if (!item
+        || destroyed
+        || !channel_opts->continuous_playback)
+    {
+        mutex.unlock ();
+        return;
+    }
+
+    if (logLevelOn (ctl, LogLevel::Debug)) {
+        logD (ctl, _this_func_);
+        item->dump ();
+    }
+
+    preroll_item = item;
+    preroll_stream = grab (new (std::nothrow) VideoStream);
+
+    preroll_buffer = grab (new (std::nothrow) PrerollBuffer);
+    preroll_buffer->init (timers, preroll_stream);
+
+    // The ticket is replaced with the ticket of the item in splicePreroll().
+    preroll_stream_data = grab (new (std::nothrow) StreamData (this, stream_ticket, stream_ticket_ref.ptr()));
+
+    preroll_media_source = startMediaSource (preroll_stream_data, preroll_stream, seek, item);
+    if (!preroll_media_source)
+        releasePreroll ();
+
+    mutex.unlock ();
+}
+
 void
 Channel::beginVideoStream (PlaybackItem   * const mt_nonnull item,
                            void           * const stream_ticket,
@@ -490,7 +644,16 @@ Channel::beginVideoStream (PlaybackItem   * const mt_nonnull item,
     this->stream_ticket = stream_ticket;
     this->stream_ticket_ref = stream_ticket_ref;
 
-    createStream (seek);
+    if (preroll_media_source
+        && preroll_item == item
+        && video_stream
+        && channel_opts->continuous_playback)
+    {
+        splicePreroll ();
+    } else {
+        releasePreroll ();
+        createStream (seek);
+    }
 
     Ref<VideoStream> const new_stream = video_stream;
     mutex.unlock ();
@@ -598,7 +761,18 @@ Channel::init (MomentServer   * const mt_nonnull moment,
 
     playback.init (CbDesc<Playback::Frontend> (&playback_frontend, this, this),
                    moment->getServerApp()->getServerContext()->getMainThreadContext()->getTimers(),
-                   channel_opts->min_playlist_duration_sec);
+                   channel_opts->min_playlist_duration_sec,
+                   channel_opts->preroll_time_sec);
+
+    if (channel_opts->timeshift) {
+        timeshift_buffer = grab (new (std::nothrow) TimeshiftBuffer);
+        timeshift_buffer->init (moment,
+                                channel_opts->channel_name->mem(),
+                                channel_opts->timeshift_path->mem(),
+                                channel_opts->timeshift_window_sec,
+                                channel_opts->timeshift_memory_sec);
+        timeshift_buffer_key = moment->addTimeshiftBuffer (timeshift_buffer, channel_opts->channel_name->mem());
+    }
 }
 
 Channel::Channel ()
@@ -618,6 +792,9 @@ Channel::Channel ()
       got_video (false),
 
       stream_start_time (0),
+      deferred_initial_seek (0),
+
+      preroll_got_video (false),
 
       connect_on_demand_timer (NULL),
 
@@ -647,13 +824,32 @@ Channel::doDestroy (bool const from_dtor)
         if (media_source)
             media_source->releasePipeline ();
 
+        if (preroll_media_source)
+            preroll_media_source->releasePipeline ();
+
+        if (preroll_buffer)
+            preroll_buffer->release ();
+
+        if (cur_preroll_buffer)
+            cur_preroll_buffer->release ();
+
         if (video_stream_events_sbn)
             video_stream->getEventInformer()->unsubscribe (video_stream_events_sbn);
+
+        if (timeshift_buffer)
+            moment->removeTimeshiftBuffer (timeshift_buffer_key);
     }
 
     media_source = NULL;
     cur_stream_data = NULL;
     video_stream_events_sbn = NULL;
+
+    preroll_item = NULL;
+    preroll_media_source = NULL;
+    preroll_stream = NULL;
+    preroll_buffer = NULL;
+    preroll_stream_data = NULL;
+    cur_preroll_buffer = NULL;
     connect_on_demand_timer = NULL;
 
     Ref<VideoStream> old_stream = video_stream;
@@ -664,6 +860,9 @@ Channel::doDestroy (bool const from_dtor)
 
     mutex.unlock ();
 
+    if (!from_dtor && timeshift_buffer)
+        timeshift_buffer->release ();
+
     if (old_stream)
         old_stream->close ();
 }
@@ -25,6 +25,7 @@
 #include <moment/channel_options.h>
 #include <moment/media_source.h>
 #include <moment/playback.h>
+#include <moment/preroll_buffer.h>
 #include <moment/moment_server.h>
 
 
@@ -154,6 +155,10 @@ private:
 				     void                    *_self);
 
       static void stopPlaybackItem (void *_self);
+
+      static void prerollPlaybackItem (Playlist::Item *item,
+                                       Time            seek,
+                                       void           *_self);
     mt_iface_end
 
 public:
@@ -179,8 +184,10 @@ private:
     public:
         Channel * const channel;
 
-	void * const stream_ticket;
-	VirtRef const stream_ticket_ref;
+	// Prerolled streams get the ticket of the item they are started for
+	// at the switch.
+	mt_mutex (Channel::mutex) void *stream_ticket;
+	mt_mutex (Channel::mutex) VirtRef stream_ticket_ref;
 
 	mt_mutex (GstStreamCtl::mutex) bool stream_closed;
         mt_mutex (GstStreamCtl::mutex) Count num_watchers;
@@ -205,6 +212,10 @@ private:
     mt_mutex (mutex) GenericInformer::SubscriptionKey video_stream_events_sbn;
     mt_mutex (mutex) MomentServer::VideoStreamKey video_stream_key;
 
+    // Null unless 'channel_opts->timeshift' is set.
+    mt_const Ref<TimeshiftBuffer> timeshift_buffer;
+    mt_mutex (mutex) MomentServer::TimeshiftBufferKey timeshift_buffer_key;
+
     mt_mutex (mutex) bool destroyed;
 
     mt_mutex (mutex) void *stream_ticket;
@@ -215,6 +226,37 @@ private:
 
     mt_mutex (mutex) Time stream_start_time;
 
+    // Initial seek of a media source which has been deferred until the first
+    // watcher with 'connect_on_demand'.
+    mt_mutex (mutex) Time deferred_initial_seek;
+
+
+  // ______________________________ next item preroll ______________________________
+
+    // The next playlist item is started in advance into 'preroll_stream',
+    // and its output is held in 'preroll_buffer' from the first frame.
+    // At the switch, 'video_stream' is rebound to a fresh bind stream and
+    // the buffer starts playing into it, delayed by the time the source has
+    // been running, so that the opening of the item is not lost.
+    // Only used with 'continuous_playback'.
+
+    mt_mutex (mutex) Ref<PlaybackItem>  preroll_item;
+    mt_mutex (mutex) Ref<MediaSource>   preroll_media_source;
+    mt_mutex (mutex) Ref<VideoStream>   preroll_stream;
+    mt_mutex (mutex) Ref<PrerollBuffer> preroll_buffer;
+    mt_mutex (mutex) Ref<StreamData>    preroll_stream_data;
+    mt_mutex (mutex) bool               preroll_got_video;
+
+    // Plays out the current item after a splice, null otherwise.
+    mt_mutex (mutex) Ref<PrerollBuffer> cur_preroll_buffer;
+
+    mt_mutex (mutex) void releasePreroll ();
+
+    mt_mutex (mutex) void splicePreroll ();
+
+    void prerollVideoStream (PlaybackItem *item,
+                             Time          seek);
+
 
   // ____________________________ connect on demand ____________________________
 
@@ -236,6 +278,11 @@ private:
 
     void setStreamParameters (VideoStream * mt_nonnull video_stream);
 
+    mt_mutex (mutex) Ref<MediaSource> startMediaSource (StreamData   * mt_nonnull stream_data,
+                                                        VideoStream  * mt_nonnull bind_stream,
+                                                        Time          initial_seek,
+                                                        PlaybackItem * mt_nonnull item);
+
     mt_mutex (mutex) void createStream (Time initial_seek);
 
     static gpointer streamThreadFunc (gpointer _media_source);
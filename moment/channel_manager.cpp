@@ -19,6 +19,11 @@
 
 #include <libmary/types.h>
 #include <cctype>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 
 #include <mconfig/mconfig.h>
 #include <moment/libmoment.h>
@@ -77,6 +82,30 @@ ChannelManager::adminHttpRequest (HttpRequest * const mt_nonnull req,
             goto _return;
         }
 
+        ConstMemory const reply_body = "OK";
+        conn_sender->send (self->page_pool,
+                           true /* do_flush */,
+                           MOMENT_SERVER__OK_HEADERS ("text/plain", reply_body.len()),
+                           "\r\n",
+                           reply_body);
+        logA_ ("moment__channel_manager OK ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "reload_channels"))
+    {
+        logD_ (_func, "reload_channels");
+
+        if (!self->loadConfigFull ()) {
+            ConstMemory const reply_body = "500 Internal Server Error: loadConfigFull() failed";
+            conn_sender->send (self->page_pool,
+                               true /* do_flush */,
+                               MOMENT_SERVER__500_HEADERS (reply_body.len()),
+                               "\r\n",
+                               reply_body);
+            logA_ ("moment__channel_manager 500 ", req->getClientAddress(), " ", req->getRequestLine());
+            goto _return;
+        }
+
         ConstMemory const reply_body = "OK";
         conn_sender->send (self->page_pool,
                            true /* do_flush */,
@@ -247,11 +276,103 @@ ChannelManager::channelCreatedTask (void * const _self)
     return false /* do not rechedule */;
 }
 
+void
+ChannelManager::loadThreadFunc (void * const _load_job)
+{
+    LoadJob * const load_job = static_cast <LoadJob*> (_load_job);
+
+    for (;;) {
+        Count const idx = (Count) load_job->next_idx.fetchAdd (1);
+        if (idx >= load_job->num_configs)
+            break;
+
+        parseConfigFile (&load_job->parsed_configs [idx]);
+    }
+}
+
+void
+ChannelManager::parseConfigFile (ParsedConfig * const mt_nonnull parsed)
+{
+    Ref<MConfig::Config> const config = grab (new (std::nothrow) MConfig::Config);
+    if (!MConfig::parseConfig (parsed->item_path->mem(), config)) {
+        logE_ (_func, "could not parse config file ", parsed->item_path);
+        parsed->config = NULL;
+        return;
+    }
+
+    parsed->config = config;
+}
+
+bool
+ChannelManager::getConfigFileState (ConstMemory       const item_path,
+                                    ConfigFileState * const mt_nonnull ret_state)
+{
+    *ret_state = ConfigFileState ();
+
+    Byte path_cstr [item_path.len() + 1];
+    memcpy (path_cstr, item_path.mem(), item_path.len());
+    path_cstr [item_path.len()] = 0;
+
+    int const fd = open ((char const *) path_cstr, O_RDONLY);
+    if (fd == -1) {
+        logD_ (_func, "open() failed for ", item_path);
+        return false;
+    }
+
+    struct stat stat_buf;
+    if (fstat (fd, &stat_buf) == -1) {
+        logD_ (_func, "fstat() failed for ", item_path);
+        close (fd);
+        return false;
+    }
+
+    // FNV-1a. Config files are small, reading them once more is cheap
+    // compared to restarting a channel.
+    Uint64 hash = 0xcbf29ce484222325ULL;
+    for (;;) {
+        Byte buf [4096];
+        ssize_t const res = read (fd, buf, sizeof (buf));
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            logD_ (_func, "read() failed for ", item_path);
+            close (fd);
+            return false;
+        }
+
+        if (res == 0)
+            break;
+
+        for (ssize_t i = 0; i < res; ++i) {
+            hash ^= buf [i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    close (fd);
+
+    ret_state->mtime        = (Time) stat_buf.st_mtime;
+    ret_state->size         = (Uint64) stat_buf.st_size;
+    ret_state->content_hash = hash;
+    return true;
+}
+
 Result
 ChannelManager::loadConfigFull ()
 {
     logD_ (_func_);
 
+    reload_mutex.lock ();
+    Result const res = doLoadConfigFull ();
+    reload_mutex.unlock ();
+
+    return res;
+}
+
+mt_mutex (reload_mutex) Result
+ChannelManager::doLoadConfigFull ()
+{
     ConstMemory const dir_name = confd_dirname->mem();
     Ref<Vfs> const vfs = Vfs::createDefaultLocalVfs (dir_name);
 
@@ -261,6 +382,14 @@ ChannelManager::loadConfigFull ()
         return Result::Success;
     }
 
+    mutex.lock ();
+    ++load_generation;
+    Uint64 const cur_generation = load_generation;
+    mutex.unlock ();
+
+    Result res = Result::Success;
+
+    List<ParsedConfig> parsed_list;
     for (;;) {
         Ref<String> filename;
         if (!dir->getNextEntry (filename)) {
@@ -278,11 +407,129 @@ ChannelManager::loadConfigFull ()
             continue;
 
         StRef<String> const path = st_makeString (dir_name, "/", filename->mem());
-        if (!loadConfigItem (filename->mem(), path->mem()))
-            return Result::Failure;
+
+        ConfigFileState file_state;
+        bool const got_state = getConfigFileState (path->mem(), &file_state);
+
+        mutex.lock ();
+        if (ItemHash::EntryKey const item_key = item_hash.lookup (filename->mem())) {
+            StRef<ConfigItem> const item = item_key.getData();
+            item->load_generation = cur_generation;
+            if (got_state && item->file_state.equals (file_state)) {
+                mutex.unlock ();
+                logD_ (_func, "unchanged: ", filename);
+                continue;
+            }
+        }
+        mutex.unlock ();
+
+        parsed_list.appendEmpty ();
+        ParsedConfig * const parsed = &parsed_list.getLast();
+        parsed->item_name  = st_grab (new (std::nothrow) String (filename->mem()));
+        parsed->item_path  = path;
+        parsed->file_state = file_state;
     }
 
-    return Result::Success;
+    Count const num_configs = parsed_list.getNumElements();
+    logD_ (_func, "files to load: ", num_configs);
+
+    if (num_configs > 0) {
+        Ref<LoadJob> const load_job = grab (new (std::nothrow) LoadJob);
+        load_job->num_configs = num_configs;
+        load_job->parsed_configs = new (std::nothrow) ParsedConfig [num_configs];
+        assert (load_job->parsed_configs);
+        {
+            Count i = 0;
+            List<ParsedConfig>::iterator iter (parsed_list);
+            while (!iter.done()) {
+                load_job->parsed_configs [i] = iter.next ()->data;
+                ++i;
+            }
+        }
+        parsed_list.clear ();
+
+      // Parsing config files in parallel. The calling thread takes part as well.
+
+#ifdef LIBMARY_MT_SAFE
+        List< Ref<Thread> > thread_list;
+        {
+            Count num_threads = num_load_threads;
+            if (num_threads > num_configs)
+                num_threads = num_configs;
+
+            for (Count i = 1; i < num_threads; ++i) {
+                Ref<Thread> const thread = grab (new (std::nothrow) Thread (
+                        CbDesc<Thread::ThreadFunc> (loadThreadFunc,
+                                                    load_job /* cb_data */,
+                                                    NULL     /* coderef_container */,
+                                                    load_job /* ref_data */)));
+                if (!thread->spawn (true /* joinable */)) {
+                    logE_ (_func, "thread->spawn() failed: ", exc->toString());
+                    break;
+                }
+
+                thread_list.append (thread);
+            }
+        }
+
+#endif
+
+        loadThreadFunc (load_job);
+
+#ifdef LIBMARY_MT_SAFE
+        {
+            List< Ref<Thread> >::iterator iter (thread_list);
+            while (!iter.done()) {
+                Ref<Thread> &thread = iter.next ()->data;
+                if (!thread->join ())
+                    logE_ (_func, "thread->join() failed: ", exc->toString());
+            }
+        }
+#endif
+
+      // Creating channels in directory order. A broken file doesn't prevent
+      // the rest of the channels from being loaded.
+
+        for (Count i = 0; i < num_configs; ++i) {
+            ParsedConfig * const parsed = &load_job->parsed_configs [i];
+            if (!parsed->config) {
+                removeConfigItem (parsed->item_name->mem());
+                res = Result::Failure;
+                continue;
+            }
+
+            applyConfigItem (parsed->item_name->mem(), parsed->config, parsed->file_state);
+        }
+
+        delete[] load_job->parsed_configs;
+        load_job->parsed_configs = NULL;
+    }
+
+  // Stopping channels whose config files have been removed.
+
+    {
+        List< StRef<String> > removed_list;
+
+        mutex.lock ();
+        {
+            ItemHash::iterator iter (item_hash);
+            while (!iter.done()) {
+                ConfigItem * const item = iter.next ()->ptr();
+                if (item->load_generation != cur_generation)
+                    removed_list.append (item->item_name);
+            }
+        }
+        mutex.unlock ();
+
+        List< StRef<String> >::iterator iter (removed_list);
+        while (!iter.done()) {
+            StRef<String> &item_name = iter.next ()->data;
+            logD_ (_func, "removed: ", item_name);
+            removeConfigItem (item_name->mem());
+        }
+    }
+
+    return res;
 }
 
 #if 0
@@ -322,6 +569,7 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
     char const opt_name__connect_on_demand_timeout[] = "connect_on_demand_timeout";
     char const opt_name__no_video_timeout[]          = "no_video_timeout";
     char const opt_name__min_playlist_duration[]     = "min_playlist_duration";
+    char const opt_name__preroll_time[]              = "preroll_time";
     char const opt_name__no_audio[]                  = "no_audio";
     char const opt_name__no_video[]                  = "no_video";
     char const opt_name__force_transcode[]           = "force_transcode";
@@ -483,6 +731,22 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
         return Result::Failure;
     }
 
+    Uint64 preroll_time = default_opts->preroll_time_sec;
+    if (!configSectionGetUint64 (section,
+                                 opt_name__preroll_time,
+                                 &preroll_time,
+                                 preroll_time))
+    {
+        return Result::Failure;
+    }
+
+    // Prerolled items are spliced in through a bind stream, which only
+    // continuous playback has.
+    if (preroll_time > 0 && !continuous_playback) {
+        logW_ (_func, opt_name__preroll_time, " is ignored without ", opt_name__continuous_playback);
+        preroll_time = 0;
+    }
+
 // TODO PushAgent    ConstMmeory push_uri;
 
     bool no_audio = default_opts->default_item->no_audio;
@@ -580,6 +844,7 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
 
     opts->no_video_timeout = no_video_timeout;
     opts->min_playlist_duration_sec = min_playlist_duration;
+    opts->preroll_time_sec = preroll_time;
 
     item->stream_spec = st_grab (new (std::nothrow) String (stream_spec));
     item->spec_kind = spec_kind;
@@ -601,29 +866,49 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
 }
 #endif
 
+void
+ChannelManager::removeConfigItem (ConstMemory const item_name)
+{
+    mutex.lock ();
+    if (ItemHash::EntryKey const old_item_key = item_hash.lookup (item_name)) {
+        StRef<ConfigItem> const item = old_item_key.getData();
+        if (item->channel)
+            item->channel->getPlayback()->stop ();
+        item_hash.remove (old_item_key);
+    }
+    mutex.unlock ();
+}
+
 Result
 ChannelManager::loadConfigItem (ConstMemory const item_name,
                                 ConstMemory const item_path)
 {
     logD_ (_func, "item_name: ", item_name, ", item_path: ", item_path);
 
+    reload_mutex.lock ();
+
+    ConfigFileState file_state;
+    getConfigFileState (item_path, &file_state);
+
     Ref<MConfig::Config> const config = grab (new (std::nothrow) MConfig::Config);
     if (!MConfig::parseConfig (item_path, config)) {
         logE_ (_func, "could not parse config file ", item_path);
-
-        mutex.lock ();
-        if (ItemHash::EntryKey const old_item_key = item_hash.lookup (item_name)) {
-            StRef<ConfigItem> const item = old_item_key.getData();
-            item->channel->getPlayback()->stop ();
-            item_hash.remove (old_item_key);
-        }
-        mutex.unlock ();
-
+        removeConfigItem (item_name);
+        reload_mutex.unlock ();
         return Result::Failure;
     }
 
-    Ref<VideoStream> const stream = grab (new (std::nothrow) VideoStream);
+    applyConfigItem (item_name, config, file_state);
+
+    reload_mutex.unlock ();
+    return Result::Success;
+}
 
+void
+ChannelManager::applyConfigItem (ConstMemory             const item_name,
+                                 MConfig::Config       * const mt_nonnull config,
+                                 ConfigFileState const &file_state)
+{
     mutex.lock ();
 
     StRef<ConfigItem> item;
@@ -632,9 +917,13 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
         item->channel->getPlayback()->stop ();
     } else {
         item = st_grab (new (std::nothrow) ConfigItem);
+        item->item_name = st_grab (new (std::nothrow) String (item_name));
         item_hash.add (item_name, item);
     }
 
+    item->file_state = file_state;
+    item->load_generation = load_generation;
+
     Ref<ChannelOptions> const channel_opts = grab (new (std::nothrow) ChannelOptions);
     *channel_opts = *default_channel_opts;
 
@@ -650,11 +939,13 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
     item->channel_name  = st_grab (new (std::nothrow) String (channel_opts->channel_name->mem()));
     item->channel_title = st_grab (new (std::nothrow) String (channel_opts->channel_title->mem()));
 
-    logD_ (_func, "ChannelOptions: ");
-    channel_opts->dump ();
+    if (logLevelOn_ (LogLevel::Debug)) {
+        logD_ (_func, "ChannelOptions: ");
+        channel_opts->dump ();
 
-    logD_ (_func, "PlaybackItem: ");
-    playback_item->dump ();
+        logD_ (_func, "PlaybackItem: ");
+        playback_item->dump ();
+    }
 
 #warning Don't substitute existing channel.
 #warning Notify only when a new channel is created.
@@ -676,8 +967,6 @@ ChannelManager::loadConfigItem (ConstMemory const item_name,
 
         notifyChannelCreated (&channel_info);
     }
-
-    return Result::Success;
 }
 
 void
@@ -731,6 +1020,12 @@ ChannelManager::init (MomentServer * const mt_nonnull moment,
 
             playlist_json_protocol = val_lowercase;
         }
+
+        {
+            Uint64 val = 4;
+            configGetUint64 (config, "moment/confd_load_threads", &val, val);
+            num_load_threads = (val > 0 ? (Count) val : 1);
+        }
     }
 
     deferred_reg.setDeferredProcessor (
@@ -745,7 +1040,9 @@ ChannelManager::init (MomentServer * const mt_nonnull moment,
 ChannelManager::ChannelManager ()
     : event_informer (this /* coderef_container */, &mutex),
       page_pool      (this /* coderef_container */),
-      serve_playlist_json (true)
+      serve_playlist_json (true),
+      num_load_threads (1),
+      load_generation (0)
 {
     channel_created_task.cb = CbDesc<DeferredProcessor::TaskCallback> (channelCreatedTask, this, this);
 }
@@ -77,13 +77,48 @@ public:
 
 
 private:
+    struct ConfigFileState
+    {
+        Time   mtime;
+        Uint64 size;
+        // Hash of the contents. mtime has a granularity of one second, which
+        // misses edits within the same second which keep the size.
+        Uint64 content_hash;
+
+        bool equals (ConfigFileState const &state) const
+        {
+            return mtime        == state.mtime
+                && size         == state.size
+                && content_hash == state.content_hash;
+        }
+
+        ConfigFileState ()
+            : mtime (0),
+              size (0),
+              content_hash (0)
+        {}
+    };
+
     class ConfigItem : public StReferenced
     {
     public:
         Ref<MConfig::Config> config;
         Ref<Channel> channel;
+        StRef<String> item_name;
         StRef<String> channel_name;
         StRef<String> channel_title;
+
+        // State of the config file at the moment it was loaded.
+        // Unchanged files are skipped by loadConfigFull().
+        ConfigFileState file_state;
+
+        // Value of ChannelManager::load_generation when the file was last seen
+        // in the conf.d directory.
+        Uint64 load_generation;
+
+        ConfigItem ()
+            : load_generation (0)
+        {}
     };
 
     mt_const Ref<MomentServer> moment;
@@ -92,12 +127,63 @@ private:
     mt_const StRef<String> confd_dirname;
     mt_const bool          serve_playlist_json;
     mt_const StRef<String> playlist_json_protocol;
+    mt_const Count         num_load_threads;
 
     typedef StringHash< StRef<ConfigItem> > ItemHash;
     mt_mutex (mutex) ItemHash item_hash;
 
     mt_mutex (mutex) Ref<ChannelOptions> default_channel_opts;
 
+    mt_mutex (mutex) Uint64 load_generation;
+
+    // Serializes loadConfigFull() and loadConfigItem(). Concurrent reloads
+    // would mark each other's items as removed.
+    Mutex reload_mutex;
+
+
+  // _________________________ Parallel config loading _________________________
+
+    // Config files are parsed in parallel by loadConfigFull(), then channels
+    // are created sequentially in directory order.
+
+    struct ParsedConfig
+    {
+        StRef<String> item_name;
+        StRef<String> item_path;
+
+        // NULL if the file could not be parsed.
+        Ref<MConfig::Config> config;
+
+        ConfigFileState file_state;
+    };
+
+    class LoadJob : public Referenced
+    {
+    public:
+        ParsedConfig *parsed_configs;
+        Count         num_configs;
+
+        AtomicInt next_idx;
+    };
+
+    static void loadThreadFunc (void *_load_job);
+
+    static void parseConfigFile (ParsedConfig * mt_nonnull parsed);
+
+    static bool getConfigFileState (ConstMemory       item_path,
+                                    ConfigFileState * mt_nonnull ret_state);
+
+    void removeConfigItem (ConstMemory item_name);
+
+    mt_mutex (reload_mutex) Result doLoadConfigFull ();
+
+    void applyConfigItem (ConstMemory            item_name,
+                          MConfig::Config       * mt_nonnull config,
+                          ConfigFileState const &file_state);
+
+  // ___________________________________________________________________________
+
+
   mt_iface (MomentServer::HttpRequestHandler)
       static MomentServer::HttpRequestHandler admin_http_handler;
 
@@ -144,6 +230,9 @@ public:
     void channelManagerLock   () { mutex.lock (); }
     void channelManagerUnlock () { mutex.unlock (); }
 
+    // Loads all channel configs from conf.d directory. Only new and modified
+    // files are (re)loaded on subsequent calls, channels for removed files are
+    // stopped. Files which fail to parse are skipped, Failure is returned then.
     Result loadConfigFull ();
 
     Result loadConfigItem (ConstMemory item_name,
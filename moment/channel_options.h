@@ -168,6 +168,17 @@ public:
 
     Time          no_video_timeout;
     Time          min_playlist_duration_sec;
+    // If non-zero, the next playlist item is started this many seconds
+    // before the switch (requires 'continuous_playback').
+    Time          preroll_time_sec;
+
+    // Keep the last 'timeshift_window_sec' seconds of the channel for
+    // playback with a start offset. The last 'timeshift_memory_sec' seconds
+    // are kept in memory, the rest in 'timeshift_path'.
+    bool          timeshift;
+    Time          timeshift_window_sec;
+    Time          timeshift_memory_sec;
+    StRef<String> timeshift_path;
   mt_end
 
     void dump ()
@@ -183,7 +194,12 @@ public:
                      "    connect_on_demand: ", connect_on_demand, "\n"
                      "    connect_on_demand_timeout: ", connect_on_demand_timeout, "\n"
                      "    no_video_timeout: ", no_video_timeout, "\n"
-                     "    min_playlist_duration_sec: ", min_playlist_duration_sec, "\n");
+                     "    min_playlist_duration_sec: ", min_playlist_duration_sec, "\n"
+                     "    preroll_time_sec: ", preroll_time_sec, "\n"
+                     "    timeshift: ", timeshift, "\n"
+                     "    timeshift_window_sec: ", timeshift_window_sec, "\n"
+                     "    timeshift_memory_sec: ", timeshift_memory_sec, "\n"
+                     "    timeshift_path: ", timeshift_path, "\n");
         logUnlock ();
     }
 
@@ -202,7 +218,13 @@ public:
           connect_on_demand_timeout (60),
 
           no_video_timeout (60),
-          min_playlist_duration_sec (10)
+          min_playlist_duration_sec (10),
+          preroll_time_sec (0),
+
+          timeshift (false),
+          timeshift_window_sec (7200),
+          timeshift_memory_sec (300),
+          timeshift_path (st_grab (new (std::nothrow) String ("/opt/moment/timeshift")))
     {
     }
 };
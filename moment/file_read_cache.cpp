@@ -0,0 +1,225 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <moment/file_read_cache.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_readcache ("moment.readcache", LogLevel::I);
+
+mt_throws Result
+FileReadCache::readFull (int    const fd,
+                         Memory       mem,
+                         Uint64       offset,
+                         Size * const mt_nonnull ret_nread)
+{
+    Size nread = 0;
+    while (mem.len() > 0) {
+        ssize_t const res = pread (fd, mem.mem(), mem.len(), (off_t) offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            return Result::Failure;
+        }
+
+        if (res == 0)
+            break;
+
+        mem = mem.region ((Size) res);
+        offset += (Uint64) res;
+        nread += (Size) res;
+    }
+
+    *ret_nread = nread;
+    return Result::Success;
+}
+
+mt_throws Result
+FileReadCache::getFileKey (int       const fd,
+                           FileKey * const mt_nonnull ret_file_key)
+{
+    struct stat stat_buf;
+    if (fstat (fd, &stat_buf) == -1) {
+        exc_throw (PosixException, errno);
+        return Result::Failure;
+    }
+
+    ret_file_key->dev   = (Uint64) stat_buf.st_dev;
+    ret_file_key->ino   = (Uint64) stat_buf.st_ino;
+    ret_file_key->mtime = (Uint64) stat_buf.st_mtime;
+    return Result::Success;
+}
+
+mt_throws Result
+FileReadCache::getBlock (int           const fd,
+                         FileKey const &file_key,
+                         Uint64        const block_idx,
+                         Ref<Block>  * const mt_nonnull ret_block)
+{
+    *ret_block = NULL;
+
+    Ref<String> const key = makeString (file_key.dev, "_", file_key.ino, "_", file_key.mtime, "_", block_idx);
+
+    mutex.lock ();
+    if (BlockHash::EntryKey const hash_key = block_hash.lookup (key->mem())) {
+        Block * const block = hash_key.getData();
+        block_list.remove (block);
+        block_list.append (block);
+        ++num_hits;
+
+        *ret_block = block;
+        mutex.unlock ();
+        return Result::Success;
+    }
+    ++num_misses;
+    mutex.unlock ();
+
+    // Concurrent misses for the same block are possible: the first reader to
+    // insert the block wins.
+    Ref<Block> const block = grab (new (std::nothrow) Block);
+    Size nread = 0;
+    if (!readFull (fd, Memory (block->data, BlockSize), block_idx * BlockSize, &nread))
+        return Result::Failure;
+
+    if (nread < BlockSize)
+        return Result::Success;
+
+    mutex.lock ();
+    if (BlockHash::EntryKey const hash_key = block_hash.lookup (key->mem())) {
+        *ret_block = hash_key.getData();
+        mutex.unlock ();
+        return Result::Success;
+    }
+
+    while (num_blocks >= max_blocks && !block_list.isEmpty()) {
+        Block * const old_block = block_list.getFirst();
+        block_list.remove (old_block);
+        --num_blocks;
+        // Releases the block unless it's being copied from.
+        block_hash.remove (old_block->hash_key);
+    }
+
+    block->hash_key = block_hash.add (key->mem(), block);
+    block_list.append (block);
+    ++num_blocks;
+    mutex.unlock ();
+
+    *ret_block = block;
+    return Result::Success;
+}
+
+mt_throws Result
+FileReadCache::read (int             const fd,
+                     FileKey const  &file_key,
+                     Memory          const mem,
+                     Uint64          const offset,
+                     Size          * const mt_nonnull ret_nread)
+{
+    *ret_nread = 0;
+
+    Size total = 0;
+    while (total < mem.len()) {
+        Uint64 const pos = offset + total;
+        Size const block_pos = (Size) (pos % BlockSize);
+
+        Ref<Block> block;
+        if (!getBlock (fd, file_key, pos / BlockSize, &block))
+            return Result::Failure;
+
+        if (!block) {
+            Size nread = 0;
+            if (!readFull (fd, mem.region (total), pos, &nread))
+                return Result::Failure;
+
+            total += nread;
+            break;
+        }
+
+        Size const len = (mem.len() - total < BlockSize - block_pos ?
+                                  mem.len() - total : BlockSize - block_pos);
+        memcpy (mem.mem() + total, block->data + block_pos, len);
+        total += len;
+    }
+
+    *ret_nread = total;
+    return Result::Success;
+}
+
+void
+FileReadCache::getStats (Uint64 * const mt_nonnull ret_num_hits,
+                         Uint64 * const mt_nonnull ret_num_misses,
+                         Count  * const mt_nonnull ret_num_blocks)
+{
+    mutex.lock ();
+    *ret_num_hits   = num_hits;
+    *ret_num_misses = num_misses;
+    *ret_num_blocks = num_blocks;
+    mutex.unlock ();
+}
+
+FileReadCache::Block::Block ()
+{
+    data = new (std::nothrow) Byte [BlockSize];
+    assert (data);
+}
+
+FileReadCache::Block::~Block ()
+{
+    delete[] data;
+}
+
+mt_const void
+FileReadCache::init (Count const max_blocks)
+{
+    this->max_blocks = (max_blocks > 0 ? max_blocks : 1);
+    logD (readcache, _func, "max_blocks: ", this->max_blocks);
+}
+
+FileReadCache::FileReadCache ()
+    : max_blocks (1),
+      num_blocks (0),
+      num_hits   (0),
+      num_misses (0)
+{
+}
+
+FileReadCache::~FileReadCache ()
+{
+    mutex.lock ();
+    while (!block_list.isEmpty()) {
+        Block * const block = block_list.getFirst();
+        block_list.remove (block);
+        block_hash.remove (block->hash_key);
+    }
+    num_blocks = 0;
+    mutex.unlock ();
+}
+
+}
+
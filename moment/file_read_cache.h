@@ -0,0 +1,128 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__FILE_READ_CACHE__H__
+#define MOMENT__FILE_READ_CACHE__H__
+
+
+#include <libmary/libmary.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Cache of file blocks which is shared between readers of the same files,
+// so that concurrent viewers of a recording do not read the same data from
+// disk several times. Blocks are evicted in LRU order.
+//
+// Only complete blocks are cached. The tail of a file, which may be still
+// growing, is always read directly.
+//
+class FileReadCache : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    enum {
+        BlockSize = 1 << 18
+    };
+
+    // Identifies a version of a file.
+    struct FileKey
+    {
+        Uint64 dev;
+        Uint64 ino;
+        Uint64 mtime;
+
+        FileKey ()
+            : dev (0),
+              ino (0),
+              mtime (0)
+        {}
+    };
+
+private:
+    class Block;
+
+    typedef StringHash< Ref<Block> > BlockHash;
+
+    class Block : public Referenced,
+                  public IntrusiveListElement<>
+    {
+    public:
+        mt_mutex (FileReadCache::mutex) BlockHash::EntryKey hash_key;
+
+        Byte *data;
+
+         Block ();
+        ~Block ();
+    };
+
+    typedef IntrusiveList<Block> BlockList;
+
+    mt_const Count max_blocks;
+
+    mt_mutex (mutex) BlockHash block_hash;
+    // Least recently used blocks first.
+    mt_mutex (mutex) BlockList block_list;
+    mt_mutex (mutex) Count     num_blocks;
+
+    mt_mutex (mutex) Uint64 num_hits;
+    mt_mutex (mutex) Uint64 num_misses;
+
+    // Sets *ret_block to NULL if the block is not complete.
+    mt_throws Result getBlock (int              fd,
+                               FileKey const   &file_key,
+                               Uint64           block_idx,
+                               Ref<Block>      * mt_nonnull ret_block);
+
+public:
+    // pread() until 'mem' is full or the end of the file is reached.
+    static mt_throws Result readFull (int    fd,
+                                      Memory mem,
+                                      Uint64 offset,
+                                      Size  * mt_nonnull ret_nread);
+
+    static mt_throws Result getFileKey (int       fd,
+                                        FileKey * mt_nonnull ret_file_key);
+
+    // Same as readFull(), with blocks taken from the cache.
+    mt_throws Result read (int            fd,
+                           FileKey const &file_key,
+                           Memory         mem,
+                           Uint64         offset,
+                           Size          * mt_nonnull ret_nread);
+
+    void getStats (Uint64 * mt_nonnull ret_num_hits,
+                   Uint64 * mt_nonnull ret_num_misses,
+                   Count  * mt_nonnull ret_num_blocks);
+
+    mt_const void init (Count max_blocks);
+
+     FileReadCache ();
+    ~FileReadCache ();
+};
+
+}
+
+
+#endif /* MOMENT__FILE_READ_CACHE__H__ */
+
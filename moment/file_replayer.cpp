@@ -0,0 +1,155 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/flv_file_reader.h>
+
+#include <moment/file_replayer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_replay ("moment.file_replayer", LogLevel::I);
+
+mt_mutex (mutex) void
+FileReplayer::stopTimer ()
+{
+    if (tick_timer) {
+        timers->deleteTimer (tick_timer);
+        tick_timer = NULL;
+    }
+}
+
+void
+FileReplayer::tickTimerTick (void * const _self)
+{
+    FileReplayer * const self = static_cast <FileReplayer*> (_self);
+
+    self->mutex.lock ();
+    if (!self->tick_timer) {
+        self->mutex.unlock ();
+        return;
+    }
+
+    Time const now_millisec = getTimeMilliseconds();
+    for (Count i = 0; ; ++i) {
+        if (!self->pacer.isPaced() && i >= FramePacer::MaxFramesPerTick)
+            break;
+
+        IoResult res;
+        if (!self->pacer.peekFrame (&res)) {
+            if (res == IoResult::Error)
+                logE (replay, _func, "read error: ", exc->toString(), ", file: ", self->filename->mem());
+            else
+                logD (replay, _func, "end of file: ", self->filename->mem());
+
+            self->stopTimer ();
+            break;
+        }
+
+        if (!self->pacer.isFrameDue (now_millisec))
+            break;
+
+        MediaReader::Frame frame;
+        self->pacer.takeFrame (&frame);
+
+        if (frame.is_audio)
+            self->video_stream->fireAudioMessage (&frame.audio_msg);
+        else
+            self->video_stream->fireVideoMessage (&frame.video_msg);
+
+        frame.release ();
+    }
+    self->mutex.unlock ();
+}
+
+mt_throws Result
+FileReplayer::init (PagePool      * const mt_nonnull page_pool,
+                    Timers        * const mt_nonnull timers,
+                    VideoStream   * const mt_nonnull video_stream,
+                    ConstMemory     const filename,
+                    FileReadCache * const read_cache,
+                    Options       * const init_opts)
+{
+    this->page_pool    = page_pool;
+    this->timers       = timers;
+    this->video_stream = video_stream;
+    this->filename     = grab (new (std::nothrow) String (filename));
+
+    reader = new (std::nothrow) FlvFileReader;
+    assert (reader);
+    reader->setPagePool (page_pool);
+    if (read_cache)
+        reader->setReadCache (read_cache);
+
+    if (!reader->open (filename)) {
+        logE (replay, _func, "could not open ", filename, ": ", exc->toString());
+        return Result::Failure;
+    }
+
+    pacer.init (reader, init_opts ? *init_opts : Options());
+
+    return Result::Success;
+}
+
+void
+FileReplayer::start ()
+{
+    mutex.lock ();
+    assert (!tick_timer);
+    tick_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (tickTimerTick, this, this),
+            FramePacer::TickInterval_Millisec * 1000,
+            true /* periodical */);
+    mutex.unlock ();
+}
+
+void
+FileReplayer::stop ()
+{
+    mutex.lock ();
+    stopTimer ();
+    mutex.unlock ();
+}
+
+FileReplayer::FileReplayer ()
+    : page_pool (this /* coderef_container */),
+      timers    (this /* coderef_container */),
+      reader (NULL),
+      tick_timer (NULL)
+{
+}
+
+FileReplayer::~FileReplayer ()
+{
+    mutex.lock ();
+    stopTimer ();
+
+    pacer.reset ();
+
+    if (reader)
+        reader->close ();
+    mutex.unlock ();
+
+    delete reader;
+}
+
+}
+
@@ -0,0 +1,88 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__FILE_REPLAYER__H__
+#define MOMENT__FILE_REPLAYER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/media_reader.h>
+#include <moment/file_read_cache.h>
+#include <moment/frame_pacer.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Replays a captured FLV file into a VideoStream for load testing with
+// real bitstreams. Unlike FileSource, it is not a MediaSource and it runs on
+// the thread which 'timers' belong to. See FramePacer::Options for speed
+// and looping.
+//
+// Many replayers of the same file should share a FileReadCache.
+//
+class FileReplayer : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    typedef FramePacer::Options Options;
+
+private:
+    mt_const DataDepRef<PagePool> page_pool;
+    mt_const DataDepRef<Timers>   timers;
+    mt_const Ref<VideoStream>     video_stream;
+
+    mt_const Ref<String> filename;
+
+    // Used with 'mutex' held.
+    mt_const MediaReader *reader;
+
+    mt_mutex (mutex) Timers::TimerKey tick_timer;
+
+    mt_mutex (mutex) FramePacer pacer;
+
+    mt_mutex (mutex) void stopTimer ();
+
+    static void tickTimerTick (void *_self);
+
+public:
+    mt_const mt_throws Result init (PagePool      * mt_nonnull page_pool,
+                                    Timers        * mt_nonnull timers,
+                                    VideoStream   * mt_nonnull video_stream,
+                                    ConstMemory    filename,
+                                    FileReadCache *read_cache,
+                                    Options       *opts);
+
+    void start ();
+
+    void stop ();
+
+     FileReplayer ();
+    ~FileReplayer ();
+};
+
+}
+
+
+#endif /* MOMENT__FILE_REPLAYER__H__ */
+
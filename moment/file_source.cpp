@@ -0,0 +1,315 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/flv_file_reader.h>
+#include <moment/mp4_file_reader.h>
+
+#include <moment/file_source.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_filesrc ("moment.filesrc", LogLevel::I);
+
+mt_mutex (mutex) void
+FileSource::fireFrame (MediaReader::Frame * const mt_nonnull frame)
+{
+    VideoStream::Message * const msg = frame->getMessage ();
+
+    traffic_stats.rx_bytes += frame->file_len;
+    if (frame->is_audio) {
+        traffic_stats.rx_audio_bytes += msg->msg_len;
+        video_stream->fireAudioMessage (&frame->audio_msg);
+    } else {
+        traffic_stats.rx_video_bytes += msg->msg_len;
+        video_stream->fireVideoMessage (&frame->video_msg);
+    }
+
+    frame->release ();
+}
+
+mt_mutex (mutex) void
+FileSource::stopTimer ()
+{
+    if (tick_timer) {
+        timers->deleteTimer (tick_timer);
+        tick_timer = NULL;
+    }
+}
+
+void
+FileSource::tickTimerTick (void * const _self)
+{
+    FileSource * const self = static_cast <FileSource*> (_self);
+
+    bool first_video = false;
+    bool eos = false;
+    bool error = false;
+
+    self->mutex.lock ();
+    if (self->released || !self->tick_timer) {
+        self->mutex.unlock ();
+        return;
+    }
+
+    Time const now_millisec = getTimeMilliseconds();
+    for (Count i = 0; ; ++i) {
+        if (!self->pacer.isPaced() && i >= FramePacer::MaxFramesPerTick)
+            break;
+
+        IoResult res;
+        if (!self->pacer.peekFrame (&res)) {
+            if (res == IoResult::Error) {
+                logE (filesrc, _func, "read error: ", exc->toString(), ", file: ", self->filename->mem());
+                error = true;
+            } else {
+                logD (filesrc, _func, "end of file: ", self->filename->mem());
+                eos = true;
+            }
+
+            self->stopTimer ();
+            break;
+        }
+
+        if (!self->pacer.isFrameDue (now_millisec))
+            break;
+
+        MediaReader::Frame frame;
+        self->pacer.takeFrame (&frame);
+
+        if (!frame.is_audio && !self->got_video) {
+            self->got_video = true;
+            first_video = true;
+        }
+
+        self->fireFrame (&frame);
+    }
+    self->mutex.unlock ();
+
+    if (!self->frontend)
+        return;
+
+    if (first_video)
+        self->frontend.call (self->frontend->gotVideo);
+
+    if (error)
+        self->frontend.call (self->frontend->error);
+    else
+    if (eos)
+        self->frontend.call (self->frontend->eos);
+}
+
+void
+FileSource::createPipeline ()
+{
+    mutex.lock ();
+    if (released || started) {
+        mutex.unlock ();
+        return;
+    }
+    started = true;
+
+    if (!reader->open (filename->mem())) {
+        mutex.unlock ();
+        logE (filesrc, _func, "could not open ", filename->mem(), ": ", exc->toString());
+        if (frontend)
+            frontend.call (frontend->error);
+        return;
+    }
+
+    if (initial_seek > 0) {
+        if (!reader->seek (initial_seek * 1000)) {
+            mutex.unlock ();
+            logE (filesrc, _func, "seek failed: ", exc->toString(), ", file: ", filename->mem());
+            if (frontend)
+                frontend.call (frontend->error);
+            return;
+        }
+    }
+
+    tick_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (tickTimerTick, this, this),
+            FramePacer::TickInterval_Millisec * 1000,
+            true /* periodical */);
+    mutex.unlock ();
+
+    logD (filesrc, _func, "playing ", filename->mem(), ", seek ", initial_seek);
+}
+
+void
+FileSource::releasePipeline ()
+{
+    mutex.lock ();
+    released = true;
+    stopTimer ();
+
+    pacer.reset ();
+    reader->close ();
+    mutex.unlock ();
+}
+
+void
+FileSource::reportStatusEvents ()
+{
+    mutex.lock ();
+    bool const tmp_got_video = got_video;
+    mutex.unlock ();
+
+    if (tmp_got_video && frontend)
+        frontend.call (frontend->gotVideo);
+}
+
+void
+FileSource::getTrafficStats (TrafficStats * const mt_nonnull ret_traffic_stats)
+{
+    mutex.lock ();
+    *ret_traffic_stats = traffic_stats;
+    mutex.unlock ();
+}
+
+void
+FileSource::resetTrafficStats ()
+{
+    mutex.lock ();
+    traffic_stats.reset ();
+    mutex.unlock ();
+}
+
+static bool
+filenameHasExtension (ConstMemory const filename,
+                      ConstMemory const ext)
+{
+    if (filename.len() <= ext.len())
+        return false;
+
+    for (Size i = 0; i < ext.len(); ++i) {
+        Byte c = filename.mem() [filename.len() - ext.len() + i];
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+
+        if (c != ext.mem() [i])
+            return false;
+    }
+
+    return true;
+}
+
+MediaReader*
+FileSource::createReaderForUri (ConstMemory   const uri,
+                                ConstMemory * const mt_nonnull ret_filename)
+{
+    ConstMemory filename;
+    if (uri.len() >= 7 && equal (uri.region (0, 7), "file://"))
+        filename = uri.region (7);
+    else
+    if (uri.len() >= 1 && uri.mem() [0] == '/')
+        filename = uri;
+    else
+        return NULL;
+
+    MediaReader *reader = NULL;
+    if (filenameHasExtension (filename, ".flv"))
+        reader = new (std::nothrow) FlvFileReader;
+    else
+    if (filenameHasExtension (filename, ".mp4")
+        || filenameHasExtension (filename, ".m4v")
+        || filenameHasExtension (filename, ".mov"))
+    {
+        reader = new (std::nothrow) Mp4FileReader;
+    } else
+        return NULL;
+
+    assert (reader);
+    *ret_filename = filename;
+    return reader;
+}
+
+void
+FileSource::init (MomentServer * const mt_nonnull moment,
+                  MediaReader  * const mt_nonnull reader,
+                  ConstMemory    const filename,
+                  VideoStream  * const mt_nonnull video_stream,
+                  Time           const initial_seek,
+                  bool           const sync_to_clock,
+                  CbDesc<MediaSource::Frontend> const &frontend)
+{
+    this->reader        = reader;
+    this->page_pool     = moment->getPagePool();
+    this->video_stream  = video_stream;
+    this->filename      = grab (new (std::nothrow) String (filename));
+    this->initial_seek  = initial_seek;
+    this->frontend      = frontend;
+
+    {
+        FramePacer::Options pacer_opts;
+        pacer_opts.speed_percent = (sync_to_clock ? 100 : 0);
+        pacer.init (reader, pacer_opts);
+    }
+
+    reader->setPagePool (moment->getPagePool());
+
+    reader_thread_pool = moment->getReaderThreadPool();
+    ServerThreadContext *thread_ctx = reader_thread_pool->grabThreadContext ("file");
+    if (thread_ctx) {
+        reader_thread_ctx = thread_ctx;
+    } else {
+        logE (filesrc, _func, "Couldn't get reader thread context: ", exc->toString());
+        thread_ctx = moment->getServerApp()->getServerContext()->getMainThreadContext();
+    }
+
+    timers = thread_ctx->getTimers();
+}
+
+FileSource::FileSource ()
+    : page_pool (this /* coderef_container */),
+      timers    (this /* coderef_container */),
+      reader_thread_pool (NULL),
+      reader_thread_ctx  (NULL),
+      reader (NULL),
+      initial_seek (0),
+      started  (false),
+      released (false),
+      got_video (false)
+{
+    traffic_stats.reset ();
+}
+
+FileSource::~FileSource ()
+{
+    mutex.lock ();
+    stopTimer ();
+
+    pacer.reset ();
+
+    if (reader)
+        reader->close ();
+    mutex.unlock ();
+
+    delete reader;
+
+    if (reader_thread_ctx) {
+        reader_thread_pool->releaseThreadContext (reader_thread_ctx);
+        reader_thread_ctx = NULL;
+    }
+}
+
+}
+
@@ -0,0 +1,109 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__FILE_SOURCE__H__
+#define MOMENT__FILE_SOURCE__H__
+
+
+#include <moment/media_source.h>
+#include <moment/media_reader.h>
+#include <moment/frame_pacer.h>
+
+#include <moment/moment_server.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Plays out an FLV or MP4 file into a VideoStream without decoding. Frames are
+// read on a thread from the reader thread pool and are paced to the clock if
+// 'sync_to_clock' is set.
+//
+class FileSource : public MediaSource
+{
+private:
+    StateMutex mutex;
+
+    mt_const DataDepRef<PagePool> page_pool;
+    mt_const DataDepRef<Timers>   timers;
+
+    mt_const ServerThreadPool    *reader_thread_pool;
+    // NULL if the main thread context is used.
+    mt_const ServerThreadContext *reader_thread_ctx;
+
+    // Used with 'mutex' held.
+    mt_const MediaReader *reader;
+
+    mt_const Ref<VideoStream> video_stream;
+    mt_const Cb<MediaSource::Frontend> frontend;
+
+    mt_const Ref<String> filename;
+    mt_const Time initial_seek;
+
+    mt_mutex (mutex) Timers::TimerKey tick_timer;
+
+    mt_mutex (mutex) bool started;
+    mt_mutex (mutex) bool released;
+
+    mt_mutex (mutex) bool got_video;
+
+    mt_mutex (mutex) FramePacer pacer;
+
+    mt_mutex (mutex) TrafficStats traffic_stats;
+
+    mt_mutex (mutex) void fireFrame (MediaReader::Frame * mt_nonnull frame);
+
+    mt_mutex (mutex) void stopTimer ();
+
+    static void tickTimerTick (void *_self);
+
+public:
+  mt_iface (MediaSource)
+    void createPipeline ();
+    void releasePipeline ();
+    void reportStatusEvents ();
+
+    void getTrafficStats (TrafficStats * mt_nonnull ret_traffic_stats);
+    void resetTrafficStats ();
+  mt_iface_end
+
+    // Returns a reader for "file://" URIs and plain absolute paths of files
+    // which can be played out natively, NULL otherwise.
+    static MediaReader* createReaderForUri (ConstMemory  uri,
+                                            ConstMemory * mt_nonnull ret_filename);
+
+    // Takes ownership of 'reader'.
+    void init (MomentServer * mt_nonnull moment,
+               MediaReader  * mt_nonnull reader,
+               ConstMemory   filename,
+               VideoStream  * mt_nonnull video_stream,
+               Time          initial_seek,
+               bool          sync_to_clock,
+               CbDesc<MediaSource::Frontend> const &frontend);
+
+     FileSource ();
+    ~FileSource ();
+};
+
+}
+
+
+#endif /* MOMENT__FILE_SOURCE__H__ */
+
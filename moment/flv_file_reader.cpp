@@ -0,0 +1,648 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <moment/flv_util.h>
+
+#include <moment/flv_file_reader.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_flvread ("moment.flvread", LogLevel::I);
+
+enum {
+    FlvHeaderLen    = 9,
+    FlvTagHeaderLen = 11,
+    FlvTagType_Audio  = 8,
+    FlvTagType_Video  = 9
+};
+
+mt_throws Result
+FlvFileReader::fill (Size const len)
+{
+    assert (len <= ReadAheadSize);
+
+    if (buf_len - buf_pos >= len || got_eof)
+        return Result::Success;
+
+    if (buf_pos > 0) {
+        memmove (buf, buf + buf_pos, buf_len - buf_pos);
+        buf_len -= buf_pos;
+        buf_pos = 0;
+    }
+
+    Size nread = 0;
+    if (!readFileData (fd, Memory (buf + buf_len, ReadAheadSize - buf_len), file_pos + buf_len, &nread))
+        return Result::Failure;
+
+    if (nread < ReadAheadSize - buf_len)
+        got_eof = true;
+
+    buf_len += nread;
+    return Result::Success;
+}
+
+void
+FlvFileReader::skip (Size const len)
+{
+    if (buf_len - buf_pos >= len) {
+        buf_pos += len;
+    } else {
+        buf_pos = 0;
+        buf_len = 0;
+    }
+
+    file_pos += len;
+}
+
+void
+FlvFileReader::seekToOffset (Uint64 const offset)
+{
+    file_pos = offset;
+    buf_pos = 0;
+    buf_len = 0;
+    got_eof = false;
+}
+
+mt_throws IoResult
+FlvFileReader::readTag (Frame * const mt_nonnull ret_frame)
+{
+    assert (fd != -1);
+
+    for (;;) {
+        if (!fill (FlvTagHeaderLen))
+            return IoResult::Error;
+
+        if (buf_len - buf_pos < FlvTagHeaderLen) {
+            if (buf_len - buf_pos > 0)
+                logD (flvread, _func, "truncated tag header at ", file_pos);
+
+            return IoResult::Eof;
+        }
+
+        Byte const * const hdr = buf + buf_pos;
+        Byte const tag_type = hdr [0] & 0x1f;
+        Size const data_len = ((Size) hdr [1] << 16) |
+                              ((Size) hdr [2] <<  8) |
+                              ((Size) hdr [3] <<  0);
+        Uint64 const timestamp_millisec = ((Uint64) hdr [7] << 24) |
+                                          ((Uint64) hdr [4] << 16) |
+                                          ((Uint64) hdr [5] <<  8) |
+                                          ((Uint64) hdr [6] <<  0);
+        Uint64 const tag_offset = file_pos;
+
+        skip (FlvTagHeaderLen);
+
+        if (tag_type != FlvTagType_Audio && tag_type != FlvTagType_Video) {
+            skip (data_len + 4 /* PreviousTagSize */);
+            continue;
+        }
+
+        Size const codec_hdr_len = (data_len < FlvVideoHeader_MaxLen ? data_len : FlvVideoHeader_MaxLen);
+        if (!fill (codec_hdr_len))
+            return IoResult::Error;
+
+        if (buf_len - buf_pos < codec_hdr_len) {
+            logD (flvread, _func, "truncated tag at ", tag_offset);
+            return IoResult::Eof;
+        }
+
+        Byte const * const data = buf + buf_pos;
+        Size flv_hdr_len = 0;
+
+        if (tag_type == FlvTagType_Audio) {
+            VideoStream::AudioMessage * const audio_msg = &ret_frame->audio_msg;
+            *audio_msg = VideoStream::AudioMessage ();
+
+            if (data_len >= 1) {
+                audio_msg->codec_id = VideoStream::AudioCodecId::fromFlvCodecId ((data [0] & 0xf0) >> 4);
+                audio_msg->frame_type = VideoStream::AudioFrameType::RawData;
+                audio_msg->rate = flvSamplingRateToNumeric ((data [0] & 0x0c) >> 2);
+                audio_msg->channels = (data [0] & 1) + 1;
+
+                flv_hdr_len = 1;
+                if (audio_msg->codec_id == VideoStream::AudioCodecId::AAC && data_len >= 2) {
+                    if (data [1] == 0)
+                        audio_msg->frame_type = VideoStream::AudioFrameType::AacSequenceHeader;
+
+                    flv_hdr_len = 2;
+                }
+            }
+
+            ret_frame->is_audio = true;
+        } else {
+            VideoStream::VideoMessage * const video_msg = &ret_frame->video_msg;
+            *video_msg = VideoStream::VideoMessage ();
+
+            if (data_len >= 1) {
+                video_msg->frame_type = VideoStream::VideoFrameType::fromFlvFrameType ((data [0] & 0xf0) >> 4);
+                video_msg->codec_id = VideoStream::VideoCodecId::fromFlvCodecId (data [0] & 0x0f);
+
+                flv_hdr_len = 1;
+                if (video_msg->codec_id == VideoStream::VideoCodecId::AVC && data_len >= 2) {
+                    if (data [1] == 0)
+                        video_msg->frame_type = VideoStream::VideoFrameType::AvcSequenceHeader;
+                    else
+                    if (data [1] == 2)
+                        video_msg->frame_type = VideoStream::VideoFrameType::AvcEndOfSequence;
+
+                    if (data_len >= 5)
+                        flv_hdr_len = 5;
+                }
+            }
+
+            ret_frame->is_audio = false;
+        }
+
+        PagePool::PageListHead page_list;
+        {
+            Size left = data_len;
+            while (left > 0) {
+                if (buf_pos == buf_len) {
+                    if (!fill (left < ReadAheadSize ? left : ReadAheadSize)) {
+                        page_pool->msgUnref (page_list.first);
+                        return IoResult::Error;
+                    }
+
+                    if (buf_pos == buf_len) {
+                        logD (flvread, _func, "truncated tag at ", tag_offset);
+                        page_pool->msgUnref (page_list.first);
+                        return IoResult::Eof;
+                    }
+                }
+
+                Size const len = (left < buf_len - buf_pos ? left : buf_len - buf_pos);
+                page_pool->getFillPages (&page_list, ConstMemory (buf + buf_pos, len));
+                buf_pos += len;
+                file_pos += len;
+                left -= len;
+            }
+        }
+
+        skip (4 /* PreviousTagSize */);
+
+        VideoStream::Message * const msg = ret_frame->getMessage ();
+        msg->timestamp_nanosec = timestamp_millisec * 1000000;
+        msg->page_pool = page_pool;
+        msg->page_list = page_list;
+        msg->msg_offset = flv_hdr_len;
+        msg->msg_len = data_len - flv_hdr_len;
+
+        ret_frame->timestamp_millisec = timestamp_millisec;
+        ret_frame->file_len = FlvTagHeaderLen + data_len + 4;
+
+        return IoResult::Normal;
+    }
+
+    unreachable ();
+    return IoResult::Error;
+}
+
+mt_throws IoResult
+FlvFileReader::readFrame (Frame * const mt_nonnull ret_frame)
+{
+    assert (fd != -1);
+
+    if (popQueuedFrame (ret_frame))
+        return IoResult::Normal;
+
+    return readTag (ret_frame);
+}
+
+mt_throws Result
+FlvFileReader::readCodecHeaders (Frame * const mt_nonnull ret_audio_hdr,
+                                 bool  * const mt_nonnull ret_got_audio_hdr,
+                                 Frame * const mt_nonnull ret_video_hdr,
+                                 bool  * const mt_nonnull ret_got_video_hdr)
+{
+    *ret_got_audio_hdr = false;
+    *ret_got_video_hdr = false;
+
+    seekToOffset (data_offset);
+
+    // Sequence headers are expected before the first audio/video data.
+    for (;;) {
+        Frame frame;
+        IoResult const res = readTag (&frame);
+        if (res == IoResult::Error)
+            return Result::Failure;
+
+        if (res == IoResult::Eof)
+            break;
+
+        if (frame.is_audio
+            && frame.audio_msg.frame_type == VideoStream::AudioFrameType::AacSequenceHeader
+            && !*ret_got_audio_hdr)
+        {
+            *ret_audio_hdr = frame;
+            *ret_got_audio_hdr = true;
+            continue;
+        }
+
+        if (!frame.is_audio
+            && frame.video_msg.frame_type == VideoStream::VideoFrameType::AvcSequenceHeader
+            && !*ret_got_video_hdr)
+        {
+            *ret_video_hdr = frame;
+            *ret_got_video_hdr = true;
+            continue;
+        }
+
+        bool const is_data = (frame.is_audio ? frame.audio_msg.frame_type.isAudioData()
+                                             : frame.video_msg.frame_type.isVideoData());
+        frame.release ();
+
+        if (is_data)
+            break;
+    }
+
+    return Result::Success;
+}
+
+mt_throws Result
+FlvFileReader::scanForKeyframe (Time     const timestamp_millisec,
+                                Uint64 * const ret_tag_offset)
+{
+    seekToOffset (data_offset);
+
+    Uint64 keyframe_offset = data_offset;
+    for (;;) {
+        if (!fill (FlvTagHeaderLen + 1))
+            return Result::Failure;
+
+        if (buf_len - buf_pos < FlvTagHeaderLen + 1)
+            break;
+
+        Byte const * const hdr = buf + buf_pos;
+        Byte const tag_type = hdr [0] & 0x1f;
+        Size const data_len = ((Size) hdr [1] << 16) |
+                              ((Size) hdr [2] <<  8) |
+                              ((Size) hdr [3] <<  0);
+        Uint64 const tag_timestamp = ((Uint64) hdr [7] << 24) |
+                                     ((Uint64) hdr [4] << 16) |
+                                     ((Uint64) hdr [5] <<  8) |
+                                     ((Uint64) hdr [6] <<  0);
+
+        if (tag_type == FlvTagType_Video || tag_type == FlvTagType_Audio) {
+            if (tag_timestamp > timestamp_millisec)
+                break;
+
+            if (tag_type == FlvTagType_Video
+                && data_len >= 1
+                && ((hdr [FlvTagHeaderLen] & 0xf0) >> 4) == 1 /* keyframe */)
+            {
+                keyframe_offset = file_pos;
+            }
+        }
+
+        skip (FlvTagHeaderLen + data_len + 4 /* PreviousTagSize */);
+    }
+
+    *ret_tag_offset = keyframe_offset;
+    return Result::Success;
+}
+
+mt_throws Result
+FlvFileReader::seek (Time const timestamp_millisec)
+{
+    if (fd == -1) {
+        exc_throw (InternalException, InternalException::IncorrectUsage);
+        return Result::Failure;
+    }
+
+    releaseQueuedFrames ();
+
+    // Sequence headers at the start of the file are skipped by the seek.
+    Frame audio_hdr;
+    Frame video_hdr;
+    bool got_audio_hdr = false;
+    bool got_video_hdr = false;
+    if (!readCodecHeaders (&audio_hdr, &got_audio_hdr, &video_hdr, &got_video_hdr))
+        return Result::Failure;
+
+    Uint64 tag_offset = data_offset;
+    if (index) {
+        // Last entry with timestamp <= timestamp_millisec.
+        Count left = 0;
+        Count right = num_index_entries;
+        while (left < right) {
+            Count const middle = left + (right - left) / 2;
+            if (index [middle].timestamp_millisec <= timestamp_millisec)
+                left = middle + 1;
+            else
+                right = middle;
+        }
+
+        if (left > 0)
+            tag_offset = index [left - 1].tag_offset;
+    } else {
+        if (!scanForKeyframe (timestamp_millisec, &tag_offset)) {
+            if (got_audio_hdr)
+                audio_hdr.release ();
+            if (got_video_hdr)
+                video_hdr.release ();
+
+            return Result::Failure;
+        }
+    }
+
+    seekToOffset (tag_offset);
+
+    // Sequence headers get the timestamp of the first frame after the seek point.
+    Frame frame;
+    IoResult const res = readTag (&frame);
+    if (res != IoResult::Normal) {
+        if (got_audio_hdr)
+            audio_hdr.release ();
+        if (got_video_hdr)
+            video_hdr.release ();
+
+        if (res == IoResult::Error)
+            return Result::Failure;
+
+        return Result::Success;
+    }
+
+    if (got_audio_hdr) {
+        audio_hdr.timestamp_millisec = frame.timestamp_millisec;
+        audio_hdr.audio_msg.timestamp_nanosec = frame.timestamp_millisec * 1000000;
+        queueFrame (audio_hdr);
+    }
+
+    if (got_video_hdr) {
+        video_hdr.timestamp_millisec = frame.timestamp_millisec;
+        video_hdr.video_msg.timestamp_nanosec = frame.timestamp_millisec * 1000000;
+        queueFrame (video_hdr);
+    }
+
+    queueFrame (frame);
+
+    return Result::Success;
+}
+
+mt_throws Result
+FlvFileReader::readLastTimestamp (Uint64 * const ret_timestamp_millisec)
+{
+    *ret_timestamp_millisec = 0;
+
+    struct stat stat_buf;
+    if (fstat (fd, &stat_buf) == -1) {
+        exc_throw (PosixException, errno);
+        return Result::Failure;
+    }
+
+    Uint64 const file_size = (Uint64) stat_buf.st_size;
+    if (file_size < data_offset + FlvTagHeaderLen + 4)
+        return Result::Success;
+
+    Byte prv_tag_size_buf [4];
+    Size nread = 0;
+    if (!FileReadCache::readFull (fd, Memory::forObject (prv_tag_size_buf), file_size - 4, &nread))
+        return Result::Failure;
+
+    Uint64 const prv_tag_size = ((Uint64) prv_tag_size_buf [0] << 24) |
+                                ((Uint64) prv_tag_size_buf [1] << 16) |
+                                ((Uint64) prv_tag_size_buf [2] <<  8) |
+                                ((Uint64) prv_tag_size_buf [3] <<  0);
+    if (nread < 4
+        || prv_tag_size < FlvTagHeaderLen
+        || prv_tag_size + 4 > file_size - data_offset)
+    {
+        // The file has been cut short.
+        return Result::Success;
+    }
+
+    Byte hdr [FlvTagHeaderLen];
+    if (!FileReadCache::readFull (fd, Memory::forObject (hdr), file_size - 4 - prv_tag_size, &nread))
+        return Result::Failure;
+
+    if (nread < sizeof (hdr))
+        return Result::Success;
+
+    *ret_timestamp_millisec = ((Uint64) hdr [7] << 24) |
+                              ((Uint64) hdr [4] << 16) |
+                              ((Uint64) hdr [5] <<  8) |
+                              ((Uint64) hdr [6] <<  0);
+    return Result::Success;
+}
+
+mt_throws Result
+FlvFileReader::loadIndex (ConstMemory const idx_filename)
+{
+    releaseIndex ();
+
+    int const idx_fd = ::open (String (idx_filename).cstr(), O_RDONLY);
+    if (idx_fd == -1) {
+        exc_throw (PosixException, errno);
+        return Result::Failure;
+    }
+
+    Result ret = Result::Failure;
+    do {
+        Byte hdr [FlvKeyframeIndex_HeaderLen];
+        Size nread = 0;
+        if (!FileReadCache::readFull (idx_fd, Memory::forObject (hdr), 0 /* offset */, &nread))
+            break;
+
+        if (nread < sizeof (hdr)
+            || memcmp (hdr, flv_keyframe_index_signature, sizeof (flv_keyframe_index_signature)))
+        {
+            exc_throw (InternalException, InternalException::BadInput);
+            break;
+        }
+
+        Uint32 const version = ((Uint32) hdr [4] << 24) |
+                               ((Uint32) hdr [5] << 16) |
+                               ((Uint32) hdr [6] <<  8) |
+                               ((Uint32) hdr [7] <<  0);
+        if (version != FlvKeyframeIndex_Version) {
+            exc_throw (InternalException, InternalException::BadInput);
+            break;
+        }
+
+        Uint64 duration_millisec = 0;
+        for (unsigned i = 0; i < 8; ++i)
+            duration_millisec = (duration_millisec << 8) | hdr [8 + i];
+
+        Count const num_entries = ((Count) hdr [24] << 24) |
+                                  ((Count) hdr [25] << 16) |
+                                  ((Count) hdr [26] <<  8) |
+                                  ((Count) hdr [27] <<  0);
+
+        IndexEntry * const entries = new (std::nothrow) IndexEntry [num_entries ? num_entries : 1];
+        assert (entries);
+
+        bool entries_ok = true;
+        Uint64 pos = FlvKeyframeIndex_HeaderLen;
+        for (Count i = 0; i < num_entries; ++i) {
+            Byte entry [FlvKeyframeIndex_EntryLen];
+            if (!FileReadCache::readFull (idx_fd, Memory::forObject (entry), pos, &nread)) {
+                entries_ok = false;
+                break;
+            }
+
+            if (nread < sizeof (entry)) {
+                exc_throw (InternalException, InternalException::BadInput);
+                entries_ok = false;
+                break;
+            }
+
+            entries [i].timestamp_millisec = 0;
+            entries [i].tag_offset = 0;
+            for (unsigned j = 0; j < 8; ++j) {
+                entries [i].timestamp_millisec = (entries [i].timestamp_millisec << 8) | entry [j];
+                entries [i].tag_offset = (entries [i].tag_offset << 8) | entry [8 + j];
+            }
+
+            pos += sizeof (entry);
+        }
+
+        if (!entries_ok) {
+            delete[] entries;
+            break;
+        }
+
+        index = entries;
+        num_index_entries = num_entries;
+        this->duration_millisec = duration_millisec;
+
+        ret = Result::Success;
+    } while (0);
+
+    if (::close (idx_fd) == -1)
+        logE (flvread, _func, "close() failed: ", errnoString (errno));
+
+    return ret;
+}
+
+void
+FlvFileReader::releaseIndex ()
+{
+    delete[] index;
+    index = NULL;
+    num_index_entries = 0;
+}
+
+mt_throws Result
+FlvFileReader::open (ConstMemory const filename)
+{
+    close ();
+
+    fd = ::open (String (filename).cstr(), O_RDONLY);
+    if (fd == -1) {
+        exc_throw (PosixException, errno);
+        return Result::Failure;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise (fd, 0 /* offset */, 0 /* len */, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (!initFileKey (fd)) {
+        close ();
+        return Result::Failure;
+    }
+
+    seekToOffset (0);
+    if (!fill (FlvHeaderLen)) {
+        close ();
+        return Result::Failure;
+    }
+
+    Byte const * const hdr = buf;
+    if (buf_len < FlvHeaderLen
+        || hdr [0] != 'F' || hdr [1] != 'L' || hdr [2] != 'V')
+    {
+        logE (flvread, _func, "not an FLV file: ", filename);
+        close ();
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    Uint32 const header_len = ((Uint32) hdr [5] << 24) |
+                              ((Uint32) hdr [6] << 16) |
+                              ((Uint32) hdr [7] <<  8) |
+                              ((Uint32) hdr [8] <<  0);
+    data_offset = (Uint64) header_len + 4 /* PreviousTagSize0 */;
+
+    {
+        Ref<String> const idx_filename = makeString (filename, ".idx");
+        if (!loadIndex (idx_filename->mem()))
+            logD (flvread, _func, "no keyframe index for ", filename, ": ", exc->toString());
+    }
+
+    if (!index) {
+        if (!readLastTimestamp (&duration_millisec))
+            logW (flvread, _func, "could not determine duration of ", filename, ": ", exc->toString());
+    }
+
+    seekToOffset (data_offset);
+    return Result::Success;
+}
+
+void
+FlvFileReader::close ()
+{
+    releaseQueuedFrames ();
+    releaseIndex ();
+    duration_millisec = 0;
+
+    if (fd != -1) {
+        if (::close (fd) == -1)
+            logE (flvread, _func, "close() failed: ", errnoString (errno));
+
+        fd = -1;
+    }
+
+    seekToOffset (0);
+    data_offset = 0;
+}
+
+FlvFileReader::FlvFileReader ()
+    : fd        (-1),
+      buf       (NULL),
+      buf_pos   (0),
+      buf_len   (0),
+      file_pos  (0),
+      got_eof   (false),
+      data_offset (0),
+      index     (NULL),
+      num_index_entries (0),
+      duration_millisec (0)
+{
+    buf = new (std::nothrow) Byte [ReadAheadSize];
+    assert (buf);
+}
+
+FlvFileReader::~FlvFileReader ()
+{
+    close ();
+    delete[] buf;
+}
+
+}
+
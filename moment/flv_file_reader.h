@@ -0,0 +1,119 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__FLV_FILE_READER__H__
+#define MOMENT__FLV_FILE_READER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/media_reader.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Sequential reader for FLV files. The file is read with pread() in large
+// blocks, so that each tag costs a copy to pages and no syscalls. Audio and
+// video tags are returned as VideoStream messages with FLV codec headers
+// cut away, just like RtmpConnection does for incoming messages.
+//
+// The "<file>.idx" keyframe index written by FlvMuxer (see flv_util.h) is
+// loaded by open() if present. Without an index, seek() scans the file.
+//
+mt_unsafe class FlvFileReader : public MediaReader
+{
+public:
+    enum {
+        ReadAheadSize = 1 << 18
+    };
+
+private:
+    struct IndexEntry
+    {
+        Uint64 timestamp_millisec;
+        Uint64 tag_offset;
+    };
+
+    int fd;
+
+    Byte *buf;
+    Size  buf_pos;
+    Size  buf_len;
+    // File offset of buf [buf_pos].
+    Uint64 file_pos;
+    bool   got_eof;
+
+    // Offset of the first tag.
+    Uint64 data_offset;
+
+    IndexEntry *index;
+    Count       num_index_entries;
+
+    Uint64 duration_millisec;
+
+    mt_throws Result fill (Size len);
+
+    void skip (Size len);
+
+    mt_throws IoResult readTag (Frame * mt_nonnull ret_frame);
+
+    mt_throws Result readCodecHeaders (Frame * mt_nonnull ret_audio_hdr,
+                                       bool  * mt_nonnull ret_got_audio_hdr,
+                                       Frame * mt_nonnull ret_video_hdr,
+                                       bool  * mt_nonnull ret_got_video_hdr);
+
+    mt_throws Result scanForKeyframe (Time    timestamp_millisec,
+                                      Uint64 *ret_tag_offset);
+
+    mt_throws Result loadIndex (ConstMemory idx_filename);
+
+    // Takes the duration from the last tag of the file.
+    mt_throws Result readLastTimestamp (Uint64 *ret_timestamp_millisec);
+
+    void releaseIndex ();
+
+    void seekToOffset (Uint64 offset);
+
+public:
+  mt_iface (MediaReader)
+    mt_throws Result open (ConstMemory filename);
+
+    void close ();
+
+    mt_throws Result seek (Time timestamp_millisec);
+
+    // Script data tags are skipped.
+    mt_throws IoResult readFrame (Frame * mt_nonnull ret_frame);
+
+    Time getDurationMillisec () { return duration_millisec; }
+  mt_iface_end
+
+    bool hasIndex () const { return index != NULL; }
+
+     FlvFileReader ();
+    ~FlvFileReader ();
+};
+
+}
+
+
+#endif /* MOMENT__FLV_FILE_READER__H__ */
+
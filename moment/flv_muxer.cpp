@@ -17,6 +17,8 @@
 */
 
 
+#include <moment/flv_util.h>
+
 #include <moment/flv_muxer.h>
 
 
@@ -49,11 +51,168 @@ static Byte const flv_header [] = {
     0x0
 };
 
+// Length of the onMetaData tag body with no keyframes and no padding.
+// See fillMetaData().
+static Size const metadata_fixed_len = 120;
+
+static Byte*
+putUint32Be (Byte   *p,
+             Uint32  const value)
+{
+    p [0] = (Byte) ((value >> 24) & 0xff);
+    p [1] = (Byte) ((value >> 16) & 0xff);
+    p [2] = (Byte) ((value >>  8) & 0xff);
+    p [3] = (Byte) ((value >>  0) & 0xff);
+    return p + 4;
+}
+
+static Byte*
+putUint64Be (Byte   *p,
+             Uint64  const value)
+{
+    p = putUint32Be (p, (Uint32) (value >> 32));
+    return putUint32Be (p, (Uint32) value);
+}
+
+static Byte*
+putAmfFieldName (Byte        *p,
+                 ConstMemory  const name)
+{
+    p [0] = (Byte) ((name.len() >> 8) & 0xff);
+    p [1] = (Byte) ((name.len() >> 0) & 0xff);
+    memcpy (p + 2, name.mem(), name.len());
+    return p + 2 + name.len();
+}
+
+static Byte*
+putAmfNumber (Byte   *p,
+              double  const number)
+{
+    Uint64 bits;
+    memcpy (&bits, &number, sizeof (bits));
+
+    *p = 0x00 /* AMF0 number */;
+    return putUint64Be (p + 1, bits);
+}
+
+static Byte*
+putAmfObjectEnd (Byte *p)
+{
+    p [0] = 0;
+    p [1] = 0;
+    p [2] = 0x09 /* AMF0 object end */;
+    return p + 3;
+}
+
+// Fills onMetaData tag body of exactly 'mem.len()' bytes. If the keyframe list
+// doesn't fit, every n-th keyframe is listed. The rest is filled with padding.
+void
+FlvMuxer::fillMetaData (Memory const mem)
+{
+    // Each keyframe takes two AMF0 numbers, 9 bytes each.
+    Count const max_keyframes = (mem.len() - metadata_fixed_len) / 18;
+    Count step = 1;
+    Count num_listed = 0;
+    if (max_keyframes > 0) {
+        if (num_keyframes > max_keyframes)
+            step = (num_keyframes + max_keyframes - 1) / max_keyframes;
+
+        num_listed = (num_keyframes + step - 1) / step;
+    }
+
+    Byte *p = mem.mem();
+
+    *p++ = 0x02 /* AMF0 string */;
+    p = putAmfFieldName (p, "onMetaData");
+
+    *p++ = 0x08 /* AMF0 ECMA array */;
+    p = putUint32Be (p, 4 /* number of entries */);
+
+    p = putAmfFieldName (p, "duration");
+    p = putAmfNumber (p, (double) last_timestamp_millisec / 1000.0);
+
+    p = putAmfFieldName (p, "filesize");
+    p = putAmfNumber (p, (double) file_pos);
+
+    p = putAmfFieldName (p, "keyframes");
+    *p++ = 0x03 /* AMF0 object */;
+    {
+        p = putAmfFieldName (p, "times");
+        *p++ = 0x0a /* AMF0 strict array */;
+        p = putUint32Be (p, (Uint32) num_listed);
+        {
+            Count i = 0;
+            List<KeyframeEntry>::iter iter (keyframe_list);
+            while (!keyframe_list.iter_done (iter)) {
+                KeyframeEntry * const entry = &keyframe_list.iter_next (iter)->data;
+                if (num_listed > 0 && i++ % step == 0)
+                    p = putAmfNumber (p, (double) entry->timestamp_millisec / 1000.0);
+            }
+        }
+
+        p = putAmfFieldName (p, "filepositions");
+        *p++ = 0x0a /* AMF0 strict array */;
+        p = putUint32Be (p, (Uint32) num_listed);
+        {
+            Count i = 0;
+            List<KeyframeEntry>::iter iter (keyframe_list);
+            while (!keyframe_list.iter_done (iter)) {
+                KeyframeEntry * const entry = &keyframe_list.iter_next (iter)->data;
+                if (num_listed > 0 && i++ % step == 0)
+                    p = putAmfNumber (p, (double) entry->file_pos);
+            }
+        }
+    }
+    p = putAmfObjectEnd (p);
+
+    Size const padding_len = mem.len() - metadata_fixed_len - num_listed * 18;
+    p = putAmfFieldName (p, "padding");
+    *p++ = 0x0c /* AMF0 long string */;
+    p = putUint32Be (p, (Uint32) padding_len);
+    memset (p, ' ', padding_len);
+    p += padding_len;
+
+    p = putAmfObjectEnd (p);
+
+    assert (p == mem.mem() + mem.len());
+}
+
+Ref<String>
+FlvMuxer::makeKeyframeIndex ()
+{
+    Ref<String> const index = grab (new (std::nothrow) String (
+            FlvKeyframeIndex_HeaderLen + num_keyframes * FlvKeyframeIndex_EntryLen));
+
+    Byte *p = index->mem().mem();
+
+    memcpy (p, flv_keyframe_index_signature, sizeof (flv_keyframe_index_signature));
+    p += sizeof (flv_keyframe_index_signature);
+    p = putUint32Be (p, FlvKeyframeIndex_Version);
+    p = putUint64Be (p, last_timestamp_millisec);
+    p = putUint64Be (p, file_pos);
+    p = putUint32Be (p, (Uint32) num_keyframes);
+
+    List<KeyframeEntry>::iter iter (keyframe_list);
+    while (!keyframe_list.iter_done (iter)) {
+        KeyframeEntry * const entry = &keyframe_list.iter_next (iter)->data;
+        p = putUint64Be (p, entry->timestamp_millisec);
+        p = putUint64Be (p, entry->file_pos);
+    }
+
+    return index;
+}
+
 mt_throws Result
 FlvMuxer::beginMuxing ()
 {
     got_first_timestamp = false;
 
+    file_pos = sizeof (flv_header);
+    last_timestamp_millisec = 0;
+    metadata_tag_pos = 0;
+    keyframe_list.clear ();
+    num_keyframes = 0;
+
     Sender::MessageEntry_Pages * const msg_pages =
             Sender::MessageEntry_Pages::createNew (sizeof (flv_header));
 
@@ -66,18 +225,54 @@ FlvMuxer::beginMuxing ()
 
     sender->sendMessage (msg_pages, true /* do_flush */);
 
+    if (metadata_reserve > 0) {
+        // Placeholder for the final onMetaData, which is patched in
+        // at the end (see getFinalData()).
+        Size const tag_len = 11 + metadata_reserve + 4;
+
+        Sender::MessageEntry_Pages * const msg_pages =
+                Sender::MessageEntry_Pages::createNew (tag_len);
+
+        Byte * const tag = msg_pages->getHeaderData();
+        tag [0] = 0x12 /* script data tag */;
+        tag [1] = (Byte) ((metadata_reserve >> 16) & 0xff);
+        tag [2] = (Byte) ((metadata_reserve >>  8) & 0xff);
+        tag [3] = (Byte) ((metadata_reserve >>  0) & 0xff);
+        memset (tag + 4, 0, 7 /* timestamp and stream id */);
+
+        fillMetaData (Memory (tag + 11, metadata_reserve));
+        putUint32Be (tag + 11 + metadata_reserve, (Uint32) (11 + metadata_reserve));
+
+        msg_pages->header_len = tag_len;
+
+        msg_pages->page_pool = NULL;
+        msg_pages->setFirstPage (NULL);
+        msg_pages->msg_offset = 0;
+
+        sender->sendMessage (msg_pages, true /* do_flush */);
+
+        metadata_tag_pos = file_pos;
+        file_pos += tag_len;
+    }
+
     return Result::Success;
 }
 
+// Messages come without FLV audio/video codec headers, which are restored
+// from message fields by fillFlvAudioHeader() and fillFlvVideoHeader(),
+// the same way RtmpConnection does when sending. 'codec_hdr' is written
+// at the beginning of tag data.
 void
 FlvMuxer::doMuxMessage (VideoStream::Message * const mt_nonnull msg,
-			Byte const msg_type)
+			Byte const msg_type,
+			ConstMemory const codec_hdr)
 {
     Uint64 const timestamp_millisec = msg->timestamp_nanosec / 1000000;
 
 //    logD_ (_func, "ts 0x", fmt_hex, msg->timestamp_nanosec);
 
-    if (msg->msg_len >= (1 << 24)) {
+    Size const data_len = codec_hdr.len() + msg->msg_len;
+    if (data_len >= (1 << 24)) {
 	logE (flvmux, _func, "Message is too long (", msg->msg_len, " bytes), dropping it");
 	return;
     }
@@ -86,9 +281,9 @@ FlvMuxer::doMuxMessage (VideoStream::Message * const mt_nonnull msg,
 	msg_type /* unencrypted */,
 
 	// Data size
-	(Byte) ((msg->msg_len >> 16) & 0xff),
-	(Byte) ((msg->msg_len >>  8) & 0xff),
-	(Byte) ((msg->msg_len >>  0) & 0xff),
+	(Byte) ((data_len >> 16) & 0xff),
+	(Byte) ((data_len >>  8) & 0xff),
+	(Byte) ((data_len >>  0) & 0xff),
 
 	// Timestamp
 	(Byte) ((timestamp_millisec >> 16) & 0xff),
@@ -106,10 +301,11 @@ FlvMuxer::doMuxMessage (VideoStream::Message * const mt_nonnull msg,
 
     {
 	Sender::MessageEntry_Pages * const msg_pages =
-		Sender::MessageEntry_Pages::createNew (sizeof (tag_header));
+		Sender::MessageEntry_Pages::createNew (sizeof (tag_header) + codec_hdr.len());
 
 	memcpy (msg_pages->getHeaderData(), tag_header, sizeof (tag_header));
-	msg_pages->header_len = sizeof (tag_header);
+	memcpy (msg_pages->getHeaderData() + sizeof (tag_header), codec_hdr.mem(), codec_hdr.len());
+	msg_pages->header_len = sizeof (tag_header) + codec_hdr.len();
 
 	if (msg->prechunk_size == 0) {
 	    msg_pages->page_pool  = msg->page_pool;
@@ -135,7 +331,7 @@ FlvMuxer::doMuxMessage (VideoStream::Message * const mt_nonnull msg,
     }
 
     {
-	Size const tag_size = msg->msg_len + sizeof (tag_header); 
+	Size const tag_size = sizeof (tag_header) + data_len;
 
 	Byte const tag_footer [] = {
 	    (Byte) ((tag_size >> 24) & 0xff),
@@ -156,13 +352,24 @@ FlvMuxer::doMuxMessage (VideoStream::Message * const mt_nonnull msg,
 
 	sender->sendMessage (msg_pages, true /* do_flush */);
     }
+
+    file_pos += sizeof (tag_header) + data_len + 4 /* tag footer */;
+    last_timestamp_millisec = timestamp_millisec;
 }
 
 mt_throws Result
 FlvMuxer::muxAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg)
 {
     logD (flvmux, _func, "ts: 0x", fmt_hex, msg->timestamp_nanosec / 1000000);
-    doMuxMessage (msg, 0x8 /* audio tag */);
+
+    Byte codec_hdr [FlvAudioHeader_MaxLen];
+    unsigned const codec_hdr_len = fillFlvAudioHeader (msg, Memory::forObject (codec_hdr));
+    if (codec_hdr_len == 0 && msg->msg_len != 0) {
+        logD (flvmux, _func, "Ignoring non-empty audio message: couldn't fill audio header");
+        return Result::Success;
+    }
+
+    doMuxMessage (msg, 0x8 /* audio tag */, ConstMemory (codec_hdr, codec_hdr_len));
     return Result::Success;
 }
 
@@ -170,7 +377,36 @@ mt_throws Result
 FlvMuxer::muxVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg)
 {
     logD (flvmux, _func, "ts: 0x", fmt_hex, msg->timestamp_nanosec / 1000000);
-    doMuxMessage (msg, 0x9 /* video tag */);
+
+    if (msg->frame_type == VideoStream::VideoFrameType::RtmpClearMetaData)
+        return Result::Success;
+
+    Uint64 const tag_pos = file_pos;
+    if (msg->frame_type == VideoStream::VideoFrameType::RtmpSetMetaData) {
+        // AMF0 data as is.
+        doMuxMessage (msg, 0x12 /* script data tag */, ConstMemory());
+        return Result::Success;
+    }
+
+    Byte codec_hdr [FlvVideoHeader_MaxLen];
+    unsigned const codec_hdr_len = fillFlvVideoHeader (msg, Memory::forObject (codec_hdr));
+    if (codec_hdr_len == 0 && msg->msg_len != 0) {
+        logD (flvmux, _func, "Ignoring non-empty video message: couldn't fill video header");
+        return Result::Success;
+    }
+
+    doMuxMessage (msg, 0x9 /* video tag */, ConstMemory (codec_hdr, codec_hdr_len));
+
+    if (msg->frame_type.isKeyFrame()
+        && file_pos != tag_pos /* not dropped */
+        && (build_keyframe_index || metadata_reserve > 0))
+    {
+        KeyframeEntry * const entry = &keyframe_list.appendEmpty()->data;
+        entry->timestamp_millisec = msg->timestamp_nanosec / 1000000;
+        entry->file_pos = tag_pos;
+        ++num_keyframes;
+    }
+
     return Result::Success;
 }
 
@@ -187,8 +423,46 @@ FlvMuxer::reset ()
     got_first_timestamp = false;
 }
 
+void
+FlvMuxer::getFinalData (FinalData * const mt_nonnull ret_data)
+{
+    if (build_keyframe_index)
+        ret_data->index = makeKeyframeIndex ();
+
+    if (metadata_reserve > 0) {
+        ret_data->patch = grab (new (std::nothrow) String (metadata_reserve));
+        fillMetaData (ret_data->patch->mem());
+        ret_data->patch_offset = metadata_tag_pos + 11 /* tag header */;
+    }
+}
+
+mt_const void
+FlvMuxer::setMetaDataReserve (Size const metadata_reserve)
+{
+    if (metadata_reserve > 0 && metadata_reserve < metadata_fixed_len) {
+        logW (flvmux, _func, "metadata reserve is too small: ", metadata_reserve,
+              ", using ", metadata_fixed_len);
+        this->metadata_reserve = metadata_fixed_len;
+        return;
+    }
+
+    // FLV tag data size is 24 bits.
+    if (metadata_reserve >= (1 << 24)) {
+        this->metadata_reserve = (1 << 24) - 1;
+        return;
+    }
+
+    this->metadata_reserve = metadata_reserve;
+}
+
 FlvMuxer::FlvMuxer ()
-    : page_pool (NULL)
+    : page_pool (NULL),
+      build_keyframe_index (false),
+      metadata_reserve (0),
+      file_pos (0),
+      last_timestamp_millisec (0),
+      metadata_tag_pos (0),
+      num_keyframes (0)
 {
     reset ();
 }
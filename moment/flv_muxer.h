@@ -33,12 +33,33 @@ using namespace M;
 mt_unsafe class FlvMuxer : public AvMuxer
 {
 private:
+    struct KeyframeEntry
+    {
+        Uint64 timestamp_millisec;
+        Uint64 file_pos;
+    };
+
     PagePool *page_pool;
 
+    mt_const bool build_keyframe_index;
+    mt_const Size metadata_reserve;
+
     bool got_first_timestamp;
 
+    Uint64 file_pos;
+    Uint64 last_timestamp_millisec;
+    Uint64 metadata_tag_pos;
+
+    List<KeyframeEntry> keyframe_list;
+    Count num_keyframes;
+
     void doMuxMessage (VideoStream::Message * mt_nonnull msg,
-		       Byte msg_type);
+		       Byte        msg_type,
+		       ConstMemory codec_hdr);
+
+    void fillMetaData (Memory mem);
+
+    Ref<String> makeKeyframeIndex ();
 public:
     mt_throws Result beginMuxing ();
     mt_throws Result endMuxing   ();
@@ -48,8 +69,19 @@ public:
 
     void reset ();
 
+    void getFinalData (FinalData * mt_nonnull ret_data);
+
     void setPagePool (PagePool * const page_pool) { this->page_pool = page_pool; }
 
+    // Keyframe index sidecar file, see flv_util.h
+    mt_const void setBuildKeyframeIndex (bool const build_keyframe_index)
+        { this->build_keyframe_index = build_keyframe_index; }
+
+    // Size of onMetaData tag body which is reserved at the beginning of
+    // the file and filled with duration, filesize and keyframes when
+    // muxing ends. 0 means no onMetaData tag.
+    mt_const void setMetaDataReserve (Size metadata_reserve);
+
     FlvMuxer ();
 };
 
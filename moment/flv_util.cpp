@@ -22,6 +22,8 @@
 
 namespace Moment {
 
+Byte const flv_keyframe_index_signature [4] = { 'M', 'K', 'F', 'I' };
+
 unsigned fillFlvAudioHeader (VideoStream::AudioMessage * const mt_nonnull audio_msg,
                              Memory const mem)
 {
@@ -31,6 +31,28 @@ enum {
     FlvVideoHeader_MaxLen = 5
 };
 
+// Keyframe index which is written next to recorded FLV files as "<file>.idx".
+// All numbers are big-endian.
+//
+//     4 bytes - "MKFI"
+//     4 bytes - version (1)
+//     8 bytes - duration in milliseconds
+//     8 bytes - file size
+//     4 bytes - number of entries
+//
+// Followed by entries, one per video keyframe:
+//
+//     8 bytes - timestamp in milliseconds
+//     8 bytes - file offset of the FLV tag
+//
+enum {
+    FlvKeyframeIndex_Version   = 1,
+    FlvKeyframeIndex_HeaderLen = 28,
+    FlvKeyframeIndex_EntryLen  = 16
+};
+
+extern Byte const flv_keyframe_index_signature [4];
+
 unsigned fillFlvAudioHeader (VideoStream::AudioMessage * mt_nonnull audio_msg,
                              Memory mem);
 
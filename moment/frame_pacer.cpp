@@ -0,0 +1,150 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <moment/frame_pacer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_pacer ("moment.frame_pacer", LogLevel::I);
+
+mt_throws MediaReader::Frame*
+FramePacer::peekFrame (IoResult * const mt_nonnull ret_res)
+{
+    if (got_pending_frame) {
+        *ret_res = IoResult::Normal;
+        return &pending_frame;
+    }
+
+    for (;;) {
+        IoResult const res = reader->readFrame (&pending_frame);
+        if (res == IoResult::Error) {
+            *ret_res = IoResult::Error;
+            return NULL;
+        }
+
+        if (res == IoResult::Eof) {
+            if (!opts.loop || !got_first_frame) {
+                *ret_res = IoResult::Eof;
+                return NULL;
+            }
+
+            // Codec headers are returned again after the seek, as for a new stream.
+            if (!reader->seek (0)) {
+                *ret_res = IoResult::Error;
+                return NULL;
+            }
+
+            loop_offset_millisec = last_timestamp_millisec + LoopGap_Millisec;
+            ++num_loops;
+            logD (pacer, _func, "loop ", num_loops);
+            continue;
+        }
+
+        break;
+    }
+
+    if (!got_first_frame) {
+        got_first_frame = true;
+        start_time_millisec = getTimeMilliseconds();
+        first_timestamp_millisec = pending_frame.timestamp_millisec;
+    }
+
+    pending_play_millisec =
+            (pending_frame.timestamp_millisec >= first_timestamp_millisec ?
+                     pending_frame.timestamp_millisec - first_timestamp_millisec : 0)
+            + loop_offset_millisec;
+
+    if (pending_play_millisec > last_timestamp_millisec)
+        last_timestamp_millisec = pending_play_millisec;
+
+    if (opts.rebase_timestamps) {
+        pending_frame.timestamp_millisec = pending_play_millisec;
+        pending_frame.getMessage()->timestamp_nanosec = pending_play_millisec * 1000000;
+    }
+
+    got_pending_frame = true;
+
+    *ret_res = IoResult::Normal;
+    return &pending_frame;
+}
+
+bool
+FramePacer::isFrameDue (Time const now_millisec)
+{
+    if (opts.speed_percent == 0)
+        return true;
+
+    Time const due_millisec = start_time_millisec + pending_play_millisec * 100 / opts.speed_percent;
+    return due_millisec <= now_millisec + Lookahead_Millisec;
+}
+
+void
+FramePacer::takeFrame (MediaReader::Frame * const mt_nonnull ret_frame)
+{
+    assert (got_pending_frame);
+    *ret_frame = pending_frame;
+    got_pending_frame = false;
+}
+
+void
+FramePacer::reset ()
+{
+    if (got_pending_frame) {
+        pending_frame.release ();
+        got_pending_frame = false;
+    }
+
+    got_first_frame = false;
+    loop_offset_millisec = 0;
+    last_timestamp_millisec = 0;
+}
+
+mt_const void
+FramePacer::init (MediaReader   * const mt_nonnull reader,
+                  Options const &opts)
+{
+    this->reader = reader;
+    this->opts = opts;
+}
+
+FramePacer::FramePacer ()
+    : reader (NULL),
+      got_first_frame (false),
+      start_time_millisec (0),
+      first_timestamp_millisec (0),
+      loop_offset_millisec (0),
+      last_timestamp_millisec (0),
+      num_loops (0),
+      got_pending_frame (false),
+      pending_play_millisec (0)
+{
+}
+
+FramePacer::~FramePacer ()
+{
+    if (got_pending_frame)
+        pending_frame.release ();
+}
+
+}
+
@@ -0,0 +1,124 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__FRAME_PACER__H__
+#define MOMENT__FRAME_PACER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/media_reader.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Reads frames of a MediaReader one frame ahead and tells when they are due.
+// Shared by the classes which play files out from a timer: FileSource and
+// FileReplayer pace frames to the clock, VodSession to the client's buffer.
+//
+// The owner serializes calls with its own mutex.
+//
+mt_unsafe class FramePacer
+{
+public:
+    enum {
+        TickInterval_Millisec = 10,
+        // Frames which are due within this interval are sent in advance.
+        Lookahead_Millisec    = 20,
+        // Limits the time spent in a single tick when frames are not paced.
+        MaxFramesPerTick      = 64
+    };
+
+    class Options
+    {
+    public:
+        // Playback speed in percent of real time: 100 - real time, 400 - 4x.
+        // 0 - frames are not paced to the clock.
+        Uint32 speed_percent;
+        // Start over at the end of the file. Timestamps keep growing across loops.
+        bool   loop;
+        // Timestamps start from 0. Otherwise, timestamps of the file are kept,
+        // which is incompatible with 'loop'.
+        bool   rebase_timestamps;
+
+        Options ()
+            : speed_percent (100),
+              loop (false),
+              rebase_timestamps (true)
+        {}
+    };
+
+private:
+    enum {
+        // Timestamp gap between the last frame of a pass and the first frame
+        // of the next one, about one frame long.
+        LoopGap_Millisec = 40
+    };
+
+    mt_const MediaReader *reader;
+    mt_const Options opts;
+
+    bool   got_first_frame;
+    Time   start_time_millisec;
+    Uint64 first_timestamp_millisec;
+
+    // Added to timestamps of the current pass over the file.
+    Uint64 loop_offset_millisec;
+    Uint64 last_timestamp_millisec;
+    Count  num_loops;
+
+    // A frame which has been read but is not due yet.
+    MediaReader::Frame pending_frame;
+    bool   got_pending_frame;
+    // Time of 'pending_frame' since the first frame, loops included.
+    Uint64 pending_play_millisec;
+
+public:
+    // Returns the next frame without taking it. Returns NULL with 'ret_res'
+    // set to IoResult::Eof at the end of the file, or to IoResult::Error.
+    mt_throws MediaReader::Frame* peekFrame (IoResult * mt_nonnull ret_res);
+
+    // Whether the frame returned by peekFrame() should be sent by 'now_millisec'.
+    // Always true if 'speed_percent' is 0.
+    bool isFrameDue (Time now_millisec);
+
+    // Takes the frame returned by peekFrame(). The caller is responsible for
+    // calling ret_frame->release().
+    void takeFrame (MediaReader::Frame * mt_nonnull ret_frame);
+
+    // Drops the pending frame and starts the clock anew. Should be called
+    // after the reader has been repositioned.
+    void reset ();
+
+    bool isPaced () const { return opts.speed_percent > 0; }
+
+    mt_const void init (MediaReader   * mt_nonnull reader,
+                        Options const &opts);
+
+     FramePacer ();
+    ~FramePacer ();
+};
+
+}
+
+
+#endif /* MOMENT__FRAME_PACER__H__ */
+
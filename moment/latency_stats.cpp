@@ -0,0 +1,125 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/latency_stats.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+Count
+LatencyHistogram::valueToBucket (Uint64 const value)
+{
+    if (value < SubBuckets)
+        return (Count) value;
+
+    // Position of the highest bit set.
+    unsigned const msb = 63 - __builtin_clzll (value);
+    unsigned const range = msb - SubBucketBits;
+    if (range >= NumRanges)
+        return NumBuckets - 1;
+
+    Count const sub_bucket = (Count) (value >> range) - SubBuckets;
+    return SubBuckets + range * SubBuckets + sub_bucket;
+}
+
+Uint64
+LatencyHistogram::bucketToValue (Count const idx)
+{
+    if (idx < SubBuckets)
+        return idx;
+
+    Count const range = (idx - SubBuckets) / SubBuckets;
+    Count const sub_bucket = (idx - SubBuckets) % SubBuckets;
+    return (((Uint64) SubBuckets + sub_bucket + 1) << range) - 1;
+}
+
+Uint64
+LatencyHistogram::getCount () const
+{
+    Uint64 count = 0;
+    for (Count i = 0; i < NumBuckets; ++i)
+        count += *(Uint64 const volatile *) &buckets [i];
+
+    return count;
+}
+
+Uint64
+LatencyHistogram::getPercentile (double const percentile) const
+{
+    Uint64 counts [NumBuckets];
+    Uint64 total = 0;
+    for (Count i = 0; i < NumBuckets; ++i) {
+        counts [i] = *(Uint64 const volatile *) &buckets [i];
+        total += counts [i];
+    }
+
+    if (total == 0)
+        return 0;
+
+    Uint64 target = (Uint64) (total * percentile / 100.0 + 0.5);
+    if (target == 0)
+        target = 1;
+    if (target > total)
+        target = total;
+
+    Uint64 seen = 0;
+    for (Count i = 0; i < NumBuckets; ++i) {
+        seen += counts [i];
+        if (seen >= target)
+            return bucketToValue (i);
+    }
+
+    return bucketToValue (NumBuckets - 1);
+}
+
+mt_const Uint32 LatencyStats::sample_interval = 0;
+
+__thread Uint32 LatencyStats::tlocal_sample_counter = 0;
+
+__thread Time LatencyStats::tlocal_queued_time_microsec = 0;
+
+LatencyStats LatencyStats::global_stats;
+
+static void printHistogram (PagePool               * const mt_nonnull page_pool,
+                            PagePool::PageListHead * const mt_nonnull page_list,
+                            ConstMemory              const name,
+                            LatencyHistogram const &histogram)
+{
+    page_pool->printToPages (
+            page_list,
+            name, ": count ", histogram.getCount(), ", usec "
+            "p50 ",   histogram.getPercentile (50.0), " "
+            "p90 ",   histogram.getPercentile (90.0), " "
+            "p99 ",   histogram.getPercentile (99.0), " "
+            "p99.9 ", histogram.getPercentile (99.9), " "
+            "max ",   histogram.getMax(), "\n");
+}
+
+void
+LatencyStats::printStats (PagePool               * const mt_nonnull page_pool,
+                          PagePool::PageListHead * const mt_nonnull page_list)
+{
+    printHistogram (page_pool, page_list, "ingest_to_fanout", ingest_to_fanout);
+    printHistogram (page_pool, page_list, "fanout_to_send",   fanout_to_send);
+}
+
+}
+
@@ -0,0 +1,156 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__LATENCY_STATS__H__
+#define MOMENT__LATENCY_STATS__H__
+
+
+#include <libmary/libmary.h>
+
+#include <time.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Histogram of latencies in microseconds with bounded relative error, in the
+// spirit of HdrHistogram. Values below SubBuckets are counted exactly. Larger
+// values are grouped by powers of two, and every power of two is split into
+// SubBuckets equal buckets, which keeps the error under 1/SubBuckets.
+//
+// record() may be called from any thread concurrently.
+//
+class LatencyHistogram
+{
+private:
+    enum {
+        SubBucketBits = 4,
+        SubBuckets    = 1 << SubBucketBits,
+        // Up to 2^(NumRanges + SubBucketBits) microseconds, about 71 minutes.
+        NumRanges     = 28,
+        NumBuckets    = SubBuckets + NumRanges * SubBuckets
+    };
+
+    Uint64 buckets [NumBuckets];
+
+    static Count valueToBucket (Uint64 value);
+
+    // The highest value which falls into bucket 'idx'.
+    static Uint64 bucketToValue (Count idx);
+
+public:
+    void record (Uint64 const value_microsec)
+        { __sync_fetch_and_add (&buckets [valueToBucket (value_microsec)], 1); }
+
+    Uint64 getCount () const;
+
+    // 'percentile' is between 0.0 and 100.0. Returns 0 if there are no values.
+    Uint64 getPercentile (double percentile) const;
+
+    Uint64 getMax () const
+        { return getPercentile (100.0); }
+
+    LatencyHistogram ()
+        { memset (buckets, 0, sizeof (buckets)); }
+};
+
+// Frame latencies along the path of a sampled frame:
+//
+//     ingest  - the frame has been received, e.g. by RtmpConnection::processMessage();
+//     fanout  - VideoStream::fire*Message() has been called for the frame;
+//     send    - the frame has been queued for sending to a watcher's RTMP
+//               connection, measured from the call to that watcher's handler.
+//               Other handlers (recorders, timeshift, relays) are not counted.
+//
+// Frames are sampled at ingest by setting Message::ingest_time_microsec.
+// With sampling disabled, the cost on the hot path is a single branch.
+//
+// Sampled times are taken with getMonotonicMicroseconds(): the cached clock
+// of getTimeMicroseconds() is updated once per event loop iteration, and all
+// of a frame's path usually falls into a single iteration.
+//
+class LatencyStats
+{
+private:
+    mt_const static Uint32 sample_interval;
+
+    static __thread Uint32 tlocal_sample_counter;
+
+    // Set by markFrameQueued() during a handler call, see VideoStream.
+    static __thread Time tlocal_queued_time_microsec;
+
+    static LatencyStats global_stats;
+
+public:
+    LatencyHistogram ingest_to_fanout;
+    LatencyHistogram fanout_to_send;
+
+    // Sample one frame out of every 'sample_interval' frames, 0 disables sampling.
+    // Should be called once at startup.
+    static void setSampleInterval (Uint32 const sample_interval)
+        { LatencyStats::sample_interval = sample_interval; }
+
+    static bool isEnabled ()
+        { return sample_interval != 0; }
+
+    // Returns true if the frame which has just been received should be sampled.
+    static bool sampleFrame ()
+    {
+        if (sample_interval == 0)
+            return false;
+
+        if (++tlocal_sample_counter < sample_interval)
+            return false;
+
+        tlocal_sample_counter = 0;
+        return true;
+    }
+
+    static Time getMonotonicMicroseconds ()
+    {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (Time) ts.tv_sec * 1000000 + (Time) ts.tv_nsec / 1000;
+    }
+
+    // Called by VideoStream before calling a handler with a sampled frame.
+    static void resetFrameQueued ()
+        { tlocal_queued_time_microsec = 0; }
+
+    // Called by socket senders when a sampled frame has been queued.
+    static void markFrameQueued ()
+        { tlocal_queued_time_microsec = getMonotonicMicroseconds (); }
+
+    // 0 if the frame has not been queued to a socket since resetFrameQueued().
+    static Time getFrameQueuedTime ()
+        { return tlocal_queued_time_microsec; }
+
+    static LatencyStats* getGlobal ()
+        { return &global_stats; }
+
+    void printStats (PagePool               * mt_nonnull page_pool,
+                     PagePool::PageListHead * mt_nonnull page_list);
+};
+
+}
+
+
+#endif /* MOMENT__LATENCY_STATS__H__ */
+
@@ -32,10 +32,24 @@
 #include <moment/channel_manager.h>
 #include <moment/media_source.h>
 #include <moment/slave_media_source.h>
+#include <moment/file_source.h>
+#include <moment/file_replayer.h>
+#include <moment/frame_pacer.h>
 #include <moment/playback.h>
+#include <moment/preroll_buffer.h>
 #include <moment/recorder.h>
 
 #include <moment/flv_util.h>
+#include <moment/file_read_cache.h>
+#include <moment/media_reader.h>
+#include <moment/flv_file_reader.h>
+#include <moment/mp4_file_reader.h>
+#include <moment/vod_session.h>
+#include <moment/timeshift_buffer.h>
+#include <moment/metrics.h>
+#include <moment/latency_stats.h>
+#include <moment/stream_stats.h>
+#include <moment/thread_monitor.h>
 #include <moment/amf_encoder.h>
 #include <moment/amf_decoder.h>
 
@@ -53,9 +67,13 @@
 #include <moment/av_muxer.h>
 #include <moment/flv_muxer.h>
 #include <moment/mp4_muxer.h>
+#include <moment/mp4_fragment_muxer.h>
 
 #include <moment/storage.h>
 #include <moment/local_storage.h>
+#ifdef MOMENT_URING
+#include <moment/uring_storage.h>
+#endif
 
 #include <moment/push_protocol.h>
 #include <moment/push_agent.h>
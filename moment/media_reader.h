@@ -0,0 +1,178 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__MEDIA_READER__H__
+#define MOMENT__MEDIA_READER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/video_stream.h>
+#include <moment/file_read_cache.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Reads frames of a media file as VideoStream messages, in decoding order.
+// Codec configuration (AAC and AVC sequence headers) is returned before
+// the first frame after open() and after every seek().
+//
+mt_unsafe class MediaReader
+{
+public:
+    class Frame
+    {
+    public:
+        bool is_audio;
+        VideoStream::AudioMessage audio_msg;
+        VideoStream::VideoMessage video_msg;
+
+        Uint64 timestamp_millisec;
+        // Number of bytes read from the file for this frame.
+        Size   file_len;
+
+        VideoStream::Message* getMessage ()
+        {
+            if (is_audio)
+                return &audio_msg;
+
+            return &video_msg;
+        }
+
+        // Releases the pages of the message.
+        void release ()
+            { getMessage()->release (); }
+
+        Frame ()
+            : is_audio (false),
+              timestamp_millisec (0),
+              file_len (0)
+        {}
+    };
+
+protected:
+    enum {
+        MaxQueuedFrames = 3
+    };
+
+    mt_const PagePool *page_pool;
+    mt_const FileReadCache *read_cache;
+
+    // Set by open() of the implementation when 'read_cache' is used.
+    FileReadCache::FileKey file_key;
+
+    // Frames to be returned by readFrame() before reading further.
+    Frame queued_frames [MaxQueuedFrames];
+    Count num_queued_frames;
+    Count queued_pos;
+
+    void queueFrame (Frame const &frame)
+    {
+        assert (num_queued_frames < MaxQueuedFrames);
+        queued_frames [num_queued_frames] = frame;
+        ++num_queued_frames;
+    }
+
+    bool popQueuedFrame (Frame * const mt_nonnull ret_frame)
+    {
+        if (queued_pos == num_queued_frames)
+            return false;
+
+        *ret_frame = queued_frames [queued_pos];
+        ++queued_pos;
+
+        if (queued_pos == num_queued_frames) {
+            num_queued_frames = 0;
+            queued_pos = 0;
+        }
+
+        return true;
+    }
+
+    // Reads media data through 'read_cache' if there is one.
+    mt_throws Result readFileData (int    const fd,
+                                   Memory const mem,
+                                   Uint64 const offset,
+                                   Size * const mt_nonnull ret_nread)
+    {
+        if (read_cache)
+            return read_cache->read (fd, file_key, mem, offset, ret_nread);
+
+        return FileReadCache::readFull (fd, mem, offset, ret_nread);
+    }
+
+    mt_throws Result initFileKey (int const fd)
+    {
+        if (!read_cache)
+            return Result::Success;
+
+        return FileReadCache::getFileKey (fd, &file_key);
+    }
+
+    void releaseQueuedFrames ()
+    {
+        for (Count i = queued_pos; i < num_queued_frames; ++i)
+            queued_frames [i].release ();
+
+        num_queued_frames = 0;
+        queued_pos = 0;
+    }
+
+public:
+    virtual mt_throws Result open (ConstMemory filename) = 0;
+
+    virtual void close () = 0;
+
+    // Positions the reader at the last video keyframe which is not later than
+    // 'timestamp_millisec'.
+    virtual mt_throws Result seek (Time timestamp_millisec) = 0;
+
+    // Returns IoResult::Eof at the end of the file. On success, the caller is
+    // responsible for calling ret_frame->release().
+    virtual mt_throws IoResult readFrame (Frame * mt_nonnull ret_frame) = 0;
+
+    // 0 if unknown.
+    virtual Time getDurationMillisec () = 0;
+
+    // For readers of live sources, readFrame() returns IoResult::Eof when
+    // there is no data yet, and the caller should try again later.
+    virtual bool isLive () { return false; }
+
+    void setPagePool (PagePool * const page_pool) { this->page_pool = page_pool; }
+
+    // Must be set before open(). The cache should outlive the reader.
+    void setReadCache (FileReadCache * const read_cache) { this->read_cache = read_cache; }
+
+    MediaReader ()
+        : page_pool  (NULL),
+          read_cache (NULL),
+          num_queued_frames (0),
+          queued_pos (0)
+    {}
+
+    virtual ~MediaReader () {}
+};
+
+}
+
+
+#endif /* MOMENT__MEDIA_READER__H__ */
+
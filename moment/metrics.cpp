@@ -0,0 +1,189 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/metrics.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+Metrics::ThreadCounters Metrics::thread_counters [Metrics::MaxThreads];
+Metrics::ThreadCounters Metrics::shared_counters;
+
+AtomicInt Metrics::num_threads;
+
+__thread Metrics::ThreadCounters *Metrics::tlocal_counters = NULL;
+__thread bool Metrics::tlocal_shared = false;
+
+void
+Metrics::initThreadCounters ()
+{
+    Count const idx = (Count) num_threads.fetchAdd (1);
+    if (idx < MaxThreads) {
+        tlocal_counters = &thread_counters [idx];
+        tlocal_shared = false;
+    } else {
+        tlocal_counters = &shared_counters;
+        tlocal_shared = true;
+    }
+}
+
+Uint64
+Metrics::get (Counter const counter)
+{
+    Count num = (Count) num_threads.get ();
+    if (num > MaxThreads)
+        num = MaxThreads;
+
+    Uint64 sum = 0;
+    for (Count i = 0; i < num; ++i)
+        sum += *(Uint64 volatile *) &thread_counters [i].counters [counter];
+
+    sum += *(Uint64 volatile *) &shared_counters.counters [counter];
+    return sum;
+}
+
+ConstMemory
+Metrics::getCounterName (Counter const counter)
+{
+    switch (counter) {
+        case RtmpBytesIn:        return "rtmp_bytes_in_total";
+        case RtmpBytesQueued:    return "rtmp_bytes_queued_total";
+        case RtmpMessagesIn:     return "rtmp_messages_in_total";
+        case RtmpMessagesOut:    return "rtmp_messages_out_total";
+        case RtmpFramesDropped:  return "rtmp_frames_dropped_total";
+        case RtmpSessionsOpened: return "rtmp_sessions_opened_total";
+        case RtmpSessionsClosed: return "rtmp_sessions_closed_total";
+        case RtmpHandshakes:     return "rtmp_handshakes_total";
+        case NumCounters:
+            break;
+    }
+    unreachable ();
+    return ConstMemory ();
+}
+
+ConstMemory
+Metrics::getCounterHelp (Counter const counter)
+{
+    switch (counter) {
+        case RtmpBytesIn:        return "Bytes received from RTMP connections.";
+        case RtmpBytesQueued:    return "Message bytes queued for sending to RTMP connections.";
+        case RtmpMessagesIn:     return "RTMP messages received.";
+        case RtmpMessagesOut:    return "RTMP messages queued for sending.";
+        case RtmpFramesDropped:  return "Audio and video frames not sent to overloaded or waiting RTMP clients.";
+        case RtmpSessionsOpened: return "RTMP and RTMPT sessions opened.";
+        case RtmpSessionsClosed: return "RTMP and RTMPT sessions closed.";
+        case RtmpHandshakes:     return "RTMP handshakes completed.";
+        case NumCounters:
+            break;
+    }
+    unreachable ();
+    return ConstMemory ();
+}
+
+// Metric names may only contain [a-zA-Z0-9_:]. The result is as long as 'name'.
+static Ref<String> sanitizeMetricName (ConstMemory const name)
+{
+    Ref<String> const str = grab (new (std::nothrow) String (name.len()));
+    Byte * const buf = str->mem().mem();
+    for (Size i = 0; i < name.len(); ++i) {
+        Byte const c = name.mem() [i];
+        if ((c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') ||
+            c == '_' || c == ':')
+        {
+            buf [i] = c;
+        } else {
+            buf [i] = '_';
+        }
+    }
+
+    return str;
+}
+
+void
+Metrics::printMetrics (PagePool               * const mt_nonnull page_pool,
+                       PagePool::PageListHead * const mt_nonnull page_list,
+                       PagePool               * const stats_page_pool)
+{
+    for (unsigned i = 0; i < NumCounters; ++i) {
+        Counter const counter = (Counter) i;
+        page_pool->printToPages (
+                page_list,
+                "# HELP moment_", getCounterName (counter), " ", getCounterHelp (counter), "\n"
+                "# TYPE moment_", getCounterName (counter), " counter\n"
+                "moment_", getCounterName (counter), " ", get (counter), "\n");
+    }
+
+    {
+        Uint64 const opened = get (RtmpSessionsOpened);
+        Uint64 const closed = get (RtmpSessionsClosed);
+        page_pool->printToPages (
+                page_list,
+                "# HELP moment_rtmp_sessions Current number of RTMP and RTMPT sessions.\n"
+                "# TYPE moment_rtmp_sessions gauge\n"
+                "moment_rtmp_sessions ", (opened > closed ? opened - closed : 0), "\n");
+    }
+
+    if (stats_page_pool) {
+        // Takes the page pool's mutex for a moment.
+        Count const num_pages = stats_page_pool->getNumPages ();
+        Count const num_spare_pages = stats_page_pool->getNumSparePages ();
+        page_pool->printToPages (
+                page_list,
+                "# HELP moment_page_pool_pages Pages allocated by the server's page pool.\n"
+                "# TYPE moment_page_pool_pages gauge\n"
+                "moment_page_pool_pages ", num_pages, "\n"
+                "# HELP moment_page_pool_pages_in_use Pages of the server's page pool which hold data.\n"
+                "# TYPE moment_page_pool_pages_in_use gauge\n"
+                "moment_page_pool_pages_in_use ", (num_pages > num_spare_pages ? num_pages - num_spare_pages : 0), "\n"
+                "# HELP moment_page_pool_page_size_bytes Page size of the server's page pool.\n"
+                "# TYPE moment_page_pool_page_size_bytes gauge\n"
+                "moment_page_pool_page_size_bytes ", stats_page_pool->getPageSize(), "\n");
+    }
+
+    // Parameters registered with libmary's Stat.
+    List<Stat::StatParam> stat_params;
+    getStat()->getAllParams (&stat_params);
+
+    List<Stat::StatParam>::iter iter (stat_params);
+    while (!stat_params.iter_done (iter)) {
+        Stat::StatParam * const stat_param = &stat_params.iter_next (iter)->data;
+
+        Ref<String> const name_str = sanitizeMetricName (stat_param->param_name->mem());
+        ConstMemory const name = name_str->mem();
+
+        page_pool->printToPages (
+                page_list,
+                "# TYPE moment_stat_", name, " gauge\n"
+                "moment_stat_", name, " ");
+
+        if (stat_param->param_type == Stat::ParamType_Int64) {
+            page_pool->printToPages (page_list, stat_param->int64_value, "\n");
+        } else {
+            assert (stat_param->param_type == Stat::ParamType_Double);
+            page_pool->printToPages (page_list, stat_param->double_value, "\n");
+        }
+    }
+}
+
+}
+
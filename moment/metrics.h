@@ -0,0 +1,112 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__METRICS__H__
+#define MOMENT__METRICS__H__
+
+
+#include <libmary/libmary.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Server-wide counters which may be updated from any thread on hot paths.
+//
+// Every thread gets its own cache line aligned block of counters and updates
+// it with plain stores, so there's no locking and no false sharing between
+// threads. Readers sum the blocks of all threads. Sums may lag behind
+// concurrent updates slightly, which is fine for monitoring.
+//
+class Metrics
+{
+public:
+    enum Counter {
+        RtmpBytesIn = 0,
+        // Counted when a message is queued on a connection, not when it is
+        // written to the socket. RTMP chunk headers are not included.
+        RtmpBytesQueued,
+        RtmpMessagesIn,
+        RtmpMessagesOut,
+        RtmpFramesDropped,
+        RtmpSessionsOpened,
+        RtmpSessionsClosed,
+        RtmpHandshakes,
+
+        NumCounters
+    };
+
+private:
+    enum {
+        CacheLineSize = 64,
+        // Threads beyond this number share a block which is updated atomically.
+        MaxThreads = 256
+    };
+
+    struct ThreadCounters
+    {
+        Uint64 counters [NumCounters];
+    } __attribute__ ((aligned (CacheLineSize)));
+
+    static ThreadCounters thread_counters [MaxThreads];
+    static ThreadCounters shared_counters;
+
+    static AtomicInt num_threads;
+
+    static __thread ThreadCounters *tlocal_counters;
+    static __thread bool tlocal_shared;
+
+    static void initThreadCounters ();
+
+public:
+    static void add (Counter const counter,
+                     Uint64  const value)
+    {
+        if (!tlocal_counters)
+            initThreadCounters ();
+
+        if (!tlocal_shared)
+            tlocal_counters->counters [counter] += value;
+        else
+            __sync_fetch_and_add (&tlocal_counters->counters [counter], value);
+    }
+
+    static void inc (Counter const counter)
+        { add (counter, 1); }
+
+    static Uint64 get (Counter counter);
+
+    // Name of the counter in the metrics endpoint, e.g. "rtmp_bytes_in_total".
+    static ConstMemory getCounterName (Counter counter);
+
+    static ConstMemory getCounterHelp (Counter counter);
+
+    // Appends all counters in Prometheus text exposition format.
+    // Usage of 'stats_page_pool' is reported if it is not NULL.
+    static void printMetrics (PagePool               * mt_nonnull page_pool,
+                              PagePool::PageListHead * mt_nonnull page_list,
+                              PagePool               *stats_page_pool);
+};
+
+}
+
+
+#endif /* MOMENT__METRICS__H__ */
+
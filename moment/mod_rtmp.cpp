@@ -73,6 +73,14 @@ mt_const Uint64 recording_limit = 1 << 24 /* 16 Mb */;
 
 mt_const Count no_keyframe_limit = 250; // 25 fps * 10 seconds
 
+// Recorded files under 'record_path' are played with "play <vod_prefix><name>".
+mt_const bool vod_enable = false;
+mt_const StRef<String> vod_prefix = st_grab (new (std::nothrow) String ("vod/"));
+// Used when the client doesn't send SetBufferLength, or asks for less.
+mt_const Uint64 vod_min_buffer_millisec = 1000;
+mt_const Uint64 vod_cache_size = 1 << 26 /* 64 Mb */;
+mt_const Ref<FileReadCache> vod_read_cache;
+
 mt_const DataDepRef<MomentServer> moment (NULL /* coderef_container */);
 mt_const DataDepRef<Timers> timers (NULL /* coderef_container */);
 mt_const DataDepRef<PagePool> page_pool (NULL /* coderef_container */);
@@ -146,6 +154,7 @@ public:
     ServerThreadContext *recorder_thread_ctx;
     AvRecorder recorder;
     FlvMuxer flv_muxer;
+    Mp4FragmentMuxer mp4_muxer;
 
     mt_const Ref<String> stream_name;
 
@@ -157,6 +166,8 @@ public:
 
     mt_mutex (mutex) Ref<VideoStream> watching_video_stream;
 
+    mt_mutex (mutex) Ref<VodSession> vod_session;
+
     mt_mutex (mutex) StreamingParams streaming_params;
     mt_mutex (mutex) WatchingParams watching_params;
 
@@ -287,8 +298,14 @@ void destroyClientSession (ClientSession * const client_session)
     Ref<MomentServer::ClientSession> const srv_session = client_session->srv_session;
     client_session->srv_session = NULL;
 
+    Ref<VodSession> const vod_session = client_session->vod_session;
+    client_session->vod_session = NULL;
+
     client_session->mutex.unlock ();
 
+    if (vod_session)
+        vod_session->stop ();
+
     MomentServer * const moment = MomentServer::getInstance();
 
     if (srv_session)
@@ -391,6 +408,7 @@ void streamAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
       // Connection overloaded, dropping this audio frame.
 	logD (framedrop, _func, "Connection overloaded, dropping audio frame");
 	client_session->mutex.unlock ();
+	Metrics::inc (Metrics::RtmpFramesDropped);
 	return;
     }
 #endif
@@ -432,6 +450,7 @@ void streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
 	client_session->keyframe_sent = false;
 
 	client_session->mutex.unlock ();
+	Metrics::inc (Metrics::RtmpFramesDropped);
 	return;
     }
 #endif // MOMENT_RTMP__FLOW_CONTROL
@@ -461,6 +480,7 @@ void streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
 	  // Waiting for a keyframe, dropping current video frame.
             logS_ (_func, "wait_for_keyframe, dropping");
 	    client_session->mutex.unlock ();
+	    Metrics::inc (Metrics::RtmpFramesDropped);
 	    return;
 	}
     }
@@ -650,7 +670,7 @@ static void completeStartStreaming (ClientSession * const client_session,
 	    // TODO Support "append" mode.
 	    client_session->recorder.setVideoStream (video_stream);
 	    client_session->recorder.start (
-		    makeString (record_path->mem(), stream_name, ".flv")->mem());
+		    makeString (record_path->mem(), stream_name, moment->getRecordFilenameExt())->mem());
 	}
     }
 
@@ -918,7 +938,197 @@ static Result completeStartWatching (VideoStream   * const video_stream,
     return Result::Success;
 }
 
+static void vodAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                             void                      * const _client_session)
+{
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+    client_session->rtmp_conn->sendAudioMessage (msg);
+}
+
+static void vodVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                             void                      * const _client_session)
+{
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+    client_session->rtmp_conn->sendVideoMessage (msg);
+}
+
+static void vodEos (void * const _client_session)
+{
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+    client_session->rtmp_server.sendPlayStatus (RtmpConnection::DefaultMessageStreamId,
+                                                "NetStream.Play.Stop",
+                                                "Stopped playing.");
+}
+
+static void vodError (void * const _client_session)
+{
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+    client_session->rtmp_conn->closeAfterFlush ();
+}
+
+static VodSession::Frontend const vod_frontend = {
+    vodAudioMessage,
+    vodVideoMessage,
+    vodEos,
+    vodError
+};
+
+static Time getVodBufferLength (ClientSession * const client_session)
+{
+    Time const buffer_len = client_session->rtmp_conn->getClientBufferLength ();
+    if (buffer_len < vod_min_buffer_millisec)
+        return vod_min_buffer_millisec;
+
+    return buffer_len;
+}
+
+// If 'timeshift_buffer' is non-null, then 'vod_name' is the name of the stream
+// to play from the buffer.
+static Result completeStartVod (ClientSession   * const client_session,
+                                ConstMemory       const vod_name,
+                                Int64             const start_millisec,
+                                TimeshiftBuffer * const timeshift_buffer)
+{
+    Ref<String> filename;
+    ConstMemory reader_filename;
+    MediaReader *reader;
+    if (timeshift_buffer) {
+        filename = grab (new (std::nothrow) String (vod_name));
+        reader_filename = filename->mem();
+        reader = timeshift_buffer->createReader ();
+    } else {
+        // Recordings are found the same way as they are named in
+        // completeStartStreaming(), with or without the extension.
+        filename = makeString ("file://", record_path->mem(), vod_name);
+        reader = FileSource::createReaderForUri (filename->mem(), &reader_filename);
+        if (!reader) {
+            filename = makeString ("file://", record_path->mem(), vod_name, moment->getRecordFilenameExt());
+            reader = FileSource::createReaderForUri (filename->mem(), &reader_filename);
+        }
+
+        if (!reader) {
+            logD (mod_rtmp, _func, "unsupported file: ", filename->mem());
+            return Result::Failure;
+        }
+
+        reader->setReadCache (vod_read_cache);
+    }
+
+    Ref<VodSession> const vod_session = grab (new (std::nothrow) VodSession);
+    vod_session->init (moment,
+                       reader,
+                       reader_filename,
+                       getVodBufferLength (client_session),
+                       CbDesc<VodSession::Frontend> (&vod_frontend, client_session, client_session));
+
+    client_session->mutex.lock ();
+    if (!client_session->valid) {
+        client_session->mutex.unlock ();
+        return Result::Failure;
+    }
+    client_session->vod_session = vod_session;
+    client_session->mutex.unlock ();
+
+    client_session->rtmp_conn->disableTimestampAdjustment ();
+
+    if (!vod_session->start (start_millisec > 0 ? (Time) start_millisec : 0)) {
+        logE (mod_rtmp, _func, "could not start vod session: ", exc->toString());
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+class StartVodCallback_Data : public Referenced
+{
+public:
+    WeakRef<ClientSession> weak_client_session;
+    Cb<RtmpServer::StartRtmpWatchingCallback> cb;
+    Ref<String> vod_name;
+    Int64 start_millisec;
+    Ref<TimeshiftBuffer> timeshift_buffer;
+};
+
+static void startVodAuthCallback (bool          const authorized,
+                                  ConstMemory   const /* reply_str */,
+                                  void        * const _data)
+{
+    StartVodCallback_Data * const data = static_cast <StartVodCallback_Data*> (_data);
+
+    Ref<ClientSession> const client_session = data->weak_client_session.getRef ();
+    if (!client_session) {
+        logD (mod_rtmp, _func, "client session gone");
+        data->cb.call_ (Result::Failure);
+        return;
+    }
+
+    if (!authorized) {
+        logD (mod_rtmp, _func, "vod not allowed: ", data->vod_name->mem());
+        data->cb.call_ (Result::Failure);
+        return;
+    }
+
+    data->cb.call_ (completeStartVod (client_session,
+                                      data->vod_name->mem(),
+                                      data->start_millisec,
+                                      data->timeshift_buffer));
+}
+
+static bool startVod (ClientSession   * const client_session,
+                      ConstMemory       const stream_name,
+                      ConstMemory       const vod_name,
+                      Int64             const start_millisec,
+                      TimeshiftBuffer * const timeshift_buffer,
+                      CbDesc<RtmpServer::StartRtmpWatchingCallback> const &cb,
+                      Result          * const mt_nonnull ret_res)
+{
+    *ret_res = Result::Failure;
+
+    // No escaping from 'record_path'.
+    for (Size i = 0; !timeshift_buffer && i + 1 < vod_name.len(); ++i) {
+        if (vod_name.mem() [i] == '.' && vod_name.mem() [i + 1] == '.') {
+            logW (mod_rtmp, _func, "bad vod name: ", vod_name);
+            return true;
+        }
+    }
+
+    Ref<StartVodCallback_Data> const data = grab (new (std::nothrow) StartVodCallback_Data);
+    data->weak_client_session = client_session;
+    data->cb = cb;
+    data->vod_name = grab (new (std::nothrow) String (vod_name));
+    data->start_millisec = start_millisec;
+    data->timeshift_buffer = timeshift_buffer;
+
+    client_session->mutex.lock ();
+    Ref<String> const auth_key = client_session->watching_params.auth_key;
+    client_session->mutex.unlock ();
+
+    bool authorized = false;
+    StRef<String> reply_str;
+    if (!moment->checkAuthorization (NULL /* auth_session */,
+                                     MomentServer::AuthAction_Watch,
+                                     stream_name,
+                                     (auth_key ? auth_key->mem() : ConstMemory()),
+                                     client_session->client_addr,
+                                     CbDesc<MomentServer::CheckAuthorizationCallback> (
+                                             startVodAuthCallback, data, NULL, data),
+                                     &authorized,
+                                     &reply_str))
+    {
+        return false;
+    }
+
+    if (!authorized) {
+        logD (mod_rtmp, _func, "vod not allowed: ", vod_name);
+        return true;
+    }
+
+    *ret_res = completeStartVod (client_session, vod_name, start_millisec, timeshift_buffer);
+    return true;
+}
+
 static bool startRtmpWatching (ConstMemory    const _stream_name,
+                               Int64          const start_millisec,
                                CbDesc<RtmpServer::StartRtmpWatchingCallback> const &cb,
                                Result       * const mt_nonnull ret_res,
                                void         * const _client_session)
@@ -962,6 +1172,41 @@ static bool startRtmpWatching (ConstMemory    const _stream_name,
     client_session->resumed = !client_session->watching_params.start_paused;
     client_session->mutex.unlock ();
 
+    // A start position within the timeshift window of the stream plays
+    // from the buffer up to the live edge.
+    if (start_millisec > 0) {
+        Ref<TimeshiftBuffer> const timeshift_buffer = moment->getTimeshiftBuffer (stream_name);
+        Uint64 window_start_millisec = 0;
+        Uint64 window_end_millisec = 0;
+        if (timeshift_buffer
+            && timeshift_buffer->getTimestampRange (&window_start_millisec, &window_end_millisec)
+            && (Uint64) start_millisec >= window_start_millisec
+            && (Uint64) start_millisec <  window_end_millisec)
+        {
+            return startVod (client_session,
+                             stream_name,
+                             stream_name,
+                             start_millisec,
+                             timeshift_buffer,
+                             cb,
+                             ret_res);
+        }
+    }
+
+    if (vod_enable
+        && start_millisec != -1 /* live only */
+        && stream_name.len() > vod_prefix->len()
+        && equal (stream_name.region (0, vod_prefix->len()), vod_prefix->mem()))
+    {
+        return startVod (client_session,
+                         stream_name,
+                         stream_name.region (vod_prefix->len()),
+                         start_millisec,
+                         NULL /* timeshift_buffer */,
+                         cb,
+                         ret_res);
+    }
+
     Ref<VideoStream> video_stream;
     {
         Ref<StartWatchingCallback_Data> const data = grab (new (std::nothrow) StartWatchingCallback_Data);
@@ -1026,10 +1271,20 @@ RtmpServer::CommandResult server_commandMessage (RtmpConnection       * const mt
     return RtmpServer::CommandResult::Success;
 }
 
-static Result pauseCmd (void * const /* _client_session */)
+static Result pauseCmd (void * const _client_session)
 {
-  // No-op
     logD_ (_func_);
+
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+
+    client_session->mutex.lock ();
+    Ref<VodSession> const vod_session = client_session->vod_session;
+    client_session->mutex.unlock ();
+
+    // No-op for live streams.
+    if (vod_session)
+        vod_session->pause ();
+
     return Result::Success;
 }
 
@@ -1038,17 +1293,48 @@ static Result resumeCmd (void * const _client_session)
 //    logD_ (_func_);
 
     ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+
+    client_session->mutex.lock ();
+    Ref<VodSession> const vod_session = client_session->vod_session;
+    client_session->mutex.unlock ();
+
+    if (vod_session) {
+        vod_session->setBufferLength (getVodBufferLength (client_session));
+        vod_session->resume ();
+        return Result::Success;
+    }
+
     client_session->doResume ();
     return Result::Success;
 }
 
+static Result seekCmd (Time   const timestamp_millisec,
+                       void * const _client_session)
+{
+    logD_ (_func, timestamp_millisec);
+
+    ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
+
+    client_session->mutex.lock ();
+    Ref<VodSession> const vod_session = client_session->vod_session;
+    client_session->mutex.unlock ();
+
+    if (!vod_session)
+        return Result::Failure;
+
+    vod_session->setBufferLength (getVodBufferLength (client_session));
+    vod_session->seek (timestamp_millisec);
+    return Result::Success;
+}
+
 static RtmpServer::Frontend const rtmp_server_frontend = {
     connect,
     startRtmpStreaming,
     startRtmpWatching,
     server_commandMessage,
     pauseCmd,
-    resumeCmd
+    resumeCmd,
+    seekCmd
 };
 
 Result audioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
@@ -1095,28 +1381,37 @@ void sendStateChanged (Sender::SendState   const send_state,
     ClientSession * const client_session = static_cast <ClientSession*> (_client_session);
 
     switch (send_state) {
-	case Sender::ConnectionReady:
+	case Sender::ConnectionReady: {
 	    logD (framedrop, _func, "ConnectionReady");
-#ifdef MOMENT_RTMP__FLOW_CONTROL
 	    client_session->mutex.lock ();
+#ifdef MOMENT_RTMP__FLOW_CONTROL
 	    client_session->overloaded = false;
-	    client_session->mutex.unlock ();
 #endif
-	    break;
+	    Ref<VodSession> const vod_session = client_session->vod_session;
+	    client_session->mutex.unlock ();
+
+	    if (vod_session)
+		vod_session->setOverloaded (false);
+	} break;
 	case Sender::ConnectionOverloaded:
 	    logD (framedrop, _func, "ConnectionOverloaded");
             // We used to set 'client_session->overloaded' to 'true' here,
             // but this turned out to happen too frequently.
             // Moved that to QueueSoftLimit instead.
 	    break;
-	case Sender::QueueSoftLimit:
+	case Sender::QueueSoftLimit: {
 	    logD (framedrop, _func, "QueueSoftLimit");
-#ifdef MOMENT_RTMP__FLOW_CONTROL
 	    client_session->mutex.lock ();
+#ifdef MOMENT_RTMP__FLOW_CONTROL
 	    client_session->overloaded = true;
-	    client_session->mutex.unlock ();
 #endif
-	    break;
+	    Ref<VodSession> const vod_session = client_session->vod_session;
+	    client_session->mutex.unlock ();
+
+	    // VOD sessions wait for the queue to drain instead of dropping frames.
+	    if (vod_session)
+		vod_session->setOverloaded (true);
+	} break;
 	case Sender::QueueHardLimit:
 	    logE_ (_func, "QueueHardLimit");
             client_session->rtmp_conn->close ();
@@ -1173,10 +1468,25 @@ Result clientConnected (RtmpConnection  * const mt_nonnull rtmp_conn,
 	}
 
 	client_session->flv_muxer.setPagePool (moment->getPagePool());
+	client_session->flv_muxer.setBuildKeyframeIndex (moment->getRecordKeyframeIndex());
+	client_session->flv_muxer.setMetaDataReserve ((Size) moment->getRecordMetaDataReserve());
+
+	client_session->mp4_muxer.setPagePool (moment->getPagePool());
+	client_session->mp4_muxer.setFragmentDuration (moment->getRecordMp4FragmentDuration());
+	client_session->mp4_muxer.setFaststart (moment->getRecordMp4Faststart());
+	if (moment->getRecordMp4IndexSpillSize()) {
+	    client_session->mp4_muxer.setIndexSpill (moment->getRecordMp4IndexSpillDir(),
+						     moment->getRecordMp4IndexSpillSize());
+	}
 
-	client_session->recorder.init (thread_ctx, moment->getStorage());
+	client_session->recorder.init (thread_ctx, moment->getStorage(), moment->getPagePool());
 	client_session->recorder.setRecordingLimit (recording_limit);
-	client_session->recorder.setMuxer (&client_session->flv_muxer);
+	client_session->recorder.setWriterParams (*moment->getRecordingWriterParams());
+	client_session->recorder.setSegmentParams (*moment->getRecordingSegmentParams());
+	if (moment->getRecordMp4())
+	    client_session->recorder.setMuxer (&client_session->mp4_muxer);
+	else
+	    client_session->recorder.setMuxer (&client_session->flv_muxer);
 	// TODO recorder frontend + error reporting
     }
 
@@ -1506,6 +1816,48 @@ static Result momentRtmpInit ()
 	logI_ (_func, opt_name, ": ", recording_limit);
     }
 
+    {
+	ConstMemory const opt_name = "mod_rtmp/vod";
+	MConfig::BooleanValue const opt_val = config->getBoolean (opt_name);
+	if (opt_val == MConfig::Boolean_Invalid)
+	    logE_ (_func, "Invalid value for config option ", opt_name);
+	else
+	if (opt_val == MConfig::Boolean_True)
+	    vod_enable = true;
+	else
+	    vod_enable = false;
+
+	logI_ (_func, opt_name, ": ", vod_enable);
+    }
+
+    vod_prefix = st_grab (new (std::nothrow) String (
+                         config->getString_default ("mod_rtmp/vod_prefix", vod_prefix->mem())));
+
+    {
+	ConstMemory const opt_name = "mod_rtmp/vod_min_buffer";
+	MConfig::GetResult const res = config->getUint64_default (
+		opt_name, &vod_min_buffer_millisec, vod_min_buffer_millisec);
+	if (!res)
+	    logE_ (_func, "bad value for ", opt_name);
+
+	logI_ (_func, opt_name, ": ", vod_min_buffer_millisec);
+    }
+
+    {
+	ConstMemory const opt_name = "mod_rtmp/vod_cache_size";
+	MConfig::GetResult const res = config->getUint64_default (
+		opt_name, &vod_cache_size, vod_cache_size);
+	if (!res)
+	    logE_ (_func, "bad value for ", opt_name);
+
+	logI_ (_func, opt_name, ": ", vod_cache_size);
+    }
+
+    if (vod_enable) {
+        vod_read_cache = grab (new (std::nothrow) FileReadCache);
+        vod_read_cache->init ((Count) (vod_cache_size / FileReadCache::BlockSize));
+    }
+
     bool prechunking_enabled = true;
     {
         ConstMemory const opt_name = "mod_rtmp/prechunking";
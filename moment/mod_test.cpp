@@ -24,7 +24,9 @@
 using namespace M;
 using namespace Moment;
 
-static Ref<TestStreamGenerator> test_stream_generator;
+static List< Ref<TestStreamGenerator> > test_stream_generators;
+static List< Ref<FileReplayer> > file_replayers;
+static Ref<FileReadCache> replay_read_cache;
 
 static void momentTestInit ()
 {
@@ -52,6 +54,20 @@ static void momentTestInit ()
 	}
     }
 
+    {
+	ConstMemory const opt_name = "mod_test/profile";
+	ConstMemory const profile = config->getString_default (opt_name, "uniform");
+	if (equal (profile, "uniform")) {
+	    opts.profile = TestStreamGenerator::Options::Profile_Uniform;
+	} else
+	if (equal (profile, "avc")) {
+	    opts.profile = TestStreamGenerator::Options::Profile_Avc;
+	} else {
+	    logE_ (_func, "Invalid value for ", opt_name, ": ", profile);
+	    return;
+	}
+    }
+
     {
 	ConstMemory const opt_name = "mod_test/frame_duration";
         if (!config->getUint64_default (opt_name, &opts.frame_duration, opts.frame_duration)) {
@@ -115,14 +131,175 @@ static void momentTestInit ()
 	    opts.use_same_pages = false;
     }
 
+    {
+	ConstMemory const opt_name = "mod_test/embed_timestamps";
+	MConfig::BooleanValue const val = config->getBoolean (opt_name);
+	if (val == MConfig::Boolean_Invalid) {
+	    logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+	    return;
+	}
+
+        if (val == MConfig::Boolean_True)
+	    opts.embed_timestamps = true;
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/keyframe_size";
+        if (!config->getUint64_default (opt_name, &opts.keyframe_size, opts.keyframe_size)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/pframe_size";
+        if (!config->getUint64_default (opt_name, &opts.pframe_size, opts.pframe_size)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/bframe_size";
+        if (!config->getUint64_default (opt_name, &opts.bframe_size, opts.bframe_size)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/bframes";
+        if (!config->getUint64_default (opt_name, &opts.num_bframes, opts.num_bframes)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/size_jitter";
+        if (!config->getUint64_default (opt_name, &opts.size_jitter_percent, opts.size_jitter_percent)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/audio";
+	MConfig::BooleanValue const val = config->getBoolean (opt_name);
+	if (val == MConfig::Boolean_Invalid) {
+	    logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+	    return;
+	}
+
+        if (val == MConfig::Boolean_True)
+	    opts.audio = true;
+	else
+	if (val == MConfig::Boolean_False)
+	    opts.audio = false;
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/audio_rate";
+        if (!config->getUint64_default (opt_name, &opts.audio_rate, opts.audio_rate)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/audio_frame_size";
+        if (!config->getUint64_default (opt_name, &opts.audio_frame_size, opts.audio_frame_size)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/metadata";
+	MConfig::BooleanValue const val = config->getBoolean (opt_name);
+	if (val == MConfig::Boolean_Invalid) {
+	    logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+	    return;
+	}
+
+        if (val == MConfig::Boolean_True)
+	    opts.metadata = true;
+	else
+	if (val == MConfig::Boolean_False)
+	    opts.metadata = false;
+    }
+
+    Uint64 num_streams = 1;
+    {
+	ConstMemory const opt_name = "mod_test/num_streams";
+        if (!config->getUint64_default (opt_name, &num_streams, num_streams)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+    }
+
+    // If set, the FLV file is replayed into the streams instead of generated frames.
+    ConstMemory const replay_file = config->getString ("mod_test/replay_file");
+    FileReplayer::Options replay_opts;
+    replay_opts.loop = true;
+
+    {
+	ConstMemory const opt_name = "mod_test/replay_speed";
+        Uint64 speed = 1;
+        if (!config->getUint64_default (opt_name, &speed, speed)) {
+	    logE_ (_func, "Bad value for config option ", opt_name);
+	    return;
+	}
+        replay_opts.speed_percent = (Uint32) speed * 100;
+    }
+
+    {
+	ConstMemory const opt_name = "mod_test/replay_loop";
+	MConfig::BooleanValue const val = config->getBoolean (opt_name);
+	if (val == MConfig::Boolean_Invalid) {
+	    logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name));
+	    return;
+	}
+
+        if (val == MConfig::Boolean_False)
+	    replay_opts.loop = false;
+    }
+
+    if (replay_file.len()) {
+        replay_read_cache = grab (new FileReadCache);
+        replay_read_cache->init (256 /* max_blocks */);
+    }
+
     ConstMemory const stream_name = config->getString_default ("mod_test/stream_name", "test");
 
-    Ref<VideoStream> const video_stream = grab (new VideoStream);
-    moment->addVideoStream (video_stream, stream_name);
+    // With several streams, they are named <stream_name>_0, <stream_name>_1, ...
+    for (Uint64 i = 0; i < num_streams; ++i) {
+        Ref<VideoStream> const video_stream = grab (new VideoStream);
+        if (num_streams == 1)
+            moment->addVideoStream (video_stream, stream_name);
+        else
+            moment->addVideoStream (video_stream, makeString (stream_name, "_", i)->mem());
+
+        if (replay_file.len()) {
+            Ref<FileReplayer> const file_replayer = grab (new FileReplayer);
+            if (!file_replayer->init (page_pool, timers, video_stream, replay_file, replay_read_cache, &replay_opts)) {
+                logE_ (_func, "Could not replay ", replay_file, ": ", exc->toString());
+                return;
+            }
+            file_replayer->start ();
+
+            file_replayers.append (file_replayer);
+            continue;
+        }
 
-    test_stream_generator = grab (new TestStreamGenerator);
-    test_stream_generator->init (page_pool, timers, video_stream, &opts);
-    test_stream_generator->start ();
+        opts.random_seed = (Uint32) i + 1;
+
+        Ref<TestStreamGenerator> const test_stream_generator = grab (new TestStreamGenerator);
+        test_stream_generator->init (page_pool, timers, video_stream, &opts);
+        test_stream_generator->start ();
+
+        test_stream_generators.append (test_stream_generator);
+    }
 }
 
 static void momentTestUnload ()
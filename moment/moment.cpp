@@ -64,6 +64,8 @@ Options options;
 
 const Count default__page_pool__min_pages     = 512;
 const Time  default__http__keepalive_timeout  =  60;
+const Time  default__profiler__duration       =  30;
+const Time  max__profiler__duration           = 3600;
 
 class MomentInstance : public Object
 {
@@ -82,18 +84,39 @@ private:
     FixedThreadPool recorder_thread_pool;
     FixedThreadPool reader_thread_pool;
 
+#ifdef MOMENT_URING
+    UringStorage storage;
+#else
     LocalStorage storage;
+#endif
 
     MomentServer moment_server;
 
+    mt_const Ref<ThreadMonitor> thread_monitor;
+
     mt_mutex (mutex) Timers::TimerKey exit_timer;
 
+    mt_mutex (mutex) bool profiler_running;
+    mt_mutex (mutex) Timers::TimerKey profiler_timer;
+    // Profile which has been written by the last profiler run.
+    mt_mutex (mutex) StRef<String> profile_filename;
+
     void doExit (ConstMemory reason);
 
     static void exitTimerTick (void *_self);
 
-    void ctl_startProfiler (ConstMemory filename);
-    void ctl_stopProfiler  ();
+    static void profilerTimerTick (void *_self);
+
+    mt_mutex (mutex) void stopProfiler_locked ();
+
+    // If 'duration_sec' is non-zero, then the profiler is stopped automatically
+    // after 'duration_sec' seconds.
+    Result ctl_startProfiler (ConstMemory filename,
+                              Time        duration_sec = 0);
+    void   ctl_stopProfiler  ();
+
+    void sendProfile (HttpRequest * mt_nonnull req,
+                      Sender      * mt_nonnull conn_sender);
 
     void ctl_exit     (ConstMemory reason);
     void ctl_abort    (ConstMemory reason);
@@ -136,6 +159,7 @@ private:
         Uint64 min_pages;
         Uint64 num_threads;
         Uint64 num_file_threads;
+        Uint64 uring_queue_depth;
 
         StRef<String> profile_filename;
         StRef<String> ctl_filename;
@@ -180,7 +204,8 @@ public:
           admin_http_service_ptr (&separate_admin_http_service),
           recorder_thread_pool (this /* coderef_container */),
           reader_thread_pool   (this /* coderef_container */),
-          storage (this /* coderef_container */)
+          storage (this /* coderef_container */),
+          profiler_running (false)
 #ifndef LIBMARY_PLATFORM_WIN32
           , line_pipe    (this /* coderef_container */)
 #endif
@@ -346,13 +371,75 @@ static char const * const gperftools_errmsg =
 #endif
 
 void
-MomentInstance::ctl_startProfiler (ConstMemory const filename)
+MomentInstance::profilerTimerTick (void * const _self)
+{
+    MomentInstance * const self = static_cast <MomentInstance*> (_self);
+
+    logI_ (_func, "profiling time is over");
+    self->mutex.lock ();
+    self->stopProfiler_locked ();
+    self->mutex.unlock ();
+}
+
+mt_mutex (mutex) void
+MomentInstance::stopProfiler_locked ()
+{
+    if (profiler_timer) {
+        server_app.getServerContext()->getMainThreadContext()->getTimers()->deleteTimer (profiler_timer);
+        profiler_timer = NULL;
+    }
+
+    if (!profiler_running)
+        return;
+
+    profiler_running = false;
+
+#ifdef MOMENT_GPERFTOOLS
+    logD_ (_func, "calling ProfilerStop()");
+    ProfilerStop ();
+    ProfilerFlush ();
+#endif
+}
+
+Result
+MomentInstance::ctl_startProfiler (ConstMemory const filename,
+                                   Time        const duration_sec)
 {
 #ifdef MOMENT_GPERFTOOLS
+    mutex.lock ();
+    if (profiler_running) {
+        mutex.unlock ();
+        logW_ (_func, "profiler is already running");
+        return Result::Failure;
+    }
+
     logD_ (_func, "calling ProfilerStart()");
-    ProfilerStart (String (filename).cstr());
+    if (!ProfilerStart (String (filename).cstr())) {
+        mutex.unlock ();
+        logE_ (_func, "ProfilerStart() failed, file: ", filename);
+        return Result::Failure;
+    }
+
+    profiler_running = true;
+    profile_filename = st_grab (new (std::nothrow) String (filename));
+
+    if (duration_sec) {
+        profiler_timer = server_app.getServerContext()->getMainThreadContext()->getTimers()->addTimer (
+                profilerTimerTick,
+                this /* cb_data */,
+                this /* coderef_container */,
+                duration_sec,
+                false /* periodical */);
+    }
+    mutex.unlock ();
+
+    logI_ (_func, "profiling to ", filename, ", duration ", duration_sec, " sec");
+    return Result::Success;
 #else
+    (void) filename;
+    (void) duration_sec;
     logD_ (_func, gperftools_errmsg);
+    return Result::Failure;
 #endif
 }
 
@@ -360,9 +447,9 @@ void
 MomentInstance::ctl_stopProfiler ()
 {
 #ifdef MOMENT_GPERFTOOLS
-    logD_ (_func, "calling ProfilerStop()");
-    ProfilerStop ();
-    ProfilerFlush ();
+    mutex.lock ();
+    stopProfiler_locked ();
+    mutex.unlock ();
 #else
     logD_ (_func, gperftools_errmsg);
 #endif
@@ -451,6 +538,90 @@ void MomentInstance::ctl_line (ConstMemory   const line,
 }
 #endif
 
+void
+MomentInstance::sendProfile (HttpRequest * const mt_nonnull req,
+                             Sender      * const mt_nonnull conn_sender)
+{
+    MOMENT_SERVER__HEADERS_DATE;
+
+    mutex.lock ();
+    bool const running = profiler_running;
+    StRef<String> const filename = profile_filename;
+    mutex.unlock ();
+
+    if (running || !filename) {
+        ConstMemory const reply_body = running ? ConstMemory ("Profiler is running")
+                                               : ConstMemory ("No profile");
+        conn_sender->send (&page_pool,
+                           true /* do_flush */,
+                           MOMENT_SERVER__404_HEADERS (reply_body.len()),
+                           "\r\n",
+                           reply_body);
+
+        logA_ ("moment_ctl 404 ", req->getClientAddress(), " ", req->getRequestLine());
+        return;
+    }
+
+    NativeFile native_file;
+    NativeFile::FileStat stat;
+    if (!native_file.open (filename->mem(), 0 /* open_flags */, File::AccessMode::ReadOnly)
+        || !native_file.stat (&stat))
+    {
+        logE_ (_func, "could not open ", filename, ": ", exc->toString());
+
+        ConstMemory const reply_body = "Could not open profile";
+        conn_sender->send (&page_pool,
+                           true /* do_flush */,
+                           MOMENT_SERVER__500_HEADERS (reply_body.len()),
+                           "\r\n",
+                           reply_body);
+
+        logA_ ("moment_ctl 500 ", req->getClientAddress(), " ", req->getRequestLine());
+        return;
+    }
+
+    conn_sender->send (
+            &page_pool,
+            false /* do_flush */,
+            MOMENT_SERVER__OK_HEADERS ("application/octet-stream", stat.size),
+            "\r\n");
+
+    // The file is sent in small pieces as it is read, the same way as mod_file
+    // does, so that neither the whole profile nor a big buffer is held here.
+    Uint64 total_sent = 0;
+    Byte buf [16384];
+    while (total_sent < stat.size) {
+        Size toread = sizeof (buf);
+        if (stat.size - total_sent < toread)
+            toread = stat.size - total_sent;
+
+        Size num_read = 0;
+        IoResult const res = native_file.read (Memory (buf, toread), &num_read);
+        if (res == IoResult::Error) {
+            logE_ (_func, "read failed: ", exc->toString(), ", file: ", filename);
+            break;
+        }
+
+        if (res == IoResult::Eof || num_read == 0)
+            break;
+
+        PagePool::PageListHead page_list;
+        page_pool.getFillPages (&page_list, ConstMemory (buf, num_read));
+        conn_sender->sendPages (&page_pool, page_list.first, false /* do_flush */);
+        total_sent += num_read;
+    }
+
+    conn_sender->flush ();
+
+    if (total_sent != stat.size) {
+        // Content-Length has been sent already.
+        logE_ (_func, "sent ", total_sent, " bytes of ", stat.size, ", file: ", filename);
+        conn_sender->closeAfterFlush ();
+    }
+
+    logA_ ("moment_ctl 200 ", req->getClientAddress(), " ", req->getRequestLine());
+}
+
 HttpService::HttpHandler const MomentInstance::ctl_http_handler = {
     ctlHttpRequest,
     NULL /* httpMessageBody */
@@ -487,6 +658,86 @@ MomentInstance::ctlHttpRequest (HttpRequest   * const mt_nonnull req,
                 "\r\n",
                 reply);
 
+        logA_ ("moment_ctl 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "profiler_start"))
+    {
+        // "profiler_start?duration=60" profiles for 60 seconds. The profile
+        // is written to "moment/profile" file and may be downloaded with
+        // "profile" request when the profiler stops.
+        Uint64 duration_sec = default__profiler__duration;
+        {
+            ConstMemory const duration_str = req->getParameter ("duration");
+            if (duration_str.len() > 0
+                && (!strToUint64_safe (duration_str, &duration_sec)
+                    || duration_sec == 0
+                    || duration_sec > max__profiler__duration))
+            {
+                logE_ (_func, "bad \"duration\" parameter: ", duration_str);
+                duration_sec = default__profiler__duration;
+            }
+        }
+
+        self->mutex.lock ();
+        Ref<MomentConfigParams> const params = self->cur_params;
+        self->mutex.unlock ();
+
+        ConstMemory reply;
+        if (self->ctl_startProfiler (params->profile_filename->mem(), duration_sec)) {
+            reply = "OK";
+        } else {
+#ifdef MOMENT_GPERFTOOLS
+            reply = "ERROR: profiler is already running or could not be started";
+#else
+            reply = "ERROR: gperftools profiler is disabled";
+#endif
+        }
+
+        conn_sender->send (
+                &self->page_pool,
+                true /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("text/plain", reply.len() /* content_length */),
+                "\r\n",
+                reply);
+
+        logA_ ("moment_ctl 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "profiler_stop"))
+    {
+        self->ctl_stopProfiler ();
+
+        ConstMemory const reply = "OK";
+        conn_sender->send (
+                &self->page_pool,
+                true /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("text/plain", reply.len() /* content_length */),
+                "\r\n",
+                reply);
+
+        logA_ ("moment_ctl 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "profile"))
+    {
+        self->sendProfile (req, conn_sender);
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "threads"))
+    {
+        PagePool::PageListHead page_list;
+        self->thread_monitor->printReport (&self->page_pool, &page_list);
+
+        Size const data_len = PagePool::countPageListDataLen (page_list.first, 0 /* msg_offset */);
+
+        conn_sender->send (
+                &self->page_pool,
+                false /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("text/plain", data_len),
+                "\r\n");
+        conn_sender->sendPages (&self->page_pool, page_list.first, true /* do_flush */);
+
         logA_ ("moment_ctl 200 ", req->getClientAddress(), " ", req->getRequestLine());
     } else {
 	logE_ (_func, "Unknown admin HTTP request: ", req->getFullPath());
@@ -584,6 +835,7 @@ MomentInstance::doConfigReload (MConfig::Config * const new_config)
 static char const opt_name__min_pages[]               = "moment/min_pages";
 static char const opt_name__num_threads[]             = "moment/num_threads";
 static char const opt_name__num_file_threads[]        = "moment/num_file_threads";
+static char const opt_name__uring_queue_depth[]       = "moment/uring_queue_depth";
 static char const opt_name__profile[]                 = "moment/profile";
 static char const opt_name__ctl_pipe[]                = "moment/ctl_pipe";
 static char const opt_name__ctl_pipe_reopen_timeout[] = "moment/ctl_pipe_reopen_timeout";
@@ -610,6 +862,12 @@ MomentInstance::processConfig (MConfig::Config    * const config,
         res = Result::Failure;
     logI_ (_func, opt_name__num_file_threads, ": ", params->num_file_threads);
 
+    if (!configGetUint64 (config, opt_name__uring_queue_depth, &params->uring_queue_depth, 256))
+        res = Result::Failure;
+#ifdef MOMENT_URING
+    logI_ (_func, opt_name__uring_queue_depth, ": ", params->uring_queue_depth);
+#endif
+
     params->profile_filename = st_grab (new (std::nothrow) String (
             config->getString_default (opt_name__profile, "/opt/moment/moment_profile")));
     params->ctl_filename = st_grab (new (std::nothrow) String (
@@ -707,6 +965,9 @@ void MomentInstance::applyConfigParams (MConfig::Config * const new_config)
     if (old_params && old_params->num_file_threads != params->num_file_threads)
         configWarnNoEffect (opt_name__num_file_threads);
 
+    if (old_params && old_params->uring_queue_depth != params->uring_queue_depth)
+        configWarnNoEffect (opt_name__uring_queue_depth);
+
     if (old_params && !equal (old_params->profile_filename->mem(), params->profile_filename->mem()))
         configWarnNoEffect (opt_name__profile);
 
@@ -742,12 +1003,15 @@ void MomentInstance::applyConfigParams (MConfig::Config * const new_config)
 
 
 static void
-serverApp_threadStarted (void * const /* cb_data */)
+serverApp_threadStarted (void * const cb_data)
 {
 #ifdef MOMENT_GPERFTOOLS
     logD_ (_func, "calling ProfilerRegisterThread()");
     ProfilerRegisterThread ();
 #endif
+
+    ThreadMonitor * const thread_monitor = static_cast <ThreadMonitor*> (cb_data);
+    thread_monitor->registerCurrentThread ("server");
 }
 
 static ServerApp::Events const server_app_events = {
@@ -809,7 +1073,10 @@ MomentInstance::run ()
     cur_params = params;
     mutex.unlock ();
 
-    server_app.getEventInformer()->subscribe (CbDesc<ServerApp::Events> (&server_app_events, NULL, NULL));
+    thread_monitor = grab (new (std::nothrow) ThreadMonitor);
+    thread_monitor->registerCurrentThread ("main");
+    server_app.getEventInformer()->subscribe (
+            CbDesc<ServerApp::Events> (&server_app_events, thread_monitor, thread_monitor));
 
     if (!server_app.init ()) {
 	logE_ (_func, "server_app.init() failed: ", exc->toString());
@@ -820,6 +1087,9 @@ MomentInstance::run ()
     server_app.setNumThreads (params->num_threads);
     recorder_thread_pool.setNumThreads (params->num_file_threads);
     reader_thread_pool.setNumThreads (params->num_file_threads /* TODO Separate config parameter? */);
+#ifdef MOMENT_URING
+    storage.setQueueDepth (params->uring_queue_depth);
+#endif
 
     if (params->http_bind_valid) {
 	if (!http_service.init (server_app.getServerContext()->getMainThreadContext()->getPollGroup(),
@@ -906,6 +1176,8 @@ MomentInstance::run ()
     moment_server.getEventInformer()->subscribe (
             CbDesc<MomentServer::Events> (&moment_server_events, this, this));
 
+    thread_monitor->start (server_app.getServerContext()->getMainThreadContext()->getTimers());
+
     if (options.exit_after != (Uint64) -1) {
 	logI_ (_func, "options.exit_after: ", options.exit_after);
 	mutex.lock ();
@@ -959,6 +1231,9 @@ MomentInstance::run ()
     logI_ (_func, "done");
 
 _stop_recorder:
+    thread_monitor->stop ();
+    ctl_stopProfiler ();
+
     recorder_thread_pool.stop ();
     reader_thread_pool.stop ();
 
@@ -0,0 +1,788 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// moment-bench: microbenchmarks of the hot paths of the server.
+//
+// No sockets are involved: RtmpConnections send to NullSenders which drop
+// outgoing messages right away, so that the numbers reflect the cost of
+// fan-out, chunking and muxing alone. Every benchmark is run once to warm up
+// and then 'num_runs' times; the median run is reported.
+
+
+#include <libmary/types.h>
+#include <algorithm>
+
+#include <moment/libmoment.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace {
+
+class Options
+{
+public:
+    bool help;
+
+    Uint32 num_watchers;
+    Uint32 num_frames;
+    Uint32 frame_size;
+    Uint32 keyframe_interval;
+    // Number of interframes after a keyframe in FrameSaver replay benchmark.
+    Uint32 num_saved_frames;
+    Uint32 num_runs;
+
+    LogLevel loglevel;
+
+    Options ()
+        : help (false),
+          num_watchers (100),
+          num_frames (2000),
+          frame_size (10000),
+          keyframe_interval (50),
+          num_saved_frames (50),
+          num_runs (5),
+          loglevel (LogLevel::Warning)
+    {
+    }
+};
+
+mt_const Options options;
+
+// A Sender which drops everything sent to it. Outgoing page lists are walked
+// the same way a real sender would walk them to fill an iovec.
+class NullSender : public Sender,
+                   public DependentCodeReferenced
+{
+private:
+    StateMutex mutex;
+
+    mt_mutex (mutex) Uint64 num_msgs;
+    mt_mutex (mutex) Uint64 num_bytes;
+
+public:
+  mt_iface (Sender)
+    mt_async void sendMessage (Sender::MessageEntry * const mt_nonnull msg_entry,
+                               bool const do_flush)
+    {
+        mutex.lock ();
+        sendMessage_unlocked (msg_entry, do_flush);
+        mutex.unlock ();
+    }
+
+    mt_mutex (mutex) void sendMessage_unlocked (Sender::MessageEntry * const mt_nonnull msg_entry,
+                                                bool const /* do_flush */)
+    {
+        switch (msg_entry->type) {
+            case Sender::MessageEntry::Pages: {
+                Sender::MessageEntry_Pages * const msg_pages =
+                        static_cast <Sender::MessageEntry_Pages*> (msg_entry);
+
+                num_bytes += msg_pages->header_len;
+
+                PagePool::Page *page = msg_pages->getFirstPage();
+                Size msg_offset = msg_pages->msg_offset;
+                while (page) {
+                    if (page->data_len > msg_offset)
+                        num_bytes += page->data_len - msg_offset;
+
+                    msg_offset = 0;
+                    page = page->getNextMsgPage();
+                }
+            } break;
+            default:
+                unreachable ();
+        }
+
+        ++num_msgs;
+        Sender::deleteMessageEntry (msg_entry);
+    }
+
+    mt_async void flush () {}
+    mt_mutex (mutex) void flush_unlocked () {}
+    mt_async void closeAfterFlush () {}
+    mt_async void close () {}
+    mt_mutex (mutex) bool isClosed_unlocked () { return false; }
+    mt_mutex (mutex) SendState getSendState_unlocked () { return SendState::ConnectionReady; }
+    void lock   () { mutex.lock (); }
+    void unlock () { mutex.unlock (); }
+  mt_iface_end
+
+    NullSender (Object * const coderef_container)
+        : Sender (coderef_container),
+          DependentCodeReferenced (coderef_container),
+          num_msgs  (0),
+          num_bytes (0)
+    {
+    }
+};
+
+// An in-memory RTMP watcher.
+class BenchWatcher : public Object
+{
+public:
+    NullSender     sender;
+    RtmpConnection rtmp_conn;
+
+    void init (Timers   * const mt_nonnull timers,
+               PagePool * const mt_nonnull page_pool)
+    {
+        rtmp_conn.setSender (&sender);
+        rtmp_conn.init (timers,
+                        page_pool,
+                        0     /* send_delay_millisec */,
+                        0     /* ping_timeout_millisec */,
+                        false /* prechunking_enabled */,
+                        false /* momentrtmp_proto */);
+    }
+
+    BenchWatcher ()
+        : sender    (this /* coderef_container */),
+          rtmp_conn (this /* coderef_container */)
+    {
+    }
+};
+
+class MomentBenchInstance : public Object
+{
+private:
+    PagePool  page_pool;
+    ServerApp server_app;
+
+    mt_const Timers *timers;
+
+    typedef void (*BenchFunc) (void   *bench_data,
+                               Uint64  num_iterations);
+
+    // Returns median run time in microseconds.
+    Time runBench (BenchFunc  bench_func,
+                   void      *bench_data,
+                   Uint64     num_iterations);
+
+    static void printResult (ConstMemory name,
+                             Time        run_microsec,
+                             Uint64      num_iterations,
+                             Uint64      num_items);
+
+    Ref<BenchWatcher> createWatcher ();
+
+    void fillFrame (VideoStream::VideoMessage * mt_nonnull msg,
+                    ConstMemory                 data);
+
+    // Fails if the benchmark took no time at all, which means that the clock
+    // used for timing is not working.
+    Result benchFanout ();
+    void benchChunking ();
+    void benchFlvHeader ();
+    void benchAmf ();
+    void benchFrameSaverReplay ();
+
+public:
+    Result run ();
+
+    MomentBenchInstance ()
+        : page_pool  (this /* coderef_container */, 4096 /* page_size */, 4096 /* min_pages */),
+          server_app (this /* coderef_container */),
+          timers (NULL)
+    {
+    }
+};
+
+Time
+MomentBenchInstance::runBench (BenchFunc   const bench_func,
+                               void      * const bench_data,
+                               Uint64      const num_iterations)
+{
+    bench_func (bench_data, num_iterations / 10 + 1);
+
+    Count const num_runs = (options.num_runs > 0 ? options.num_runs : 1);
+    Time * const run_times = new (std::nothrow) Time [num_runs];
+    assert (run_times);
+
+    // getTimeMicroseconds() is updated by the event loop, which is never run.
+    for (Count i = 0; i < num_runs; ++i) {
+        Time const start_microsec = LatencyStats::getMonotonicMicroseconds ();
+        bench_func (bench_data, num_iterations);
+        run_times [i] = LatencyStats::getMonotonicMicroseconds () - start_microsec;
+    }
+
+    std::sort (run_times, run_times + num_runs);
+    Time const median = run_times [num_runs / 2];
+    delete[] run_times;
+
+    return median;
+}
+
+// 'num_items' is the number of units of work per iteration, e.g. the number
+// of watchers for fan-out.
+void
+MomentBenchInstance::printResult (ConstMemory const name,
+                                  Time        const run_microsec,
+                                  Uint64      const num_iterations,
+                                  Uint64      const num_items)
+{
+    Uint64 const per_sec = (run_microsec > 0 ? num_iterations * 1000000 / run_microsec : 0);
+    Uint64 const ns_per_iteration = run_microsec * 1000 / (num_iterations > 0 ? num_iterations : 1);
+
+    outs->print (name, ": ", per_sec, " /sec, ", ns_per_iteration, " ns/iteration");
+    if (num_items > 1)
+        outs->print (", ", ns_per_iteration / num_items, " ns/item");
+    outs->print ("\n");
+    outs->flush ();
+}
+
+Ref<BenchWatcher>
+MomentBenchInstance::createWatcher ()
+{
+    Ref<BenchWatcher> const watcher = grab (new (std::nothrow) BenchWatcher);
+    watcher->init (timers, &page_pool);
+    return watcher;
+}
+
+void
+MomentBenchInstance::fillFrame (VideoStream::VideoMessage * const mt_nonnull msg,
+                                ConstMemory                 const data)
+{
+    msg->frame_type = VideoStream::VideoFrameType::KeyFrame;
+    msg->codec_id = VideoStream::VideoCodecId::AVC;
+    msg->timestamp_nanosec = 0;
+    msg->prechunk_size = 0;
+
+    msg->page_pool = &page_pool;
+    msg->page_list.reset ();
+    page_pool.getFillPages (&msg->page_list, data);
+    msg->msg_len = data.len();
+    msg->msg_offset = 0;
+}
+
+struct FanoutData
+{
+    VideoStream *video_stream;
+    VideoStream::VideoMessage *msg;
+    Uint64 timestamp_nanosec;
+};
+
+void fanoutVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                         void                      * const _watcher)
+{
+    BenchWatcher * const watcher = static_cast <BenchWatcher*> (_watcher);
+    watcher->rtmp_conn.sendVideoMessage (msg);
+}
+
+VideoStream::EventHandler const fanout_handler = {
+    NULL /* audioMessage */,
+    fanoutVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
+void fanoutBench (void   * const _data,
+                  Uint64   const num_iterations)
+{
+    FanoutData * const data = static_cast <FanoutData*> (_data);
+
+    for (Uint64 i = 0; i < num_iterations; ++i) {
+        if (options.keyframe_interval > 0 && i % options.keyframe_interval == 0)
+            data->msg->frame_type = VideoStream::VideoFrameType::KeyFrame;
+        else
+            data->msg->frame_type = VideoStream::VideoFrameType::InterFrame;
+
+        // 25 fps
+        data->msg->timestamp_nanosec = data->timestamp_nanosec;
+        data->timestamp_nanosec += 40000000;
+
+        data->video_stream->fireVideoMessage (data->msg);
+    }
+}
+
+Result
+MomentBenchInstance::benchFanout ()
+{
+    Ref<VideoStream> const video_stream = grab (new (std::nothrow) VideoStream);
+
+    Count const num_watchers = options.num_watchers;
+    Ref<BenchWatcher> * const watchers = new (std::nothrow) Ref<BenchWatcher> [num_watchers > 0 ? num_watchers : 1];
+    assert (watchers);
+    for (Count i = 0; i < num_watchers; ++i) {
+        watchers [i] = createWatcher ();
+        video_stream->getEventInformer()->subscribe (
+                CbDesc<VideoStream::EventHandler> (&fanout_handler, watchers [i], watchers [i]));
+    }
+    video_stream->plusWatchers (num_watchers);
+
+    Byte * const frame_buf = new (std::nothrow) Byte [options.frame_size];
+    assert (frame_buf);
+    memset (frame_buf, 0, options.frame_size);
+
+    VideoStream::VideoMessage msg;
+    fillFrame (&msg, ConstMemory (frame_buf, options.frame_size));
+
+    FanoutData data;
+    data.video_stream = video_stream;
+    data.msg = &msg;
+    data.timestamp_nanosec = 0;
+
+    Time const run_microsec = runBench (fanoutBench, &data, options.num_frames);
+    printResult (makeString ("fanout (", num_watchers, " watchers, ", options.frame_size, " bytes/frame)")->mem(),
+                 run_microsec, options.num_frames, num_watchers);
+
+    video_stream->getFrameSaver()->releaseState ();
+    msg.release ();
+    delete[] frame_buf;
+    delete[] watchers;
+
+    if (run_microsec == 0 && options.num_frames > 0 && num_watchers > 0) {
+        logE_ (_func, "fan-out of ", options.num_frames, " frames to ", num_watchers, " watchers "
+               "took no time, the results are bogus");
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+struct ChunkingData
+{
+    BenchWatcher *watcher;
+    VideoStream::VideoMessage *msg;
+};
+
+void chunkingBench (void   * const _data,
+                    Uint64   const num_iterations)
+{
+    ChunkingData * const data = static_cast <ChunkingData*> (_data);
+
+    for (Uint64 i = 0; i < num_iterations; ++i) {
+        data->msg->timestamp_nanosec += 40000000;
+        data->watcher->rtmp_conn.sendVideoMessage (data->msg);
+    }
+}
+
+void
+MomentBenchInstance::benchChunking ()
+{
+    Byte * const frame_buf = new (std::nothrow) Byte [options.frame_size];
+    assert (frame_buf);
+    memset (frame_buf, 0, options.frame_size);
+
+    VideoStream::VideoMessage msg;
+    fillFrame (&msg, ConstMemory (frame_buf, options.frame_size));
+
+    Uint32 const chunk_sizes [] = { 128, 4096, 65536 };
+    for (unsigned i = 0; i < sizeof (chunk_sizes) / sizeof (chunk_sizes [0]); ++i) {
+        Ref<BenchWatcher> const watcher = createWatcher ();
+        watcher->rtmp_conn.sendSetChunkSize (chunk_sizes [i]);
+
+        ChunkingData data;
+        data.watcher = watcher;
+        data.msg = &msg;
+
+        Uint64 const num_iterations = (Uint64) options.num_frames * 10;
+        Time const run_microsec = runBench (chunkingBench, &data, num_iterations);
+        printResult (makeString ("sendMessagePages (chunk size ", chunk_sizes [i], ", ",
+                                 options.frame_size, " bytes/frame)")->mem(),
+                     run_microsec, num_iterations, 1);
+    }
+
+    msg.release ();
+    delete[] frame_buf;
+}
+
+Uint64 volatile bench_sink = 0;
+
+void flvHeaderBench (void   * const _msg,
+                     Uint64   const num_iterations)
+{
+    VideoStream::VideoMessage * const msg = static_cast <VideoStream::VideoMessage*> (_msg);
+
+    Byte flv_video_header [FlvVideoHeader_MaxLen];
+    Uint64 total_len = 0;
+    for (Uint64 i = 0; i < num_iterations; ++i)
+        total_len += fillFlvVideoHeader (msg, Memory::forObject (flv_video_header));
+
+    bench_sink += total_len;
+}
+
+void
+MomentBenchInstance::benchFlvHeader ()
+{
+    VideoStream::VideoMessage msg;
+    msg.frame_type = VideoStream::VideoFrameType::InterFrame;
+    msg.codec_id = VideoStream::VideoCodecId::AVC;
+
+    Uint64 const num_iterations = (Uint64) options.num_frames * 1000;
+    Time const run_microsec = runBench (flvHeaderBench, &msg, num_iterations);
+    printResult ("fillFlvVideoHeader", run_microsec, num_iterations, 1);
+}
+
+// Typical "_result" reply to "connect".
+void amfEncodeResult (AmfEncoder * const mt_nonnull encoder)
+{
+    encoder->addString ("_result");
+    encoder->addNumber (1.0);
+
+    encoder->beginObject ();
+    encoder->addFieldName ("fmsVer");
+    encoder->addString ("MMNT/0,1,0,0");
+    encoder->addFieldName ("capabilities");
+    encoder->addNumber (31.0);
+    encoder->endObject ();
+
+    encoder->beginObject ();
+    encoder->addFieldName ("level");
+    encoder->addString ("status");
+    encoder->addFieldName ("code");
+    encoder->addString ("NetConnection.Connect.Success");
+    encoder->addFieldName ("description");
+    encoder->addString ("Connection succeeded.");
+    encoder->addFieldName ("objectEncoding");
+    encoder->addNumber (0.0);
+    encoder->endObject ();
+}
+
+void amfEncodeBench (void   * const /* data */,
+                     Uint64   const num_iterations)
+{
+    AmfAtom atoms [32];
+    AmfEncoder encoder (atoms);
+    Byte msg_buf [512];
+
+    Uint64 total_len = 0;
+    for (Uint64 i = 0; i < num_iterations; ++i) {
+        encoder.reset ();
+        amfEncodeResult (&encoder);
+
+        Size msg_len;
+        if (!encoder.encode (Memory::forObject (msg_buf), AmfEncoding::AMF0, &msg_len))
+            unreachable ();
+
+        total_len += msg_len;
+    }
+
+    bench_sink += total_len;
+}
+
+struct AmfDecodeData
+{
+    PagePool::PageListHead *page_list;
+    Size msg_len;
+};
+
+void amfDecodeBench (void   * const _data,
+                     Uint64   const num_iterations)
+{
+    AmfDecodeData * const data = static_cast <AmfDecodeData*> (_data);
+
+    Byte method_name_buf [256];
+    Uint64 total_len = 0;
+    for (Uint64 i = 0; i < num_iterations; ++i) {
+        PagePool::PageListArray pl_array (data->page_list->first, data->msg_len);
+        AmfDecoder decoder (AmfEncoding::AMF0, &pl_array, data->msg_len);
+
+        Size method_name_len;
+        if (!decoder.decodeString (Memory::forObject (method_name_buf), &method_name_len, NULL))
+            unreachable ();
+
+        double transaction_id;
+        if (!decoder.decodeNumber (&transaction_id))
+            unreachable ();
+
+        if (!decoder.skipObject () ||
+            !decoder.skipObject ())
+        {
+            unreachable ();
+        }
+
+        total_len += method_name_len;
+    }
+
+    bench_sink += total_len;
+}
+
+void
+MomentBenchInstance::benchAmf ()
+{
+    Uint64 const num_iterations = (Uint64) options.num_frames * 100;
+
+    {
+        Time const run_microsec = runBench (amfEncodeBench, NULL, num_iterations);
+        printResult ("AMF0 encode", run_microsec, num_iterations, 1);
+    }
+
+    {
+        AmfAtom atoms [32];
+        AmfEncoder encoder (atoms);
+        amfEncodeResult (&encoder);
+
+        Byte msg_buf [512];
+        Size msg_len;
+        if (!encoder.encode (Memory::forObject (msg_buf), AmfEncoding::AMF0, &msg_len))
+            unreachable ();
+
+        PagePool::PageListHead page_list;
+        page_pool.getFillPages (&page_list, ConstMemory (msg_buf, msg_len));
+
+        AmfDecodeData data;
+        data.page_list = &page_list;
+        data.msg_len = msg_len;
+
+        Time const run_microsec = runBench (amfDecodeBench, &data, num_iterations);
+        printResult ("AMF0 decode", run_microsec, num_iterations, 1);
+
+        page_pool.msgUnref (page_list.first);
+    }
+}
+
+Result replayAudioFrame (VideoStream::AudioMessage * const mt_nonnull msg,
+                         void                      * const _watcher)
+{
+    BenchWatcher * const watcher = static_cast <BenchWatcher*> (_watcher);
+    watcher->rtmp_conn.sendAudioMessage (msg);
+    return Result::Success;
+}
+
+Result replayVideoFrame (VideoStream::VideoMessage * const mt_nonnull msg,
+                         void                      * const _watcher)
+{
+    BenchWatcher * const watcher = static_cast <BenchWatcher*> (_watcher);
+    watcher->rtmp_conn.sendVideoMessage (msg);
+    return Result::Success;
+}
+
+VideoStream::FrameSaver::FrameHandler const replay_handler = {
+    replayAudioFrame,
+    replayVideoFrame
+};
+
+struct ReplayData
+{
+    VideoStream::FrameSaver *frame_saver;
+    BenchWatcher *watcher;
+};
+
+void frameSaverReplayBench (void   * const _data,
+                            Uint64   const num_iterations)
+{
+    ReplayData * const data = static_cast <ReplayData*> (_data);
+
+    for (Uint64 i = 0; i < num_iterations; ++i)
+        data->frame_saver->reportSavedFrames (&replay_handler, data->watcher);
+}
+
+// Replays the state a new watcher gets when it joins a stream: AVC sequence
+// header, the last keyframe and the interframes which followed it.
+void
+MomentBenchInstance::benchFrameSaverReplay ()
+{
+    Byte * const frame_buf = new (std::nothrow) Byte [options.frame_size];
+    assert (frame_buf);
+    memset (frame_buf, 0, options.frame_size);
+
+    VideoStream::FrameSaver frame_saver;
+
+    {
+        Byte const avc_seq_hdr [] = { 0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x00 };
+
+        VideoStream::VideoMessage msg;
+        fillFrame (&msg, ConstMemory::forObject (avc_seq_hdr));
+        msg.frame_type = VideoStream::VideoFrameType::AvcSequenceHeader;
+        frame_saver.processVideoFrame (&msg);
+        msg.release ();
+    }
+
+    for (Count i = 0; i <= options.num_saved_frames; ++i) {
+        VideoStream::VideoMessage msg;
+        fillFrame (&msg, ConstMemory (frame_buf, options.frame_size));
+        msg.frame_type = (i == 0 ? VideoStream::VideoFrameType::KeyFrame
+                                 : VideoStream::VideoFrameType::InterFrame);
+        msg.timestamp_nanosec = (Uint64) i * 40000000;
+        frame_saver.processVideoFrame (&msg);
+        msg.release ();
+    }
+
+    Ref<BenchWatcher> const watcher = createWatcher ();
+
+    ReplayData data;
+    data.frame_saver = &frame_saver;
+    data.watcher = watcher;
+
+    Uint64 const num_iterations = options.num_frames / 10 + 1;
+    Time const run_microsec = runBench (frameSaverReplayBench, &data, num_iterations);
+    printResult (makeString ("FrameSaver replay (", options.num_saved_frames + 2, " frames)")->mem(),
+                 run_microsec, num_iterations, options.num_saved_frames + 2);
+
+    frame_saver.releaseState ();
+    delete[] frame_buf;
+}
+
+Result
+MomentBenchInstance::run ()
+{
+    if (!server_app.init ()) {
+        logE_ (_func, "server_app.init() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    // The event loop is never run: timers are needed by RtmpConnection only.
+    timers = server_app.getServerContext()->getMainThreadContext()->getTimers();
+
+    outs->print ("moment-bench: median of ", options.num_runs, " runs\n");
+
+    if (!benchFanout ())
+        return Result::Failure;
+
+    benchChunking ();
+    benchFlvHeader ();
+    benchAmf ();
+    benchFrameSaverReplay ();
+
+    return Result::Success;
+}
+
+void
+printUsage ()
+{
+    outs->print ("Usage: moment-bench [options]\n"
+                 "Options:\n"
+                 "  -w --watchers <number>           Number of watchers for fan-out benchmark (default: 100)\n"
+                 "  -f --frames <number>             Number of frames per run (default: 2000)\n"
+                 "  -s --frame-size <number>         Video frame size in bytes (default: 10000)\n"
+                 "  -k --keyframe-interval <number>  Keyframe interval in frames (default: 50)\n"
+                 "  --saved-frames <number>          Interframes saved after a keyframe for FrameSaver replay (default: 50)\n"
+                 "  -r --runs <number>               Number of runs of each benchmark (default: 5)\n"
+                 "  --loglevel <loglevel>            Loglevel, one of A/D/I/W/E/H/F/N (default: W)\n"
+                 "  -h --help                        Show this help message.\n");
+    outs->flush ();
+}
+
+bool cmdline_help (char const * /* short_name */,
+                   char const * /* long_name */,
+                   char const * /* value */,
+                   void       * /* opt_data */,
+                   void       * /* cb_data */)
+{
+    options.help = true;
+    return true;
+}
+
+bool cmdline_uint32 (char const * /* short_name */,
+                     char const * const long_name,
+                     char const * const value,
+                     void       * const opt_data,
+                     void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, static_cast <Uint32*> (opt_data))) {
+        logE_ (_func, "Invalid value \"", value, "\" "
+               "for --", long_name, " (number expected): ", exc->toString());
+        exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_loglevel (char const * /* short_name */,
+                       char const * /* long_name */,
+                       char const * const value,
+                       void       * /* opt_data */,
+                       void       * /* cb_data */)
+{
+    ConstMemory const value_mem = ConstMemory (value, value ? strlen (value) : 0);
+    if (!LogLevel::fromString (value_mem, &options.loglevel)) {
+        logE_ (_func, "Invalid loglevel name \"", value_mem, "\", using \"Warning\"");
+        options.loglevel = LogLevel::Warning;
+    }
+    return true;
+}
+
+} // namespace {}
+
+int main (int argc, char **argv)
+{
+    libMaryInit ();
+
+    {
+        unsigned const num_opts = 8;
+        CmdlineOption opts [num_opts];
+
+        opts [0].short_name = "h";
+        opts [0].long_name  = "help";
+        opts [0].with_value = false;
+        opts [0].opt_data   = NULL;
+        opts [0].opt_callback = cmdline_help;
+
+        opts [1].short_name = "w";
+        opts [1].long_name  = "watchers";
+        opts [1].with_value = true;
+        opts [1].opt_data   = &options.num_watchers;
+        opts [1].opt_callback = cmdline_uint32;
+
+        opts [2].short_name = "f";
+        opts [2].long_name  = "frames";
+        opts [2].with_value = true;
+        opts [2].opt_data   = &options.num_frames;
+        opts [2].opt_callback = cmdline_uint32;
+
+        opts [3].short_name = "s";
+        opts [3].long_name  = "frame-size";
+        opts [3].with_value = true;
+        opts [3].opt_data   = &options.frame_size;
+        opts [3].opt_callback = cmdline_uint32;
+
+        opts [4].short_name = "k";
+        opts [4].long_name  = "keyframe-interval";
+        opts [4].with_value = true;
+        opts [4].opt_data   = &options.keyframe_interval;
+        opts [4].opt_callback = cmdline_uint32;
+
+        opts [5].short_name = NULL;
+        opts [5].long_name  = "saved-frames";
+        opts [5].with_value = true;
+        opts [5].opt_data   = &options.num_saved_frames;
+        opts [5].opt_callback = cmdline_uint32;
+
+        opts [6].short_name = "r";
+        opts [6].long_name  = "runs";
+        opts [6].with_value = true;
+        opts [6].opt_data   = &options.num_runs;
+        opts [6].opt_callback = cmdline_uint32;
+
+        opts [7].short_name = NULL;
+        opts [7].long_name  = "loglevel";
+        opts [7].with_value = true;
+        opts [7].opt_data   = NULL;
+        opts [7].opt_callback = cmdline_loglevel;
+
+        ArrayIterator<CmdlineOption> opts_iter (opts, num_opts);
+        parseCmdline (&argc, &argv, opts_iter, NULL /* callback */, NULL /* callbackData */);
+    }
+
+    if (options.help) {
+        printUsage ();
+        return 0;
+    }
+
+    setGlobalLogLevel (options.loglevel);
+
+    Ref<MomentBenchInstance> const bench_instance = grab (new (std::nothrow) MomentBenchInstance);
+    if (bench_instance->run ())
+        return 0;
+
+    return EXIT_FAILURE;
+}
+
@@ -17,7 +17,11 @@
 */
 
 
+#include <cstdlib>
+
 #include <moment/slave_media_source.h>
+#include <moment/file_source.h>
+#include <moment/metrics.h>
 
 #include <moment/moment_server.h>
 
@@ -33,6 +37,181 @@ MomentServer* MomentServer::instance = NULL;
 
 // ___________________________ HTTP request handlers ___________________________
 
+namespace {
+    struct StreamStatsEntry
+    {
+        StRef<String> stream_name;
+        StreamStats::Info info;
+    };
+}
+
+static int compareStreamStatsByName (void const * const _left,
+                                     void const * const _right)
+{
+    ConstMemory const left  = (*(StreamStatsEntry* const *) _left) ->stream_name->mem();
+    ConstMemory const right = (*(StreamStatsEntry* const *) _right)->stream_name->mem();
+
+    Size const len = left.len() < right.len() ? left.len() : right.len();
+    if (len > 0) {
+        int const res = memcmp (left.mem(), right.mem(), len);
+        if (res != 0)
+            return res;
+    }
+
+    if (left.len() < right.len())
+        return -1;
+    if (left.len() > right.len())
+        return 1;
+
+    return 0;
+}
+
+// Comparators for "top N" sort orders: the largest value goes first.
+#define MOMENT_SERVER__STREAM_STATS_CMP(field)                                            \
+    static int compareStreamStatsBy_##field (void const * const _left,                   \
+                                             void const * const _right)                  \
+    {                                                                                    \
+        StreamStatsEntry const * const left  = *(StreamStatsEntry* const *) _left;       \
+        StreamStatsEntry const * const right = *(StreamStatsEntry* const *) _right;      \
+        if (left->info.field > right->info.field)                                        \
+            return -1;                                                                   \
+        if (left->info.field < right->info.field)                                        \
+            return 1;                                                                    \
+        return compareStreamStatsByName (_left, _right);                                 \
+    }
+
+MOMENT_SERVER__STREAM_STATS_CMP (egress_bitrate)
+MOMENT_SERVER__STREAM_STATS_CMP (video_bitrate)
+MOMENT_SERVER__STREAM_STATS_CMP (audio_bitrate)
+MOMENT_SERVER__STREAM_STATS_CMP (video_fps_x100)
+MOMENT_SERVER__STREAM_STATS_CMP (num_watchers)
+
+#undef MOMENT_SERVER__STREAM_STATS_CMP
+
+// Prints 'str' as the contents of a JSON string literal, escaping quotes,
+// backslashes and control characters. Other bytes are copied as is.
+static void printJsonString (PagePool               * const mt_nonnull page_pool,
+                             PagePool::PageListHead * const mt_nonnull page_list,
+                             ConstMemory              const str)
+{
+    Byte const * const buf = str.mem();
+    Size run_start = 0;
+    for (Size i = 0; i < str.len(); ++i) {
+        Byte const c = buf [i];
+        if (c != '"' && c != '\\' && c >= 0x20)
+            continue;
+
+        if (i > run_start)
+            page_pool->getFillPages (page_list, ConstMemory (buf + run_start, i - run_start));
+        run_start = i + 1;
+
+        switch (c) {
+            case '"':  page_pool->printToPages (page_list, "\\\""); break;
+            case '\\': page_pool->printToPages (page_list, "\\\\"); break;
+            case '\n': page_pool->printToPages (page_list, "\\n");  break;
+            case '\r': page_pool->printToPages (page_list, "\\r");  break;
+            case '\t': page_pool->printToPages (page_list, "\\t");  break;
+            default: {
+                static char const hex_digits [] = "0123456789abcdef";
+                char const escape [] = { '\\', 'u', '0', '0', hex_digits [c >> 4], hex_digits [c & 0xf] };
+                page_pool->getFillPages (page_list, ConstMemory::forObject (escape));
+            } break;
+        }
+    }
+
+    if (str.len() > run_start)
+        page_pool->getFillPages (page_list, ConstMemory (buf + run_start, str.len() - run_start));
+}
+
+// Prints a JSON array of per-stream statistics.
+//
+// 'sort_by' is one of "egress" (the default), "video_bitrate", "audio_bitrate",
+// "fps", "watchers" and "name". 'limit' of 0 means no limit.
+//
+static void printStreamStatsJson (MomentServer           * const mt_nonnull moment,
+                                  PagePool               * const mt_nonnull page_pool,
+                                  PagePool::PageListHead * const mt_nonnull page_list,
+                                  ConstMemory              const sort_by,
+                                  Count                    const limit)
+{
+    List<MomentServer::VideoStreamListEntry> stream_list;
+    moment->getVideoStreamList (&stream_list);
+
+    Count num_entries = 0;
+    {
+        List<MomentServer::VideoStreamListEntry>::iter iter (stream_list);
+        while (!stream_list.iter_done (iter)) {
+            stream_list.iter_next (iter);
+            ++num_entries;
+        }
+    }
+
+    StreamStatsEntry * const entries = new (std::nothrow) StreamStatsEntry [num_entries + 1];
+    assert (entries);
+    StreamStatsEntry ** const sorted = new (std::nothrow) StreamStatsEntry* [num_entries + 1];
+    assert (sorted);
+
+    {
+        Count i = 0;
+        List<MomentServer::VideoStreamListEntry>::iter iter (stream_list);
+        while (!stream_list.iter_done (iter)) {
+            MomentServer::VideoStreamListEntry * const list_entry = &stream_list.iter_next (iter)->data;
+
+            entries [i].stream_name = list_entry->stream_name;
+            list_entry->video_stream->getStreamStats (&entries [i].info);
+            sorted [i] = &entries [i];
+            ++i;
+        }
+    }
+
+    int (*cmp) (void const *, void const *) = compareStreamStatsBy_egress_bitrate;
+    if (equal (sort_by, "video_bitrate"))
+        cmp = compareStreamStatsBy_video_bitrate;
+    else
+    if (equal (sort_by, "audio_bitrate"))
+        cmp = compareStreamStatsBy_audio_bitrate;
+    else
+    if (equal (sort_by, "fps"))
+        cmp = compareStreamStatsBy_video_fps_x100;
+    else
+    if (equal (sort_by, "watchers"))
+        cmp = compareStreamStatsBy_num_watchers;
+    else
+    if (equal (sort_by, "name"))
+        cmp = compareStreamStatsByName;
+
+    if (num_entries > 1)
+        qsort (sorted, num_entries, sizeof (sorted [0]), cmp);
+
+    Count const num_printed = (limit && limit < num_entries ? limit : num_entries);
+
+    page_pool->printToPages (page_list, "[\n");
+    for (Count i = 0; i < num_printed; ++i) {
+        StreamStatsEntry const * const entry = sorted [i];
+        StreamStats::Info const &info = entry->info;
+
+        page_pool->printToPages (page_list, "  { \"name\": \"");
+        printJsonString (page_pool, page_list, entry->stream_name->mem());
+        page_pool->printToPages (
+                page_list,
+                "\", "
+                "\"watchers\": ", info.num_watchers, ", "
+                "\"egress_bitrate\": ", info.egress_bitrate, ", "
+                "\"video_bitrate\": ", info.video_bitrate, ", "
+                "\"audio_bitrate\": ", info.audio_bitrate, ", "
+                "\"fps\": ", info.video_fps_x100 / 100, ".",
+                        (info.video_fps_x100 % 100 < 10 ? "0" : ""), info.video_fps_x100 % 100, ", "
+                "\"avg_video_frame_size\": ", info.avg_video_frame_size, ", "
+                "\"keyframe_interval_ms\": ", info.keyframe_interval_millisec, ", "
+                "\"timestamp_drift_ms\": ", info.timestamp_drift_millisec, " }",
+                (i + 1 < num_printed ? ",\n" : "\n"));
+    }
+    page_pool->printToPages (page_list, "]\n");
+
+    delete[] sorted;
+    delete[] entries;
+}
+
 HttpService::HttpHandler const MomentServer::admin_http_handler = {
     adminHttpRequest,
     NULL /* httpMessageBody */
@@ -92,6 +271,22 @@ MomentServer::adminHttpRequest (HttpRequest   * const mt_nonnull req,
                         "</tr>");
             }
         }
+        self->page_pool->printToPages (
+                &page_list,
+                "</table>"
+                "<p>Recording writers</p>"
+                "<table>"
+                "<tr>"
+                "<th>file</th>"
+                "<th>bytes written</th>"
+                "<th>writes</th>"
+                "<th>queue depth</th>"
+                "<th>max queue depth</th>"
+                "<th>last latency, us</th>"
+                "<th>avg latency, us</th>"
+                "<th>max latency, us</th>"
+                "</tr>");
+        AvRecorder::printWriterStats (self->page_pool, &page_list);
         self->page_pool->printToPages (
                 &page_list,
                 "</table>"
@@ -108,6 +303,83 @@ MomentServer::adminHttpRequest (HttpRequest   * const mt_nonnull req,
         conn_sender->sendPages (self->page_pool, page_list.first, true /* do_flush */);
 
         logA_ ("file 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "metrics"))
+    {
+        // Counters are summed without taking any service locks, so that
+        // frequent scraping does not stall busy servers.
+        PagePool::PageListHead page_list;
+        Metrics::printMetrics (self->page_pool, &page_list, self->getPagePool());
+
+        Size const data_len = PagePool::countPageListDataLen (page_list.first, 0 /* msg_offset */);
+
+        conn_sender->send (
+                self->page_pool,
+                false /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("text/plain; version=0.0.4", data_len),
+                "\r\n");
+        conn_sender->sendPages (self->page_pool, page_list.first, true /* do_flush */);
+
+        logA_ ("moment_server__admin 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "latency"))
+    {
+        // "latency" for all streams, "latency/<stream_name>" for one stream.
+        PagePool::PageListHead page_list;
+        if (!LatencyStats::isEnabled ()) {
+            self->page_pool->printToPages (&page_list, "latency sampling is disabled (moment/latency_sample_interval)\n");
+        } else
+        if (req->getNumPathElems() >= 3 && req->getPath (2).len() > 0) {
+            ConstMemory const stream_name = req->getPath (2);
+            Ref<VideoStream> const video_stream = self->getVideoStream (stream_name);
+            if (!video_stream
+                || !video_stream->printLatencyStats (self->page_pool, &page_list))
+            {
+                self->page_pool->printToPages (&page_list, "no samples for stream ", stream_name, "\n");
+            }
+        } else {
+            LatencyStats::getGlobal()->printStats (self->page_pool, &page_list);
+        }
+
+        Size const data_len = PagePool::countPageListDataLen (page_list.first, 0 /* msg_offset */);
+
+        conn_sender->send (
+                self->page_pool,
+                false /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("text/plain", data_len),
+                "\r\n");
+        conn_sender->sendPages (self->page_pool, page_list.first, true /* do_flush */);
+
+        logA_ ("moment_server__admin 200 ", req->getClientAddress(), " ", req->getRequestLine());
+    } else
+    if (req->getNumPathElems() >= 2
+        && equal (req->getPath (1), "streams"))
+    {
+        // "streams?sort=egress&limit=10" lists the top 10 streams by egress bandwidth.
+        Uint32 limit = 0;
+        {
+            ConstMemory const limit_str = req->getParameter ("limit");
+            if (limit_str.len() > 0 && !strToUint32_safe (limit_str, &limit)) {
+                logE_ (_func, "bad \"limit\" parameter: ", limit_str);
+                limit = 0;
+            }
+        }
+
+        PagePool::PageListHead page_list;
+        printStreamStatsJson (self, self->page_pool, &page_list, req->getParameter ("sort"), limit);
+
+        Size const data_len = PagePool::countPageListDataLen (page_list.first, 0 /* msg_offset */);
+
+        conn_sender->send (
+                self->page_pool,
+                false /* do_flush */,
+                MOMENT_SERVER__OK_HEADERS ("application/json", data_len),
+                "\r\n");
+        conn_sender->sendPages (self->page_pool, page_list.first, true /* do_flush */);
+
+        logA_ ("moment_server__admin 200 ", req->getClientAddress(), " ", req->getRequestLine());
     } else {
         HttpHandlerEntryList::iterator iter (self->admin_http_handlers);
         while (!iter.done()) {
@@ -257,32 +529,38 @@ MomentServer::fireVideoStreamAdded (VideoStream * const mt_nonnull video_stream,
 }
 #endif
 
-mt_mutex (mutex) void
+void
 MomentServer::notifyDeferred_VideoStreamAdded (VideoStream * const mt_nonnull video_stream,
                                                ConstMemory  const stream_name)
 {
+    vs_notification_mutex.lock ();
     VideoStreamAddedNotification * const notification = &vs_added_notifications.appendEmpty()->data;
     notification->video_stream = video_stream;
     notification->stream_name = grab (new (std::nothrow) String (stream_name));
+    vs_notification_mutex.unlock ();
 
     vs_inform_reg.scheduleTask (&vs_added_inform_task, false /* permanent */);
 }
 
-mt_mutex (mutex) void
+void
 MomentServer::notifyDeferred_StreamClosed (VideoStream * const mt_nonnull stream)
 {
+    vs_notification_mutex.lock ();
     StreamClosedNotification * const notification = &vs_closed_notifications.appendEmpty()->data;
     notification->stream = stream;
+    vs_notification_mutex.unlock ();
 
     vs_inform_reg.scheduleTask (&vs_closed_inform_task, false /* permanent */);
 }
 
+// Notifications are drained by a single task, so handlers see streams
+// in the order they were added to the registry.
 bool
 MomentServer::videoStreamAddedInformTask (void * const _self)
 {
     MomentServer * const self = static_cast <MomentServer*> (_self);
 
-    self->mutex.lock ();
+    self->vs_notification_mutex.lock ();
     while (!self->vs_added_notifications.isEmpty()) {
         VideoStreamAddedNotification * const notification = &self->vs_added_notifications.getFirst();
 
@@ -295,11 +573,14 @@ MomentServer::videoStreamAddedInformTask (void * const _self)
         notification->stream_name.setNoUnref ((String*) NULL);
 
         self->vs_added_notifications.remove (self->vs_added_notifications.getFirstElement());
+        self->vs_notification_mutex.unlock ();
 
         InformVideoStreamAdded_Data inform_data (video_stream, stream_name->mem());
-        mt_unlocks_locks (self->mutex) self->video_stream_informer.informAll_unlocked (informVideoStreamAdded, &inform_data);
+        self->video_stream_informer.informAll (informVideoStreamAdded, &inform_data);
+
+        self->vs_notification_mutex.lock ();
     }
-    self->mutex.unlock ();
+    self->vs_notification_mutex.unlock ();
 
     return false /* Do not reschedule */;
 }
@@ -309,7 +590,7 @@ MomentServer::streamClosedInformTask (void * const _self)
 {
     MomentServer * const self = static_cast <MomentServer*> (_self);
 
-    self->mutex.lock ();
+    self->vs_notification_mutex.lock ();
     while (!self->vs_closed_notifications.isEmpty()) {
         StreamClosedNotification * const notification = &self->vs_closed_notifications.getFirst();
 
@@ -318,13 +599,13 @@ MomentServer::streamClosedInformTask (void * const _self)
         notification->stream.setNoUnref ((VideoStream*) NULL);
 
         self->vs_closed_notifications.remove (self->vs_closed_notifications.getFirstElement());
-        self->mutex.unlock ();
+        self->vs_notification_mutex.unlock ();
 
         stream->close ();
 
-        self->mutex.lock ();
+        self->vs_notification_mutex.lock ();
     }
-    self->mutex.unlock ();
+    self->vs_notification_mutex.unlock ();
 
     return false /* Do not reschedule */;
 }
@@ -489,47 +770,215 @@ MomentServer::ClientEntry::fireClientConnected (ClientSession * const client_ses
     event_informer.informAll (informClientConnected, &inform_data);
 }
 
-// @ret_path_tail should contain original path.
-mt_mutex (mutex) MomentServer::ClientEntry*
-MomentServer::getClientEntry_rec (ConstMemory   const path,
-				  ConstMemory * const mt_nonnull ret_path_tail,
-				  Namespace   * const mt_nonnull nsp)
+static int compareRouteNames (ConstMemory const left,
+                              ConstMemory const right)
 {
-    Byte const *delim = (Byte const *) memchr (path.mem(), '/', path.len());
-    ConstMemory next_name;
-    if (delim) {
-	next_name = path.region (0, delim - path.mem());
-	Namespace::NamespaceHash::EntryKey const next_nsp_key = nsp->namespace_hash.lookup (next_name);
-	if (next_nsp_key) {
-	    Namespace * const next_nsp = next_nsp_key.getData();
-	    ClientEntry * const client_entry = getClientEntry_rec (path.region (delim - path.mem() + 1),
-								   ret_path_tail,
-								   next_nsp);
-	    if (client_entry)
-		return client_entry;
-	}
-    } else {
-	next_name = path;
+    Size const len = left.len() < right.len() ? left.len() : right.len();
+    if (len > 0) {
+        int const res = memcmp (left.mem(), right.mem(), len);
+        if (res != 0)
+            return res;
     }
 
-    Namespace::ClientEntryHash::EntryKey const client_entry_key = nsp->client_entry_hash.lookup (next_name);
-    if (!client_entry_key)
-	return NULL;
+    if (left.len() < right.len())
+        return -1;
+    if (left.len() > right.len())
+        return 1;
 
-    *ret_path_tail = (*ret_path_tail).region ((next_name.mem() + next_name.len()) - (*ret_path_tail).mem());
-    return client_entry_key.getData();
+    return 0;
 }
 
-mt_mutex (mutex) MomentServer::ClientEntry*
-MomentServer::getClientEntry (ConstMemory  path,
-			      ConstMemory * const mt_nonnull ret_path_tail,
-			      Namespace   * const mt_nonnull nsp)
+// Picks the deepest client entry along @path, which is what
+// the former recursive namespace walk did.
+MomentServer::ClientEntry*
+MomentServer::RouteTable::lookup (ConstMemory   path,
+                                  ConstMemory * const mt_nonnull ret_path_tail) const
 {
     if (path.len() > 0 && path.mem() [0] == '/')
 	path = path.region (1);
 
     *ret_path_tail = path;
-    return getClientEntry_rec (path, ret_path_tail, nsp);
+
+    ClientEntry *client_entry = NULL;
+    Node const *node = &nodes [0];
+    ConstMemory left = path;
+    for (;;) {
+        Byte const * const delim = (Byte const *) memchr (left.mem(), '/', left.len());
+        ConstMemory const name = delim ? left.region (0, delim - left.mem()) : left;
+
+        Node const *child = NULL;
+        {
+            Count lo = node->first_child;
+            Count hi = node->first_child + node->num_children;
+            while (lo < hi) {
+                Count const mid = lo + (hi - lo) / 2;
+                int const res = compareRouteNames (ConstMemory (names + nodes [mid].name_offs,
+                                                                nodes [mid].name_len),
+                                                   name);
+                if (res == 0) {
+                    child = &nodes [mid];
+                    break;
+                }
+
+                if (res < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+
+        if (!child)
+            break;
+
+        if (child->client_entry) {
+            client_entry = child->client_entry;
+            *ret_path_tail = path.region ((name.mem() + name.len()) - path.mem());
+        }
+
+        if (!delim)
+            break;
+
+        node = child;
+        left = left.region (delim - left.mem() + 1);
+    }
+
+    return client_entry;
+}
+
+mt_const void
+MomentServer::RouteTable::addChild (Node        * const mt_nonnull node,
+                                    ConstMemory   const name,
+                                    ClientEntry * const client_entry,
+                                    Size        * const mt_nonnull next_name_offs)
+{
+    if (name.len() > 0)
+        memcpy (names + *next_name_offs, name.mem(), name.len());
+
+    // Insertion sort: nodes have few children, and tables are rebuilt rarely.
+    Count pos = node->num_children;
+    while (pos > 0) {
+        Node * const prv = &nodes [node->first_child + pos - 1];
+        if (compareRouteNames (ConstMemory (names + prv->name_offs, prv->name_len), name) < 0)
+            break;
+
+        nodes [node->first_child + pos] = *prv;
+        --pos;
+    }
+
+    Node * const child = &nodes [node->first_child + pos];
+    child->name_offs = *next_name_offs;
+    child->name_len = name.len();
+    child->first_child = 0;
+    child->num_children = 0;
+    child->client_entry = client_entry;
+
+    *next_name_offs += name.len();
+    ++node->num_children;
+}
+
+mt_mutex (mutex) void
+MomentServer::countRoutes (Namespace * const mt_nonnull nsp,
+                           Count     * const mt_nonnull ret_num_nodes,
+                           Size      * const mt_nonnull ret_names_len)
+{
+    {
+        Namespace::NamespaceHash::iter iter (nsp->namespace_hash);
+        while (!nsp->namespace_hash.iter_done (iter)) {
+            Namespace::NamespaceHash::EntryKey const nsp_key = nsp->namespace_hash.iter_next (iter);
+            ++*ret_num_nodes;
+            *ret_names_len += nsp_key.getKey().len();
+
+            countRoutes (nsp_key.getData(), ret_num_nodes, ret_names_len);
+        }
+    }
+
+    {
+        Namespace::ClientEntryHash::iter iter (nsp->client_entry_hash);
+        while (!nsp->client_entry_hash.iter_done (iter)) {
+            Namespace::ClientEntryHash::EntryKey const client_entry_key = nsp->client_entry_hash.iter_next (iter);
+            if (!nsp->namespace_hash.lookup (client_entry_key.getKey())) {
+                ++*ret_num_nodes;
+                *ret_names_len += client_entry_key.getKey().len();
+            }
+        }
+    }
+}
+
+// A namespace and a client entry with the same name share a single node.
+mt_mutex (mutex) void
+MomentServer::fillRoutes (RouteTable * const mt_nonnull table,
+                          Count        const node_idx,
+                          Namespace  * const mt_nonnull nsp,
+                          Count      * const mt_nonnull next_node,
+                          Size       * const mt_nonnull next_name_offs)
+{
+    RouteTable::Node * const node = &table->nodes [node_idx];
+    node->first_child = *next_node;
+    node->num_children = 0;
+
+    {
+        Namespace::NamespaceHash::iter iter (nsp->namespace_hash);
+        while (!nsp->namespace_hash.iter_done (iter)) {
+            Namespace::NamespaceHash::EntryKey const nsp_key = nsp->namespace_hash.iter_next (iter);
+            ClientEntry *client_entry = NULL;
+            {
+                Namespace::ClientEntryHash::EntryKey const client_entry_key =
+                        nsp->client_entry_hash.lookup (nsp_key.getKey());
+                if (client_entry_key)
+                    client_entry = client_entry_key.getData();
+            }
+
+            table->addChild (node, nsp_key.getKey(), client_entry, next_name_offs);
+        }
+    }
+
+    {
+        Namespace::ClientEntryHash::iter iter (nsp->client_entry_hash);
+        while (!nsp->client_entry_hash.iter_done (iter)) {
+            Namespace::ClientEntryHash::EntryKey const client_entry_key = nsp->client_entry_hash.iter_next (iter);
+            if (!nsp->namespace_hash.lookup (client_entry_key.getKey()))
+                table->addChild (node, client_entry_key.getKey(), client_entry_key.getData(), next_name_offs);
+        }
+    }
+
+    *next_node += node->num_children;
+
+    for (Count i = 0; i < node->num_children; ++i) {
+        RouteTable::Node * const child = &table->nodes [node->first_child + i];
+        Namespace::NamespaceHash::EntryKey const nsp_key =
+                nsp->namespace_hash.lookup (ConstMemory (table->names + child->name_offs, child->name_len));
+        if (nsp_key)
+            fillRoutes (table, node->first_child + i, nsp_key.getData(), next_node, next_name_offs);
+    }
+}
+
+mt_mutex (mutex) void
+MomentServer::rebuildRouteTable ()
+{
+    Count num_nodes = 1 /* root */;
+    Size names_len = 0;
+    countRoutes (&root_namespace, &num_nodes, &names_len);
+
+    Ref<RouteTable> const table = grab (new (std::nothrow) RouteTable);
+    table->nodes = new (std::nothrow) RouteTable::Node [num_nodes];
+    assert (table->nodes);
+    table->names = new (std::nothrow) Byte [names_len > 0 ? names_len : 1];
+    assert (table->names);
+
+    table->nodes [0].name_offs = 0;
+    table->nodes [0].name_len = 0;
+
+    Count next_node = 1;
+    Size next_name_offs = 0;
+    fillRoutes (table, 0 /* node_idx */, &root_namespace, &next_node, &next_name_offs);
+    assert (next_node == num_nodes);
+    assert (next_name_offs == names_len);
+
+    logD (session, _func, "num_nodes: ", num_nodes);
+
+    route_mutex.lock ();
+    route_table = table;
+    route_mutex.unlock ();
 }
 
 mt_throws Result
@@ -872,8 +1321,17 @@ MomentServer::rtmpClientConnected (ConstMemory const &path,
                                                    auth_backend->newAuthSession);
     }
 
+    Ref<ClientEntry> client_entry;
+    {
+        route_mutex.lock ();
+        Ref<RouteTable> const table = route_table;
+        route_mutex.unlock ();
+
+        if (table)
+            client_entry = table->lookup (path, &path_tail);
+    }
+
     mutex.lock ();
-    Ref<ClientEntry> const client_entry = getClientEntry (path, &path_tail, &root_namespace);
 
     Ref<ClientSession> const client_session = grab (new (std::nothrow) ClientSession);
     client_session->weak_rtmp_conn = conn;
@@ -923,10 +1381,10 @@ MomentServer::clientDisconnected (ClientSession * const mt_nonnull client_sessio
 
     client_session->mutex.unlock ();
 
-    mutex.lock ();
     if (client_session->video_stream_key)
-	removeVideoStream_unlocked (client_session->video_stream_key);
+	removeVideoStream (client_session->video_stream_key);
 
+    mutex.lock ();
     client_session_list.remove (client_session);
 
     Cb<AuthBackend> const tmp_auth_backend = auth_backend;
@@ -1580,6 +2038,7 @@ MomentServer::addClientHandler (CbDesc<ClientHandler> const &cb,
 {
     mutex.lock ();
     ClientHandlerKey const client_handler_key = addClientHandler_rec (cb, path, &root_namespace);
+    rebuildRouteTable ();
     mutex.unlock ();
     return client_handler_key;
 }
@@ -1612,25 +2071,39 @@ MomentServer::removeClientHandler (ClientHandlerKey const client_handler_key)
 		    Namespace * const tmp_nsp = nsp;
 		    nsp = nsp->parent_nsp;
 		    nsp->namespace_hash.remove (tmp_nsp->namespace_hash_key);
+		} else {
+		    break;
 		}
 	    }
 	}
+
+	rebuildRouteTable ();
     }
 
     mutex.unlock ();
 }
 
-Ref<VideoStream>
-MomentServer::getVideoStream (ConstMemory const path)
+MomentServer::StreamShard*
+MomentServer::getStreamShard (ConstMemory const stream_name)
 {
-  StateMutexLock l (&mutex);
-    return getVideoStream_unlocked (path);
+    // FNV-1a
+    Uint32 hash = 2166136261U;
+    for (Size i = 0; i < stream_name.len(); ++i) {
+        hash ^= (Uint32) stream_name.mem() [i];
+        hash *= 16777619U;
+    }
+
+    return &stream_shards [hash % num_stream_shards];
 }
 
-mt_mutex (mutex) Ref<VideoStream>
-MomentServer::getVideoStream_unlocked (ConstMemory const path)
+Ref<VideoStream>
+MomentServer::getVideoStream (ConstMemory const path)
 {
-    VideoStreamHash::EntryKey const entry_key = video_stream_hash.lookup (path);
+    StreamShard * const shard = getStreamShard (path);
+
+  StateMutexLock l (&shard->mutex);
+
+    VideoStreamHash::EntryKey const entry_key = shard->video_stream_hash.lookup (path);
     if (!entry_key)
 	return NULL;
 
@@ -1643,17 +2116,44 @@ MomentServer::getVideoStream_unlocked (ConstMemory const path)
     return stream_entry->video_stream;
 }
 
-mt_mutex (mutex) MomentServer::VideoStreamKey
-MomentServer::addVideoStream_unlocked (VideoStream * const stream,
-                                       ConstMemory   const path)
+void
+MomentServer::getVideoStreamList (List<VideoStreamListEntry> * const mt_nonnull ret_list)
+{
+    for (unsigned i = 0; i < num_stream_shards; ++i) {
+        StreamShard * const shard = &stream_shards [i];
+      StateMutexLock l (&shard->mutex);
+
+        VideoStreamHash::iter iter (shard->video_stream_hash);
+        while (!shard->video_stream_hash.iter_done (iter)) {
+            VideoStreamHash::EntryKey const entry_key = shard->video_stream_hash.iter_next (iter);
+
+            VideoStreamEntry * const stream_entry = (*entry_key.getDataPtr())->stream_list.getFirst();
+            if (!stream_entry || stream_entry->displaced)
+                continue;
+
+            ret_list->appendEmpty ();
+            VideoStreamListEntry * const list_entry = &ret_list->getLast();
+            list_entry->stream_name = st_grab (new (std::nothrow) String (entry_key.getKey()));
+            list_entry->video_stream = stream_entry->video_stream;
+        }
+    }
+}
+
+MomentServer::VideoStreamKey
+MomentServer::addVideoStream (VideoStream * const stream,
+			      ConstMemory   const path)
 {
     logD_ (_func, "name: ", path, ", stream 0x", fmt_hex, (UintPtr) stream);
 
-    VideoStreamEntry * const stream_entry = new (std::nothrow) VideoStreamEntry (stream);
+    StreamShard * const shard = getStreamShard (path);
+
+    VideoStreamEntry * const stream_entry = new (std::nothrow) VideoStreamEntry (stream, shard);
     assert (stream_entry);
 
+    shard->mutex.lock ();
+
     {
-        VideoStreamHash::EntryKey const entry_key = video_stream_hash.lookup (path);
+        VideoStreamHash::EntryKey const entry_key = shard->video_stream_hash.lookup (path);
         if (entry_key) {
             stream_entry->entry_key = entry_key;
 
@@ -1669,27 +2169,25 @@ MomentServer::addVideoStream_unlocked (VideoStream * const stream,
             StRef<StreamHashEntry> const hash_entry = st_grab (new (std::nothrow) StreamHashEntry);
             hash_entry->stream_list.append (stream_entry);
 
-            stream_entry->entry_key = video_stream_hash.add (path, hash_entry);
+            stream_entry->entry_key = shard->video_stream_hash.add (path, hash_entry);
         }
     }
 
+    // Queued under the shard lock to keep notifications in registry order.
     notifyDeferred_VideoStreamAdded (stream, path);
+
+    shard->mutex.unlock ();
+
     return VideoStreamKey (stream_entry);
 }
 
-MomentServer::VideoStreamKey
-MomentServer::addVideoStream (VideoStream * const stream,
-			      ConstMemory   const path)
+void
+MomentServer::removeVideoStream (VideoStreamKey const vs_key)
 {
-    mutex.lock ();
-    MomentServer::VideoStreamKey const stream_key = addVideoStream_unlocked (stream, path);
-    mutex.unlock ();
-    return stream_key;
-}
+    StreamShard * const shard = vs_key.stream_entry->shard;
+
+    shard->mutex.lock ();
 
-mt_mutex (mutex) void
-MomentServer::removeVideoStream_unlocked (VideoStreamKey const vs_key)
-{
     logD_ (_func, "name: ", vs_key.stream_entry->entry_key.getKey(), ", "
            "stream 0x", fmt_hex, (UintPtr) vs_key.stream_entry->video_stream.ptr());
 
@@ -1698,16 +2196,10 @@ MomentServer::removeVideoStream_unlocked (VideoStreamKey const vs_key)
     hash_entry->stream_list.remove (vs_key.stream_entry);
     if (hash_entry->stream_list.isEmpty()) {
         logD_ (_func, "last stream ", hash_key.getKey());
-        video_stream_hash.remove (hash_key);
+        shard->video_stream_hash.remove (hash_key);
     }
-}
 
-void
-MomentServer::removeVideoStream (VideoStreamKey const video_stream_key)
-{
-    mutex.lock ();
-    removeVideoStream_unlocked (video_stream_key);
-    mutex.unlock ();
+    shard->mutex.unlock ();
 }
 
 Ref<VideoStream>
@@ -1794,7 +2286,7 @@ MomentServer::stopRestreaming (RestreamInfo * const mt_nonnull restream_info)
 
     if (restream_info->stream_key) {
         stream = restream_info->unsafe_stream;
-        removeVideoStream_unlocked (restream_info->stream_key);
+        removeVideoStream (restream_info->stream_key);
         restream_info->stream_key = VideoStreamKey();
     }
     restream_info->fetch_conn = NULL;
@@ -2015,6 +2507,39 @@ MomentServer::getFetchProtocolForUri (ConstMemory const uri)
     return fetch_protocol;
 }
 
+MomentServer::TimeshiftBufferKey
+MomentServer::addTimeshiftBuffer (TimeshiftBuffer * const mt_nonnull timeshift_buffer,
+                                  ConstMemory       const stream_name)
+{
+    mutex.lock ();
+    TimeshiftBufferKey const timeshift_buffer_key = timeshift_buffer_hash.add (stream_name, timeshift_buffer);
+    mutex.unlock ();
+
+    return timeshift_buffer_key;
+}
+
+void
+MomentServer::removeTimeshiftBuffer (TimeshiftBufferKey const timeshift_buffer_key)
+{
+    mutex.lock ();
+    timeshift_buffer_hash.remove (timeshift_buffer_key);
+    mutex.unlock ();
+}
+
+Ref<TimeshiftBuffer>
+MomentServer::getTimeshiftBuffer (ConstMemory const stream_name)
+{
+    Ref<TimeshiftBuffer> timeshift_buffer;
+
+    mutex.lock ();
+    TimeshiftBufferHash::EntryKey const timeshift_buffer_key = timeshift_buffer_hash.lookup (stream_name);
+    if (timeshift_buffer_key)
+        timeshift_buffer = timeshift_buffer_key.getData();
+    mutex.unlock ();
+
+    return timeshift_buffer;
+}
+
 Ref<MediaSource>
 MomentServer::createMediaSource (CbDesc<MediaSource::Frontend> const &frontend,
                                  Timers            * const timers,
@@ -2032,6 +2557,24 @@ MomentServer::createMediaSource (CbDesc<MediaSource::Frontend> const &frontend,
         return slave;
     }
 
+    if (playback_item->spec_kind == PlaybackItem::SpecKind::Uri) {
+        // Pre-encoded FLV and MP4 files are played out natively, without
+        // a decoding media source.
+        ConstMemory filename;
+        MediaReader * const reader = FileSource::createReaderForUri (playback_item->stream_spec->mem(), &filename);
+        if (reader) {
+            Ref<FileSource> const file_source = grab (new (std::nothrow) FileSource);
+            file_source->init (this,
+                               reader,
+                               filename,
+                               video_stream,
+                               initial_seek,
+                               playback_item->sync_to_clock,
+                               frontend);
+            return file_source;
+        }
+    }
+
     if (!media_source_provider)
         return NULL;
 
@@ -2102,12 +2645,13 @@ MomentServer::dumpStreamList ()
 
     log__ (_func_);
 
-    {
-      StateMutexLock l (&mutex);
+    for (unsigned i = 0; i < num_stream_shards; ++i) {
+        StreamShard * const shard = &stream_shards [i];
+      StateMutexLock l (&shard->mutex);
 
-	VideoStreamHash::iter iter (video_stream_hash);
-	while (!video_stream_hash.iter_done (iter)) {
-	    VideoStreamHash::EntryKey const entry = video_stream_hash.iter_next (iter);
+	VideoStreamHash::iter iter (shard->video_stream_hash);
+	while (!shard->video_stream_hash.iter_done (iter)) {
+	    VideoStreamHash::EntryKey const entry = shard->video_stream_hash.iter_next (iter);
 	    log__ (_func, "    ", entry.getKey());
 	}
     }
@@ -2205,6 +2749,179 @@ MomentServer::init (ServerApp        * const mt_nonnull server_app,
         }
     }
 
+    {
+        ConstMemory const opt_name = "moment/record_buffer_size";
+        Uint64 value = recording_writer_params.buffer_size;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        recording_writer_params.buffer_size = (Size) value;
+        logD_ (_func, opt_name, ": ", recording_writer_params.buffer_size);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_flush_interval";
+        Uint64 value = recording_writer_params.flush_interval_millisec;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        recording_writer_params.flush_interval_millisec = (Time) value;
+        logD_ (_func, opt_name, ": ", recording_writer_params.flush_interval_millisec);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_prealloc";
+        if (!config->getUint64_default (opt_name,
+                                        &recording_writer_params.prealloc_size,
+                                        recording_writer_params.prealloc_size))
+        {
+            logE_ (_func, "bad value for ", opt_name);
+        }
+
+        logD_ (_func, opt_name, ": ", recording_writer_params.prealloc_size);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_direct_io";
+        MConfig::BooleanValue const value = config->getBoolean (opt_name);
+        if (value == MConfig::Boolean_Invalid) {
+            logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name),
+                   ", assuming \"", recording_writer_params.direct_io, "\"");
+        } else {
+            if (value == MConfig::Boolean_True)
+                recording_writer_params.direct_io = true;
+            else
+                recording_writer_params.direct_io = false;
+
+            logD_ (_func, opt_name, ": ", recording_writer_params.direct_io);
+        }
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_segment_duration";
+        Uint64 value = recording_segment_params.segment_duration_sec;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        recording_segment_params.segment_duration_sec = (Time) value;
+        logD_ (_func, opt_name, ": ", recording_segment_params.segment_duration_sec);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_segment_size";
+        if (!config->getUint64_default (opt_name,
+                                        &recording_segment_params.segment_size,
+                                        recording_segment_params.segment_size))
+        {
+            logE_ (_func, "bad value for ", opt_name);
+        }
+
+        logD_ (_func, opt_name, ": ", recording_segment_params.segment_size);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_manifest_length";
+        Uint64 value = recording_segment_params.manifest_length;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        recording_segment_params.manifest_length = (Count) value;
+        logD_ (_func, opt_name, ": ", recording_segment_params.manifest_length);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_keyframe_index";
+        MConfig::BooleanValue const value = config->getBoolean (opt_name);
+        if (value == MConfig::Boolean_Invalid) {
+            logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name),
+                   ", assuming \"", record_keyframe_index, "\"");
+        } else {
+            if (value == MConfig::Boolean_False)
+                record_keyframe_index = false;
+            else
+                record_keyframe_index = true;
+
+            logD_ (_func, opt_name, ": ", record_keyframe_index);
+        }
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_metadata_reserve";
+        if (!config->getUint64_default (opt_name, &record_metadata_reserve, record_metadata_reserve))
+            logE_ (_func, "bad value for ", opt_name);
+
+        logD_ (_func, opt_name, ": ", record_metadata_reserve);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_format";
+        ConstMemory const opt_val = config->getString (opt_name);
+        if (opt_val.len() == 0 || equal (opt_val, "flv")) {
+            record_mp4 = false;
+        } else
+        if (equal (opt_val, "mp4")) {
+            record_mp4 = true;
+        } else {
+            logE_ (_func, "Invalid value for ", opt_name, ": ", opt_val, ", assuming \"flv\"");
+            record_mp4 = false;
+        }
+
+        logD_ (_func, opt_name, ": ", record_mp4 ? "mp4" : "flv");
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_mp4_fragment_duration";
+        Uint64 value = record_mp4_fragment_duration_millisec;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        record_mp4_fragment_duration_millisec = (Time) value;
+        logD_ (_func, opt_name, ": ", record_mp4_fragment_duration_millisec);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_mp4_faststart";
+        MConfig::BooleanValue const value = config->getBoolean (opt_name);
+        if (value == MConfig::Boolean_Invalid) {
+            logE_ (_func, "Invalid value for ", opt_name, ": ", config->getString (opt_name),
+                   ", assuming \"", record_mp4_faststart, "\"");
+        } else {
+            if (value == MConfig::Boolean_True)
+                record_mp4_faststart = true;
+            else
+                record_mp4_faststart = false;
+
+            logD_ (_func, opt_name, ": ", record_mp4_faststart);
+        }
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_mp4_index_spill_size";
+        if (!config->getUint64_default (opt_name, &record_mp4_index_spill_size, record_mp4_index_spill_size))
+            logE_ (_func, "bad value for ", opt_name);
+
+        logD_ (_func, opt_name, ": ", record_mp4_index_spill_size);
+    }
+
+    {
+        ConstMemory const opt_name = "moment/record_mp4_index_spill_dir";
+        ConstMemory const opt_val = config->getString (opt_name);
+        if (opt_val.len() > 0)
+            record_mp4_index_spill_dir = grab (new String (opt_val));
+
+        logD_ (_func, opt_name, ": ", record_mp4_index_spill_dir->mem());
+    }
+
+    {
+        ConstMemory const opt_name = "moment/latency_sample_interval";
+        Uint64 value = 0;
+        if (!config->getUint64_default (opt_name, &value, value))
+            logE_ (_func, "bad value for ", opt_name);
+
+        LatencyStats::setSampleInterval ((Uint32) value);
+        logD_ (_func, opt_name, ": ", value);
+    }
+
     admin_http_service->addHttpHandler (
 	    CbDesc<HttpService::HttpHandler> (&admin_http_handler, this, this),
 	    "admin");
@@ -2230,6 +2947,13 @@ MomentServer::MomentServer ()
       storage               (NULL),
       publish_all_streams   (true),
       enable_restreaming    (false),
+      record_keyframe_index (true),
+      record_metadata_reserve (0),
+      record_mp4            (false),
+      record_mp4_fragment_duration_millisec (1000),
+      record_mp4_faststart  (false),
+      record_mp4_index_spill_size (1 << 20),
+      record_mp4_index_spill_dir (grab (new String ("/tmp"))),
       new_streams_on_top    (true),
       config                (NULL),
       media_source_provider (this /* coderef_container */)
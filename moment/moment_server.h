@@ -29,6 +29,8 @@
 #include <moment/rtmp_connection.h>
 #include <moment/video_stream.h>
 #include <moment/storage.h>
+#include <moment/recording_writer.h>
+#include <moment/av_recorder.h>
 #include <moment/push_protocol.h>
 #include <moment/fetch_protocol.h>
 #include <moment/transcoder.h>
@@ -75,6 +77,7 @@ namespace Moment {
 using namespace M;
 
 class ChannelManager;
+class TimeshiftBuffer;
 
 // Only one MomentServer object may be initialized during program's lifetime.
 // This limitation comes form loadable modules support.
@@ -97,15 +100,25 @@ private:
 
     typedef StringHash< StRef<StreamHashEntry> > VideoStreamHash;
 
+    class StreamShard
+    {
+    public:
+        StateMutex mutex;
+        mt_mutex (mutex) VideoStreamHash video_stream_hash;
+    };
+
     class VideoStreamEntry : public IntrusiveListElement< StreamList_name >
     {
     public:
 	Ref<VideoStream> video_stream;
-        VideoStreamHash::EntryKey entry_key;
-        bool displaced;
+        mt_const StreamShard *shard;
+        mt_mutex (shard->mutex) VideoStreamHash::EntryKey entry_key;
+        mt_mutex (shard->mutex) bool displaced;
 
-	VideoStreamEntry (VideoStream * const video_stream)
+	VideoStreamEntry (VideoStream * const video_stream,
+                          StreamShard * const shard)
 	    : video_stream (video_stream),
+              shard (shard),
               displaced (false)
 	{}
     };
@@ -311,8 +324,12 @@ private:
     DeferredProcessor::Task vs_closed_inform_task;
     DeferredProcessor::Registration vs_inform_reg;
 
-    mt_mutex (mutex) List<VideoStreamAddedNotification> vs_added_notifications;
-    mt_mutex (mutex) List<StreamClosedNotification> vs_closed_notifications;
+    // Notifications are queued while holding a stream shard lock, hence
+    // a separate mutex. Lock order: mutex -> shard->mutex -> vs_notification_mutex.
+    Mutex vs_notification_mutex;
+
+    mt_mutex (vs_notification_mutex) List<VideoStreamAddedNotification> vs_added_notifications;
+    mt_mutex (vs_notification_mutex) List<StreamClosedNotification> vs_closed_notifications;
 
     static void informVideoStreamAdded (VideoStreamHandler *vs_handler,
                                         void               *cb_data,
@@ -323,10 +340,10 @@ private:
                                ConstMemory  stream_name);
 #endif
 
-    mt_mutex (mutex) void notifyDeferred_VideoStreamAdded (VideoStream * mt_nonnull video_stream,
-                                                           ConstMemory  stream_name);
+    void notifyDeferred_VideoStreamAdded (VideoStream * mt_nonnull video_stream,
+                                          ConstMemory  stream_name);
 
-    mt_mutex (mutex) void notifyDeferred_StreamClosed (VideoStream * mt_nonnull video_stream);
+    void notifyDeferred_StreamClosed (VideoStream * mt_nonnull video_stream);
 
     static bool videoStreamAddedInformTask (void *_self);
     static bool streamClosedInformTask (void *_self);
@@ -594,12 +611,30 @@ private:
     mt_const bool publish_all_streams;
     mt_const bool enable_restreaming;
 
+    mt_const RecordingWriter::Params recording_writer_params;
+    mt_const AvRecorder::SegmentParams recording_segment_params;
+
+    mt_const bool   record_keyframe_index;
+    mt_const Uint64 record_metadata_reserve;
+
+    mt_const bool   record_mp4;
+    mt_const Time   record_mp4_fragment_duration_millisec;
+    mt_const bool   record_mp4_faststart;
+    mt_const Uint64 record_mp4_index_spill_size;
+    mt_const Ref<String> record_mp4_index_spill_dir;
+
     mt_mutex (mutex) ClientSessionList client_session_list;
 
     static MomentServer *instance;
 
     mt_const bool new_streams_on_top;
-    mt_mutex (mutex) VideoStreamHash video_stream_hash;
+
+    // The stream registry is split into shards, each with its own lock,
+    // so that stream lookups do not contend on 'mutex'.
+    enum { num_stream_shards = 32 };
+    StreamShard stream_shards [num_stream_shards];
+
+    StreamShard* getStreamShard (ConstMemory stream_name);
 
     mt_const Ref<VideoStream> mix_video_stream;
 
@@ -626,13 +661,60 @@ private:
 
     mt_mutex (mutex) Namespace root_namespace;
 
-    mt_mutex (mutex) ClientEntry* getClientEntry_rec (ConstMemory  path,
-						      ConstMemory * mt_nonnull ret_path_tail,
-						      Namespace   * mt_nonnull nsp);
+    // Immutable routing trie compiled from 'root_namespace'. A new table is
+    // built on every change of the namespace tree and swapped in under
+    // 'route_mutex', which lets rtmpClientConnected() resolve client entries
+    // without taking 'mutex'.
+    class RouteTable : public Referenced
+    {
+    public:
+        struct Node
+        {
+            Size  name_offs;
+            Size  name_len;
+            // Children are stored contiguously and sorted by name.
+            Count first_child;
+            Count num_children;
+            Ref<ClientEntry> client_entry;
+        };
+
+        mt_const Node *nodes;
+        mt_const Byte *names;
+
+        ClientEntry* lookup (ConstMemory  path,
+                             ConstMemory * mt_nonnull ret_path_tail) const;
+
+        mt_const void addChild (Node        * mt_nonnull node,
+                                ConstMemory  name,
+                                ClientEntry *client_entry,
+                                Size        * mt_nonnull next_name_offs);
+
+        RouteTable ()
+            : nodes (NULL),
+              names (NULL)
+        {}
+
+        ~RouteTable ()
+        {
+            delete[] nodes;
+            delete[] names;
+        }
+    };
+
+    Mutex route_mutex;
+    mt_mutex (route_mutex) Ref<RouteTable> route_table;
 
-    mt_mutex (mutex) ClientEntry* getClientEntry (ConstMemory  path,
-						  ConstMemory * mt_nonnull ret_path_tail,
-						  Namespace   * mt_nonnull nsp);
+    static mt_mutex (mutex) void countRoutes (Namespace * mt_nonnull nsp,
+                                              Count     * mt_nonnull ret_num_nodes,
+                                              Size      * mt_nonnull ret_names_len);
+
+    static mt_mutex (mutex) void fillRoutes (RouteTable * mt_nonnull table,
+                                             Count       node_idx,
+                                             Namespace  * mt_nonnull nsp,
+                                             Count      * mt_nonnull next_node,
+                                             Size       * mt_nonnull next_name_offs);
+
+    mt_mutex (mutex) void rebuildRouteTable ();
 
     mt_throws Result loadModules ();
 
@@ -647,6 +729,24 @@ public:
     ServerThreadPool* getReaderThreadPool ();
     Storage*          getStorage ();
 
+    RecordingWriter::Params const * getRecordingWriterParams () { return &recording_writer_params; }
+
+    AvRecorder::SegmentParams const * getRecordingSegmentParams () { return &recording_segment_params; }
+
+    bool   getRecordKeyframeIndex   () { return record_keyframe_index; }
+    Uint64 getRecordMetaDataReserve () { return record_metadata_reserve; }
+
+    // "moment/record_format": FLV (default) or fragmented MP4.
+    bool   getRecordMp4 () { return record_mp4; }
+    Time   getRecordMp4FragmentDuration () { return record_mp4_fragment_duration_millisec; }
+    bool   getRecordMp4Faststart () { return record_mp4_faststart; }
+    // Faststart sample tables larger than this are kept in a temporary file
+    // in getRecordMp4IndexSpillDir(). 0 - always in memory.
+    Size        getRecordMp4IndexSpillSize () { return (Size) record_mp4_index_spill_size; }
+    ConstMemory getRecordMp4IndexSpillDir  () { return record_mp4_index_spill_dir->mem(); }
+
+    ConstMemory getRecordFilenameExt () { return record_mp4 ? ConstMemory (".mp4") : ConstMemory (".flv"); }
+
     Ref<ChannelManager> getChannelManager () { return weak_channel_manager.getRef(); }
 
     static MomentServer* getInstance ();
@@ -759,22 +859,34 @@ public:
     // TODO There's a logical problem here. A stream can only be deleted
     // by the one who created it. This limitation makes little sense.
     // But overcoming it requires more complex synchronization.
+    //
+    // The registry is protected by per-shard locks, not by 'mutex'.
+    // The *_unlocked variants are kept for callers which hold 'mutex'
+    // and are equivalent to the locking ones.
     Ref<VideoStream> getVideoStream (ConstMemory path);
 
-    mt_mutex (mutex) Ref<VideoStream> getVideoStream_unlocked (ConstMemory path);
+    mt_mutex (mutex) Ref<VideoStream> getVideoStream_unlocked (ConstMemory path)
+        { return getVideoStream (path); }
 
     VideoStreamKey addVideoStream (VideoStream *stream,
 				   ConstMemory  path);
 
-    mt_mutex (mutex) VideoStreamKey addVideoStream_unlocked (VideoStream *stream,
-                                                             ConstMemory  path);
+    mt_mutex (mutex) VideoStreamKey addVideoStream_unlocked (VideoStream * const stream,
+                                                             ConstMemory   const path)
+        { return addVideoStream (stream, path); }
 
-private:
-    mt_mutex (mutex) void removeVideoStream_unlocked (VideoStreamKey video_stream_key);
-
-public:
     void removeVideoStream (VideoStreamKey video_stream_key);
 
+    struct VideoStreamListEntry
+    {
+        StRef<String>    stream_name;
+        Ref<VideoStream> video_stream;
+    };
+
+    // Returns a snapshot of all published streams. Shards are locked one at
+    // a time, so the snapshot is not atomic across shards.
+    void getVideoStreamList (List<VideoStreamListEntry> * mt_nonnull ret_list);
+
     Ref<VideoStream> getMixVideoStream ();
 
 
@@ -788,7 +900,7 @@ private:
 
         mt_mutex (mutex) VideoStreamKey stream_key;
         // Valid when 'stream_key' is non-null, which means that
-        // video_stream_hash holds a reference to the stream.
+        // the stream registry holds a reference to the stream.
         mt_mutex (mutex) VideoStream *unsafe_stream;
 
         mt_mutex (mutex) Ref<FetchConnection> fetch_conn;
@@ -829,6 +941,24 @@ public:
     Ref<FetchProtocol> getFetchProtocolForUri (ConstMemory uri);
 
 
+  // ____________________________ Timeshift buffers ____________________________
+
+private:
+    typedef StringHash< Ref<TimeshiftBuffer> > TimeshiftBufferHash;
+
+    mt_mutex (mutex) TimeshiftBufferHash timeshift_buffer_hash;
+
+public:
+    typedef TimeshiftBufferHash::EntryKey TimeshiftBufferKey;
+
+    TimeshiftBufferKey addTimeshiftBuffer (TimeshiftBuffer * mt_nonnull timeshift_buffer,
+                                           ConstMemory      stream_name);
+
+    void removeTimeshiftBuffer (TimeshiftBufferKey timeshift_buffer_key);
+
+    Ref<TimeshiftBuffer> getTimeshiftBuffer (ConstMemory stream_name);
+
+
   // _________________________ media source providers __________________________
 
 private:
@@ -944,6 +1074,7 @@ public:
 
 
 #include <moment/channel_manager.h>
+#include <moment/timeshift_buffer.h>
 
 
 #endif /* MOMENT__SERVER__H__ */
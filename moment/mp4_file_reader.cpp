@@ -0,0 +1,963 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <moment/mp4_file_reader.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_mp4read ("moment.mp4read", LogLevel::I);
+
+enum {
+    // 'moov' is loaded into memory as a whole.
+    MaxMoovSize = 1 << 28,
+    MaxSamples  = 1 << 26
+};
+
+static Uint32
+readBe16 (Byte const * const mt_nonnull p)
+{
+    return ((Uint32) p [0] << 8) |
+           ((Uint32) p [1] << 0);
+}
+
+static Uint32
+readBe32 (Byte const * const mt_nonnull p)
+{
+    return ((Uint32) p [0] << 24) |
+           ((Uint32) p [1] << 16) |
+           ((Uint32) p [2] <<  8) |
+           ((Uint32) p [3] <<  0);
+}
+
+static Uint64
+readBe64 (Byte const * const mt_nonnull p)
+{
+    return ((Uint64) readBe32 (p) << 32) | (Uint64) readBe32 (p + 4);
+}
+
+// Iterates over the boxes contained in 'mem'.
+static bool
+nextBox (ConstMemory    const mem,
+         Size         * const mt_nonnull pos,
+         Byte const  ** const mt_nonnull ret_type,
+         ConstMemory  * const mt_nonnull ret_body)
+{
+    if (mem.len() - *pos < 8)
+        return false;
+
+    Byte const * const p = mem.mem() + *pos;
+    Uint64 size = readBe32 (p);
+    Size hdr_len = 8;
+    if (size == 1) {
+        if (mem.len() - *pos < 16)
+            return false;
+
+        size = readBe64 (p + 8);
+        hdr_len = 16;
+    } else
+    if (size == 0) {
+        size = mem.len() - *pos;
+    }
+
+    if (size < hdr_len || size > mem.len() - *pos)
+        return false;
+
+    *ret_type = p + 4;
+    *ret_body = mem.region (*pos + hdr_len, (Size) size - hdr_len);
+    *pos += (Size) size;
+    return true;
+}
+
+static bool
+findBox (ConstMemory   const mem,
+         char const  * const mt_nonnull type,
+         ConstMemory * const mt_nonnull ret_body)
+{
+    Size pos = 0;
+    Byte const *box_type;
+    ConstMemory body;
+    while (nextBox (mem, &pos, &box_type, &body)) {
+        if (!memcmp (box_type, type, 4)) {
+            *ret_body = body;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+readDescriptorHeader (ConstMemory   const mem,
+                      Size        * const mt_nonnull pos,
+                      Byte        * const mt_nonnull ret_tag,
+                      Size        * const mt_nonnull ret_len)
+{
+    if (*pos >= mem.len())
+        return false;
+
+    Byte const tag = mem.mem() [*pos];
+    ++*pos;
+
+    Size len = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        if (*pos >= mem.len())
+            return false;
+
+        Byte const b = mem.mem() [*pos];
+        ++*pos;
+
+        len = (len << 7) | (b & 0x7f);
+        if (!(b & 0x80))
+            break;
+    }
+
+    if (len > mem.len() - *pos)
+        return false;
+
+    *ret_tag = tag;
+    *ret_len = len;
+    return true;
+}
+
+// Extracts AudioSpecificConfig from an 'esds' box of an AAC track.
+static bool
+parseEsds (ConstMemory   const esds,
+           ConstMemory * const mt_nonnull ret_asc)
+{
+    Size pos = 4 /* version and flags */;
+    Byte tag;
+    Size len;
+
+    // ES_Descriptor
+    if (!readDescriptorHeader (esds, &pos, &tag, &len) || tag != 0x03 || len < 3)
+        return false;
+
+    Byte const flags = esds.mem() [pos + 2];
+    pos += 3;
+    if (flags & 0x80) // streamDependenceFlag
+        pos += 2;
+    if (flags & 0x40) { // URL_Flag
+        if (pos >= esds.len())
+            return false;
+
+        pos += 1 + esds.mem() [pos];
+    }
+    if (flags & 0x20) // OCRstreamFlag
+        pos += 2;
+
+    if (pos > esds.len())
+        return false;
+
+    // DecoderConfigDescriptor
+    if (!readDescriptorHeader (esds, &pos, &tag, &len) || tag != 0x04 || len < 13)
+        return false;
+
+    Byte const object_type = esds.mem() [pos];
+    if (object_type != 0x40 /* MPEG-4 AAC */
+        && (object_type < 0x66 || object_type > 0x68) /* MPEG-2 AAC */)
+    {
+        return false;
+    }
+    pos += 13;
+
+    // DecoderSpecificInfo
+    if (!readDescriptorHeader (esds, &pos, &tag, &len) || tag != 0x05)
+        return false;
+
+    *ret_asc = esds.region (pos, len);
+    return true;
+}
+
+// Number of samples with timestamp <= timestamp_millisec.
+static Count
+countSamplesNotLater (Mp4FileReader::Sample const * const samples,
+                      Count  const num_samples,
+                      Uint64 const timestamp_millisec)
+{
+    Count left = 0;
+    Count right = num_samples;
+    while (left < right) {
+        Count const middle = left + (right - left) / 2;
+        if (samples [middle].timestamp_millisec <= timestamp_millisec)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+
+    return left;
+}
+
+// Index of the first sample with timestamp >= timestamp_millisec.
+static Count
+findFirstSampleNotEarlier (Mp4FileReader::Sample const * const samples,
+                           Count  const num_samples,
+                           Uint64 const timestamp_millisec)
+{
+    Count left = 0;
+    Count right = num_samples;
+    while (left < right) {
+        Count const middle = left + (right - left) / 2;
+        if (samples [middle].timestamp_millisec < timestamp_millisec)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+
+    return left;
+}
+
+void
+Mp4FileReader::Track::release ()
+{
+    delete[] samples;
+    samples = NULL;
+    num_samples = 0;
+    pos = 0;
+
+    delete[] sync_samples;
+    sync_samples = NULL;
+    num_sync_samples = 0;
+
+    delete[] codec_config;
+    codec_config = NULL;
+    codec_config_len = 0;
+
+    valid = false;
+    timescale = 0;
+    rate = 0;
+    channels = 0;
+}
+
+Mp4FileReader::Track::Track ()
+    : valid     (false),
+      is_audio  (false),
+      timescale (0),
+      samples     (NULL),
+      num_samples (0),
+      pos         (0),
+      sync_samples     (NULL),
+      num_sync_samples (0),
+      codec_config     (NULL),
+      codec_config_len (0),
+      rate     (0),
+      channels (0)
+{
+}
+
+mt_throws Result
+Mp4FileReader::parseStbl (ConstMemory   const stbl,
+                          Track       * const mt_nonnull track)
+{
+    ConstMemory stsd;
+    ConstMemory stts;
+    ConstMemory stsc;
+    ConstMemory stsz;
+    ConstMemory stco;
+    ConstMemory stss;
+    bool co64 = false;
+
+    if (!findBox (stbl, "stsd", &stsd)
+        || !findBox (stbl, "stts", &stts)
+        || !findBox (stbl, "stsc", &stsc)
+        || !findBox (stbl, "stsz", &stsz))
+    {
+        logE (mp4read, _func, "incomplete sample table");
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    if (!findBox (stbl, "stco", &stco)) {
+        if (!findBox (stbl, "co64", &stco)) {
+            logE (mp4read, _func, "no chunk offsets");
+            exc_throw (InternalException, InternalException::BadInput);
+            return Result::Failure;
+        }
+
+        co64 = true;
+    }
+
+    bool const got_stss = findBox (stbl, "stss", &stss);
+
+    ConstMemory codec_config;
+    {
+        Size pos = 8 /* version, flags and entry_count */;
+        Byte const *type;
+        ConstMemory entry;
+        if (stsd.len() < pos || !nextBox (stsd, &pos, &type, &entry)) {
+            exc_throw (InternalException, InternalException::BadInput);
+            return Result::Failure;
+        }
+
+        if (!track->is_audio) {
+            if (memcmp (type, "avc1", 4)) {
+                logD (mp4read, _func, "unsupported video codec: ", ConstMemory (type, 4));
+                return Result::Success;
+            }
+
+            // VisualSampleEntry fields precede child boxes.
+            if (entry.len() < 78 || !findBox (entry.region (78), "avcC", &codec_config)) {
+                logE (mp4read, _func, "no avcC");
+                exc_throw (InternalException, InternalException::BadInput);
+                return Result::Failure;
+            }
+        } else {
+            if (memcmp (type, "mp4a", 4)) {
+                logD (mp4read, _func, "unsupported audio codec: ", ConstMemory (type, 4));
+                return Result::Success;
+            }
+
+            if (entry.len() < 28) {
+                exc_throw (InternalException, InternalException::BadInput);
+                return Result::Failure;
+            }
+
+            // QuickTime sound description versions 1 and 2 have extra fields.
+            Uint32 const version = readBe16 (entry.mem() + 8);
+            Size const entry_hdr_len = 28 + (version == 1 ? 16 : (version == 2 ? 36 : 0));
+
+            ConstMemory esds;
+            if (entry.len() < entry_hdr_len || !findBox (entry.region (entry_hdr_len), "esds", &esds)) {
+                logE (mp4read, _func, "no esds");
+                exc_throw (InternalException, InternalException::BadInput);
+                return Result::Failure;
+            }
+
+            if (!parseEsds (esds, &codec_config)) {
+                logD (mp4read, _func, "unsupported audio object type");
+                return Result::Success;
+            }
+
+            track->channels = readBe16 (entry.mem() + 16);
+            track->rate = readBe32 (entry.mem() + 24) >> 16;
+        }
+    }
+
+    if (stsz.len() < 12 || stts.len() < 8 || stsc.len() < 8 || stco.len() < 8) {
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    Uint32 const sample_size = readBe32 (stsz.mem() + 4);
+    Count  num_samples = readBe32 (stsz.mem() + 8);
+    Count const num_stts_entries = readBe32 (stts.mem() + 4);
+    Count const num_stsc_entries = readBe32 (stsc.mem() + 4);
+    Count const num_chunks = readBe32 (stco.mem() + 4);
+    Count const num_stss_entries = (got_stss && stss.len() >= 8 ? readBe32 (stss.mem() + 4) : 0);
+
+    if (num_samples > MaxSamples
+        || (sample_size == 0 && (stsz.len() - 12) / 4 < num_samples)
+        || (stts.len() - 8) / 8 < num_stts_entries
+        || (stsc.len() - 8) / 12 < num_stsc_entries
+        || (stco.len() - 8) / (co64 ? 8 : 4) < num_chunks
+        || (got_stss && (stss.len() < 8 || (stss.len() - 8) / 4 < num_stss_entries)))
+    {
+        logE (mp4read, _func, "bad sample table");
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    if (num_samples == 0) {
+        // Fragmented files keep their samples in 'moof' boxes.
+        logD (mp4read, _func, "no samples in track");
+        return Result::Success;
+    }
+
+    Sample * const samples = new (std::nothrow) Sample [num_samples];
+    assert (samples);
+
+    for (Count i = 0; i < num_samples; ++i) {
+        samples [i].offset = 0;
+        samples [i].size = (sample_size ? sample_size : readBe32 (stsz.mem() + 12 + i * 4));
+        samples [i].is_sync = !got_stss;
+    }
+
+    {
+        Uint64 dts = 0;
+        Count sample_idx = 0;
+        for (Count i = 0; i < num_stts_entries && sample_idx < num_samples; ++i) {
+            Count  const count = readBe32 (stts.mem() + 8 + i * 8);
+            Uint32 const delta = readBe32 (stts.mem() + 8 + i * 8 + 4);
+            for (Count j = 0; j < count && sample_idx < num_samples; ++j) {
+                samples [sample_idx].timestamp_millisec = dts * 1000 / track->timescale;
+                dts += delta;
+                ++sample_idx;
+            }
+        }
+
+        for (; sample_idx < num_samples; ++sample_idx)
+            samples [sample_idx].timestamp_millisec = dts * 1000 / track->timescale;
+    }
+
+    {
+        Count sample_idx = 0;
+        for (Count i = 0; i < num_stsc_entries && sample_idx < num_samples; ++i) {
+            Byte const * const entry = stsc.mem() + 8 + i * 12;
+            Count const first_chunk = readBe32 (entry);
+            Count const samples_per_chunk = readBe32 (entry + 4);
+            Count last_chunk = (i + 1 < num_stsc_entries ? readBe32 (entry + 12) - 1 : num_chunks);
+            if (last_chunk > num_chunks)
+                last_chunk = num_chunks;
+
+            if (first_chunk == 0) {
+                delete[] samples;
+                exc_throw (InternalException, InternalException::BadInput);
+                return Result::Failure;
+            }
+
+            for (Count chunk = first_chunk; chunk <= last_chunk && sample_idx < num_samples; ++chunk) {
+                Uint64 offset = (co64 ? readBe64 (stco.mem() + 8 + (chunk - 1) * 8)
+                                      : readBe32 (stco.mem() + 8 + (chunk - 1) * 4));
+                for (Count j = 0; j < samples_per_chunk && sample_idx < num_samples; ++j) {
+                    samples [sample_idx].offset = offset;
+                    offset += samples [sample_idx].size;
+                    ++sample_idx;
+                }
+            }
+        }
+
+        if (sample_idx < num_samples) {
+            logW (mp4read, _func, "chunk table covers ", sample_idx, " samples out of ", num_samples);
+            num_samples = sample_idx;
+        }
+    }
+
+    Count *sync_samples = NULL;
+    Count num_sync_samples = 0;
+    if (got_stss) {
+        sync_samples = new (std::nothrow) Count [num_stss_entries ? num_stss_entries : 1];
+        assert (sync_samples);
+
+        for (Count i = 0; i < num_stss_entries; ++i) {
+            Count const sample_number = readBe32 (stss.mem() + 8 + i * 4);
+            if (sample_number == 0 || sample_number > num_samples)
+                continue;
+
+            if (num_sync_samples > 0 && sync_samples [num_sync_samples - 1] >= sample_number - 1)
+                continue;
+
+            sync_samples [num_sync_samples] = sample_number - 1;
+            ++num_sync_samples;
+            samples [sample_number - 1].is_sync = true;
+        }
+    }
+
+    track->samples = samples;
+    track->num_samples = num_samples;
+    track->pos = 0;
+    track->sync_samples = sync_samples;
+    track->num_sync_samples = num_sync_samples;
+
+    track->codec_config = new (std::nothrow) Byte [codec_config.len() ? codec_config.len() : 1];
+    assert (track->codec_config);
+    memcpy (track->codec_config, codec_config.mem(), codec_config.len());
+    track->codec_config_len = codec_config.len();
+
+    track->valid = true;
+
+    return Result::Success;
+}
+
+mt_throws Result
+Mp4FileReader::parseTrak (ConstMemory const trak)
+{
+    ConstMemory mdia;
+    ConstMemory hdlr;
+    ConstMemory mdhd;
+    ConstMemory minf;
+    ConstMemory stbl;
+    if (!findBox (trak, "mdia", &mdia)
+        || !findBox (mdia, "hdlr", &hdlr)
+        || !findBox (mdia, "mdhd", &mdhd)
+        || !findBox (mdia, "minf", &minf)
+        || !findBox (minf, "stbl", &stbl)
+        || hdlr.len() < 12)
+    {
+        logD (mp4read, _func, "incomplete track, skipping");
+        return Result::Success;
+    }
+
+    Track *track;
+    Byte const * const handler_type = hdlr.mem() + 8;
+    if (!memcmp (handler_type, "vide", 4)) {
+        track = &video_track;
+        track->is_audio = false;
+    } else
+    if (!memcmp (handler_type, "soun", 4)) {
+        track = &audio_track;
+        track->is_audio = true;
+    } else {
+        return Result::Success;
+    }
+
+    if (track->valid) {
+        logD (mp4read, _func, "skipping extra ", (track->is_audio ? "audio" : "video"), " track");
+        return Result::Success;
+    }
+
+    Uint32 timescale = 0;
+    if (mdhd.len() >= 1 && mdhd.mem() [0] == 1) {
+        if (mdhd.len() >= 24)
+            timescale = readBe32 (mdhd.mem() + 20);
+    } else {
+        if (mdhd.len() >= 16)
+            timescale = readBe32 (mdhd.mem() + 12);
+    }
+
+    if (timescale == 0) {
+        logE (mp4read, _func, "bad track timescale");
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    track->timescale = timescale;
+
+    return parseStbl (stbl, track);
+}
+
+mt_throws Result
+Mp4FileReader::parseMoov (ConstMemory const moov)
+{
+    ConstMemory mvhd;
+    if (findBox (moov, "mvhd", &mvhd)) {
+        Uint32 timescale = 0;
+        Uint64 duration = 0;
+        if (mvhd.len() >= 1 && mvhd.mem() [0] == 1) {
+            if (mvhd.len() >= 32) {
+                timescale = readBe32 (mvhd.mem() + 20);
+                duration  = readBe64 (mvhd.mem() + 24);
+            }
+        } else {
+            if (mvhd.len() >= 20) {
+                timescale = readBe32 (mvhd.mem() + 12);
+                duration  = readBe32 (mvhd.mem() + 16);
+            }
+        }
+
+        if (timescale)
+            duration_millisec = duration * 1000 / timescale;
+    }
+
+    Size pos = 0;
+    Byte const *type;
+    ConstMemory body;
+    while (nextBox (moov, &pos, &type, &body)) {
+        if (!memcmp (type, "trak", 4)) {
+            if (!parseTrak (body))
+                return Result::Failure;
+        }
+    }
+
+    return Result::Success;
+}
+
+void
+Mp4FileReader::queueCodecHeaders ()
+{
+    bool got_timestamp = false;
+    Uint64 timestamp_millisec = 0;
+    for (unsigned i = 0; i < 2; ++i) {
+        Track const * const track = (i == 0 ? &video_track : &audio_track);
+        if (!track->valid || track->pos >= track->num_samples)
+            continue;
+
+        Uint64 const sample_timestamp = track->samples [track->pos].timestamp_millisec;
+        if (!got_timestamp || sample_timestamp < timestamp_millisec) {
+            timestamp_millisec = sample_timestamp;
+            got_timestamp = true;
+        }
+    }
+
+    if (!got_timestamp)
+        return;
+
+    if (audio_track.valid) {
+        Frame frame;
+        frame.is_audio = true;
+
+        VideoStream::AudioMessage * const audio_msg = &frame.audio_msg;
+        audio_msg->codec_id = VideoStream::AudioCodecId::AAC;
+        audio_msg->frame_type = VideoStream::AudioFrameType::AacSequenceHeader;
+        audio_msg->rate = audio_track.rate;
+        audio_msg->channels = audio_track.channels;
+
+        PagePool::PageListHead page_list;
+        page_pool->getFillPages (&page_list, ConstMemory (audio_track.codec_config, audio_track.codec_config_len));
+
+        audio_msg->timestamp_nanosec = timestamp_millisec * 1000000;
+        audio_msg->page_pool = page_pool;
+        audio_msg->page_list = page_list;
+        audio_msg->msg_offset = 0;
+        audio_msg->msg_len = audio_track.codec_config_len;
+
+        frame.timestamp_millisec = timestamp_millisec;
+        queueFrame (frame);
+    }
+
+    if (video_track.valid) {
+        Frame frame;
+        frame.is_audio = false;
+
+        VideoStream::VideoMessage * const video_msg = &frame.video_msg;
+        video_msg->codec_id = VideoStream::VideoCodecId::AVC;
+        video_msg->frame_type = VideoStream::VideoFrameType::AvcSequenceHeader;
+
+        PagePool::PageListHead page_list;
+        page_pool->getFillPages (&page_list, ConstMemory (video_track.codec_config, video_track.codec_config_len));
+
+        video_msg->timestamp_nanosec = timestamp_millisec * 1000000;
+        video_msg->page_pool = page_pool;
+        video_msg->page_list = page_list;
+        video_msg->msg_offset = 0;
+        video_msg->msg_len = video_track.codec_config_len;
+
+        frame.timestamp_millisec = timestamp_millisec;
+        queueFrame (frame);
+    }
+}
+
+mt_throws IoResult
+Mp4FileReader::readSample (Track * const mt_nonnull track,
+                           Frame * const mt_nonnull ret_frame)
+{
+    Sample const * const sample = &track->samples [track->pos];
+
+    // Samples of both tracks are usually interleaved closely enough to be
+    // served from the same read-ahead block.
+    PagePool::PageListHead page_list;
+    {
+        Uint64 offset = sample->offset;
+        Size left = sample->size;
+        while (left > 0) {
+            if (offset < buf_offset || offset >= buf_offset + buf_len) {
+                Size nread = 0;
+                if (!readFileData (fd, Memory (buf, ReadAheadSize), offset, &nread)) {
+                    page_pool->msgUnref (page_list.first);
+                    return IoResult::Error;
+                }
+
+                buf_offset = offset;
+                buf_len = nread;
+
+                if (nread == 0) {
+                    logD (mp4read, _func, "truncated sample at ", sample->offset);
+                    page_pool->msgUnref (page_list.first);
+                    return IoResult::Eof;
+                }
+            }
+
+            Size const buf_pos = (Size) (offset - buf_offset);
+            Size const len = (left < buf_len - buf_pos ? left : buf_len - buf_pos);
+            page_pool->getFillPages (&page_list, ConstMemory (buf + buf_pos, len));
+            offset += len;
+            left -= len;
+        }
+    }
+
+    ++track->pos;
+
+    if (track->is_audio) {
+        VideoStream::AudioMessage * const audio_msg = &ret_frame->audio_msg;
+        *audio_msg = VideoStream::AudioMessage ();
+        audio_msg->codec_id = VideoStream::AudioCodecId::AAC;
+        audio_msg->frame_type = VideoStream::AudioFrameType::RawData;
+        audio_msg->rate = track->rate;
+        audio_msg->channels = track->channels;
+
+        ret_frame->is_audio = true;
+    } else {
+        VideoStream::VideoMessage * const video_msg = &ret_frame->video_msg;
+        *video_msg = VideoStream::VideoMessage ();
+        video_msg->codec_id = VideoStream::VideoCodecId::AVC;
+        video_msg->frame_type = (sample->is_sync ? VideoStream::VideoFrameType::KeyFrame
+                                                 : VideoStream::VideoFrameType::InterFrame);
+
+        ret_frame->is_audio = false;
+    }
+
+    VideoStream::Message * const msg = ret_frame->getMessage ();
+    msg->timestamp_nanosec = sample->timestamp_millisec * 1000000;
+    msg->page_pool = page_pool;
+    msg->page_list = page_list;
+    msg->msg_offset = 0;
+    msg->msg_len = sample->size;
+
+    ret_frame->timestamp_millisec = sample->timestamp_millisec;
+    ret_frame->file_len = sample->size;
+
+    return IoResult::Normal;
+}
+
+mt_throws IoResult
+Mp4FileReader::readFrame (Frame * const mt_nonnull ret_frame)
+{
+    assert (fd != -1);
+
+    if (popQueuedFrame (ret_frame))
+        return IoResult::Normal;
+
+    // Tracks are merged by timestamp.
+    Track *track = NULL;
+    if (video_track.valid && video_track.pos < video_track.num_samples)
+        track = &video_track;
+
+    if (audio_track.valid && audio_track.pos < audio_track.num_samples) {
+        if (!track
+            || audio_track.samples [audio_track.pos].timestamp_millisec
+                       < track->samples [track->pos].timestamp_millisec)
+        {
+            track = &audio_track;
+        }
+    }
+
+    if (!track)
+        return IoResult::Eof;
+
+    return readSample (track, ret_frame);
+}
+
+mt_throws Result
+Mp4FileReader::seek (Time const timestamp_millisec)
+{
+    if (fd == -1) {
+        exc_throw (InternalException, InternalException::IncorrectUsage);
+        return Result::Failure;
+    }
+
+    releaseQueuedFrames ();
+
+    Uint64 start_millisec = timestamp_millisec;
+    if (video_track.valid) {
+        Track * const track = &video_track;
+        Count pos = 0;
+        if (track->sync_samples) {
+            // Last sync sample with timestamp <= timestamp_millisec.
+            Count left = 0;
+            Count right = track->num_sync_samples;
+            while (left < right) {
+                Count const middle = left + (right - left) / 2;
+                if (track->samples [track->sync_samples [middle]].timestamp_millisec <= timestamp_millisec)
+                    left = middle + 1;
+                else
+                    right = middle;
+            }
+
+            if (left > 0)
+                pos = track->sync_samples [left - 1];
+            else
+            if (track->num_sync_samples > 0)
+                pos = track->sync_samples [0];
+        } else {
+            Count const num = countSamplesNotLater (track->samples, track->num_samples, timestamp_millisec);
+            if (num > 0)
+                pos = num - 1;
+        }
+
+        track->pos = pos;
+        if (pos < track->num_samples)
+            start_millisec = track->samples [pos].timestamp_millisec;
+    }
+
+    if (audio_track.valid) {
+        Track * const track = &audio_track;
+        if (video_track.valid) {
+            track->pos = findFirstSampleNotEarlier (track->samples, track->num_samples, start_millisec);
+        } else {
+            Count const num = countSamplesNotLater (track->samples, track->num_samples, timestamp_millisec);
+            track->pos = (num > 0 ? num - 1 : 0);
+        }
+    }
+
+    queueCodecHeaders ();
+
+    return Result::Success;
+}
+
+mt_throws Result
+Mp4FileReader::open (ConstMemory const filename)
+{
+    close ();
+
+    fd = ::open (String (filename).cstr(), O_RDONLY);
+    if (fd == -1) {
+        exc_throw (PosixException, errno);
+        return Result::Failure;
+    }
+
+    struct stat stat_buf;
+    if (fstat (fd, &stat_buf) == -1) {
+        exc_throw (PosixException, errno);
+        close ();
+        return Result::Failure;
+    }
+    Uint64 const file_size = (Uint64) stat_buf.st_size;
+
+    if (!initFileKey (fd)) {
+        close ();
+        return Result::Failure;
+    }
+
+    // Top-level boxes are walked with a read per box header.
+    bool   got_moov = false;
+    Uint64 moov_offset = 0;
+    Uint64 moov_len = 0;
+    {
+        Uint64 pos = 0;
+        while (file_size - pos >= 8) {
+            Byte hdr [16];
+            Size nread = 0;
+            if (!FileReadCache::readFull (fd, Memory::forObject (hdr), pos, &nread)) {
+                close ();
+                return Result::Failure;
+            }
+
+            if (nread < 8)
+                break;
+
+            Uint64 size = readBe32 (hdr);
+            Uint64 hdr_len = 8;
+            if (size == 1) {
+                if (nread < 16)
+                    break;
+
+                size = readBe64 (hdr + 8);
+                hdr_len = 16;
+            } else
+            if (size == 0) {
+                size = file_size - pos;
+            }
+
+            if (size < hdr_len || size > file_size - pos)
+                break;
+
+            if (!memcmp (hdr + 4, "moov", 4)) {
+                got_moov = true;
+                moov_offset = pos + hdr_len;
+                moov_len = size - hdr_len;
+                break;
+            }
+
+            pos += size;
+        }
+    }
+
+    if (!got_moov || moov_len > MaxMoovSize) {
+        logE (mp4read, _func, (got_moov ? "moov box is too large: " : "no moov box: "), filename);
+        close ();
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    {
+        Byte * const moov = new (std::nothrow) Byte [moov_len ? moov_len : 1];
+        assert (moov);
+
+        Size nread = 0;
+        Result res = FileReadCache::readFull (fd, Memory (moov, moov_len), moov_offset, &nread);
+        if (res && nread < moov_len) {
+            exc_throw (InternalException, InternalException::BadInput);
+            res = Result::Failure;
+        }
+
+        if (res)
+            res = parseMoov (ConstMemory (moov, moov_len));
+
+        delete[] moov;
+
+        if (!res) {
+            close ();
+            return Result::Failure;
+        }
+    }
+
+    if (!video_track.valid && !audio_track.valid) {
+        logE (mp4read, _func, "no AVC or AAC tracks: ", filename);
+        close ();
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
+
+    if (duration_millisec == 0) {
+        for (unsigned i = 0; i < 2; ++i) {
+            Track const * const track = (i == 0 ? &video_track : &audio_track);
+            if (track->valid
+                && track->num_samples > 0
+                && track->samples [track->num_samples - 1].timestamp_millisec > duration_millisec)
+            {
+                duration_millisec = track->samples [track->num_samples - 1].timestamp_millisec;
+            }
+        }
+    }
+
+    logD (mp4read, _func, filename, ": "
+          "video samples: ", video_track.num_samples, ", "
+          "audio samples: ", audio_track.num_samples, ", "
+          "duration: ", duration_millisec);
+
+    queueCodecHeaders ();
+
+    return Result::Success;
+}
+
+void
+Mp4FileReader::close ()
+{
+    releaseQueuedFrames ();
+    video_track.release ();
+    audio_track.release ();
+    duration_millisec = 0;
+
+    if (fd != -1) {
+        if (::close (fd) == -1)
+            logE (mp4read, _func, "close() failed: ", errnoString (errno));
+
+        fd = -1;
+    }
+
+    buf_len = 0;
+    buf_offset = 0;
+}
+
+Mp4FileReader::Mp4FileReader ()
+    : fd         (-1),
+      buf        (NULL),
+      buf_len    (0),
+      buf_offset (0),
+      duration_millisec (0)
+{
+    buf = new (std::nothrow) Byte [ReadAheadSize];
+    assert (buf);
+}
+
+Mp4FileReader::~Mp4FileReader ()
+{
+    close ();
+    delete[] buf;
+}
+
+}
+
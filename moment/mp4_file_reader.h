@@ -0,0 +1,130 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__MP4_FILE_READER__H__
+#define MOMENT__MP4_FILE_READER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/media_reader.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Reader for non-fragmented MP4 files with one AVC video track and/or one AAC
+// audio track. Sample tables of the 'moov' box are parsed once by open() into
+// flat per-track arrays, so that seek() is a binary search over sync samples.
+// Sample data is read with pread() in large blocks. AVC and AAC sequence
+// headers are made of 'avcC' and 'esds' contents.
+//
+// Composition time offsets ('ctts') and edit lists are ignored.
+//
+mt_unsafe class Mp4FileReader : public MediaReader
+{
+public:
+    enum {
+        ReadAheadSize = 1 << 18
+    };
+
+    struct Sample
+    {
+        Uint64 offset;
+        Uint64 timestamp_millisec;
+        Uint32 size;
+        bool   is_sync;
+    };
+
+private:
+    struct Track
+    {
+        bool    valid;
+        bool    is_audio;
+        Uint32  timescale;
+
+        Sample *samples;
+        Count   num_samples;
+        // Index of the next sample to be read.
+        Count   pos;
+
+        // Indexes of sync samples in ascending order, from 'stss'.
+        // NULL if every sample is a sync sample.
+        Count  *sync_samples;
+        Count   num_sync_samples;
+
+        // AVCDecoderConfigurationRecord or AudioSpecificConfig.
+        Byte   *codec_config;
+        Size    codec_config_len;
+
+        Uint32  rate;
+        Uint32  channels;
+
+        void release ();
+
+        Track ();
+    };
+
+    int fd;
+
+    Byte  *buf;
+    Size   buf_len;
+    // File offset of buf [0].
+    Uint64 buf_offset;
+
+    Track video_track;
+    Track audio_track;
+
+    Uint64 duration_millisec;
+
+    mt_throws Result parseMoov (ConstMemory moov);
+
+    mt_throws Result parseTrak (ConstMemory trak);
+
+    mt_throws Result parseStbl (ConstMemory  stbl,
+                                Track       * mt_nonnull track);
+
+    mt_throws IoResult readSample (Track * mt_nonnull track,
+                                   Frame * mt_nonnull ret_frame);
+
+    void queueCodecHeaders ();
+
+public:
+  mt_iface (MediaReader)
+    mt_throws Result open (ConstMemory filename);
+
+    void close ();
+
+    mt_throws Result seek (Time timestamp_millisec);
+
+    mt_throws IoResult readFrame (Frame * mt_nonnull ret_frame);
+
+    Time getDurationMillisec () { return duration_millisec; }
+  mt_iface_end
+
+     Mp4FileReader ();
+    ~Mp4FileReader ();
+};
+
+}
+
+
+#endif /* MOMENT__MP4_FILE_READER__H__ */
+
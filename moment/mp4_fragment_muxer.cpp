@@ -0,0 +1,895 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/rtmp_connection.h>
+
+#include <moment/mp4_fragment_muxer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_mp4frag ("moment.mp4frag", LogLevel::I);
+
+static Uint32 const aac_sampling_rates [] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+// ES_Descriptor lengths are written as single bytes.
+static Size const max_aac_config_len = 100;
+
+static Byte*
+putUint16Be (Byte   *p,
+             Uint32  const value)
+{
+    p [0] = (Byte) ((value >> 8) & 0xff);
+    p [1] = (Byte) ((value >> 0) & 0xff);
+    return p + 2;
+}
+
+static Byte*
+putUint32Be (Byte   *p,
+             Uint32  const value)
+{
+    p [0] = (Byte) ((value >> 24) & 0xff);
+    p [1] = (Byte) ((value >> 16) & 0xff);
+    p [2] = (Byte) ((value >>  8) & 0xff);
+    p [3] = (Byte) ((value >>  0) & 0xff);
+    return p + 4;
+}
+
+static Byte*
+putUint64Be (Byte   *p,
+             Uint64  const value)
+{
+    p = putUint32Be (p, (Uint32) (value >> 32));
+    return putUint32Be (p, (Uint32) value);
+}
+
+static Byte*
+putFourcc (Byte       *p,
+           char const * const fourcc)
+{
+    memcpy (p, fourcc, 4);
+    return p + 4;
+}
+
+static Byte*
+putZeros (Byte *p,
+          Size  const len)
+{
+    memset (p, 0, len);
+    return p + len;
+}
+
+static Byte*
+putBoxHeader (Byte       *p,
+              Size        const box_len,
+              char const * const type)
+{
+    p = putUint32Be (p, (Uint32) box_len);
+    return putFourcc (p, type);
+}
+
+// Box size is filled in by endBox().
+static Byte*
+beginBox (Byte       *p,
+          char const * const type)
+{
+    return putBoxHeader (p, 0, type);
+}
+
+static void
+endBox (Byte * const box,
+        Byte * const end)
+{
+    putUint32Be (box, (Uint32) (end - box));
+}
+
+static Byte*
+putUnityMatrix (Byte *p)
+{
+    p = putUint32Be (p, 0x00010000);
+    p = putZeros (p, 12);
+    p = putUint32Be (p, 0x00010000);
+    p = putZeros (p, 12);
+    return putUint32Be (p, 0x40000000);
+}
+
+static Ref<String>
+copyMessageData (VideoStream::Message * const mt_nonnull msg,
+                 PagePool             * const mt_nonnull page_pool)
+{
+    Ref<String> const data = grab (new (std::nothrow) String (msg->msg_len));
+
+    if (msg->prechunk_size == 0) {
+        PagePool::PageListArray pl_array (msg->page_list.first, msg->msg_offset, msg->msg_len);
+        pl_array.get (0, data->mem());
+    } else {
+        PagePool *norm_page_pool;
+        PagePool::PageListHead norm_page_list;
+        Size norm_msg_offs;
+        RtmpConnection::normalizePrechunkedData (msg,
+                                                 page_pool,
+                                                 &norm_page_pool,
+                                                 &norm_page_list,
+                                                 &norm_msg_offs);
+
+        PagePool::PageListArray pl_array (norm_page_list.first, norm_msg_offs, msg->msg_len);
+        pl_array.get (0, data->mem());
+
+        norm_page_pool->msgUnref (norm_page_list.first);
+    }
+
+    return data;
+}
+
+void
+Mp4FragmentMuxer::Track::releaseSamples ()
+{
+    List<Sample>::iter iter (samples);
+    while (!samples.iter_done (iter)) {
+        Sample * const sample = &samples.iter_next (iter)->data;
+        sample->page_pool->msgUnref (sample->first_page);
+    }
+
+    samples.clear ();
+    num_samples = 0;
+    data_len = 0;
+}
+
+Mp4FragmentMuxer::Track::~Track ()
+{
+    releaseSamples ();
+}
+
+void
+Mp4FragmentMuxer::sendData (ConstMemory const mem,
+                            bool        const do_flush)
+{
+    Sender::MessageEntry_Pages * const msg_pages =
+            Sender::MessageEntry_Pages::createNew (mem.len());
+
+    memcpy (msg_pages->getHeaderData(), mem.mem(), mem.len());
+    msg_pages->header_len = mem.len();
+
+    msg_pages->page_pool = NULL;
+    msg_pages->setFirstPage (NULL);
+    msg_pages->msg_offset = 0;
+
+    sender->sendMessage (msg_pages, do_flush);
+
+    file_pos += mem.len();
+}
+
+Byte*
+Mp4FragmentMuxer::fillTrak (Byte  *p,
+                            Track * const mt_nonnull track,
+                            bool    const is_video)
+{
+    Byte * const trak = p;
+    p = beginBox (p, "trak");
+    {
+        Byte * const tkhd = p;
+        p = beginBox (p, "tkhd");
+        p = putUint32Be (p, 0x000003 /* version 0, track enabled and in movie */);
+        p = putUint32Be (p, 0 /* creation time */);
+        p = putUint32Be (p, 0 /* modification time */);
+        p = putUint32Be (p, track->track_id);
+        p = putUint32Be (p, 0 /* reserved */);
+        p = putUint32Be (p, 0 /* duration */);
+        p = putZeros    (p, 8 /* reserved */);
+        p = putUint16Be (p, 0 /* layer */);
+        p = putUint16Be (p, 0 /* alternate group */);
+        p = putUint16Be (p, is_video ? 0 : 0x0100 /* volume */);
+        p = putUint16Be (p, 0 /* reserved */);
+        p = putUnityMatrix (p);
+        // Players take picture dimensions from the SPS.
+        p = putUint32Be (p, 0 /* width */);
+        p = putUint32Be (p, 0 /* height */);
+        endBox (tkhd, p);
+    }
+
+    Byte * const mdia = p;
+    p = beginBox (p, "mdia");
+    {
+        Byte * const mdhd = p;
+        p = beginBox (p, "mdhd");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, 0 /* creation time */);
+        p = putUint32Be (p, 0 /* modification time */);
+        p = putUint32Be (p, 1000 /* timescale */);
+        p = putUint32Be (p, 0 /* duration */);
+        p = putUint16Be (p, 0x55c4 /* language: "und" */);
+        p = putUint16Be (p, 0 /* pre-defined */);
+        endBox (mdhd, p);
+    }
+    {
+        ConstMemory const handler_name = (is_video ? ConstMemory ("VideoHandler") : ConstMemory ("SoundHandler"));
+
+        Byte * const hdlr = p;
+        p = beginBox (p, "hdlr");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, 0 /* pre-defined */);
+        p = putFourcc   (p, is_video ? "vide" : "soun");
+        p = putZeros    (p, 12 /* reserved */);
+        memcpy (p, handler_name.mem(), handler_name.len());
+        p += handler_name.len();
+        *p++ = 0;
+        endBox (hdlr, p);
+    }
+
+    Byte * const minf = p;
+    p = beginBox (p, "minf");
+    if (is_video) {
+        Byte * const vmhd = p;
+        p = beginBox (p, "vmhd");
+        p = putUint32Be (p, 0x000001 /* version 0, flags */);
+        p = putZeros    (p, 8 /* graphics mode, opcolor */);
+        endBox (vmhd, p);
+    } else {
+        Byte * const smhd = p;
+        p = beginBox (p, "smhd");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putZeros    (p, 4 /* balance, reserved */);
+        endBox (smhd, p);
+    }
+    {
+        Byte * const dinf = p;
+        p = beginBox (p, "dinf");
+        Byte * const dref = p;
+        p = beginBox (p, "dref");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, 1 /* entry count */);
+        p = putBoxHeader (p, 12, "url ");
+        p = putUint32Be (p, 0x000001 /* self-contained */);
+        endBox (dref, p);
+        endBox (dinf, p);
+    }
+
+    Byte * const stbl = p;
+    p = beginBox (p, "stbl");
+    {
+        Byte * const stsd = p;
+        p = beginBox (p, "stsd");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, 1 /* entry count */);
+
+        ConstMemory const config = track->config->mem();
+        if (is_video) {
+            Byte * const avc1 = p;
+            p = beginBox (p, "avc1");
+            p = putZeros    (p, 6 /* reserved */);
+            p = putUint16Be (p, 1 /* data reference index */);
+            p = putZeros    (p, 16 /* pre-defined, reserved */);
+            p = putUint16Be (p, 0 /* width */);
+            p = putUint16Be (p, 0 /* height */);
+            p = putUint32Be (p, 0x00480000 /* 72 dpi */);
+            p = putUint32Be (p, 0x00480000 /* 72 dpi */);
+            p = putUint32Be (p, 0 /* reserved */);
+            p = putUint16Be (p, 1 /* frame count */);
+            p = putZeros    (p, 32 /* compressor name */);
+            p = putUint16Be (p, 0x0018 /* depth */);
+            p = putUint16Be (p, 0xffff /* pre-defined */);
+
+            p = putBoxHeader (p, 8 + config.len(), "avcC");
+            memcpy (p, config.mem(), config.len());
+            p += config.len();
+            endBox (avc1, p);
+        } else {
+            Byte * const mp4a = p;
+            p = beginBox (p, "mp4a");
+            p = putZeros    (p, 6 /* reserved */);
+            p = putUint16Be (p, 1 /* data reference index */);
+            p = putZeros    (p, 8 /* reserved */);
+            p = putUint16Be (p, audio_channels);
+            p = putUint16Be (p, 16 /* sample size */);
+            p = putZeros    (p, 4 /* pre-defined, reserved */);
+            p = putUint32Be (p, (audio_rate & 0xffff) << 16);
+
+            Byte * const esds = p;
+            p = beginBox (p, "esds");
+            p = putUint32Be (p, 0 /* version, flags */);
+
+            *p++ = 0x03 /* ES_Descriptor */;
+            *p++ = (Byte) (23 + config.len());
+            p = putUint16Be (p, 0 /* ES_ID */);
+            *p++ = 0 /* flags */;
+
+            *p++ = 0x04 /* DecoderConfigDescriptor */;
+            *p++ = (Byte) (15 + config.len());
+            *p++ = 0x40 /* ISO/IEC 14496-3 audio */;
+            *p++ = 0x15 /* audio stream */;
+            p = putZeros    (p, 3 /* buffer size */);
+            p = putUint32Be (p, 0 /* max bitrate */);
+            p = putUint32Be (p, 0 /* avg bitrate */);
+
+            *p++ = 0x05 /* DecoderSpecificInfo */;
+            *p++ = (Byte) config.len();
+            memcpy (p, config.mem(), config.len());
+            p += config.len();
+
+            *p++ = 0x06 /* SLConfigDescriptor */;
+            *p++ = 0x01;
+            *p++ = 0x02;
+
+            endBox (esds, p);
+            endBox (mp4a, p);
+        }
+
+        endBox (stsd, p);
+    }
+    // Sample tables are empty, samples are described in fragments.
+    p = putBoxHeader (p, 16, "stts");
+    p = putZeros (p, 8 /* version, flags, entry count */);
+    p = putBoxHeader (p, 16, "stsc");
+    p = putZeros (p, 8 /* version, flags, entry count */);
+    p = putBoxHeader (p, 20, "stsz");
+    p = putZeros (p, 12 /* version, flags, sample size, sample count */);
+    p = putBoxHeader (p, 16, "stco");
+    p = putZeros (p, 8 /* version, flags, entry count */);
+    endBox (stbl, p);
+
+    endBox (minf, p);
+    endBox (mdia, p);
+    endBox (trak, p);
+
+    return p;
+}
+
+// Fills ftyp and moov boxes.
+Size
+Mp4FragmentMuxer::fillMoov (Byte * const mt_nonnull buf)
+{
+    Byte *p = buf;
+
+    {
+        Byte * const ftyp = p;
+        p = beginBox (p, "ftyp");
+        p = putFourcc   (p, "isom");
+        p = putUint32Be (p, 0x200 /* minor version */);
+        p = putFourcc   (p, "isom");
+        p = putFourcc   (p, "iso2");
+        p = putFourcc   (p, "iso6");
+        p = putFourcc   (p, "avc1");
+        p = putFourcc   (p, "mp41");
+        endBox (ftyp, p);
+    }
+
+    Byte * const moov = p;
+    p = beginBox (p, "moov");
+    {
+        Byte * const mvhd = p;
+        p = beginBox (p, "mvhd");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, 0 /* creation time */);
+        p = putUint32Be (p, 0 /* modification time */);
+        p = putUint32Be (p, 1000 /* timescale */);
+        p = putUint32Be (p, 0 /* duration */);
+        p = putUint32Be (p, 0x00010000 /* rate */);
+        p = putUint16Be (p, 0x0100 /* volume */);
+        p = putZeros    (p, 10 /* reserved */);
+        p = putUnityMatrix (p);
+        p = putZeros    (p, 24 /* pre-defined */);
+        p = putUint32Be (p, 3 /* next track id */);
+        endBox (mvhd, p);
+    }
+
+    if (video_track.enabled)
+        p = fillTrak (p, &video_track, true /* is_video */);
+
+    if (audio_track.enabled)
+        p = fillTrak (p, &audio_track, false /* is_video */);
+
+    {
+        Byte * const mvex = p;
+        p = beginBox (p, "mvex");
+
+        Track * const tracks [] = { &video_track, &audio_track };
+        for (unsigned i = 0; i < sizeof (tracks) / sizeof (tracks [0]); ++i) {
+            if (!tracks [i]->enabled)
+                continue;
+
+            p = putBoxHeader (p, 32, "trex");
+            p = putUint32Be (p, 0 /* version, flags */);
+            p = putUint32Be (p, tracks [i]->track_id);
+            p = putUint32Be (p, 1 /* default sample description index */);
+            p = putUint32Be (p, 0 /* default sample duration */);
+            p = putUint32Be (p, 0 /* default sample size */);
+            p = putUint32Be (p, 0 /* default sample flags */);
+        }
+
+        endBox (mvex, p);
+    }
+
+    endBox (moov, p);
+
+    return p - buf;
+}
+
+// Called on the first media frame, when codec configuration is known.
+void
+Mp4FragmentMuxer::writeMoov ()
+{
+    video_track.enabled = (video_track.config ? true : false);
+    audio_track.enabled = (audio_track.config ? true : false);
+
+    if (audio_track.enabled && audio_track.config->len() > max_aac_config_len) {
+        logE (mp4frag, _func, "AAC sequence header is too long (", audio_track.config->len(), " bytes), "
+              "skipping audio");
+        audio_track.enabled = false;
+    }
+
+    Size const max_len = 2048
+                         + (video_track.enabled ? video_track.config->len() : 0)
+                         + (audio_track.enabled ? audio_track.config->len() : 0);
+
+    Byte * const buf = new (std::nothrow) Byte [max_len];
+    assert (buf);
+
+    Size const len = fillMoov (buf);
+    assert (len <= max_len);
+
+    sendData (ConstMemory (buf, len), true /* do_flush */);
+    delete[] buf;
+
+    fragments_pos = file_pos;
+    got_moov = true;
+
+    if (faststart) {
+        index_muxer = new (std::nothrow) Mp4Muxer;
+        assert (index_muxer);
+        index_muxer->init (page_pool, 0 /* duration_millisec */);
+        if (index_spill_dir)
+            index_muxer->setSpill (index_spill_dir->mem(), index_spill_threshold);
+
+        // Mp4Muxer keeps its own references to codec configuration pages.
+        if (video_track.enabled) {
+            PagePool::PageListHead pages;
+            page_pool->getFillPages (&pages, video_track.config->mem());
+            index_muxer->pass1_avcSequenceHeader (page_pool, pages.first, 0 /* msg_offs */, video_track.config->len());
+            page_pool->msgUnref (pages.first);
+        }
+
+        if (audio_track.enabled) {
+            PagePool::PageListHead pages;
+            page_pool->getFillPages (&pages, audio_track.config->mem());
+            index_muxer->pass1_aacSequenceHeader (page_pool, pages.first, 0 /* msg_offs */, audio_track.config->len());
+            page_pool->msgUnref (pages.first);
+        }
+    }
+}
+
+Byte*
+Mp4FragmentMuxer::fillTraf (Byte  *p,
+                            Track * const mt_nonnull track,
+                            Size    const data_offset)
+{
+    Size const trun_len = 20 + 12 * track->num_samples;
+
+    p = putBoxHeader (p, 8 + 16 /* tfhd */ + 20 /* tfdt */ + trun_len, "traf");
+
+    p = putBoxHeader (p, 16, "tfhd");
+    p = putUint32Be (p, 0x020000 /* default-base-is-moof */);
+    p = putUint32Be (p, track->track_id);
+
+    p = putBoxHeader (p, 20, "tfdt");
+    p = putUint32Be (p, 0x01000000 /* version 1 */);
+    p = putUint64Be (p, track->samples.getFirst().timestamp_millisec);
+
+    p = putBoxHeader (p, trun_len, "trun");
+    p = putUint32Be (p, 0x000701 /* data offset, sample duration, size and flags present */);
+    p = putUint32Be (p, (Uint32) track->num_samples);
+    p = putUint32Be (p, (Uint32) data_offset);
+
+    // Duration of a sample is the distance to the next one. The last sample
+    // of a fragment gets the duration of the one before it, tfdt of
+    // the next fragment keeps the timeline exact.
+    Sample *prv_sample = NULL;
+    List<Sample>::iter iter (track->samples);
+    for (;;) {
+        Sample * const sample = (!track->samples.iter_done (iter) ? &track->samples.iter_next (iter)->data : NULL);
+        if (prv_sample) {
+            if (sample) {
+                track->last_duration_millisec =
+                        (sample->timestamp_millisec > prv_sample->timestamp_millisec ?
+                                 sample->timestamp_millisec - prv_sample->timestamp_millisec : 0);
+            }
+
+            p = putUint32Be (p, (Uint32) track->last_duration_millisec);
+            p = putUint32Be (p, (Uint32) prv_sample->len);
+            p = putUint32Be (p, prv_sample->is_sync_sample ? 0x02000000 /* depends on no other samples */
+                                                           : 0x01010000 /* non-sync sample */);
+        }
+
+        if (!sample)
+            break;
+
+        prv_sample = sample;
+    }
+
+    return p;
+}
+
+void
+Mp4FragmentMuxer::flushFragment ()
+{
+    if (video_track.num_samples == 0 && audio_track.num_samples == 0)
+        return;
+
+    Size moof_len = 8 + 16 /* mfhd */;
+    if (video_track.num_samples > 0)
+        moof_len += 8 + 16 + 20 + 20 + 12 * video_track.num_samples;
+    if (audio_track.num_samples > 0)
+        moof_len += 8 + 16 + 20 + 20 + 12 * audio_track.num_samples;
+
+    Size const hdr_len = moof_len + 8 /* mdat header */;
+    Size const mdat_payload_len = video_track.data_len + audio_track.data_len;
+
+    {
+        Sender::MessageEntry_Pages * const msg_pages =
+                Sender::MessageEntry_Pages::createNew (hdr_len);
+
+        Byte * const hdr = msg_pages->getHeaderData();
+        Byte *p = hdr;
+
+        p = putBoxHeader (p, moof_len, "moof");
+        p = putBoxHeader (p, 16, "mfhd");
+        p = putUint32Be (p, 0 /* version, flags */);
+        p = putUint32Be (p, fragment_seq);
+
+        // Video samples go first in mdat, followed by audio samples.
+        Size data_offset = hdr_len;
+        if (video_track.num_samples > 0) {
+            p = fillTraf (p, &video_track, data_offset);
+            data_offset += video_track.data_len;
+        }
+        if (audio_track.num_samples > 0)
+            p = fillTraf (p, &audio_track, data_offset);
+
+        p = putBoxHeader (p, 8 + mdat_payload_len, "mdat");
+        assert (p == hdr + hdr_len);
+
+        msg_pages->header_len = hdr_len;
+
+        msg_pages->page_pool = NULL;
+        msg_pages->setFirstPage (NULL);
+        msg_pages->msg_offset = 0;
+
+        sender->sendMessage (msg_pages, false /* do_flush */);
+        file_pos += hdr_len;
+    }
+
+    Track * const tracks [] = { &video_track, &audio_track };
+    for (unsigned i = 0; i < sizeof (tracks) / sizeof (tracks [0]); ++i) {
+        Track * const track = tracks [i];
+
+        List<Sample>::iter iter (track->samples);
+        while (!track->samples.iter_done (iter)) {
+            Sample * const sample = &track->samples.iter_next (iter)->data;
+
+            if (index_muxer) {
+                index_muxer->pass1_frameAt (track == &video_track ? Mp4Muxer::FrameType_Video
+                                                                  : Mp4Muxer::FrameType_Audio,
+                                            sample->timestamp_millisec * 1000000,
+                                            sample->len,
+                                            sample->is_sync_sample,
+                                            file_pos - fragments_pos);
+            }
+
+            // The reference to sample's pages is passed to the sender.
+            Sender::MessageEntry_Pages * const msg_pages =
+                    Sender::MessageEntry_Pages::createNew (0 /* max_header_len */);
+            msg_pages->header_len = 0;
+
+            msg_pages->page_pool  = sample->page_pool;
+            msg_pages->setFirstPage (sample->first_page);
+            msg_pages->msg_offset = sample->msg_offset;
+
+            sender->sendMessage (msg_pages, false /* do_flush */);
+            file_pos += sample->len;
+        }
+
+        track->samples.clear ();
+        track->num_samples = 0;
+        track->data_len = 0;
+    }
+
+    sender->flush ();
+
+    logD (mp4frag, _func, "fragment ", fragment_seq, ": ", hdr_len + mdat_payload_len, " bytes");
+    ++fragment_seq;
+}
+
+void
+Mp4FragmentMuxer::addSample (Track                * const mt_nonnull track,
+                             VideoStream::Message * const mt_nonnull msg,
+                             bool                   const is_sync_sample)
+{
+    Uint64 const timestamp_millisec = msg->timestamp_nanosec / 1000000;
+
+    if (video_track.num_samples == 0 && audio_track.num_samples == 0)
+        fragment_start_millisec = timestamp_millisec;
+
+    Sample * const sample = &track->samples.appendEmpty()->data;
+
+    if (msg->prechunk_size == 0) {
+        sample->page_pool  = msg->page_pool;
+        sample->first_page = msg->page_list.first;
+        sample->msg_offset = msg->msg_offset;
+
+        msg->page_pool->msgRef (msg->page_list.first);
+    } else {
+        PagePool::PageListHead norm_page_list;
+        RtmpConnection::normalizePrechunkedData (msg,
+                                                 page_pool,
+                                                 &sample->page_pool,
+                                                 &norm_page_list,
+                                                 &sample->msg_offset);
+        sample->first_page = norm_page_list.first;
+    }
+
+    sample->len = msg->msg_len;
+    sample->timestamp_millisec = timestamp_millisec;
+    sample->is_sync_sample = is_sync_sample;
+
+    ++track->num_samples;
+    track->data_len += msg->msg_len;
+    track->last_timestamp_millisec = timestamp_millisec;
+}
+
+void
+Mp4FragmentMuxer::releaseIndexMuxer ()
+{
+    if (index_muxer) {
+        delete index_muxer;
+        index_muxer = NULL;
+    }
+}
+
+mt_throws Result
+Mp4FragmentMuxer::beginMuxing ()
+{
+    video_track.releaseSamples ();
+    video_track.config = NULL;
+    video_track.enabled = false;
+    video_track.last_timestamp_millisec = 0;
+    video_track.last_duration_millisec = 0;
+
+    audio_track.releaseSamples ();
+    audio_track.config = NULL;
+    audio_track.enabled = false;
+    audio_track.last_timestamp_millisec = 0;
+    audio_track.last_duration_millisec = 0;
+
+    audio_rate = 44100;
+    audio_channels = 2;
+
+    got_moov = false;
+    file_pos = 0;
+    fragments_pos = 0;
+    fragment_seq = 1;
+    fragment_start_millisec = 0;
+
+    releaseIndexMuxer ();
+    index_failed = false;
+
+    // The moov is written once codec configuration is known.
+    return Result::Success;
+}
+
+mt_throws Result
+Mp4FragmentMuxer::muxAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg)
+{
+    logD (mp4frag, _func, "ts: 0x", fmt_hex, msg->timestamp_nanosec / 1000000);
+
+    if (msg->codec_id != VideoStream::AudioCodecId::AAC)
+        return Result::Success;
+
+    if (msg->frame_type == VideoStream::AudioFrameType::AacSequenceHeader) {
+        if (got_moov) {
+            logD (mp4frag, _func, "AAC sequence header after moov, ignoring");
+            return Result::Success;
+        }
+
+        audio_track.config = copyMessageData (msg, page_pool);
+
+        audio_rate = msg->rate;
+        audio_channels = msg->channels;
+
+        ConstMemory const config = audio_track.config->mem();
+        if (config.len() >= 2) {
+            unsigned const rate_idx = ((config.mem() [0] & 0x07) << 1) | (config.mem() [1] >> 7);
+            if (rate_idx < sizeof (aac_sampling_rates) / sizeof (aac_sampling_rates [0]))
+                audio_rate = aac_sampling_rates [rate_idx];
+
+            unsigned const channels = (config.mem() [1] >> 3) & 0x0f;
+            if (channels > 0)
+                audio_channels = channels;
+        }
+
+        return Result::Success;
+    }
+
+    if (!msg->frame_type.isAudioData())
+        return Result::Success;
+
+    if (!got_moov) {
+        // With video present, the file starts with a video keyframe.
+        if (video_track.config || !audio_track.config)
+            return Result::Success;
+
+        writeMoov ();
+    }
+
+    if (!audio_track.enabled)
+        return Result::Success;
+
+    if (!video_track.enabled
+        && audio_track.num_samples > 0
+        && msg->timestamp_nanosec / 1000000 >= fragment_start_millisec + fragment_duration_millisec)
+    {
+        flushFragment ();
+    }
+
+    addSample (&audio_track, msg, true /* is_sync_sample */);
+
+    return Result::Success;
+}
+
+mt_throws Result
+Mp4FragmentMuxer::muxVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg)
+{
+    logD (mp4frag, _func, "ts: 0x", fmt_hex, msg->timestamp_nanosec / 1000000);
+
+    if (msg->codec_id != VideoStream::VideoCodecId::AVC)
+        return Result::Success;
+
+    if (msg->frame_type == VideoStream::VideoFrameType::AvcSequenceHeader) {
+        if (got_moov) {
+            logD (mp4frag, _func, "AVC sequence header after moov, ignoring");
+            return Result::Success;
+        }
+
+        video_track.config = copyMessageData (msg, page_pool);
+        return Result::Success;
+    }
+
+    if (!msg->frame_type.isVideoData())
+        return Result::Success;
+
+    bool const is_keyframe = msg->frame_type.isKeyFrame();
+
+    if (!got_moov) {
+        if (!video_track.config || !is_keyframe)
+            return Result::Success;
+
+        writeMoov ();
+    }
+
+    if (!video_track.enabled)
+        return Result::Success;
+
+    if (is_keyframe
+        && (video_track.num_samples > 0 || audio_track.num_samples > 0)
+        && msg->timestamp_nanosec / 1000000 >= fragment_start_millisec + fragment_duration_millisec)
+    {
+        flushFragment ();
+    }
+
+    addSample (&video_track, msg, is_keyframe);
+
+    return Result::Success;
+}
+
+mt_throws Result
+Mp4FragmentMuxer::endMuxing ()
+{
+    flushFragment ();
+    releaseIndexMuxer ();
+
+    sender->closeAfterFlush ();
+
+    if (index_failed) {
+        exc_throw (InternalException, InternalException::BackendMalfunction);
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+void
+Mp4FragmentMuxer::reset ()
+{
+    video_track.releaseSamples ();
+    audio_track.releaseSamples ();
+}
+
+void
+Mp4FragmentMuxer::getFinalData (FinalData * const mt_nonnull ret_data)
+{
+    // Sample tables are complete only when the last fragment is written.
+    flushFragment ();
+
+    if (!index_muxer)
+        return;
+
+    Uint64 const data_len = file_pos - fragments_pos;
+
+    Uint64 duration_millisec = 0;
+    {
+        Track * const tracks [] = { &video_track, &audio_track };
+        for (unsigned i = 0; i < sizeof (tracks) / sizeof (tracks [0]); ++i) {
+            Uint64 const track_duration =
+                    tracks [i]->last_timestamp_millisec + tracks [i]->last_duration_millisec;
+            if (tracks [i]->enabled && track_duration > duration_millisec)
+                duration_millisec = track_duration;
+        }
+    }
+
+    PagePool::PageListHead pages;
+    if (!index_muxer->pass1_complete (duration_millisec, data_len, &pages)) {
+        logE (mp4frag, _func, "index_muxer->pass1_complete() failed: ", exc->toString());
+        index_failed = true;
+        releaseIndexMuxer ();
+        return;
+    }
+
+    Size const header_len = PagePool::countPageListDataLen (pages.first, 0 /* msg_offset */);
+
+    // ftyp + moov + mdat header. Fragments become mdat payload as they are.
+    ret_data->rewrite_header = grab (new (std::nothrow) String (header_len));
+    {
+        PagePool::PageListArray pl_array (pages.first, 0 /* offset */, header_len);
+        pl_array.get (0, ret_data->rewrite_header->mem());
+    }
+    page_pool->msgUnref (pages.first);
+
+    ret_data->rewrite_data_offset = fragments_pos;
+    ret_data->rewrite_data_len = data_len;
+
+    releaseIndexMuxer ();
+}
+
+Mp4FragmentMuxer::Mp4FragmentMuxer ()
+    : page_pool (NULL),
+      fragment_duration_millisec (1000),
+      faststart (false),
+      index_spill_threshold (0),
+      video_track (1 /* track_id */),
+      audio_track (2 /* track_id */),
+      audio_rate (44100),
+      audio_channels (2),
+      got_moov (false),
+      file_pos (0),
+      fragments_pos (0),
+      fragment_seq (1),
+      fragment_start_millisec (0),
+      index_muxer (NULL),
+      index_failed (false)
+{
+}
+
+Mp4FragmentMuxer::~Mp4FragmentMuxer ()
+{
+    releaseIndexMuxer ();
+}
+
+}
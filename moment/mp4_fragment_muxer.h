@@ -0,0 +1,177 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__MP4_FRAGMENT_MUXER__H__
+#define MOMENT__MP4_FRAGMENT_MUXER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/av_muxer.h>
+#include <moment/mp4_muxer.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Fragmented MP4 (AVC + AAC). The file begins with a moov box which describes
+// no samples, media data follows as a series of moof+mdat fragments, each
+// starting at a video keyframe. A file which has been cut short at any point
+// is playable up to the last complete fragment.
+//
+// With faststart enabled, sample tables for a regular moov are built with
+// Mp4Muxer while recording, and getFinalData() describes how to turn the file
+// into a non-fragmented one with the moov at the front. All fragments end up
+// inside a single mdat box as is, so only the new header has to be written.
+//
+mt_unsafe class Mp4FragmentMuxer : public AvMuxer
+{
+private:
+    struct Sample
+    {
+        PagePool       *page_pool;
+        PagePool::Page *first_page;
+        Size            msg_offset;
+        Size            len;
+        Uint64          timestamp_millisec;
+        bool            is_sync_sample;
+    };
+
+    struct Track
+    {
+        Uint32 track_id;
+
+        // Codec configuration: AVCDecoderConfigurationRecord for video,
+        // AudioSpecificConfig for audio.
+        Ref<String> config;
+
+        // Set when the moov has been written.
+        bool enabled;
+
+        // Samples of the current fragment.
+        List<Sample> samples;
+        Count        num_samples;
+        Size         data_len;
+
+        Uint64 last_timestamp_millisec;
+        Uint64 last_duration_millisec;
+
+        void releaseSamples ();
+
+        Track (Uint32 const track_id)
+            : track_id (track_id),
+              enabled (false),
+              num_samples (0),
+              data_len (0),
+              last_timestamp_millisec (0),
+              last_duration_millisec (0)
+        {}
+
+        ~Track ();
+    };
+
+    PagePool *page_pool;
+
+    mt_const Time fragment_duration_millisec;
+    mt_const bool faststart;
+
+    mt_const Ref<String> index_spill_dir;
+    mt_const Size        index_spill_threshold;
+
+    Track video_track;
+    Track audio_track;
+
+    Uint32 audio_rate;
+    Uint32 audio_channels;
+
+    bool   got_moov;
+    Uint64 file_pos;
+    // Position of the first fragment.
+    Uint64 fragments_pos;
+
+    Uint32 fragment_seq;
+    Uint64 fragment_start_millisec;
+
+    // Sample tables for faststart conversion.
+    Mp4Muxer *index_muxer;
+    // Set by getFinalData() if the faststart moov could not be built.
+    // The recording is left fragmented and endMuxing() fails.
+    bool index_failed;
+
+    void sendData (ConstMemory mem,
+                   bool        do_flush);
+
+    Byte* fillTrak (Byte  * mt_nonnull p,
+                    Track * mt_nonnull track,
+                    bool    is_video);
+
+    Size fillMoov (Byte * mt_nonnull buf);
+
+    void writeMoov ();
+
+    Byte* fillTraf (Byte  * mt_nonnull p,
+                    Track * mt_nonnull track,
+                    Size    data_offset);
+
+    void flushFragment ();
+
+    void addSample (Track                * mt_nonnull track,
+                    VideoStream::Message * mt_nonnull msg,
+                    bool                  is_sync_sample);
+
+    void releaseIndexMuxer ();
+
+public:
+    mt_throws Result beginMuxing ();
+    mt_throws Result endMuxing   ();
+
+    mt_throws Result muxAudioMessage (VideoStream::AudioMessage * mt_nonnull msg);
+    mt_throws Result muxVideoMessage (VideoStream::VideoMessage * mt_nonnull msg);
+
+    void reset ();
+
+    void getFinalData (FinalData * mt_nonnull ret_data);
+
+    void setPagePool (PagePool * const page_pool) { this->page_pool = page_pool; }
+
+    // A new fragment is started on the first video keyframe after
+    // 'fragment_duration_millisec' (on any frame for audio-only streams).
+    mt_const void setFragmentDuration (Time const fragment_duration_millisec)
+        { this->fragment_duration_millisec = fragment_duration_millisec; }
+
+    mt_const void setFaststart (bool const faststart)
+        { this->faststart = faststart; }
+
+    // See Mp4Muxer::setSpill().
+    mt_const void setIndexSpill (ConstMemory const spill_dir,
+                                 Size        const spill_threshold)
+    {
+        this->index_spill_dir = grab (new String (spill_dir));
+        this->index_spill_threshold = spill_threshold;
+    }
+
+     Mp4FragmentMuxer ();
+    ~Mp4FragmentMuxer ();
+};
+
+}
+
+
+#endif /* MOMENT__MP4_FRAGMENT_MUXER__H__ */
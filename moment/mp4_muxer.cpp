@@ -17,6 +17,11 @@
 */
 
 
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
 #include <moment/rtmp_connection.h>
 
 #include <moment/mp4_muxer.h>
@@ -28,35 +33,294 @@ namespace Moment {
 
 static LogGroup libMary_logGroup_mp4mux   ("moment.mp4mux", LogLevel::I);
 
+static mt_throws Result
+writeSpillData (int         const fd,
+                ConstMemory       mem,
+                Uint64            offset)
+{
+    while (mem.len() > 0) {
+        ssize_t const res = pwrite (fd, mem.mem(), mem.len(), (off_t) offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            return Result::Failure;
+        }
+
+        mem = mem.region ((Size) res);
+        offset += (Uint64) res;
+    }
+
+    return Result::Success;
+}
+
+static mt_throws Result
+readSpillData (int    const fd,
+               Memory       mem,
+               Uint64       offset)
+{
+    while (mem.len() > 0) {
+        ssize_t const res = pread (fd, mem.mem(), mem.len(), (off_t) offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            return Result::Failure;
+        }
+
+        if (res == 0) {
+            exc_throw (InternalException, InternalException::BackendMalfunction);
+            return Result::Failure;
+        }
+
+        mem = mem.region ((Size) res);
+        offset += (Uint64) res;
+    }
+
+    return Result::Success;
+}
+
+bool
+Mp4Muxer::openSpillFile ()
+{
+    Ref<String> const filename = makeString (spill_dir, "/moment_mp4_index_XXXXXX");
+    int const fd = mkstemp (const_cast <char*> (filename->cstr()));
+    if (fd == -1) {
+        logE (mp4mux, _func, "mkstemp() failed for ", filename->mem(), ": ", errnoString (errno));
+        return false;
+    }
+
+    // The file is only accessed through the descriptor.
+    unlink (filename->cstr());
+
+    spill_fd = fd;
+    spill_pos = 0;
+    return true;
+}
+
 void
-Mp4Muxer::patchTrackStco (TrackInfo * const mt_nonnull track,
-                          Uint32      const offset)
+Mp4Muxer::spillTable (Table * const mt_nonnull table)
 {
-    PagePool::PageListArray stco_arr (track->stco_pages.first, 0 /* offset*/, track->stco_pos /* data_len */);
-    Byte stco_entry [4];
-    for (Size i = 0; i < track->stco_pos; i += 4) {
-        stco_arr.get (i, Memory::forObject (stco_entry));
-
-        Uint32 const value = offset + (((Uint32) stco_entry [0] << 24) |
-                                       ((Uint32) stco_entry [1] << 16) |
-                                       ((Uint32) stco_entry [2] <<  8) |
-                                       ((Uint32) stco_entry [3] <<  0));
-        stco_entry [0] = (Byte) (value >> 24);
-        stco_entry [1] = (Byte) (value >> 16);
-        stco_entry [2] = (Byte) (value >>  8);
-        stco_entry [3] = (Byte) (value >>  0);
-        stco_arr.set (i, ConstMemory::forObject (stco_entry));
+    if (spill_failed)
+        return;
+
+    if (spill_fd == -1) {
+        if (!openSpillFile ()) {
+            spill_failed = true;
+            return;
+        }
     }
+
+    Uint64 const file_offset = spill_pos;
+    Uint64 pos = file_offset;
+    PagePool::Page *page = table->pages.first;
+    while (page) {
+        if (!writeSpillData (spill_fd, page->mem(), pos)) {
+            logE (mp4mux, _func, "could not write to spill file: ", exc->toString());
+            spill_failed = true;
+            return;
+        }
+
+        pos += page->data_len;
+        page = page->getNextMsgPage();
+    }
+
+    SpillExtent * const extent = &table->spilled.appendEmpty()->data;
+    extent->file_offset = file_offset;
+    extent->len = table->pos;
+
+    spill_pos = pos;
+
+    page_pool->msgUnref (table->pages.first);
+    table->pages.reset ();
+    table->pos = 0;
+}
+
+void
+Mp4Muxer::appendTableEntry (Table       * const mt_nonnull table,
+                            ConstMemory   const entry)
+{
+    page_pool->getFillPages (&table->pages, entry);
+    table->pos += entry.len();
+
+    if (spill_threshold && table->pos >= spill_threshold)
+        spillTable (table);
 }
 
-mt_sync_domain (pass1) PagePool::PageListHead
-Mp4Muxer::writeMoovAtom ()
+void
+Mp4Muxer::flushRleRun (RleTable * const mt_nonnull rle_table)
 {
-  // TODO Сжатие таблиц в stbl
+    if (rle_table->run_count == 0)
+        return;
+
+    Byte const entry [] = {
+        (Byte) (rle_table->run_count >> 24),
+        (Byte) (rle_table->run_count >> 16),
+        (Byte) (rle_table->run_count >>  8),
+        (Byte) (rle_table->run_count >>  0),
+        (Byte) (rle_table->run_value >> 24),
+        (Byte) (rle_table->run_value >> 16),
+        (Byte) (rle_table->run_value >>  8),
+        (Byte) (rle_table->run_value >>  0)
+    };
+    appendTableEntry (&rle_table->table, ConstMemory::forObject (entry));
+    ++rle_table->num_entries;
 
+    rle_table->run_count = 0;
+}
+
+void
+Mp4Muxer::addRleSample (RleTable * const mt_nonnull rle_table,
+                        Uint32     const value)
+{
+    if (rle_table->run_count > 0 && rle_table->run_value == value) {
+        ++rle_table->run_count;
+        return;
+    }
+
+    flushRleRun (rle_table);
+
+    rle_table->run_value = value;
+    rle_table->run_count = 1;
+}
+
+void
+Mp4Muxer::appendTableData (PagePool::PageListHead * const mt_nonnull pages,
+                           ConstMemory              const data,
+                           bool                     const chunk_offsets,
+                           Uint64                   const offset_delta,
+                           bool                     const co64)
+{
+    if (!chunk_offsets) {
+        page_pool->getFillPages (pages, data);
+        return;
+    }
+
+    Byte buf [4096];
+    Size buf_pos = 0;
+    for (Size i = 0; i + 8 <= data.len(); i += 8) {
+        Byte const * const entry = data.mem() + i;
+        Uint64 const value = offset_delta + (((Uint64) entry [0] << 56) |
+                                             ((Uint64) entry [1] << 48) |
+                                             ((Uint64) entry [2] << 40) |
+                                             ((Uint64) entry [3] << 32) |
+                                             ((Uint64) entry [4] << 24) |
+                                             ((Uint64) entry [5] << 16) |
+                                             ((Uint64) entry [6] <<  8) |
+                                             ((Uint64) entry [7] <<  0));
+        if (co64) {
+            buf [buf_pos + 0] = (Byte) (value >> 56);
+            buf [buf_pos + 1] = (Byte) (value >> 48);
+            buf [buf_pos + 2] = (Byte) (value >> 40);
+            buf [buf_pos + 3] = (Byte) (value >> 32);
+            buf_pos += 4;
+        }
+        buf [buf_pos + 0] = (Byte) (value >> 24);
+        buf [buf_pos + 1] = (Byte) (value >> 16);
+        buf [buf_pos + 2] = (Byte) (value >>  8);
+        buf [buf_pos + 3] = (Byte) (value >>  0);
+        buf_pos += 4;
+
+        if (buf_pos == sizeof (buf)) {
+            page_pool->getFillPages (pages, ConstMemory (buf, buf_pos));
+            buf_pos = 0;
+        }
+    }
+
+    if (buf_pos > 0)
+        page_pool->getFillPages (pages, ConstMemory (buf, buf_pos));
+}
+
+void
+Mp4Muxer::appendTable (Table                  * const mt_nonnull table,
+                       PagePool::PageListHead * const mt_nonnull pages,
+                       bool                     const chunk_offsets,
+                       Uint64                   const offset_delta,
+                       bool                     const co64)
+{
+    Byte buf [16384];
+
+    {
+        List<SpillExtent>::iter iter (table->spilled);
+        while (!table->spilled.iter_done (iter)) {
+            SpillExtent * const extent = &table->spilled.iter_next (iter)->data;
+
+            Size pos = 0;
+            while (pos < extent->len) {
+                Size const len = (extent->len - pos < sizeof (buf) ? extent->len - pos : sizeof (buf));
+                if (!readSpillData (spill_fd, Memory (buf, len), extent->file_offset + pos)) {
+                    logE (mp4mux, _func, "could not read from spill file: ", exc->toString());
+                    // Box sizes are kept consistent, the result is discarded
+                    // by writeMoovAtom().
+                    spill_read_failed = true;
+                    memset (buf, 0, len);
+                }
+
+                appendTableData (pages, ConstMemory (buf, len), chunk_offsets, offset_delta, co64);
+                pos += len;
+            }
+        }
+    }
+
+    if (!chunk_offsets) {
+        pages->appendList (&table->pages);
+        table->pages.reset ();
+    } else
+    if (table->pos > 0) {
+        PagePool::PageListArray arr (table->pages.first, 0 /* offset */, table->pos /* data_len */);
+        Size pos = 0;
+        while (pos < table->pos) {
+            Size const len = (table->pos - pos < sizeof (buf) ? table->pos - pos : sizeof (buf));
+            arr.get (pos, Memory (buf, len));
+            appendTableData (pages, ConstMemory (buf, len), true /* chunk_offsets */, offset_delta, co64);
+            pos += len;
+        }
+    }
+
+    releaseTable (table);
+}
+
+void
+Mp4Muxer::releaseTable (Table * const mt_nonnull table)
+{
+    page_pool->msgUnref (table->pages.first);
+    table->pages.reset ();
+    table->pos = 0;
+
+    table->spilled.clear ();
+}
+
+mt_sync_domain (pass1) mt_throws Result
+Mp4Muxer::writeMoovAtom (Uint64                   const mdat_payload_size,
+                         PagePool::PageListHead * const mt_nonnull ret_pages)
+{
     bool const got_audio = audio_track.num_frames > 0;
     bool const got_video = video_track.num_frames > 0;
 
+    bool const mdat_largesize = (mdat_payload_size + 8 > 0xffffffff);
+    Size const mdat_header_len = (mdat_largesize ? 16 : 8);
+
+    // Chunk offsets are written as 64-bit co64 entries if the last chunk may
+    // end up beyond 4 GB. The size of the moov is estimated from above here.
+    bool co64;
+    {
+        Uint64 moov_estimate = 4096 + audio_track.hdr_size + video_track.hdr_size;
+        TrackInfo * const tracks [] = { &audio_track, &video_track };
+        for (unsigned i = 0; i < sizeof (tracks) / sizeof (tracks [0]); ++i) {
+            moov_estimate += (Uint64) tracks [i]->num_frames * 12 /* stsz + co64 */
+                             + (Uint64) tracks [i]->num_stss_entries * 4
+                             + (Uint64) tracks [i]->stts.num_entries * 8
+                             + (Uint64) tracks [i]->ctts.num_entries * 8;
+        }
+
+        Uint64 const max_chunk_offset = (audio_track.max_chunk_offset > video_track.max_chunk_offset ?
+                                                 audio_track.max_chunk_offset : video_track.max_chunk_offset);
+        co64 = (0x20 /* ftyp */ + moov_estimate + mdat_header_len + max_chunk_offset > 0xffffffff);
+    }
+    Size const chunk_offset_len = (co64 ? 8 : 4);
+
     PagePool::PageListHead pages;
 
     // mac time - 2082844800 = unixtime
@@ -371,13 +635,17 @@ Mp4Muxer::writeMoovAtom ()
     };
 #endif
 
-    Size const audio_stco_size = 16 + audio_track.num_frames * 4;
-    Byte audio_stco_data [] = {
+    Size const audio_stco_size = 16 + audio_track.num_frames * chunk_offset_len;
+    // chunk offset atom
+    Byte const audio_stco_data [] = {
         (Byte) (audio_stco_size >> 24),
         (Byte) (audio_stco_size >> 16),
         (Byte) (audio_stco_size >>  8),
         (Byte) (audio_stco_size >>  0),
-         's',  't',  'c',  'o',
+        (Byte) (co64 ? 'c' : 's'),
+        (Byte) (co64 ? 'o' : 't'),
+        (Byte) (co64 ? '6' : 'c'),
+        (Byte) (co64 ? '4' : 'o'),
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
@@ -387,7 +655,7 @@ Mp4Muxer::writeMoovAtom ()
         (Byte) (audio_track.num_frames >>  0)
     };
 
-    Size const audio_stts_size = 16 + audio_track.num_frames * 8;
+    Size const audio_stts_size = 16 + audio_track.stts.num_entries * 8;
     // time-to-sample atom
     Byte audio_stts_data [] = {
         (Byte) (audio_stts_size >> 24),
@@ -398,10 +666,10 @@ Mp4Muxer::writeMoovAtom ()
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
-        (Byte) (audio_track.num_frames >> 24),
-        (Byte) (audio_track.num_frames >> 16),
-        (Byte) (audio_track.num_frames >>  8),
-        (Byte) (audio_track.num_frames >>  0)
+        (Byte) (audio_track.stts.num_entries >> 24),
+        (Byte) (audio_track.stts.num_entries >> 16),
+        (Byte) (audio_track.stts.num_entries >>  8),
+        (Byte) (audio_track.stts.num_entries >>  0)
     };
 
     Size const audio_stsz_size = 20 + audio_track.num_frames * 4;
@@ -423,7 +691,7 @@ Mp4Muxer::writeMoovAtom ()
         (Byte) (audio_track.num_frames >>  0)
     };
 
-    Size const audio_ctts_size = 16 + audio_track.num_frames * 8;
+    Size const audio_ctts_size = 16 + audio_track.ctts.num_entries * 8;
     // composition offset atom
     Byte const audio_ctts_data [] = {
         (Byte) (audio_ctts_size >> 24),
@@ -434,10 +702,10 @@ Mp4Muxer::writeMoovAtom ()
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
-        (Byte) (audio_track.num_frames >> 24),
-        (Byte) (audio_track.num_frames >> 16),
-        (Byte) (audio_track.num_frames >>  8),
-        (Byte) (audio_track.num_frames >>  0)
+        (Byte) (audio_track.ctts.num_entries >> 24),
+        (Byte) (audio_track.ctts.num_entries >> 16),
+        (Byte) (audio_track.ctts.num_entries >>  8),
+        (Byte) (audio_track.ctts.num_entries >>  0)
     };
 
     Byte video_trak_data [] = {
@@ -703,13 +971,17 @@ Mp4Muxer::writeMoovAtom ()
     };
 #endif
 
-    Size const video_stco_size = 16 + video_track.num_frames * 4;
-    Byte video_stco_data [] = {
+    Size const video_stco_size = 16 + video_track.num_frames * chunk_offset_len;
+    // chunk offset atom
+    Byte const video_stco_data [] = {
         (Byte) (video_stco_size >> 24),
         (Byte) (video_stco_size >> 16),
         (Byte) (video_stco_size >>  8),
         (Byte) (video_stco_size >>  0),
-         's',  't',  'c',  'o',
+        (Byte) (co64 ? 'c' : 's'),
+        (Byte) (co64 ? 'o' : 't'),
+        (Byte) (co64 ? '6' : 'c'),
+        (Byte) (co64 ? '4' : 'o'),
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
@@ -719,7 +991,7 @@ Mp4Muxer::writeMoovAtom ()
         (Byte) (video_track.num_frames >>  0)
     };
 
-    Size const video_stts_size = 16 + video_track.num_frames * 8;
+    Size const video_stts_size = 16 + video_track.stts.num_entries * 8;
     // time-to-sample atom
     Byte video_stts_data [] = {
         (Byte) (video_stts_size >> 24),
@@ -730,10 +1002,10 @@ Mp4Muxer::writeMoovAtom ()
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
-        (Byte) (video_track.num_frames >> 24),
-        (Byte) (video_track.num_frames >> 16),
-        (Byte) (video_track.num_frames >>  8),
-        (Byte) (video_track.num_frames >>  0)
+        (Byte) (video_track.stts.num_entries >> 24),
+        (Byte) (video_track.stts.num_entries >> 16),
+        (Byte) (video_track.stts.num_entries >>  8),
+        (Byte) (video_track.stts.num_entries >>  0)
     };
 
     Size const video_stss_size = 16 + video_track.num_stss_entries * 4;
@@ -772,7 +1044,7 @@ Mp4Muxer::writeMoovAtom ()
         (Byte) (video_track.num_frames >>  0)
     };
 
-    Size const video_ctts_size = 16 + video_track.num_frames * 8;
+    Size const video_ctts_size = 16 + video_track.ctts.num_entries * 8;
     // composition offset atom
     Byte const video_ctts_data [] = {
         (Byte) (video_ctts_size >> 24),
@@ -783,19 +1055,28 @@ Mp4Muxer::writeMoovAtom ()
         // version, flags
         0x00, 0x00, 0x00, 0x00,
         // number of entries
-        (Byte) (video_track.num_frames >> 24),
-        (Byte) (video_track.num_frames >> 16),
-        (Byte) (video_track.num_frames >>  8),
-        (Byte) (video_track.num_frames >>  0)
+        (Byte) (video_track.ctts.num_entries >> 24),
+        (Byte) (video_track.ctts.num_entries >> 16),
+        (Byte) (video_track.ctts.num_entries >>  8),
+        (Byte) (video_track.ctts.num_entries >>  0)
     };
 
-    Size const mdat_size = 8 + audio_track.total_frame_size + video_track.total_frame_size;
+    Uint64 const mdat_size = mdat_header_len + mdat_payload_size;
+    // 'largesize' follows the type if the size doesn't fit into 32 bits.
     Byte const mdat_data [] = {
+        (Byte) (mdat_largesize ? 0 : (mdat_size >> 24)),
+        (Byte) (mdat_largesize ? 0 : (mdat_size >> 16)),
+        (Byte) (mdat_largesize ? 0 : (mdat_size >>  8)),
+        (Byte) (mdat_largesize ? 1 : (mdat_size >>  0)),
+         'm',  'd',  'a',  't',
+        (Byte) (mdat_size >> 56),
+        (Byte) (mdat_size >> 48),
+        (Byte) (mdat_size >> 40),
+        (Byte) (mdat_size >> 32),
         (Byte) (mdat_size >> 24),
         (Byte) (mdat_size >> 16),
         (Byte) (mdat_size >>  8),
-        (Byte) (mdat_size >>  0),
-         'm',  'd',  'a',  't'
+        (Byte) (mdat_size >>  0)
     };
 
     Size const audio_stbl_size = 8 + audio_stsd_size + sizeof (audio_stsc_data) +
@@ -859,9 +1140,7 @@ Mp4Muxer::writeMoovAtom ()
     moov_data [2] = (Byte) (moov_size >>  8);
     moov_data [3] = (Byte) (moov_size >>  0);
 
-    Size const stco_offset = sizeof (ftyp_data) + moov_size + 8 /* mdat header */;
-    patchTrackStco (&audio_track, stco_offset);
-    patchTrackStco (&video_track, stco_offset);
+    Uint64 const stco_offset = sizeof (ftyp_data) + moov_size + mdat_header_len;
 
     page_pool->getFillPages (&pages, ConstMemory::forObject (ftyp_data));
     page_pool->getFillPages (&pages, ConstMemory::forObject (moov_data));
@@ -889,20 +1168,16 @@ Mp4Muxer::writeMoovAtom ()
         page_pool->getFillPages (&pages, ConstMemory::forObject (audio_stsc_data));
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (audio_stco_data));
-        pages.appendList (&audio_track.stco_pages);
-        audio_track.stco_pages.reset ();
+        appendTable (&audio_track.stco, &pages, true /* chunk_offsets */, stco_offset, co64);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (audio_stts_data));
-        pages.appendList (&audio_track.stts_pages);
-        audio_track.stts_pages.reset ();
+        appendTable (&audio_track.stts.table, &pages);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (audio_stsz_data));
-        pages.appendList (&audio_track.stsz_pages);
-        audio_track.stsz_pages.reset ();
+        appendTable (&audio_track.stsz, &pages);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (audio_ctts_data));
-        pages.appendList (&audio_track.ctts_pages);
-        audio_track.ctts_pages.reset ();
+        appendTable (&audio_track.ctts.table, &pages);
     }
 
     if (got_video) {
@@ -922,34 +1197,36 @@ Mp4Muxer::writeMoovAtom ()
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_stsc_data));
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_stco_data));
-        pages.appendList (&video_track.stco_pages);
-        video_track.stco_pages.reset ();
+        appendTable (&video_track.stco, &pages, true /* chunk_offsets */, stco_offset, co64);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_stts_data));
-        pages.appendList (&video_track.stts_pages);
-        video_track.stts_pages.reset ();
+        appendTable (&video_track.stts.table, &pages);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_stss_data));
-        pages.appendList (&video_track.stss_pages);
-        video_track.stss_pages.reset ();
+        appendTable (&video_track.stss, &pages);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_stsz_data));
-        pages.appendList (&video_track.stsz_pages);
-        video_track.stsz_pages.reset ();
+        appendTable (&video_track.stsz, &pages);
 
         page_pool->getFillPages (&pages, ConstMemory::forObject (video_ctts_data));
-        pages.appendList (&video_track.ctts_pages);
-        video_track.ctts_pages.reset ();
+        appendTable (&video_track.ctts.table, &pages);
     }
 
-    page_pool->getFillPages (&pages, ConstMemory::forObject (mdat_data));
+    page_pool->getFillPages (&pages, ConstMemory (mdat_data, mdat_header_len));
 
     if (logLevelOn (mp4mux, LogLevel::Debug)) {
         logD (mp4mux, _func, "result: ", PagePool::countPageListDataLen (pages.first, 0 /* msg_offset */), " bytes:");
         PagePool::dumpPages (logs, &pages);
     }
 
-    return pages;
+    if (spill_read_failed) {
+        page_pool->msgUnref (pages.first);
+        exc_throw (InternalException, InternalException::BackendMalfunction);
+        return Result::Failure;
+    }
+
+    *ret_pages = pages;
+    return Result::Success;
 }
 
 void
@@ -994,7 +1271,8 @@ void
 Mp4Muxer::processFrame (TrackInfo * const mt_nonnull track,
                         Time        const timestamp_nanosec,
                         Size        const frame_size,
-                        bool        const is_sync_sample)
+                        bool        const is_sync_sample,
+                        Uint64      const data_offset)
 {
     logD (mp4mux, _func, " ts ", timestamp_nanosec, " len ", frame_size);
 
@@ -1008,9 +1286,7 @@ Mp4Muxer::processFrame (TrackInfo * const mt_nonnull track,
             (Byte) (frame_size >>  8),
             (Byte) (frame_size >>  0)
         };
-        page_pool->getFillPages (&track->stsz_pages, ConstMemory::forObject (stsz_entry));
-        track->stsz_pos += sizeof (stsz_entry);
-        logD (mp4mux, _func, "stsz_pos: ", track->stsz_pos);
+        appendTableEntry (&track->stsz, ConstMemory::forObject (stsz_entry));
     }
 
     if (is_sync_sample) {
@@ -1020,183 +1296,68 @@ Mp4Muxer::processFrame (TrackInfo * const mt_nonnull track,
             (Byte) (track->num_frames >>  8),
             (Byte) (track->num_frames >>  0)
         };
-        page_pool->getFillPages (&track->stss_pages, ConstMemory::forObject (stss_entry));
-        track->stss_pos += sizeof (stss_entry);
+        appendTableEntry (&track->stss, ConstMemory::forObject (stss_entry));
         ++track->num_stss_entries;
     }
 
-    Time pts = timestamp_nanosec / (1000000 / 3);
-    Time dts = pts;
-
-    // Canonical:
-    //    ts   0 3 1 2 4
-    //   dts   0 1 2 3 4
-    //   pts   1 4 2 3 5
-    //   cto   1 3 0 0 1
+    // Incoming timestamps are presentation timestamps, which go backwards
+    // for B-frames. Decoding timestamps are derived from them: dts of
+    // a sample is the minimum of pts of the sample itself and all samples
+    // which follow it. When a timestamp goes backwards, dts of the latest
+    // samples is moved back, and the difference goes to ctts:
     //
-    // We do:
-    //    ts   0 3 1 2 4
-    //   dts   0 1 1 2 4
-    //   pts   0 3 1 2 4
-    //  stts   1 0 1 2 .
-    //   cto   0 2 0 0 0
+    //    pts   0 3 1 2 4
+    //    dts   0 1 1 2 4
+    //   stts   1 0 1 2 .
+    //   ctts   0 2 0 0 0
     //
-    //    ts   0  3  1
-    //   dts   0  3
-    //  stts  +0 +2
-    //  stco   0  0
-    //
-    //    ts   0  3  1  2  4
-    //   dts   0  1  1  2  4
-    //  stts  +0 +1 +0 +1 +2
-    //  stco   0  2  0  0  0
-    //
-    //         0 3 2 1 4
-    //   dts   0 1 1 1 4
-    //  stts   1 0 0 3 .
-    //  stco   0 2 1 0 0
-    //
-    //         0 3 2
-    //   dts   0 2 2
-    //  stts   2 0 .
-    //  stco   0 1 0
-    //
-    // Как строить таблицы?
-    //
-    // Если dts < prv_dts, то По stts идём назад и протягиваем нули.
-    // При этом в stco меняем значения в соответствии с изменениями в stts.
-    //
-    // Ещё один момент: dts начинаются с 0, поэтому может потребоваться сдвиг.
-    //
-    // Сейчас один кадр -> одна запись в stts и stco.
-    //
-    // 3 0 1
-    // 0 0 1
-    // 0 1
-    //
-    // 3 1 2
-    // 1 1 2 => 0 0 2 (новый минимум)
-    // 0 0 1
-
-    if (pts < track->prv_pts) {
-        PagePool::PageListArray stts_arr (track->stts_pages.first, 0 /* offset*/, track->stts_pos /* data_len */);
-        PagePool::PageListArray ctts_arr (track->ctts_pages.first, 0 /* offset*/, track->ctts_pos /* data_len */);
-
-        Byte stts_entry [8];
-        Byte ctts_entry [8];
-
-        if (pts < track->min_pts) {
-            for (Size ctts_i = track->ctts_pos; ctts_i > 0; ctts_i -= sizeof (ctts_entry)) {
-                ctts_arr.get (ctts_i - sizeof (ctts_entry), Memory::forObject (ctts_entry));
-                Uint32 const ctts_val = (track->min_pts - pts) + (((Uint32) ctts_entry [4] << 24) |
-                                                                  ((Uint32) ctts_entry [5] << 16) |
-                                                                  ((Uint32) ctts_entry [6] <<  8) |
-                                                                  ((Uint32) ctts_entry [7] <<  0));
-                ctts_entry [4] = (Byte) (ctts_val >> 24);
-                ctts_entry [5] = (Byte) (ctts_val >> 16);
-                ctts_entry [6] = (Byte) (ctts_val >>  8);
-                ctts_entry [7] = (Byte) (ctts_val >>  0);
-                ctts_arr.set (track->ctts_pos - sizeof (ctts_entry), ConstMemory::forObject (ctts_entry));
-            }
-
-            track->min_pts = pts;
+    // Only the latest MaxReorderDepth samples may be moved back, stts and
+    // ctts entries are written for older samples.
+    Time pts = timestamp_nanosec / (1000000 / 3);
+    if (track->num_pending > 0) {
+        PendingSample * const oldest = &track->pending [track->pending_first];
+        if (track->got_flushed_samples && pts < oldest->dts) {
+            logD (mp4mux, _func, "timestamp goes back too far: ", pts, " < ", oldest->dts);
+            pts = oldest->dts;
         }
 
-        Size stts_i = track->stts_pos;
-        Size ctts_i = track->ctts_pos;
-
-        Time cur_dts = track->prv_pts;
-        for (;;) {
-            assert (stts_i != 0);
-
-            stts_arr.get (stts_i - sizeof (stts_entry), Memory::forObject (stts_entry));
-            Uint32 const stts_val = ((Uint32) stts_entry [4] << 24) |
-                                    ((Uint32) stts_entry [5] << 16) |
-                                    ((Uint32) stts_entry [6] <<  8) |
-                                    ((Uint32) stts_entry [7] <<  0);
-
-            ctts_arr.get (ctts_i - sizeof (ctts_entry), Memory::forObject (ctts_entry));
-            Uint32 const ctts_val = ((Uint32) ctts_entry [4] << 24) |
-                                    ((Uint32) ctts_entry [5] << 16) |
-                                    ((Uint32) ctts_entry [6] <<  8) |
-                                    ((Uint32) ctts_entry [7] <<  0);
-
-            bool last = false;
-            Uint32 new_ctts_val;
-            if (stts_val >= cur_dts - dts) {
-                last = true;
-
-                Uint32 const new_stts_val = stts_val - (cur_dts - dts);
-                stts_entry [4] = (Byte) (new_stts_val >> 24);
-                stts_entry [5] = (Byte) (new_stts_val >> 16);
-                stts_entry [6] = (Byte) (new_stts_val >>  8);
-                stts_entry [7] = (Byte) (new_stts_val >>  0);
-
-                new_ctts_val = ctts_val + (cur_dts - dts);
-            } else {
-                stts_entry [4] = 0;
-                stts_entry [5] = 0;
-                stts_entry [6] = 0;
-                stts_entry [7] = 0;
-
-                new_ctts_val = stts_val;
-            }
-
-            ctts_entry [4] = (Byte) (new_ctts_val >> 24);
-            ctts_entry [5] = (Byte) (new_ctts_val >> 16);
-            ctts_entry [6] = (Byte) (new_ctts_val >>  8);
-            ctts_entry [7] = (Byte) (new_ctts_val >>  0);
-
-            stts_arr.set (stts_i - sizeof (stts_entry), ConstMemory::forObject (stts_entry));
-            ctts_arr.set (ctts_i - sizeof (ctts_entry), ConstMemory::forObject (ctts_entry));
-
-            if (last)
+        for (Count i = track->num_pending; i > 0; --i) {
+            PendingSample * const sample =
+                    &track->pending [(track->pending_first + i - 1) % MaxReorderDepth];
+            if (sample->dts <= pts)
                 break;
 
-            cur_dts -= stts_val;
-
-            stts_i -= sizeof (stts_entry);
-            ctts_i -= sizeof (ctts_entry);
+            sample->dts = pts;
         }
-    }
 
-    {
-        Byte const stts_entry [] = {
-            0, 0, 0, 1,
-            (Byte) ((pts - track->prv_pts) >> 24),
-            (Byte) ((pts - track->prv_pts) >> 16),
-            (Byte) ((pts - track->prv_pts) >>  8),
-            (Byte) ((pts - track->prv_pts) >>  0)
-        };
-        if (track->num_frames > 1) {
-            page_pool->getFillPages (&track->stts_pages, ConstMemory::forObject (stts_entry));
-            track->stts_pos += sizeof (stts_entry);
-        }
+        if (track->num_pending == MaxReorderDepth)
+            flushPendingSample (track, track->pending [(track->pending_first + 1) % MaxReorderDepth].dts);
     }
 
     {
-        Byte const ctts_entry [] = {
-            0, 0, 0, 1,
-            0, 0, 0, 0
-        };
-        page_pool->getFillPages (&track->ctts_pages, ConstMemory::forObject (ctts_entry));
-        track->ctts_pos += sizeof (ctts_entry);
+        PendingSample * const sample =
+                &track->pending [(track->pending_first + track->num_pending) % MaxReorderDepth];
+        sample->pts = pts;
+        sample->dts = pts;
+        ++track->num_pending;
     }
 
     {
         Byte const stco_entry [] = {
-            (Byte) (mdat_pos >> 24),
-            (Byte) (mdat_pos >> 16),
-            (Byte) (mdat_pos >>  8),
-            (Byte) (mdat_pos >>  0),
+            (Byte) (data_offset >> 56),
+            (Byte) (data_offset >> 48),
+            (Byte) (data_offset >> 40),
+            (Byte) (data_offset >> 32),
+            (Byte) (data_offset >> 24),
+            (Byte) (data_offset >> 16),
+            (Byte) (data_offset >>  8),
+            (Byte) (data_offset >>  0)
         };
-        page_pool->getFillPages (&track->stco_pages, ConstMemory::forObject (stco_entry));
-        track->stco_pos += sizeof (stco_entry);
-    }
+        appendTableEntry (&track->stco, ConstMemory::forObject (stco_entry));
 
-    track->prv_pts = pts;
-
-    mdat_pos += frame_size;
+        if (data_offset > track->max_chunk_offset)
+            track->max_chunk_offset = data_offset;
+    }
 }
 
 void
@@ -1206,72 +1367,117 @@ Mp4Muxer::pass1_frame (FrameType const frame_type,
                        bool      const is_sync_sample)
 {
     if (frame_type == FrameType_Audio)
-        processFrame (&audio_track, timestamp_nanosec, frame_size, is_sync_sample);
+        processFrame (&audio_track, timestamp_nanosec, frame_size, is_sync_sample, mdat_pos);
+    else
+        processFrame (&video_track, timestamp_nanosec, frame_size, is_sync_sample, mdat_pos);
+
+    mdat_pos += frame_size;
+}
+
+void
+Mp4Muxer::pass1_frameAt (FrameType const frame_type,
+                         Time      const timestamp_nanosec,
+                         Size      const frame_size,
+                         bool      const is_sync_sample,
+                         Uint64    const data_offset)
+{
+    if (frame_type == FrameType_Audio)
+        processFrame (&audio_track, timestamp_nanosec, frame_size, is_sync_sample, data_offset);
     else
-        processFrame (&video_track, timestamp_nanosec, frame_size, is_sync_sample);
+        processFrame (&video_track, timestamp_nanosec, frame_size, is_sync_sample, data_offset);
+}
+
+void
+Mp4Muxer::flushPendingSample (TrackInfo * const mt_nonnull track,
+                              Time        const next_dts)
+{
+    assert (track->num_pending > 0);
+    PendingSample const * const sample = &track->pending [track->pending_first];
+
+    addRleSample (&track->stts, (Uint32) (next_dts - sample->dts));
+    addRleSample (&track->ctts, (Uint32) (sample->pts - sample->dts));
+
+    track->pending_first = (track->pending_first + 1) % MaxReorderDepth;
+    --track->num_pending;
+    track->got_flushed_samples = true;
 }
 
 void
 Mp4Muxer::finalizeTrack (TrackInfo * const mt_nonnull track)
 {
-    if (track->num_frames > 0) {
+    while (track->num_pending > 1)
+        flushPendingSample (track, track->pending [(track->pending_first + 1) % MaxReorderDepth].dts);
+
+    if (track->num_pending > 0) {
         // (total duration) - (last frame timestamp)
-        Time last_duration = 0;
-        if (duration_millisec * 3 > track->prv_pts)
-            last_duration = duration_millisec * 3 - track->prv_pts;
-
-        Byte const stts_entry [] = {
-            0, 0, 0, 1,
-            (Byte) (last_duration >> 24),
-            (Byte) (last_duration >> 16),
-            (Byte) (last_duration >>  8),
-            (Byte) (last_duration >>  0),
-        };
+        Time const last_dts = track->pending [track->pending_first].dts;
+        Time end_dts = last_dts;
+        if (duration_millisec * 3 > last_dts)
+            end_dts = duration_millisec * 3;
 
-        page_pool->getFillPages (&track->stts_pages, ConstMemory::forObject (stts_entry));
-        track->stts_pos += sizeof (stts_entry);
+        flushPendingSample (track, end_dts);
     }
+
+    flushRleRun (&track->stts);
+    flushRleRun (&track->ctts);
 }
 
-PagePool::PageListHead
-Mp4Muxer::pass1_complete ()
+mt_throws Result
+Mp4Muxer::pass1_complete (PagePool::PageListHead * const mt_nonnull ret_pages)
 {
     finalizeTrack (&audio_track);
     finalizeTrack (&video_track);
 
-    return writeMoovAtom ();
+    return writeMoovAtom (getTotalDataSize(), ret_pages);
 }
 
-void
-Mp4Muxer::TrackInfo::clear (PagePool * const mt_nonnull page_pool)
+mt_throws Result
+Mp4Muxer::pass1_complete (Time                     const duration_millisec,
+                          Uint64                   const mdat_payload_size,
+                          PagePool::PageListHead * const mt_nonnull ret_pages)
 {
-    if (hdr_page_pool) {
-        hdr_page_pool->msgUnref (hdr_msg);
-        hdr_page_pool = NULL;
-        hdr_msg = NULL;
-    }
-
-    page_pool->msgUnref (stsz_pages.first);
-    stsz_pages.reset ();
-
-    page_pool->msgUnref (stss_pages.first);
-    stss_pages.reset ();
-
-    page_pool->msgUnref (stts_pages.first);
-    stts_pages.reset ();
+    this->duration_millisec = duration_millisec;
 
-    page_pool->msgUnref (ctts_pages.first);
-    ctts_pages.reset ();
+    finalizeTrack (&audio_track);
+    finalizeTrack (&video_track);
 
-    page_pool->msgUnref (stco_pages.first);
-    stco_pages.reset ();
+    return writeMoovAtom (mdat_payload_size, ret_pages);
 }
 
 void
 Mp4Muxer::clear ()
 {
-    audio_track.clear (page_pool);
-    video_track.clear (page_pool);
+    TrackInfo * const tracks [] = { &audio_track, &video_track };
+    for (unsigned i = 0; i < sizeof (tracks) / sizeof (tracks [0]); ++i) {
+        TrackInfo * const track = tracks [i];
+
+        if (track->hdr_page_pool) {
+            track->hdr_page_pool->msgUnref (track->hdr_msg);
+            track->hdr_page_pool = NULL;
+            track->hdr_msg = NULL;
+        }
+
+        releaseTable (&track->stsz);
+        releaseTable (&track->stss);
+        releaseTable (&track->stts.table);
+        releaseTable (&track->ctts.table);
+        releaseTable (&track->stco);
+
+        track->pending_first = 0;
+        track->num_pending = 0;
+        track->got_flushed_samples = false;
+    }
+
+    if (spill_fd != -1) {
+        if (::close (spill_fd) == -1)
+            logE (mp4mux, _func, "close() failed: ", errnoString (errno));
+
+        spill_fd = -1;
+        spill_pos = 0;
+    }
+
+    spill_failed = false;
+    spill_read_failed = false;
 }
 
 void
@@ -1282,6 +1488,14 @@ Mp4Muxer::init (PagePool * const mt_nonnull page_pool,
     this->duration_millisec = duration_millisec;
 }
 
+void
+Mp4Muxer::setSpill (ConstMemory const spill_dir,
+                    Size        const spill_threshold)
+{
+    this->spill_dir = grab (new String (spill_dir));
+    this->spill_threshold = spill_threshold;
+}
+
 Mp4Muxer::~Mp4Muxer ()
 {
     clear ();
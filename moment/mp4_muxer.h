@@ -37,6 +37,55 @@ public:
     };
 
 private:
+    struct SpillExtent
+    {
+        Uint64 file_offset;
+        Size   len;
+    };
+
+    // Sample table data. Entries are appended to 'pages' and moved to
+    // the spill file in bulk when spilling is enabled.
+    struct Table
+    {
+        PagePool::PageListHead pages;
+        // Number of bytes in 'pages'.
+        Size pos;
+
+        List<SpillExtent> spilled;
+
+        Table ()
+            : pos (0)
+        {}
+    };
+
+    // Run-length encoded table of (sample count, value) pairs: stts, ctts.
+    // The current run is appended to 'table' when the value changes.
+    struct RleTable
+    {
+        Table  table;
+        Count  num_entries;
+        Uint32 run_count;
+        Uint32 run_value;
+
+        RleTable ()
+            : num_entries (0),
+              run_count (0),
+              run_value (0)
+        {}
+    };
+
+    enum {
+        // Timestamps which go backwards are handled by moving decoding
+        // timestamps of this many latest samples back. See processFrame().
+        MaxReorderDepth = 64
+    };
+
+    struct PendingSample
+    {
+        Time pts;
+        Time dts;
+    };
+
     struct TrackInfo
     {
         PagePool       *hdr_page_pool;
@@ -47,27 +96,26 @@ private:
         Size num_frames;
         Size total_frame_size;
 
-        PagePool::PageListHead stsz_pages;
-        Size stsz_pos;
+        Table stsz;
 
-        PagePool::PageListHead stss_pages;
-        Size stss_pos;
+        Table stss;
         Count num_stss_entries;
 
-        PagePool::PageListHead stts_pages;
-        Size stts_pos;
-        Time prv_stts_value;
-
-        PagePool::PageListHead ctts_pages;
-        Size ctts_pos;
+        RleTable stts;
+        RleTable ctts;
 
-        PagePool::PageListHead stco_pages;
-        Size stco_pos;
+        // 64-bit chunk offsets, converted to stco or co64 in writeMoovAtom().
+        Table  stco;
+        Uint64 max_chunk_offset;
 
-        Time prv_pts;
-        Time min_pts;
-
-        void clear (PagePool * mt_nonnull page_pool);
+        // Latest samples, a ring buffer. Their stts and ctts entries are not
+        // written yet since 'dts' may still be moved back.
+        PendingSample pending [MaxReorderDepth];
+        Count pending_first;
+        Count num_pending;
+        // Set once a sample has left 'pending'. The oldest pending sample's
+        // dts is fixed from then on, as it determines the written stts entry.
+        bool  got_flushed_samples;
 
         TrackInfo ()
             : hdr_page_pool    (NULL),
@@ -76,35 +124,76 @@ private:
               hdr_size         (0),
               num_frames       (0),
               total_frame_size (0),
-              stsz_pos         (0),
-              stss_pos         (0),
               num_stss_entries (0),
-              stts_pos         (0),
-              prv_stts_value   (0),
-              ctts_pos         (0),
-              stco_pos         (0),
-              prv_pts          (0),
-              min_pts          (0)
+              max_chunk_offset (0),
+              pending_first    (0),
+              num_pending      (0),
+              got_flushed_samples (false)
         {}
     };
 
     mt_const CodeDepRef<PagePool> page_pool;
     mt_const Time duration_millisec;
 
+    mt_const Ref<String> spill_dir;
+    mt_const Size        spill_threshold;
+
     TrackInfo audio_track;
     TrackInfo video_track;
 
     Uint64 mdat_pos;
 
-    void patchTrackStco (TrackInfo * mt_nonnull track,
-                         Uint32     offset);
+    int    spill_fd;
+    Uint64 spill_pos;
+    // Set when the spill file could not be created or written to.
+    // Sample tables are kept in memory from then on.
+    bool   spill_failed;
+    // Set when spilled sample tables could not be read back. The moov
+    // can't be written then.
+    bool   spill_read_failed;
+
+    void appendTableEntry (Table       * mt_nonnull table,
+                           ConstMemory  entry);
+
+    void addRleSample (RleTable * mt_nonnull rle_table,
+                       Uint32     value);
+
+    void flushRleRun (RleTable * mt_nonnull rle_table);
+
+    bool openSpillFile ();
 
-    PagePool::PageListHead writeMoovAtom ();
+    void spillTable (Table * mt_nonnull table);
+
+    void appendTableData (PagePool::PageListHead * mt_nonnull pages,
+                          ConstMemory             data,
+                          bool                    chunk_offsets,
+                          Uint64                  offset_delta,
+                          bool                    co64);
+
+    // Moves contents of 'table' to 'pages'. If 'chunk_offsets' is true,
+    // 64-bit entries are adjusted by 'offset_delta' and written as stco or
+    // co64 entries.
+    void appendTable (Table                  * mt_nonnull table,
+                      PagePool::PageListHead * mt_nonnull pages,
+                      bool                    chunk_offsets = false,
+                      Uint64                  offset_delta  = 0,
+                      bool                    co64          = false);
+
+    void releaseTable (Table * mt_nonnull table);
+
+    mt_throws Result writeMoovAtom (Uint64                  mdat_payload_size,
+                                    PagePool::PageListHead * mt_nonnull ret_pages);
 
     void processFrame (TrackInfo * mt_nonnull track,
                        Time       timestamp_nanosec,
                        Size       frame_size,
-                       bool       is_sync_sample);
+                       bool       is_sync_sample,
+                       Uint64     data_offset);
+
+    // Writes stts and ctts entries of the oldest pending sample. 'next_dts' is
+    // the decoding timestamp of the sample which follows it.
+    void flushPendingSample (TrackInfo * mt_nonnull track,
+                             Time       next_dts);
 
     void finalizeTrack (TrackInfo * mt_nonnull track);
 
@@ -124,7 +213,22 @@ public:
                       Size      frame_size,
                       bool      is_sync_sample);
 
-    PagePool::PageListHead pass1_complete ();
+    // For media data which is laid out by the caller: 'data_offset' is
+    // the position of the frame relative to the beginning of mdat payload.
+    void pass1_frameAt (FrameType frame_type,
+                        Time      timestamp_nanosec,
+                        Size      frame_size,
+                        bool      is_sync_sample,
+                        Uint64    data_offset);
+
+    // Fails if spilled sample tables could not be read back.
+    mt_throws Result pass1_complete (PagePool::PageListHead * mt_nonnull ret_pages);
+
+    // Used together with pass1_frameAt(). The resulting mdat header
+    // announces 'mdat_payload_size' bytes of payload.
+    mt_throws Result pass1_complete (Time                    duration_millisec,
+                                     Uint64                  mdat_payload_size,
+                                     PagePool::PageListHead * mt_nonnull ret_pages);
 
     Size getTotalDataSize () const
         { return audio_track.total_frame_size + video_track.total_frame_size; }
@@ -134,9 +238,20 @@ public:
     mt_const void init (PagePool * mt_nonnull page_pool,
                         Time       const duration_millisec);
 
+    // Sample tables of a track which grow over 'spill_threshold' bytes are
+    // moved to a temporary file in 'spill_dir', so that memory usage does not
+    // depend on the duration of the recording. 0 disables spilling.
+    mt_const void setSpill (ConstMemory spill_dir,
+                            Size        spill_threshold);
+
     Mp4Muxer ()
         : duration_millisec (0),
-          mdat_pos (0)
+          spill_threshold (0),
+          mdat_pos (0),
+          spill_fd (-1),
+          spill_pos (0),
+          spill_failed (false),
+          spill_read_failed (false)
     {}
 
     ~Mp4Muxer ();
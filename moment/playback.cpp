@@ -62,6 +62,11 @@ Playback::advancePlayback ()
 	    assert (!playback_timer);
 	}
 
+        if (preroll_timer) {
+            timers->deleteTimer (preroll_timer);
+            preroll_timer = NULL;
+        }
+
 	// Resetting 'got_next' after a call to frontend->stopItem.
 	got_next = false;
 
@@ -78,6 +83,9 @@ Playback::advancePlayback ()
 					      &next_duration_full);
 	    if (next_item == NULL) {
 		logD (playback, _func, "Empty playlist");
+		// Cancelling preroll, if any.
+		if (frontend && frontend->prerollItem)
+		    frontend.call_mutex (frontend->prerollItem, mutex, (Playlist::Item*) NULL, (Time) 0);
 		goto _return;
 	    }
 
@@ -119,6 +127,7 @@ Playback::advancePlayback ()
 						   advance_ticket /* ref_data */),
 		    next_start_rel,
 		    false /* periodical */);
+            setPrerollTimer (next_start_rel);
 
 	    next_start_rel = 0;
 	    got_next = true;
@@ -134,6 +143,7 @@ Playback::advancePlayback ()
 						   advance_ticket),
 		    next_duration,
 		    false /* periodical */);
+            setPrerollTimer (next_duration);
 	}
 
 	logD (playback, _func, "Calling frontend->startItem");
@@ -176,6 +186,77 @@ Playback::playbackTimerTick (void * const _advance_ticket)
     self->mutex.unlock ();
 }
 
+mt_mutex (mutex) void
+Playback::setPrerollTimer (Time const time_to_switch)
+{
+    if (preroll_time_sec == 0
+        || !frontend
+        || !frontend->prerollItem
+        || time_to_switch <= preroll_time_sec)
+    {
+        return;
+    }
+
+    // Directory-based playlists are re-read on every getNextItem() call,
+    // which would invalidate the prerolled item.
+    if (playlist.from_dir)
+        return;
+
+    logD (playback, _func, "Setting preroll timer to ", time_to_switch - preroll_time_sec);
+    preroll_timer = timers->addTimer (
+            CbDesc<Timers::TimerCallback> (prerollTimerTick,
+                                           advance_ticket /* cb_data */,
+                                           getCoderefContainer() /* coderef_container */,
+                                           advance_ticket /* ref_data */),
+            time_to_switch - preroll_time_sec,
+            false /* periodical */);
+}
+
+void
+Playback::prerollTimerTick (void * const _advance_ticket)
+{
+    AdvanceTicket * const advance_ticket = static_cast <AdvanceTicket*> (_advance_ticket);
+    Playback * const self = advance_ticket->playback;
+
+    logD (playback, _func_);
+
+    self->mutex.lock ();
+    if (self->advance_ticket != advance_ticket) {
+	self->mutex.unlock ();
+	return;
+    }
+
+    StRef<Playlist::Item> item;
+    Time seek = 0;
+    if (self->got_next) {
+        // Waiting for a scheduled item to start.
+        item = self->next_item;
+        seek = self->next_seek;
+    } else {
+        Time start_rel = 0;
+        Time duration = 0;
+        bool duration_full = false;
+        item = self->playlist.getNextItem (self->cur_item,
+                                           getUnixtime(),
+                                           (Int64) self->preroll_time_sec /* time_offset */,
+                                           &start_rel,
+                                           &seek,
+                                           &duration,
+                                           &duration_full);
+        if (start_rel > 0) {
+            // The item won't be started right at the switch.
+            item = NULL;
+        }
+    }
+
+    if (item) {
+        logD (playback, _func, "prerolling item 0x", fmt_hex, (UintPtr) item.ptr());
+        self->frontend.call_mutex (self->frontend->prerollItem, self->mutex, item, seek);
+    }
+
+    self->mutex.unlock ();
+}
+
 mt_mutex (mutex) void
 Playback::doSetPosition (Playlist::Item * const item,
 			 Time             const seek)
@@ -422,11 +503,13 @@ Playback::loadPlaylistDirectory (ConstMemory    const dirname,
 mt_const void
 Playback::init (CbDesc<Frontend> const &frontend,
                 Timers * const timers,
-                Uint64   const min_playlist_duration_sec)
+                Uint64   const min_playlist_duration_sec,
+                Time     const preroll_time_sec)
 {
     this->frontend = frontend;
     this->timers = timers;
     this->min_playlist_duration_sec = min_playlist_duration_sec;
+    this->preroll_time_sec = preroll_time_sec;
 }
 
 Playback::Playback (Object * const coderef_container)
@@ -435,10 +518,12 @@ Playback::Playback (Object * const coderef_container)
       timers (NULL),
 
       min_playlist_duration_sec (10),
+      preroll_time_sec (0),
 
       cur_item (NULL),
 
       playback_timer (NULL),
+      preroll_timer (NULL),
 
       got_next (false),
       next_item (NULL),
@@ -52,6 +52,15 @@ public:
 			   void           *cb_data);
 
 	void (*stopItem) (void *cb_data);
+
+        // Optional. Called 'preroll_time_sec' seconds before @item is expected
+        // to be started with startItem(), so that the frontend could warm up
+        // the item's media source in advance. There's no guarantee that startItem()
+        // will be called for the same item afterwards. @item is NULL when
+        // there's nothing to play next and the preroll should be cancelled.
+        void (*prerollItem) (Playlist::Item *item,
+                             Time            seek,
+                             void           *cb_data);
     };
 
 private:
@@ -60,6 +69,7 @@ private:
     mt_const Timers *timers;
 
     mt_const Uint64 min_playlist_duration_sec;
+    mt_const Time   preroll_time_sec;
 
     mt_mutex (mutex)
     mt_begin
@@ -68,6 +78,7 @@ private:
       StRef<Playlist::Item> cur_item;
 
       Timers::TimerKey playback_timer;
+      Timers::TimerKey preroll_timer;
 
       bool got_next;
       StRef<Playlist::Item> next_item;
@@ -87,6 +98,10 @@ private:
 
     static void playbackTimerTick (void *_advance_ticket);
 
+    mt_mutex (mutex) void setPrerollTimer (Time time_to_switch);
+
+    static void prerollTimerTick (void *_advance_ticket);
+
     mt_mutex (mutex) void doSetPosition (Playlist::Item *item,
 					 Time            seek);
 
@@ -128,9 +143,12 @@ public:
                                   bool          keep_cur_item,
                                   PlaybackItem * mt_nonnull default_playback_item);
 
+    // @preroll_time_sec - if non-zero, then frontend->prerollItem() is called
+    // this many seconds before switching to the next item.
     mt_const void init (CbDesc<Frontend> const &frontend,
                         Timers *timers,
-                        Uint64  min_playlist_duration_sec);
+                        Uint64  min_playlist_duration_sec,
+                        Time    preroll_time_sec = 0);
 
      Playback (Object *coderef_container);
     ~Playback ();
@@ -81,13 +81,7 @@ Playlist::getNextItem (Item  *prv_item,
 
     Item *item = prv_item;
     for (;;) {
-	if (item) {
-	    item = ItemList::getNext (item);
-	} else {
-	    logD (playlist, _func, "First item");
-	    item = item_list.getFirst();
-	}
-
+	item = findNextUnexpiredItem (item, (Int64) cur_time + time_offset);
 	if (!item) {
 	    logD (playlist, _func, "No next item");
 	    break;
@@ -238,22 +232,157 @@ Playlist::getItemById (ConstMemory id)
 Playlist::Item*
 Playlist::getNthItem (Count const idx)
 {
-    Item *item = NULL;
+    // Items are numbered starting from 1.
+    if (idx == 0 || idx > num_items)
+	return NULL;
 
-    ItemList::iter iter (item_list);
-    for (Count i = 0; i < idx; ++i) {
-	if (item_list.iter_done (iter))
-	    return NULL;
+    return item_index [idx - 1];
+}
+
+static inline bool isUnexpired (Time  const expire_time,
+				Int64 const now)
+{
+    return expire_time == (Time) -1 || (Int64) expire_time > now;
+}
+
+// Returns the index of the first leaf at or after @lo which has not expired
+// by @now, or (Count) -1 if there's no such leaf in the subtree of @node.
+// The subtree of @node covers leaves [node_lo, node_hi).
+static Count findFirstUnexpired (Time  const * const mt_nonnull expire_tree,
+				 Count const node,
+				 Count const node_lo,
+				 Count const node_hi,
+				 Count const lo,
+				 Int64 const now)
+{
+    if (node_hi <= lo || !isUnexpired (expire_tree [node], now))
+	return (Count) -1;
+
+    if (node_hi - node_lo == 1)
+	return node_lo;
 
-	item = item_list.iter_next (iter);
+    Count const node_mid = node_lo + (node_hi - node_lo) / 2;
+    Count const res = findFirstUnexpired (expire_tree, node * 2, node_lo, node_mid, lo, now);
+    if (res != (Count) -1)
+	return res;
+
+    return findFirstUnexpired (expire_tree, node * 2 + 1, node_mid, node_hi, lo, now);
+}
+
+Playlist::Item*
+Playlist::findNextUnexpiredItem (Item  * const prv_item,
+				 Int64   const now)
+{
+    Count const lo = prv_item ? prv_item->index + 1 : 0;
+    if (lo >= num_items)
+	return NULL;
+
+    Count const idx = findFirstUnexpired (expire_tree, 1 /* node */, 0 /* node_lo */, expire_tree_leaves, lo, now);
+    if (idx >= num_items)
+	return NULL;
+
+    return item_index [idx];
+}
+
+// Mirrors the checks in getNextItem(): an item is skipped there if and only if
+// current time is greater or equal to the returned value.
+static Time calculateExpireTime (Playlist::Item * const mt_nonnull item)
+{
+    if (item->duration_full)
+	return (Time) -1;
+
+    if (item->start_immediate) {
+	if (item->got_end_time)
+	    return item->end_time;
+
+	return (Time) -1;
     }
 
-    return item;
+    Time expire_time = (Time) -1;
+    if (!item->duration_default) {
+	// Zero-length items are still played if they start right now.
+	expire_time = item->start_time + (item->duration > 0 ? item->duration : 1);
+    }
+
+    if (item->got_end_time) {
+	if (item->end_time <= item->start_time)
+	    return 0;
+
+	if (item->end_time < expire_time)
+	    expire_time = item->end_time;
+    }
+
+    return expire_time;
+}
+
+void
+Playlist::releaseIndex ()
+{
+    delete[] item_index;
+    item_index = NULL;
+    num_items = 0;
+
+    delete[] expire_tree;
+    expire_tree = NULL;
+    expire_tree_leaves = 0;
+}
+
+void
+Playlist::buildIndex ()
+{
+    releaseIndex ();
+
+    {
+	ItemList::iterator iter (item_list);
+	while (!iter.done()) {
+	    iter.next ();
+	    ++num_items;
+	}
+    }
+
+    if (num_items == 0)
+	return;
+
+    expire_tree_leaves = 1;
+    while (expire_tree_leaves < num_items)
+	expire_tree_leaves <<= 1;
+
+    item_index = new (std::nothrow) Item* [num_items];
+    assert (item_index);
+
+    expire_tree = new (std::nothrow) Time [expire_tree_leaves * 2];
+    assert (expire_tree);
+
+    {
+	Count i = 0;
+	ItemList::iterator iter (item_list);
+	while (!iter.done()) {
+	    Item * const item = iter.next ();
+	    item->index = i;
+	    item->expire_time = calculateExpireTime (item);
+
+	    item_index [i] = item;
+	    expire_tree [expire_tree_leaves + i] = item->expire_time;
+	    ++i;
+	}
+    }
+
+    // Padding leaves are always expired.
+    for (Count i = expire_tree_leaves + num_items; i < expire_tree_leaves * 2; ++i)
+	expire_tree [i] = 0;
+
+    for (Count i = expire_tree_leaves - 1; i > 0; --i) {
+	Time const left  = expire_tree [i * 2];
+	Time const right = expire_tree [i * 2 + 1];
+	expire_tree [i] = (left > right ? left : right);
+    }
 }
 
 void
 Playlist::clear ()
 {
+    releaseIndex ();
+
     ItemList::iter iter (item_list);
     while (!item_list.iter_done (iter)) {
 	Item * const item = item_list.iter_next (iter);
@@ -307,6 +436,8 @@ Playlist::doParsePlaylist (xmlDocPtr     doc,
 
 	cur_node = firstXmlElementNode (cur_node->next);
     }
+
+    buildIndex ();
 }
 
 void
@@ -704,6 +835,7 @@ Playlist::setSingleItem (PlaybackItem * const mt_nonnull playback_item)
     assert (item);
     item->playback_item = playback_item;
     item_list.append (item);
+    buildIndex ();
 }
 
 void
@@ -713,6 +845,7 @@ Playlist::setSingleChannelRecorder (ConstMemory const channel_name)
     assert (item);
     item->id = grab (new (std::nothrow) String (channel_name));
     item_list.append (item);
+    buildIndex ();
 }
 
 mt_throws Result
@@ -870,6 +1003,8 @@ Playlist::doReadDirectory (ConstMemory    const from_dir,
         item->playback_item->spec_kind = PlaybackItem::SpecKind::Uri;
     }
 
+    buildIndex ();
+
     return Result::Success;
 }
 
@@ -886,6 +1021,15 @@ Playlist::dump ()
     }
 }
 
+Playlist::Playlist ()
+    : item_index (NULL),
+      num_items (0),
+      expire_tree (NULL),
+      expire_tree_leaves (0),
+      from_dir_is_relative (false)
+{
+}
+
 Playlist::~Playlist ()
 {
     clear ();
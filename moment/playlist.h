@@ -59,6 +59,13 @@ public:
 
 	Ref<String> id;
 
+	// Position of the item in 'item_list'. Set by Playlist::buildIndex().
+	Count index;
+	// The item is skipped by getNextItem() once current time reaches
+	// 'expire_time'. (Time) -1 means that the item never expires.
+	// Set by Playlist::buildIndex().
+	Time expire_time;
+
 	void reset ()
 	{
 	    start_time = 0;
@@ -72,6 +79,9 @@ public:
 	    duration_default = true;
 
 	    seek = 0;
+
+	    index = 0;
+	    expire_time = (Time) -1;
 	}
 
 	Item ()
@@ -97,6 +107,23 @@ public:
     ItemList item_list;
     ItemHash item_hash;
 
+    // Ordered index of 'item_list' which is rebuilt every time the list changes.
+    // 'item_index' maps ordinals to items. 'expire_tree' is a complete binary
+    // max-tree of Item::expire_time values in ordinal order with leaves starting
+    // at 'expire_tree_leaves'. It lets getNextItem() skip expired scheduled items
+    // in O(log n) instead of walking the list.
+    Item **item_index;
+    Count  num_items;
+    Time  *expire_tree;
+    Count  expire_tree_leaves;
+
+    void releaseIndex ();
+
+    void buildIndex ();
+
+    Item* findNextUnexpiredItem (Item  *prv_item,
+				 Int64  now);
+
     // If non-null, then the directory should be re-read for every getNextItem() call.
     // ...possible alternative - re-read after all known files have been played.
     StRef<String> from_dir;
@@ -152,6 +179,7 @@ public:
 
     void dump ();
 
+    Playlist ();
     ~Playlist ();
 };
 
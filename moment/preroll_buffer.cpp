@@ -0,0 +1,207 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/preroll_buffer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_preroll ("moment.preroll_buffer", LogLevel::I);
+
+VideoStream::EventHandler const PrerollBuffer::source_handler = {
+    sourceAudioMessage,
+    sourceVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
+void
+PrerollBuffer::sourceAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                                   void                      * const _self)
+{
+    PrerollBuffer * const self = static_cast <PrerollBuffer*> (_self);
+    self->addFrame (msg, true /* is_audio */);
+}
+
+void
+PrerollBuffer::sourceVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                                   void                      * const _self)
+{
+    PrerollBuffer * const self = static_cast <PrerollBuffer*> (_self);
+    self->addFrame (msg, false /* is_audio */);
+}
+
+void
+PrerollBuffer::addFrame (VideoStream::Message * const mt_nonnull msg,
+                         bool                   const is_audio)
+{
+    Time const now_millisec = getTimeMilliseconds();
+
+    mutex.lock ();
+    if (released) {
+        mutex.unlock ();
+        return;
+    }
+
+    if (!got_first_frame) {
+        got_first_frame = true;
+        first_arrival_millisec = now_millisec;
+        logD (preroll, _func, "first frame");
+    }
+
+    frames.appendEmpty ();
+    Frame * const frame = &frames.getLast();
+    frame->is_audio = is_audio;
+    if (is_audio)
+        frame->audio_msg = *static_cast <VideoStream::AudioMessage*> (msg);
+    else
+        frame->video_msg = *static_cast <VideoStream::VideoMessage*> (msg);
+
+    frame->arrival_millisec = now_millisec;
+    // Delayed frames are not latency samples for out_stream.
+    frame->getMessage()->ingest_time_microsec = 0;
+    frame->getMessage()->seize ();
+    mutex.unlock ();
+}
+
+mt_mutex (mutex) void
+PrerollBuffer::releaseFrames ()
+{
+    while (!frames.isEmpty()) {
+        frames.getFirst().getMessage()->release ();
+        frames.remove (frames.getFirstElement());
+    }
+}
+
+void
+PrerollBuffer::tickTimerTick (void * const _self)
+{
+    PrerollBuffer * const self = static_cast <PrerollBuffer*> (_self);
+
+    Time const now_millisec = getTimeMilliseconds();
+
+    self->mutex.lock ();
+    while (!self->released && !self->frames.isEmpty()) {
+        Frame frame = self->frames.getFirst();
+        if (frame.arrival_millisec + self->delay_millisec > now_millisec)
+            break;
+
+        self->frames.remove (self->frames.getFirstElement());
+        Ref<VideoStream> const out_stream = self->out_stream;
+        self->mutex.unlock ();
+
+        // Timer callbacks are not reentered, so the frames are fired in order.
+        if (frame.is_audio)
+            out_stream->fireAudioMessage (&frame.audio_msg);
+        else
+            out_stream->fireVideoMessage (&frame.video_msg);
+
+        frame.getMessage()->release ();
+
+        self->mutex.lock ();
+    }
+    self->mutex.unlock ();
+}
+
+void
+PrerollBuffer::start (VideoStream * const mt_nonnull out_stream)
+{
+    Time const now_millisec = getTimeMilliseconds();
+
+    mutex.lock ();
+    assert (!tick_timer);
+
+    this->out_stream = out_stream;
+    delay_millisec = (got_first_frame && now_millisec > first_arrival_millisec ?
+                              now_millisec - first_arrival_millisec : 0);
+    logD (preroll, _func, "delay: ", delay_millisec, " ms, "
+          "buffered frames: ", frames.getNumElements());
+
+    tick_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (tickTimerTick, this, this),
+            TickInterval_Millisec * 1000,
+            true /* periodical */);
+    mutex.unlock ();
+}
+
+void
+PrerollBuffer::release ()
+{
+    mutex.lock ();
+    if (released) {
+        mutex.unlock ();
+        return;
+    }
+    released = true;
+
+    if (tick_timer) {
+        timers->deleteTimer (tick_timer);
+        tick_timer = NULL;
+    }
+
+    GenericInformer::SubscriptionKey const sbn = source_sbn;
+    source_sbn = NULL;
+
+    releaseFrames ();
+    out_stream = NULL;
+    mutex.unlock ();
+
+    if (sbn)
+        source_stream->getEventInformer()->unsubscribe (sbn);
+}
+
+mt_const void
+PrerollBuffer::init (Timers      * const mt_nonnull timers,
+                     VideoStream * const mt_nonnull source_stream)
+{
+    this->timers = timers;
+    this->source_stream = source_stream;
+
+    GenericInformer::SubscriptionKey const sbn =
+            source_stream->getEventInformer()->subscribe (
+                    CbDesc<VideoStream::EventHandler> (&source_handler, this, this));
+
+    mutex.lock ();
+    source_sbn = sbn;
+    mutex.unlock ();
+}
+
+PrerollBuffer::PrerollBuffer ()
+    : timers (this /* coderef_container */),
+      source_sbn (NULL),
+      tick_timer (NULL),
+      got_first_frame (false),
+      first_arrival_millisec (0),
+      delay_millisec (0),
+      released (false)
+{
+}
+
+PrerollBuffer::~PrerollBuffer ()
+{
+    mutex.lock ();
+    releaseFrames ();
+    mutex.unlock ();
+}
+
+}
+
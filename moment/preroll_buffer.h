@@ -0,0 +1,119 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__PREROLL_BUFFER__H__
+#define MOMENT__PREROLL_BUFFER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/video_stream.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Holds the output of a media source which has been started ahead of time,
+// from its very first frame. Nothing is lost while the source is warming up:
+// after start(), frames are fired into the output stream delayed by the time
+// which has passed between the arrival of the first frame and the call
+// to start(), which keeps the source's pacing. Frames which arrive later go
+// through the same delay.
+//
+class PrerollBuffer : public Object
+{
+private:
+    StateMutex mutex;
+
+    enum {
+        TickInterval_Millisec = 10
+    };
+
+    struct Frame
+    {
+        bool is_audio;
+        VideoStream::AudioMessage audio_msg;
+        VideoStream::VideoMessage video_msg;
+
+        Time arrival_millisec;
+
+        VideoStream::Message* getMessage ()
+        {
+            if (is_audio)
+                return &audio_msg;
+
+            return &video_msg;
+        }
+    };
+
+    mt_const DataDepRef<Timers> timers;
+
+    mt_const Ref<VideoStream> source_stream;
+
+    mt_mutex (mutex) GenericInformer::SubscriptionKey source_sbn;
+
+    mt_mutex (mutex) Ref<VideoStream> out_stream;
+    mt_mutex (mutex) Timers::TimerKey tick_timer;
+
+    mt_mutex (mutex) List<Frame> frames;
+
+    mt_mutex (mutex) bool got_first_frame;
+    mt_mutex (mutex) Time first_arrival_millisec;
+    mt_mutex (mutex) Time delay_millisec;
+
+    mt_mutex (mutex) bool released;
+
+    void addFrame (VideoStream::Message * mt_nonnull msg,
+                   bool                   is_audio);
+
+    mt_mutex (mutex) void releaseFrames ();
+
+    static void tickTimerTick (void *_self);
+
+  mt_iface (VideoStream::EventHandler)
+    static VideoStream::EventHandler const source_handler;
+
+    static void sourceAudioMessage (VideoStream::AudioMessage * mt_nonnull msg,
+                                    void                      *_self);
+
+    static void sourceVideoMessage (VideoStream::VideoMessage * mt_nonnull msg,
+                                    void                      *_self);
+  mt_iface_end
+
+public:
+    // Starts playing out the buffered frames into @out_stream.
+    void start (VideoStream * mt_nonnull out_stream);
+
+    // Drops buffered frames and stops following the source stream.
+    void release ();
+
+    // Buffering starts right away.
+    mt_const void init (Timers      * mt_nonnull timers,
+                        VideoStream * mt_nonnull source_stream);
+
+     PrerollBuffer ();
+    ~PrerollBuffer ();
+};
+
+}
+
+
+#endif /* MOMENT__PREROLL_BUFFER__H__ */
+
@@ -26,7 +26,8 @@ namespace Moment {
 
 Playback::Frontend Recorder::playback_frontend = {
     startPlaybackItem,
-    stopPlaybackItem
+    stopPlaybackItem,
+    NULL /* prerollItem */
 };
 
 void
@@ -242,7 +243,7 @@ Recorder::doStartItem ()
 		tlocal->localtime.tm_hour, "-",
 		tlocal->localtime.tm_min, "-",
 		tlocal->localtime.tm_sec,
-		".flv");
+		moment->getRecordFilenameExt());
 
 	logD_ (_func, "Calling recorder.start(), filename: ", filename->mem());
 	recorder.start (filename->mem());
@@ -285,12 +286,25 @@ Recorder::init (MomentServer * const moment,
 	    thread_ctx = moment->getServerApp()->getServerContext()->getMainThreadContext();
 	}
 
-	recorder.init (thread_ctx, moment->getStorage());
+	recorder.init (thread_ctx, moment->getStorage(), moment->getPagePool());
+	recorder.setWriterParams (*moment->getRecordingWriterParams());
+	recorder.setSegmentParams (*moment->getRecordingSegmentParams());
     }
 
     flv_muxer.setPagePool (page_pool);
-
-    recorder.setMuxer (&flv_muxer);
+    flv_muxer.setBuildKeyframeIndex (moment->getRecordKeyframeIndex());
+    flv_muxer.setMetaDataReserve ((Size) moment->getRecordMetaDataReserve());
+
+    mp4_muxer.setPagePool (page_pool);
+    mp4_muxer.setFragmentDuration (moment->getRecordMp4FragmentDuration());
+    mp4_muxer.setFaststart (moment->getRecordMp4Faststart());
+    if (moment->getRecordMp4IndexSpillSize())
+        mp4_muxer.setIndexSpill (moment->getRecordMp4IndexSpillDir(), moment->getRecordMp4IndexSpillSize());
+
+    if (moment->getRecordMp4())
+        recorder.setMuxer (&mp4_muxer);
+    else
+        recorder.setMuxer (&flv_muxer);
 
 // TODO recorder frontend + error reporting
 //    recorder.setFrontend (CbDesc<AvRecorder::Frontend> (
@@ -27,6 +27,7 @@
 #include <moment/channel_set.h>
 #include <moment/av_recorder.h>
 #include <moment/flv_muxer.h>
+#include <moment/mp4_fragment_muxer.h>
 
 
 namespace Moment {
@@ -50,6 +51,7 @@ private:
 
     mt_async AvRecorder recorder;
     mt_async FlvMuxer   flv_muxer;
+    mt_async Mp4FragmentMuxer mp4_muxer;
 
     mt_mutex (mutex) bool                 recording_now;
     mt_mutex (mutex) Ref<RecordingTicket> cur_recording_ticket;
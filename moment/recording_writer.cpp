@@ -0,0 +1,609 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <moment/latency_stats.h>
+
+#include <moment/recording_writer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_writer ("recording_writer", LogLevel::I);
+
+// O_DIRECT requires block-aligned buffers, offsets and lengths.
+static Size const direct_io_block_size = 4096;
+
+mt_mutex (mutex) RecordingWriter::WriteBuffer*
+RecordingWriter::newBuffer ()
+{
+    WriteBuffer *buf;
+    if (spare_buf) {
+        buf = spare_buf;
+        spare_buf = NULL;
+    } else {
+        buf = new (std::nothrow) WriteBuffer;
+        assert (buf);
+
+        void *data = NULL;
+        if (posix_memalign (&data, direct_io_block_size, params.buffer_size) != 0)
+            data = NULL;
+        assert (data);
+        buf->data = (Byte*) data;
+    }
+
+    buf->len = 0;
+    buf->carry_len = 0;
+    buf->payload_len = 0;
+    buf->file_offs = 0;
+    buf->enqueue_time_microsec = 0;
+
+    return buf;
+}
+
+void
+RecordingWriter::deleteBuffer (WriteBuffer * const buf)
+{
+    if (!buf)
+        return;
+
+    free (buf->data);
+    delete buf;
+}
+
+// With O_DIRECT, the unaligned tail of the buffer is written padded and then
+// carried over to the next buffer, which rewrites the last block later on.
+mt_mutex (mutex) void
+RecordingWriter::pushCurBuffer ()
+{
+    if (cur_buf->len <= cur_buf->carry_len)
+        return;
+
+    Size const aligned_len = cur_buf->len - cur_buf->len % block_size;
+    Size const tail_len = cur_buf->len - aligned_len;
+
+    cur_buf->payload_len = cur_buf->len - cur_buf->carry_len;
+
+    WriteBuffer * const next_buf = newBuffer ();
+    next_buf->file_offs = cur_buf->file_offs + aligned_len;
+    if (tail_len > 0) {
+        memcpy (next_buf->data, cur_buf->data + aligned_len, tail_len);
+        memset (cur_buf->data + cur_buf->len, 0, block_size - tail_len);
+        cur_buf->len = aligned_len + block_size;
+    }
+    next_buf->len = tail_len;
+    next_buf->carry_len = tail_len;
+
+    cur_buf->enqueue_time_microsec = LatencyStats::getMonotonicMicroseconds ();
+    write_queue.append (cur_buf);
+    cur_buf = next_buf;
+
+    ++stats.queue_depth;
+    if (stats.queue_depth > stats.max_queue_depth)
+        stats.max_queue_depth = stats.queue_depth;
+
+    last_push_time_millisec = getTimeMilliseconds ();
+
+    write_reg.scheduleTask (&write_task, false /* permanent */);
+}
+
+mt_mutex (mutex) void
+RecordingWriter::appendData (ConstMemory mem)
+{
+    while (mem.len() > 0) {
+        Size tocopy = params.buffer_size - cur_buf->len;
+        if (tocopy > mem.len())
+            tocopy = mem.len();
+
+        memcpy (cur_buf->data + cur_buf->len, mem.mem(), tocopy);
+        cur_buf->len += tocopy;
+        total_len += tocopy;
+        mem = mem.region (tocopy);
+
+        if (cur_buf->len == params.buffer_size)
+            pushCurBuffer ();
+    }
+}
+
+mt_mutex (mutex) void
+RecordingWriter::recycleBuffer (WriteBuffer * const mt_nonnull buf)
+{
+    --stats.queue_depth;
+
+    if (!spare_buf)
+        spare_buf = buf;
+    else
+        deleteBuffer (buf);
+}
+
+mt_mutex (mutex) void
+RecordingWriter::updateWriteStats (WriteBuffer * const mt_nonnull buf)
+{
+    // Measured from the moment when the buffer was queued. The buffer is
+    // queued and written on different threads, hence the raw clock.
+    Time const now_microsec = LatencyStats::getMonotonicMicroseconds ();
+    Time const write_latency = (now_microsec > buf->enqueue_time_microsec ?
+                                        now_microsec - buf->enqueue_time_microsec : 0);
+
+    stats.bytes_written += buf->payload_len;
+    ++stats.num_writes;
+
+    stats.last_write_latency_microsec = write_latency;
+    if (write_latency > stats.max_write_latency_microsec)
+        stats.max_write_latency_microsec = write_latency;
+
+    total_write_latency_microsec += write_latency;
+    stats.avg_write_latency_microsec = total_write_latency_microsec / stats.num_writes;
+}
+
+void
+RecordingWriter::preallocate (WriteBuffer * const mt_nonnull buf)
+{
+    if (params.prealloc_size == 0)
+        return;
+
+    while (buf->file_offs + buf->len > prealloc_end) {
+        if (async_file) {
+            async_file->preallocate (prealloc_end, params.prealloc_size);
+        } else {
+#ifdef __linux__
+            if (fallocate (fd, FALLOC_FL_KEEP_SIZE, (off_t) prealloc_end, (off_t) params.prealloc_size) == -1) {
+                logD (writer, _func, "fallocate() failed: ", errnoString (errno));
+                break;
+            }
+#endif
+        }
+
+        prealloc_end += params.prealloc_size;
+    }
+}
+
+Result
+RecordingWriter::writeBuffer (WriteBuffer * const mt_nonnull buf)
+{
+    preallocate (buf);
+
+    Size pos = 0;
+    while (pos < buf->len) {
+        ssize_t const res = pwrite (fd, buf->data + pos, buf->len - pos, (off_t) (buf->file_offs + pos));
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            logE (writer, _func, "pwrite() failed: ", errnoString (errno));
+            return Result::Failure;
+        }
+
+        pos += (Size) res;
+    }
+
+    return Result::Success;
+}
+
+// Called in the thread of 'write_reg', which is the thread where
+// async_file's completions are delivered as well.
+mt_unlocks (mutex) void
+RecordingWriter::submitAsyncWrites ()
+{
+    while (!write_queue.isEmpty()) {
+        // With O_DIRECT, the padded tail of a buffer overlaps with the next one,
+        // hence such writes must not be reordered.
+        if (block_size > 1 && num_inflight > 0)
+            break;
+
+        WriteBuffer * const buf = write_queue.getFirst();
+        write_queue.remove (write_queue.getFirstElement());
+
+        if (write_error) {
+            recycleBuffer (buf);
+            continue;
+        }
+
+        ++num_inflight;
+        mutex.unlock ();
+
+        preallocate (buf);
+        Result const res = async_file->write (ConstMemory (buf->data, buf->len), buf->file_offs, buf);
+
+        mutex.lock ();
+        if (!res) {
+            logE (writer, _func, "async_file->write() failed: ", exc->toString());
+            --num_inflight;
+            write_error = true;
+            recycleBuffer (buf);
+        }
+    }
+
+    bool const do_close = close_after_flush
+                          && !closed
+                          && write_queue.isEmpty()
+                          && num_inflight == 0;
+    if (do_close)
+        closed = true;
+    mutex.unlock ();
+
+    if (do_close) {
+        doClose ();
+        // Pairs with ref() in closeAfterFlush().
+        getCoderefContainer()->unref ();
+    }
+}
+
+Storage::AsyncFile::Frontend const RecordingWriter::async_file_frontend = {
+    asyncWriteComplete
+};
+
+void
+RecordingWriter::asyncWriteComplete (Result   const res,
+                                     void   * const _buf,
+                                     void   * const _self)
+{
+    RecordingWriter * const self = static_cast <RecordingWriter*> (_self);
+    WriteBuffer * const buf = static_cast <WriteBuffer*> (_buf);
+
+    self->mutex.lock ();
+    --self->num_inflight;
+    if (res)
+        self->updateWriteStats (buf);
+    else
+        self->write_error = true;
+
+    self->recycleBuffer (buf);
+
+    mt_unlocks (mutex) self->submitAsyncWrites ();
+}
+
+void
+RecordingWriter::doClose ()
+{
+    if (flush_timer) {
+        timers->deleteTimer (flush_timer);
+        flush_timer = NULL;
+    }
+
+    mutex.lock ();
+    Uint64 const file_len = total_len;
+    bool const got_write_error = write_error;
+    mutex.unlock ();
+
+    // Padding and preallocated blocks past the end of data are cut off.
+    bool const do_truncate = (params.direct_io || params.prealloc_size > 0);
+
+    if (async_file) {
+        if (do_truncate) {
+            if (!async_file->truncate (file_len))
+                logE (writer, _func, "async_file->truncate() failed: ", exc->toString());
+        }
+
+        async_file->close ();
+    } else
+    if (fd != -1) {
+        if (do_truncate) {
+            if (ftruncate (fd, (off_t) file_len) == -1)
+                logE (writer, _func, "ftruncate() failed: ", errnoString (errno));
+        }
+
+        if (::close (fd) == -1)
+            logE (writer, _func, "close() failed: ", errnoString (errno));
+
+        fd = -1;
+    }
+
+    logD (writer, _func, "bytes written: ", stats.bytes_written, ", "
+          "writes: ", stats.num_writes, ", "
+          "max queue depth: ", stats.max_queue_depth, ", "
+          "max write latency: ", stats.max_write_latency_microsec, " us");
+
+    // The file may be opened once again by the frontend (without O_DIRECT),
+    // which is fine since all writes have completed by now.
+    if (close_frontend)
+        close_frontend.call (close_frontend->closed, /*(*/ got_write_error /*)*/);
+}
+
+bool
+RecordingWriter::writeTask (void * const _self)
+{
+    RecordingWriter * const self = static_cast <RecordingWriter*> (_self);
+
+    self->mutex.lock ();
+
+    if (self->async_file) {
+        mt_unlocks (mutex) self->submitAsyncWrites ();
+        return false /* Do not reschedule */;
+    }
+
+    while (!self->write_queue.isEmpty()) {
+        WriteBuffer * const buf = self->write_queue.getFirst();
+        self->write_queue.remove (self->write_queue.getFirstElement());
+        bool const skip = self->write_error;
+        self->mutex.unlock ();
+
+        Result res = Result::Success;
+        if (!skip)
+            res = self->writeBuffer (buf);
+
+        self->mutex.lock ();
+        if (!skip) {
+            if (res)
+                self->updateWriteStats (buf);
+            else
+                self->write_error = true;
+        }
+
+        self->recycleBuffer (buf);
+    }
+
+    bool const do_close = self->close_after_flush && !self->closed;
+    if (do_close)
+        self->closed = true;
+    self->mutex.unlock ();
+
+    if (do_close) {
+        self->doClose ();
+        // Pairs with ref() in closeAfterFlush().
+        self->getCoderefContainer()->unref ();
+    }
+
+    return false /* Do not reschedule */;
+}
+
+void
+RecordingWriter::flushTimerTick (void * const _self)
+{
+    RecordingWriter * const self = static_cast <RecordingWriter*> (_self);
+
+    self->mutex.lock ();
+    if (!self->close_after_flush
+        && getTimeMilliseconds () - self->last_push_time_millisec >= self->params.flush_interval_millisec)
+    {
+        self->pushCurBuffer ();
+    }
+    self->mutex.unlock ();
+}
+
+mt_async void
+RecordingWriter::sendMessage (Sender::MessageEntry * const mt_nonnull msg_entry,
+                              bool                   const do_flush)
+{
+    mutex.lock ();
+    sendMessage_unlocked (msg_entry, do_flush);
+    mutex.unlock ();
+}
+
+mt_mutex (mutex) void
+RecordingWriter::sendMessage_unlocked (Sender::MessageEntry * const mt_nonnull msg_entry,
+                                       bool                   const /* do_flush */)
+{
+    // 'do_flush' is ignored: flushing each FLV tag is exactly what we avoid.
+
+    if (close_after_flush || write_error) {
+        Sender::deleteMessageEntry (msg_entry);
+        return;
+    }
+
+    switch (msg_entry->type) {
+	case Sender::MessageEntry::Pages: {
+	    Sender::MessageEntry_Pages * const msg_pages =
+		    static_cast <Sender::MessageEntry_Pages*> (msg_entry);
+
+            appendData (ConstMemory (msg_pages->getHeaderData(), msg_pages->header_len));
+
+            PagePool::Page *page = msg_pages->getFirstPage();
+            Size msg_offset = msg_pages->msg_offset;
+            while (page) {
+                if (page->data_len > msg_offset)
+                    appendData (page->mem().region (msg_offset));
+
+                msg_offset = 0;
+                page = page->getNextMsgPage();
+            }
+	} break;
+	default:
+	    unreachable ();
+    }
+
+    Sender::deleteMessageEntry (msg_entry);
+}
+
+mt_async void
+RecordingWriter::flush ()
+{
+    mutex.lock ();
+    flush_unlocked ();
+    mutex.unlock ();
+}
+
+mt_mutex (mutex) void
+RecordingWriter::flush_unlocked ()
+{
+  // Explicit flushes are no-ops. Data is written by size or by timer.
+}
+
+mt_async void
+RecordingWriter::closeAfterFlush ()
+{
+    mutex.lock ();
+    if (close_after_flush) {
+        mutex.unlock ();
+        return;
+    }
+    close_after_flush = true;
+
+    // Keeps the writer alive until all buffers are written.
+    getCoderefContainer()->ref ();
+
+    pushCurBuffer ();
+    write_reg.scheduleTask (&write_task, false /* permanent */);
+    mutex.unlock ();
+}
+
+mt_async void
+RecordingWriter::close ()
+{
+    closeAfterFlush ();
+}
+
+mt_mutex (mutex) bool
+RecordingWriter::isClosed_unlocked ()
+{
+    return close_after_flush;
+}
+
+mt_mutex (mutex) Sender::SendState
+RecordingWriter::getSendState_unlocked ()
+{
+    return SendState::ConnectionReady;
+}
+
+void
+RecordingWriter::lock ()
+{
+    mutex.lock ();
+}
+
+void
+RecordingWriter::unlock ()
+{
+    mutex.unlock ();
+}
+
+void
+RecordingWriter::getStats (Stats * const mt_nonnull ret_stats)
+{
+    mutex.lock ();
+    *ret_stats = stats;
+    mutex.unlock ();
+}
+
+mt_throws Result
+RecordingWriter::open (ConstMemory         const filename,
+                       Params const       &params,
+                       Storage           * const storage,
+                       DeferredProcessor * const mt_nonnull deferred_processor,
+                       Timers            * const mt_nonnull timers,
+                       PollGroup         * const mt_nonnull poll_group)
+{
+    this->params = params;
+    this->timers = timers;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    block_size = 1;
+#ifdef O_DIRECT
+    if (params.direct_io) {
+        flags |= O_DIRECT;
+        block_size = direct_io_block_size;
+    }
+#endif
+
+    if (this->params.buffer_size < block_size)
+        this->params.buffer_size = block_size;
+    this->params.buffer_size = (this->params.buffer_size + block_size - 1) / block_size * block_size;
+
+    if (storage) {
+        async_file = storage->openAsyncFile (filename,
+                                             params.direct_io,
+                                             deferred_processor,
+                                             poll_group,
+                                             CbDesc<Storage::AsyncFile::Frontend> (&async_file_frontend,
+                                                                                   this,
+                                                                                   getCoderefContainer()));
+    }
+
+    if (!async_file) {
+        // Falling back to synchronous pwrite() from the recorder thread.
+        fd = ::open (String (filename).cstr(), flags, 0644);
+        if (fd == -1) {
+            exc_throw (PosixException, errno);
+            logE (writer, _func, "open() failed for ", filename, ": ", errnoString (errno));
+            return Result::Failure;
+        }
+    }
+
+    write_reg.setDeferredProcessor (deferred_processor);
+
+    mutex.lock ();
+    cur_buf = newBuffer ();
+    last_push_time_millisec = getTimeMilliseconds ();
+    mutex.unlock ();
+
+    if (params.flush_interval_millisec > 0) {
+        flush_timer = timers->addTimer_microseconds (
+                CbDesc<Timers::TimerCallback> (flushTimerTick, this, getCoderefContainer()),
+                params.flush_interval_millisec * 1000,
+                true /* periodical */);
+    }
+
+    return Result::Success;
+}
+
+RecordingWriter::RecordingWriter (Object * const coderef_container)
+    : Sender (coderef_container),
+      DependentCodeReferenced (coderef_container),
+      cur_buf (NULL),
+      spare_buf (NULL),
+      total_len (0),
+      last_push_time_millisec (0),
+      close_after_flush (false),
+      closed (false),
+      write_error (false),
+      num_inflight (0),
+      total_write_latency_microsec (0),
+      block_size (1),
+      fd (-1),
+      prealloc_end (0),
+      timers (NULL),
+      flush_timer (NULL)
+{
+    memset (&stats, 0, sizeof (stats));
+
+    write_task.cb = CbDesc<DeferredProcessor::TaskCallback> (writeTask, this, coderef_container);
+}
+
+RecordingWriter::~RecordingWriter ()
+{
+    write_reg.release ();
+
+    if (flush_timer) {
+        timers->deleteTimer (flush_timer);
+        flush_timer = NULL;
+    }
+
+    if (fd != -1) {
+        ::close (fd);
+        fd = -1;
+    }
+
+    mutex.lock ();
+    while (!write_queue.isEmpty()) {
+        deleteBuffer (write_queue.getFirst());
+        write_queue.remove (write_queue.getFirstElement());
+    }
+
+    deleteBuffer (cur_buf);
+    deleteBuffer (spare_buf);
+    mutex.unlock ();
+}
+
+}
@@ -0,0 +1,205 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__RECORDING_WRITER__H__
+#define MOMENT__RECORDING_WRITER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/storage.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// A Sender which coalesces muxed messages into large buffers and writes them
+// to a file in big chunks from the recorder thread. Buffers are flushed when
+// they're full or when 'flush_interval_millisec' expires.
+//
+// If the storage supports asynchronous writes (see Storage::openAsyncFile()),
+// buffers are handed to it instead of being written with pwrite().
+//
+class RecordingWriter : public Sender,
+                        public DependentCodeReferenced
+{
+public:
+    struct Params
+    {
+        // 0 means that coalescing is disabled and recordings are written
+        // through Storage::openFile() as usual.
+        Size   buffer_size;
+        Time   flush_interval_millisec;
+        // Preallocation step for fallocate(), 0 - no preallocation.
+        Uint64 prealloc_size;
+        bool   direct_io;
+
+        Params ()
+            : buffer_size (0),
+              flush_interval_millisec (1000),
+              prealloc_size (0),
+              direct_io (false)
+        {}
+    };
+
+    struct Stats
+    {
+        Count  queue_depth;
+        Count  max_queue_depth;
+        // Recorded data only. O_DIRECT padding and rewritten tail blocks
+        // are not counted.
+        Uint64 bytes_written;
+        Uint64 num_writes;
+        Time   last_write_latency_microsec;
+        Time   max_write_latency_microsec;
+        Time   avg_write_latency_microsec;
+    };
+
+    struct CloseFrontend
+    {
+        // Called from the recorder thread once all data has been written
+        // and the file has been closed.
+        void (*closed) (bool  write_error,
+                        void *cb_data);
+    };
+
+private:
+    struct WriteBuffer
+    {
+        Byte   *data;
+        Size    len;
+        // Bytes carried over from the previous buffer (O_DIRECT alignment).
+        Size    carry_len;
+        // Bytes of data which are written for the first time, without
+        // carried over bytes and padding.
+        Size    payload_len;
+        Uint64  file_offs;
+        // LatencyStats::getMonotonicMicroseconds()
+        Time    enqueue_time_microsec;
+    };
+
+  mt_mutex (mutex)
+  mt_begin
+    WriteBuffer *cur_buf;
+    List<WriteBuffer*> write_queue;
+    // A single spare buffer to avoid reallocating big chunks of memory.
+    WriteBuffer *spare_buf;
+
+    Uint64 total_len;
+    Time   last_push_time_millisec;
+
+    bool close_after_flush;
+    bool closed;
+    bool write_error;
+
+    // Asynchronous writes which have not completed yet.
+    Count num_inflight;
+
+    Stats stats;
+    Time  total_write_latency_microsec;
+  mt_end
+
+    mt_const Params params;
+    mt_const Size   block_size;
+    mt_const int    fd;
+
+    mt_const Ref<Storage::AsyncFile> async_file;
+
+    mt_const Cb<CloseFrontend> close_frontend;
+
+    // Accessed from write task only.
+    Uint64 prealloc_end;
+
+    mt_const Timers *timers;
+    mt_const Timers::TimerKey flush_timer;
+
+    DeferredProcessor::Task write_task;
+    DeferredProcessor::Registration write_reg;
+
+    mt_mutex (mutex) WriteBuffer* newBuffer ();
+
+    void deleteBuffer (WriteBuffer *buf);
+
+    mt_mutex (mutex) void pushCurBuffer ();
+
+    mt_mutex (mutex) void appendData (ConstMemory mem);
+
+    mt_mutex (mutex) void recycleBuffer (WriteBuffer * mt_nonnull buf);
+
+    mt_mutex (mutex) void updateWriteStats (WriteBuffer * mt_nonnull buf);
+
+    void preallocate (WriteBuffer * mt_nonnull buf);
+
+    Result writeBuffer (WriteBuffer * mt_nonnull buf);
+
+    mt_unlocks (mutex) void submitAsyncWrites ();
+
+    void doClose ();
+
+    static bool writeTask (void *_self);
+
+  mt_iface (Storage::AsyncFile::Frontend)
+    static Storage::AsyncFile::Frontend const async_file_frontend;
+
+    static void asyncWriteComplete (Result  res,
+                                    void   *_buf,
+                                    void   *_self);
+  mt_iface_end
+
+    static void flushTimerTick (void *_self);
+
+public:
+  mt_iface (Sender)
+    mt_async void sendMessage (Sender::MessageEntry * mt_nonnull msg_entry,
+                               bool do_flush);
+    mt_mutex (mutex) void sendMessage_unlocked (Sender::MessageEntry * mt_nonnull msg_entry,
+                                                bool do_flush);
+    mt_async void flush ();
+    mt_mutex (mutex) void flush_unlocked ();
+    mt_async void closeAfterFlush ();
+    mt_async void close ();
+    mt_mutex (mutex) bool isClosed_unlocked ();
+    mt_mutex (mutex) SendState getSendState_unlocked ();
+    void lock ();
+    void unlock ();
+  mt_iface_end
+
+    void getStats (Stats * mt_nonnull ret_stats);
+
+    mt_const void setCloseFrontend (CbDesc<CloseFrontend> const &close_frontend)
+        { this->close_frontend = close_frontend; }
+
+    // 'storage' is used for asynchronous writes only and may be NULL.
+    // 'poll_group' belongs to the thread of 'deferred_processor'.
+    mt_throws Result open (ConstMemory        filename,
+                           Params const      &params,
+                           Storage           *storage,
+                           DeferredProcessor * mt_nonnull deferred_processor,
+                           Timers            * mt_nonnull timers,
+                           PollGroup         * mt_nonnull poll_group);
+
+     RecordingWriter (Object *coderef_container);
+    ~RecordingWriter ();
+};
+
+}
+
+
+#endif /* MOMENT__RECORDING_WRITER__H__ */
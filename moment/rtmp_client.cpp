@@ -35,6 +35,7 @@ RtmpClient::connected (Exception * const exc_,
     RtmpClient * const self = static_cast <RtmpClient*> (_self);
 
     if (exc_) {
+        self->stopPublishing ();
         if (self->frontend)
             self->frontend.call (self->frontend->closed);
         return;
@@ -57,6 +58,7 @@ RtmpClient::closeRtmpConn (void * const _self)
 
     logD_ (_func_);
 
+    self->stopPublishing ();
     if (self->frontend)
         self->frontend.call (self->frontend->closed);
 }
@@ -122,18 +124,22 @@ RtmpClient::commandMessage (VideoStream::Message   * const mt_nonnull msg,
 		    return Result::Failure;
 		}
 
-#if 0
-// publish
-                    self->rtmp_conn.sendPublish (options.channel->mem());
-
-                    Ref<VideoStream> const video_stream = grab (new (std::nothrow) VideoStream);
-                    video_stream->getEventInformer()->subscribe (
-                            CbDesc<VideoStream::EventHandler> (&gen_stream_handler,
-                                                               self,
-                                                               self->getCoderefContainer()));
-#endif
-
-                self->rtmp_conn.sendPlay (self->stream_name->mem());
+                if (self->publish) {
+                    self->rtmp_conn.sendPublish (self->stream_name->mem());
+
+                    if (self->stream) {
+                        GenericInformer::SubscriptionKey const sbn =
+                                self->stream->getEventInformer()->subscribe (
+                                        CbDesc<VideoStream::EventHandler> (&publish_stream_handler,
+                                                                           self,
+                                                                           self->getCoderefContainer()));
+                        self->mutex.lock ();
+                        self->publish_sbn = sbn;
+                        self->mutex.unlock ();
+                    }
+                } else {
+                    self->rtmp_conn.sendPlay (self->stream_name->mem());
+                }
 		self->conn_state = ConnectionState_Streaming;
 	    } break;
 	    case ConnectionState_PlaySent: {
@@ -183,7 +189,7 @@ RtmpClient::audioMessage (VideoStream::AudioMessage * const mt_nonnull audio_msg
 {
     RtmpClient * const self = static_cast <RtmpClient*> (_self);
 
-    if (self->stream)
+    if (self->stream && !self->publish)
         self->stream->fireAudioMessage (audio_msg);
 
     return Result::Success;
@@ -195,7 +201,7 @@ RtmpClient::videoMessage (VideoStream::VideoMessage * const mt_nonnull video_msg
 {
     RtmpClient * const self = static_cast <RtmpClient*> (_self);
 
-    if (self->stream)
+    if (self->stream && !self->publish)
         self->stream->fireVideoMessage (video_msg);
 
     return Result::Success;
@@ -212,10 +218,47 @@ RtmpClient::closed (Exception * const exc_,
     else
 	logD_ (_func_);
 
+    self->stopPublishing ();
     if (self->frontend)
         self->frontend.call (self->frontend->closed);
 }
 
+VideoStream::EventHandler const RtmpClient::publish_stream_handler = {
+    publishAudioMessage,
+    publishVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
+void
+RtmpClient::publishAudioMessage (VideoStream::AudioMessage * const mt_nonnull audio_msg,
+                                 void                      * const _self)
+{
+    RtmpClient * const self = static_cast <RtmpClient*> (_self);
+    self->rtmp_conn.sendAudioMessage (audio_msg);
+}
+
+void
+RtmpClient::publishVideoMessage (VideoStream::VideoMessage * const mt_nonnull video_msg,
+                                 void                      * const _self)
+{
+    RtmpClient * const self = static_cast <RtmpClient*> (_self);
+    self->rtmp_conn.sendVideoMessage (video_msg);
+}
+
+void
+RtmpClient::stopPublishing ()
+{
+    mutex.lock ();
+    GenericInformer::SubscriptionKey const sbn = publish_sbn;
+    publish_sbn = NULL;
+    mutex.unlock ();
+
+    if (sbn)
+        stream->getEventInformer()->unsubscribe (sbn);
+}
+
 Result
 RtmpClient::start ()
 {
@@ -271,6 +314,7 @@ RtmpClient::init (ServerThreadContext * const mt_nonnull thread_ctx,
                   IpAddress             const server_addr,
                   ConstMemory           const app_name,
                   ConstMemory           const stream_name,
+                  bool                  const publish,
                   bool                  const momentrtmp_proto,
                   Time                  const ping_timeout_millisec,
                   Time                  const send_delay_millisec,
@@ -281,6 +325,7 @@ RtmpClient::init (ServerThreadContext * const mt_nonnull thread_ctx,
     this->server_addr      = server_addr;
     this->app_name         = st_grab (new (std::nothrow) String (app_name));
     this->stream_name      = st_grab (new (std::nothrow) String (stream_name));
+    this->publish          = publish;
     this->momentrtmp_proto = momentrtmp_proto;
     this->frontend         = frontend;
 
@@ -311,6 +356,7 @@ RtmpClient::RtmpClient (Object * const coderef_container)
       tcp_conn         (coderef_container),
       conn_sender      (coderef_container),
       conn_receiver    (coderef_container),
+      publish          (false),
       momentrtmp_proto (false),
       conn_state       (ConnectionState_Connect)
 {
@@ -318,6 +364,8 @@ RtmpClient::RtmpClient (Object * const coderef_container)
 
 RtmpClient::~RtmpClient ()
 {
+    stopPublishing ();
+
     mutex.lock ();
     thread_ctx->getPollGroup()->removePollable (pollable_key);
     mutex.unlock ();
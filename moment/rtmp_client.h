@@ -56,17 +56,34 @@ private:
     DeferredConnectionSender conn_sender;
     ConnectionReceiver       conn_receiver;
 
+    // Received messages are fired into 'stream' when playing. When publishing,
+    // messages of 'stream' are sent to the server.
     mt_const Ref<VideoStream> stream;
 
     mt_const IpAddress     server_addr;
     mt_const StRef<String> app_name;
     mt_const StRef<String> stream_name;
+    mt_const bool          publish;
     mt_const bool          momentrtmp_proto;
 
     mt_const Cb<Frontend> frontend;
 
     mt_mutex (mutex) PollGroup::PollableKey pollable_key;
 
+    mt_mutex (mutex) GenericInformer::SubscriptionKey publish_sbn;
+
+    void stopPublishing ();
+
+  mt_iface (VideoStream::EventHandler)
+    static VideoStream::EventHandler const publish_stream_handler;
+
+    static void publishAudioMessage (VideoStream::AudioMessage * mt_nonnull audio_msg,
+                                     void                      *_self);
+
+    static void publishVideoMessage (VideoStream::VideoMessage * mt_nonnull video_msg,
+                                     void                      *_self);
+  mt_iface_end
+
     mt_sync_domain (rtmp_conn_frontend) ConnectionState conn_state;
 
   mt_iface (TcpConnection::Frontend)
@@ -117,6 +134,7 @@ public:
                         IpAddress            server_addr,
                         ConstMemory          app_name,
                         ConstMemory          stream_name,
+                        bool                 publish,
                         bool                 momentrtmp_proto,
                         Time                 ping_timeout_millisec,
                         Time                 send_delay_millisec,
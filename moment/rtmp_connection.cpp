@@ -21,6 +21,7 @@
 #include "hmac/hmac_sha2.h"
 
 #include <moment/flv_util.h>
+#include <moment/metrics.h>
 
 #include <moment/rtmp_connection.h>
 
@@ -470,12 +471,11 @@ RtmpConnection::fillPrechunkedPages (PrechunkContext        * const  prechunk_ct
 				     PagePool::PageListHead * const  page_list,
 				     Uint32                   const  chunk_stream_id,
 				     Uint64                   const  /* msg_timestamp */,
-				     bool                     const  first_chunk)
+				     bool                     const  first_chunk,
+				     Size                     const  prechunk_size)
 {
 //    logD_ (_func, "len: ", mem.len(), ", timestamp: 0x", fmt_hex, (UintPtr) msg_timestamp);
 
-    Size const prechunk_size = PrechunkSize;
-
     logD (prechunk, _func, mem.len(), " bytes, prechunk_size: ", prechunk_size);
 
     Size total_filled = 0;
@@ -588,6 +588,9 @@ RtmpConnection::sendMessagePages (MessageDesc const      * const mt_nonnull mdes
     }
 #endif
 
+    Metrics::inc (Metrics::RtmpMessagesOut);
+    Metrics::add (Metrics::RtmpBytesQueued, mdesc->msg_len);
+
     if (!unlocked)
 	send_mutex.lock ();
 
@@ -882,6 +885,15 @@ RtmpConnection::sendSetPeerBandwidth (Uint32 const wack_size,
     sendMessage (&mdesc, control_chunk_stream, ConstMemory::forObject (msg), 0 /* prechunk_size */);
 }
 
+void
+RtmpConnection::disableTimestampAdjustment ()
+{
+    send_mutex.lock ();
+    out_got_first_timestamp = true;
+    out_first_timestamp = 0;
+    send_mutex.unlock ();
+}
+
 void
 RtmpConnection::sendUserControl_StreamBegin (Uint32 const msg_stream_id)
 {
@@ -1139,6 +1151,9 @@ RtmpConnection::sendVideoMessage (VideoStream::VideoMessage * const mt_nonnull m
                       false /* unlocked */,
                       flv_video_header,
                       flv_video_header_len);
+
+    if (msg->ingest_time_microsec)
+        LatencyStats::markFrameQueued ();
 }
 
 void
@@ -1184,6 +1199,9 @@ RtmpConnection::sendAudioMessage (VideoStream::AudioMessage * const mt_nonnull m
                       false /* unlocked */,
                       flv_audio_header,
                       flv_audio_header_len);
+
+    if (msg->ingest_time_microsec)
+        LatencyStats::markFrameQueued ();
 }
 
 void
@@ -1424,6 +1442,8 @@ RtmpConnection::processMessage (ChunkStream * const chunk_stream)
 {
     logD (msg, _func_);
 
+    Metrics::inc (Metrics::RtmpMessagesIn);
+
     logD (proto_in, _func, "ts 0x", fmt_hex, chunk_stream->in_msg_timestamp,
 	  " (", fmt_def, chunk_stream->in_msg_timestamp, "), "
 	  "tid ", fmt_def, chunk_stream->in_msg_type_id, " (", (RtmpMessageType) chunk_stream->in_msg_type_id, ")"
@@ -1607,6 +1627,9 @@ RtmpConnection::processMessage (ChunkStream * const chunk_stream)
 
 		audio_msg.prechunk_size = (prechunking_enabled ? PrechunkSize : 0);
 
+                if (LatencyStats::sampleFrame ())
+                    audio_msg.ingest_time_microsec = LatencyStats::getMonotonicMicroseconds ();
+
 		Result res = Result::Failure;
 		frontend.call_ret<Result> (&res, frontend->audioMessage, /*(*/ &audio_msg /*)*/);
 		return res;
@@ -1666,6 +1689,9 @@ RtmpConnection::processMessage (ChunkStream * const chunk_stream)
 
 		video_msg.prechunk_size = (prechunking_enabled ? PrechunkSize : 0);
 
+                if (LatencyStats::sampleFrame ())
+                    video_msg.ingest_time_microsec = LatencyStats::getMonotonicMicroseconds ();
+
 		Result res = Result::Failure;
 		frontend.call_ret<Result> (&res, frontend->videoMessage, /*(*/ &video_msg /*)*/);
 		return res;
@@ -1773,7 +1799,17 @@ RtmpConnection::processUserControlMessage (ChunkStream * const chunk_stream)
 	} break;
 	case UserControlMessageType::SetBufferLength: {
 	    logD (proto_in, _func, "SetBufferLength");
-	  // No-op
+
+	    if (msg_len < 10) {
+		logE_ (_func, "SetBufferLength message is too short (", msg_len, " bytes)");
+		return Result::Failure;
+	    }
+
+	    Uint32 const buffer_len = ((Uint32) msg_buf [6] << 24) |
+				      ((Uint32) msg_buf [7] << 16) |
+				      ((Uint32) msg_buf [8] <<  8) |
+				      ((Uint32) msg_buf [9] <<  0);
+	    client_buffer_len.set ((int) (buffer_len < 0x7fffffff ? buffer_len : 0x7fffffff));
 	} break;
 	case UserControlMessageType::StreamIsRecorded: {
 	  // TODO Send "stream is recorded" to clients?
@@ -2195,6 +2231,8 @@ RtmpConnection::doProcessInput (ConstMemory   const mem,
 		    len -= 1536;
 		}
 
+		Metrics::inc (Metrics::RtmpHandshakes);
+
 		if (frontend && frontend->handshakeComplete) {
 		    Result res;
 		    if (!frontend.call_ret<Result> (&res, frontend->handshakeComplete)) {
@@ -2654,6 +2692,7 @@ _return:
 
     assert (len <= mem.len());
     *ret_accepted = mem.len() - len;
+    Metrics::add (Metrics::RtmpBytesIn, *ret_accepted);
 
     processing_input = false;
 
@@ -2932,6 +2971,8 @@ RtmpConnection::RtmpConnection (Object * const coderef_container)
       // First timeout period has double duration.
       ping_reply_received (1),
 
+      client_buffer_len (0),
+
       in_chunk_size  (DefaultChunkSize),
       out_chunk_size (DefaultChunkSize),
 
@@ -299,6 +299,9 @@ private:
     AtomicInt ping_reply_received;
     AtomicInt ping_timeout_expired_once;
 
+    // Set by the client with SetBufferLength user control message.
+    AtomicInt client_buffer_len;
+
     mt_sync_domain (receiver) Size in_chunk_size;
     mt_mutex (send_mutex) Size out_chunk_size;
 
@@ -393,13 +396,16 @@ public:
 	ChunkStream* getChunkStream (Uint32 chunk_stream_id,
 				     bool create);
 
+    // Messages prechunked with a non-default @prechunk_size should be sent
+    // with the same VideoStream::Message::prechunk_size.
     static void fillPrechunkedPages (PrechunkContext        *prechunk_ctx,
 				     ConstMemory const      &mem,
 				     PagePool               *page_pool,
 				     PagePool::PageListHead *page_list,
 				     Uint32                  chunk_stream_id,
 				     Uint64                  msg_timestamp,
-				     bool                    first_chunk);
+				     bool                    first_chunk,
+				     Size                    prechunk_size = PrechunkSize);
 
   // Send methods.
 
@@ -587,6 +593,13 @@ public:
     // Should be called from frontend->commandMessage() callback only.
     Uint32 getRemoteWackSize () const { return remote_wack_size; }
 
+    // Buffer length in milliseconds requested by the client, 0 if unknown.
+    Uint32 getClientBufferLength () { return (Uint32) client_buffer_len.get(); }
+
+    // Outgoing audio/video timestamps are not rebased to the first message
+    // sent. Used for VOD, where timestamps are file positions.
+    void disableTimestampAdjustment ();
+
   // TODO doConnect(), doCreateStream(), etc. belong to RtmpServer.
 
     Result doCreateStream (Uint32      msg_stream_id,
@@ -43,6 +43,7 @@ RtmpFetchConnection::startNewSession (VideoStream * const stream,
                           server_addr,
                           app_name->mem(),
                           stream_name->mem(),
+                          false /* publish */,
                           momentrtmp_proto,
                           ping_timeout_millisec,
                           0 /* send_delay_millisec */,
@@ -277,6 +277,21 @@ RtmpServer::doPlay (Uint32       const msg_stream_id,
 	       "(length ", vs_name_full_len, " bytes, limit ", sizeof (vs_name_buf), " bytes)");
     }
 
+    Int64 start_millisec = -2;
+    {
+        // Flash Player sends the start position in milliseconds.
+        double start;
+        if (decoder->decodeNumber (&start)) {
+            if (start >= 0.0)
+                start_millisec = (Int64) start;
+            else
+            if (start > -1.5)
+                start_millisec = -1;
+        } else {
+            logD (rtmp_server, _func, "no start position");
+        }
+    }
+
     {
 	AmfAtom atoms [4];
 	AmfEncoder encoder (atoms);
@@ -399,6 +414,7 @@ RtmpServer::doPlay (Uint32       const msg_stream_id,
                     frontend->startRtmpWatching,
                     /*(*/
                         ConstMemory (vs_name_buf, vs_name_len),
+                        start_millisec,
                         CbDesc<StartRtmpWatchingCallback> (startRtmpWatchingCallback,
                                                            data,
                                                            getCoderefContainer(),
@@ -484,6 +500,97 @@ RtmpServer::doPause (Uint32       const msg_stream_id,
     return Result::Success;
 }
 
+Result
+RtmpServer::doSeek (Uint32       const msg_stream_id,
+                    AmfDecoder * const mt_nonnull decoder)
+{
+    logD (rtmp_server, _func_);
+
+    if (!playing.get()) {
+	logW_ (_func, "not playing");
+	return Result::Success;
+    }
+
+    double transaction_id;
+    if (!decoder->decodeNumber (&transaction_id)) {
+	logE_ (_func, "could not decode transaction_id");
+	return Result::Failure;
+    }
+
+    if (!decoder->skipObject ()) {
+	logE_ (_func, "could not skip command object");
+	return Result::Failure;
+    }
+
+    double position;
+    if (!decoder->decodeNumber (&position)) {
+	logE_ (_func, "could not decode seek position");
+	return Result::Failure;
+    }
+
+    Time const timestamp_millisec = (position > 0.0 ? (Time) position : 0);
+
+    Result res = Result::Failure;
+    if (frontend && frontend->seek) {
+	if (!frontend.call_ret<Result> (&res, frontend->seek, /*(*/ timestamp_millisec /*)*/)) {
+	    logE_ (_func, "frontend gone");
+	    return Result::Failure;
+	}
+    }
+
+    if (!res) {
+        // Live streams can't be seeked. This is not a connection error.
+        return sendPlayStatus (msg_stream_id, "NetStream.Seek.Failed", "Seek failed.");
+    }
+
+    {
+        Ref<String> const description_str = makeString ("Seeking ", timestamp_millisec, ".");
+        if (!sendPlayStatus (msg_stream_id, "NetStream.Seek.Notify", description_str->mem()))
+            return Result::Failure;
+    }
+
+    return sendPlayStatus (msg_stream_id, "NetStream.Play.Start", "Started playing.");
+}
+
+Result
+RtmpServer::sendPlayStatus (Uint32      const msg_stream_id,
+                            ConstMemory const code,
+                            ConstMemory const description)
+{
+    AmfAtom atoms [15];
+    AmfEncoder encoder (atoms);
+
+    encoder.addString ("onStatus");
+    encoder.addNumber (0.0 /* transaction_id */);
+    encoder.addNullObject ();
+
+    encoder.beginObject ();
+
+    encoder.addFieldName ("level");
+    encoder.addString ("status");
+
+    encoder.addFieldName ("code");
+    encoder.addString (code);
+
+    encoder.addFieldName ("description");
+    encoder.addString (description);
+
+    encoder.addFieldName ("clientid");
+    encoder.addNumber (1.0);
+
+    encoder.endObject ();
+
+    Byte msg_buf [4096];
+    Size msg_len;
+    if (!encoder.encode (Memory::forObject (msg_buf), AmfEncoding::AMF0, &msg_len)) {
+        logE_ (_func, "could not encode onStatus message");
+        return Result::Failure;
+    }
+
+    rtmp_conn->sendCommandMessage_AMF0 (msg_stream_id, ConstMemory (msg_buf, msg_len));
+    return Result::Success;
+}
+
 namespace {
 class StartRtmpStreamingCallback_Data : public Referenced
 {
@@ -863,6 +970,9 @@ RtmpServer::commandMessage (VideoStream::Message * const mt_nonnull msg,
     if (equal (method_mem, "pause")) {
 	return doPause (msg_stream_id, &decoder);
     } else
+    if (equal (method_mem, "seek")) {
+	return doSeek (msg_stream_id, &decoder);
+    } else
     if (equal (method_mem, "publish")) {
 	return doPublish (msg_stream_id, &decoder, conn_info);
     } else
@@ -68,7 +68,10 @@ public:
                                     Result                                   * mt_nonnull ret_res,
                                     void                                     *cb_data);
 
+        // 'start_millisec' is the "start" argument of "play": -2 if not
+        // specified (live or recorded), -1 for live only.
 	bool (*startRtmpWatching) (ConstMemory                              stream_name,
+                                   Int64                                    start_millisec,
                                    CbDesc<StartRtmpWatchingCallback> const &cb,
                                    Result                                  * mt_nonnull ret_res,
                                    void                                    *cb_data);
@@ -83,6 +86,9 @@ public:
 	Result (*pause) (void *cb_data);
 
 	Result (*resume) (void *cb_data);
+
+	Result (*seek) (Time  timestamp_millisec,
+	                void *cb_data);
     };
 
 private:
@@ -110,6 +116,9 @@ private:
     Result doPause (Uint32      msg_streamd_id,
 	   	    AmfDecoder * mt_nonnull decoder);
 
+    Result doSeek (Uint32      msg_stream_id,
+                   AmfDecoder * mt_nonnull decoder);
+
     static void startRtmpStreamingCallback (Result  res,
                                             void   *_self);
 
@@ -140,6 +149,11 @@ public:
     //      Get rid of it and use FrameSaver directly instead.
     void sendInitialMessages_unlocked (VideoStream::FrameSaver * mt_nonnull frame_saver);
 
+    // Sends an onStatus message with "status" level.
+    Result sendPlayStatus (Uint32      msg_stream_id,
+                           ConstMemory code,
+                           ConstMemory description);
+
     Result commandMessage (VideoStream::Message * mt_nonnull msg,
 			   Uint32                msg_stream_id,
 			   AmfEncoding           amf_encoding,
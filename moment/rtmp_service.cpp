@@ -17,6 +17,8 @@
 */
 
 
+#include <moment/metrics.h>
+
 #include <moment/rtmp_service.h>
 
 
@@ -56,6 +58,7 @@ RtmpService::destroySession (ClientSession * const session)
     }
     session->valid = false;
     --num_valid_sessions;
+    Metrics::inc (Metrics::RtmpSessionsClosed);
 
     assert (session->pollable_key);
     session->thread_ctx->getPollGroup()->removePollable (session->pollable_key);
@@ -169,6 +172,7 @@ RtmpService::acceptOneConnection ()
         // We may call destroySession(session) from now on.
 
         ++num_valid_sessions;
+        Metrics::inc (Metrics::RtmpSessionsOpened);
         last_accept_time = getTime();
 
         mutex.unlock ();
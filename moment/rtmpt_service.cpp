@@ -17,6 +17,8 @@
 */
 
 
+#include <moment/metrics.h>
+
 #include <moment/rtmpt_service.h>
 
 
@@ -287,6 +289,7 @@ RtmptService::destroyRtmptSession (RtmptSession * const mt_nonnull session,
     if (!session->session_map_entry.isNull()) {
         session_map.remove (session->session_map_entry);
         --num_valid_sessions;
+        Metrics::inc (Metrics::RtmpSessionsClosed);
     }
 
     mutex.unlock ();
@@ -453,6 +456,7 @@ RtmptService::doOpen (Sender * const mt_nonnull conn_sender,
 
     session->session_map_entry = session_map.add (session);
     ++num_valid_sessions;
+    Metrics::inc (Metrics::RtmpSessionsOpened);
 
     {
 	// Checking for session timeout at least each 10 seconds.
@@ -58,6 +58,26 @@ public:
 
     bool dump_frames;
 
+    // Load test mode.
+    bool   load_test;
+    // Clients to start per second, 0 - start all clients at once.
+    Uint32 ramp_rate;
+    // Seconds to keep all clients running before printing the summary.
+    Uint32 hold_time;
+    Uint32 num_publishers;
+    Uint32 num_streams;
+    // A player which gets no frames for this long is considered stalled.
+    Uint32 stall_timeout_millisec;
+    bool   json_summary;
+
+    // Decode frame marks put by TestStreamGenerator to measure publish->play
+    // latency and frame loss. Publishers put the marks in this mode.
+    bool measure_latency;
+
+    // Publishers replay this FLV file instead of generating a test stream.
+    Ref<String> replay_file;
+    FileReplayer::Options replay_opts;
+
     LogLevel loglevel;
 
     Options ()
@@ -74,6 +94,14 @@ public:
           report_audio (false),
           report_video (true),
           dump_frames (false),
+          load_test (false),
+          ramp_rate (0),
+          hold_time (60),
+          num_publishers (0),
+          num_streams (1),
+          stall_timeout_millisec (2000),
+          json_summary (false),
+          measure_latency (false),
           loglevel (LogLevel::Debug)
     {
     }
@@ -81,6 +109,77 @@ public:
 
 mt_const Options options;
 
+// Results of a load test. Updated concurrently by clients from their threads.
+class LoadTestStats
+{
+public:
+    // Microseconds since the client started.
+    LatencyHistogram connect_time;
+    LatencyHistogram handshake_time;
+    LatencyHistogram first_frame_time;
+
+    Uint64 num_started;
+    Uint64 num_connected;
+    Uint64 num_failed;
+    Uint64 num_closed;
+    // Players which have received a frame, publishers which have started publishing.
+    Uint64 num_streaming;
+
+    // Frames and bytes received by players.
+    Uint64 num_frames;
+    Uint64 num_bytes;
+
+    Uint64 num_stalls;
+    Uint64 stall_time_microsec;
+
+    static void add (Uint64 * const mt_nonnull counter,
+                     Uint64   const value)
+        { __sync_fetch_and_add (counter, value); }
+
+    static Uint64 get (Uint64 const * const mt_nonnull counter)
+        { return *(Uint64 const volatile *) counter; }
+
+    LoadTestStats ()
+        : num_started (0),
+          num_connected (0),
+          num_failed (0),
+          num_closed (0),
+          num_streaming (0),
+          num_frames (0),
+          num_bytes (0),
+          num_stalls (0),
+          stall_time_microsec (0)
+    {
+    }
+};
+
+LoadTestStats load_test_stats;
+
+// Publish->play latency of frames with TestStreamGenerator frame marks.
+class LatencyTestStats
+{
+public:
+    // Microseconds between generation of a frame and its arrival to a player.
+    LatencyHistogram latency;
+
+    Uint64 num_frames;
+    Uint64 num_lost;
+    // Frames with a sequence number lower than expected.
+    Uint64 num_reordered;
+
+    LatencyTestStats ()
+        : num_frames (0),
+          num_lost (0),
+          num_reordered (0)
+    {
+    }
+};
+
+LatencyTestStats latency_test_stats;
+
+// Shared by all publishers replaying --replay file.
+mt_const Ref<FileReadCache> replay_read_cache;
+
 class RtmpClient : public DependentCodeReferenced
 {
 private:
@@ -94,6 +193,10 @@ private:
 
     mt_const Byte id_char;
 
+    mt_const bool publish;
+    mt_const bool play;
+    mt_const StRef<String> channel;
+
     mt_const DataDepRef<ServerThreadContext> thread_ctx;
     mt_const DataDepRef<PagePool> page_pool;
 
@@ -106,6 +209,21 @@ private:
     ConnectionState conn_state;
 
     Ref<TestStreamGenerator> test_stream_generator;
+    Ref<FileReplayer> file_replayer;
+
+    // Load test state. Updated by the client's thread. Read by the load test
+    // report without synchronization, which is fine for the summary.
+    mt_const Time start_time_microsec;
+    bool got_first_frame;
+    Time last_frame_time_microsec;
+
+    // Latency measurement state. Updated by the client's thread.
+    bool   got_frame_seq;
+    Uint32 next_frame_seq;
+
+    void processFrame (Size msg_len);
+
+    void processFrameMark (VideoStream::VideoMessage * mt_nonnull msg);
 
     static TcpConnection::Frontend const tcp_conn_frontend;
 
@@ -148,11 +266,19 @@ private:
 public:
     Result start (IpAddress const &addr);
 
+    // For players in load test mode.
+    void getLoadTestState (Time  now_microsec,
+                           bool *ret_stalled,
+                           bool *ret_no_frames);
+
     mt_const void init (ServerThreadContext *thread_ctx,
 			PagePool            *page_pool);
 
-    RtmpClient (Object *coderef_container,
-		Byte    id_char);
+    RtmpClient (Object      *coderef_container,
+		Byte         id_char,
+                ConstMemory  channel,
+                bool         publish,
+                bool         play);
 };
 
 TcpConnection::Frontend const RtmpClient::tcp_conn_frontend = {
@@ -180,11 +306,20 @@ RtmpClient::connected (Exception * const exc_,
 
     if (exc_) {
         logE_ (_func, "exception: ", exc_->toString());
+        if (options.load_test) {
+            LoadTestStats::add (&load_test_stats.num_failed, 1);
+            return;
+        }
 	exit (EXIT_FAILURE);
     }
 
     logI_ (_func, "Connected successfully");
 
+    if (options.load_test) {
+        load_test_stats.connect_time.record (getTimeMicroseconds() - self->start_time_microsec);
+        LoadTestStats::add (&load_test_stats.num_connected, 1);
+    }
+
     self->rtmp_conn.startClient ();
     self->conn_receiver.start ();
 }
@@ -193,6 +328,11 @@ void
 RtmpClient::closeRtmpConn (void * const /* cb_data */)
 {
     logI_ (_func, "Connection closed");
+    if (options.load_test) {
+        LoadTestStats::add (&load_test_stats.num_closed, 1);
+        return;
+    }
+
     if (!options.nonfatal_errors)
 	exit (0);
 }
@@ -204,6 +344,9 @@ RtmpClient::handshakeComplete (void * const _self)
 
     RtmpClient * const self = static_cast <RtmpClient*> (_self);
 
+    if (options.load_test)
+        load_test_stats.handshake_time.record (getTimeMicroseconds() - self->start_time_microsec);
+
     self->conn_state = ConnectionState_ConnectSent;
     self->rtmp_conn.sendConnect (options.app_name->mem());
 
@@ -255,12 +398,14 @@ RtmpClient::commandMessage (VideoStream::Message   * const mt_nonnull msg,
 		    return Result::Failure;
 		}
 
-                if (!options.publish || options.play) {
-                    self->rtmp_conn.sendPlay (options.channel->mem());
+                if (self->play) {
+                    self->rtmp_conn.sendPlay (self->channel->mem());
                 }
 
-                if (options.publish) {
-                    self->rtmp_conn.sendPublish (options.channel->mem());
+                if (self->publish) {
+                    self->rtmp_conn.sendPublish (self->channel->mem());
+                    if (options.load_test)
+                        LoadTestStats::add (&load_test_stats.num_streaming, 1);
 
                     Ref<VideoStream> const video_stream = grab (new (std::nothrow) VideoStream);
                     video_stream->getEventInformer()->subscribe (
@@ -268,12 +413,27 @@ RtmpClient::commandMessage (VideoStream::Message   * const mt_nonnull msg,
                                                                self,
                                                                self->getCoderefContainer()));
 
-                    self->test_stream_generator = grab (new (std::nothrow) TestStreamGenerator);
-                    self->test_stream_generator->init (self->page_pool,
-                                                       self->thread_ctx->getTimers(),
-                                                       video_stream,
-                                                       &options.gen_opts);
-                    self->test_stream_generator->start ();
+                    if (options.replay_file) {
+                        self->file_replayer = grab (new (std::nothrow) FileReplayer);
+                        if (!self->file_replayer->init (self->page_pool,
+                                                        self->thread_ctx->getTimers(),
+                                                        video_stream,
+                                                        options.replay_file->mem(),
+                                                        replay_read_cache,
+                                                        &options.replay_opts))
+                        {
+                            logE_ (_func, "Could not replay ", options.replay_file->mem(), ": ", exc->toString());
+                            return Result::Failure;
+                        }
+                        self->file_replayer->start ();
+                    } else {
+                        self->test_stream_generator = grab (new (std::nothrow) TestStreamGenerator);
+                        self->test_stream_generator->init (self->page_pool,
+                                                           self->thread_ctx->getTimers(),
+                                                           video_stream,
+                                                           &options.gen_opts);
+                        self->test_stream_generator->start ();
+                    }
                 }
 
 		self->conn_state = ConnectionState_Streaming;
@@ -339,6 +499,77 @@ RtmpClient::commandMessage (VideoStream::Message   * const mt_nonnull msg,
     return Result::Success;
 }
 
+void
+RtmpClient::processFrame (Size const msg_len)
+{
+    Time const now = getTimeMicroseconds();
+
+    if (!got_first_frame) {
+        got_first_frame = true;
+        load_test_stats.first_frame_time.record (now - start_time_microsec);
+        LoadTestStats::add (&load_test_stats.num_streaming, 1);
+    } else
+    if (now - last_frame_time_microsec >= (Time) options.stall_timeout_millisec * 1000) {
+        LoadTestStats::add (&load_test_stats.num_stalls, 1);
+        LoadTestStats::add (&load_test_stats.stall_time_microsec, now - last_frame_time_microsec);
+    }
+    last_frame_time_microsec = now;
+
+    LoadTestStats::add (&load_test_stats.num_frames, 1);
+    LoadTestStats::add (&load_test_stats.num_bytes, msg_len);
+}
+
+void
+RtmpClient::processFrameMark (VideoStream::VideoMessage * const mt_nonnull msg)
+{
+    TestStreamGenerator::FrameMark mark;
+    if (!TestStreamGenerator::parseFrameMark (msg, &mark))
+        return;
+
+    Time const now = TestStreamGenerator::getWallClockMicroseconds ();
+    // Clocks of different hosts may be slightly off.
+    latency_test_stats.latency.record (now > mark.wallclock_microsec ? now - mark.wallclock_microsec : 0);
+    LoadTestStats::add (&latency_test_stats.num_frames, 1);
+
+    if (got_frame_seq) {
+        if (mark.seq > next_frame_seq)
+            LoadTestStats::add (&latency_test_stats.num_lost, mark.seq - next_frame_seq);
+        else
+        if (mark.seq < next_frame_seq) {
+            LoadTestStats::add (&latency_test_stats.num_reordered, 1);
+            return;
+        }
+    }
+
+    got_frame_seq = true;
+    next_frame_seq = mark.seq + 1;
+}
+
+void
+RtmpClient::getLoadTestState (Time   const now_microsec,
+                              bool * const ret_stalled,
+                              bool * const ret_no_frames)
+{
+    *ret_stalled = false;
+    *ret_no_frames = false;
+
+    if (!play)
+        return;
+
+    Time const stall_timeout = (Time) options.stall_timeout_millisec * 1000;
+    if (!got_first_frame) {
+        *ret_no_frames = true;
+        return;
+    }
+
+    Time const last_frame_time = *(Time const volatile *) &last_frame_time_microsec;
+    if (now_microsec > last_frame_time
+        && now_microsec - last_frame_time >= stall_timeout)
+    {
+        *ret_stalled = true;
+    }
+}
+
 static Uint32 debug_counter = 0;
 
 // TEST
@@ -361,6 +592,9 @@ RtmpClient::audioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
 #endif
     }
 
+    if (options.load_test && self->play)
+        self->processFrame (msg->msg_len);
+
     if (options.report_audio && options.report_interval) {
 	++debug_counter;
 	if (debug_counter >= options.report_interval) {
@@ -398,6 +632,12 @@ RtmpClient::videoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
               msg->codec_id, " ", msg->frame_type, " len ", msg->msg_len);
     }
 
+    if (options.load_test && self->play)
+        self->processFrame (msg->msg_len);
+
+    if (options.measure_latency && self->play)
+        self->processFrameMark (msg);
+
     if (options.report_video && options.report_interval) {
 	++debug_counter;
 	if (debug_counter >= options.report_interval) {
@@ -461,6 +701,10 @@ RtmpClient::genVideoMessage (VideoStream::VideoMessage * const video_msg,
 Result
 RtmpClient::start (IpAddress const &addr)
 {
+    start_time_microsec = getTimeMicroseconds();
+    if (options.load_test)
+        LoadTestStats::add (&load_test_stats.num_started, 1);
+
     if (!tcp_conn.open ()) {
         logE_ (_func, "tcp_conn.open() failed: ", exc->toString());
         return Result::Failure;
@@ -483,6 +727,11 @@ RtmpClient::start (IpAddress const &addr)
     }
 
     if (connect_res == TcpConnection::ConnectResult_Connected) {
+        if (options.load_test) {
+            load_test_stats.connect_time.record (getTimeMicroseconds() - start_time_microsec);
+            LoadTestStats::add (&load_test_stats.num_connected, 1);
+        }
+
         rtmp_conn.startClient ();
         conn_receiver.start ();
     } else
@@ -519,51 +768,96 @@ RtmpClient::init (ServerThreadContext * const thread_ctx,
                     false         /* momentrtmp_proto */);
 }
 
-RtmpClient::RtmpClient (Object * const coderef_container,
-			Byte     const id_char)
+RtmpClient::RtmpClient (Object      * const coderef_container,
+			Byte          const id_char,
+                        ConstMemory   const channel,
+                        bool          const publish,
+                        bool          const play)
     : DependentCodeReferenced (coderef_container),
       id_char (id_char),
+      publish (publish),
+      play    (play),
+      channel (st_grab (new (std::nothrow) String (channel))),
       thread_ctx    (coderef_container),
       page_pool     (coderef_container),
       rtmp_conn     (coderef_container),
       tcp_conn      (coderef_container),
       conn_sender   (coderef_container),
       conn_receiver (coderef_container),
-      conn_state (ConnectionState_Connect)
+      conn_state (ConnectionState_Connect),
+      start_time_microsec (0),
+      got_first_frame (false),
+      last_frame_time_microsec (0),
+      got_frame_seq (false),
+      next_frame_seq (0)
 {
 }
 
+// Client number 'idx'. In load test mode, the first 'num_publishers' clients
+// are publishers and the rest are players, spread evenly across streams.
+// Returns NULL if the client could not be started.
+RtmpClient*
+startClient (Uint32      const idx,
+             PagePool  * const page_pool,
+             ServerApp * const server_app,
+             IpAddress * const server_addr,
+             bool        const use_main_thread)
+{
+    Byte const id_char = 'a' + idx % 26;
+
+    bool publish = options.publish;
+    bool play = !options.publish || options.play;
+    StRef<String> channel = st_grab (new (std::nothrow) String (options.channel->mem()));
+    Uint32 stream_idx = idx % options.num_streams;
+    if (options.load_test) {
+        if (idx < options.num_publishers) {
+            publish = true;
+            play = false;
+            stream_idx = idx % options.num_streams;
+        } else {
+            publish = false;
+            play = true;
+            stream_idx = (idx - options.num_publishers) % options.num_streams;
+        }
+    }
+
+    if (options.num_streams > 1)
+        channel = st_makeString (options.channel->mem(), "_", stream_idx);
+
+    logD_ (_func, "Starting client, id_char: ", ConstMemory::forObject (id_char), ", channel: ", channel);
+
+    // Note that RtmpClient objects are never freed.
+    RtmpClient * const client = new (std::nothrow) RtmpClient (NULL /* coderef_container */,
+                                                               id_char,
+                                                               channel->mem(),
+                                                               publish,
+                                                               play);
+    assert (client);
+
+    CodeDepRef<ServerThreadContext> thread_ctx;
+    if (use_main_thread)
+        thread_ctx = server_app->getServerContext()->getMainThreadContext();
+    else
+        thread_ctx = server_app->getServerContext()->selectThreadContext();
+
+    client->init (thread_ctx, page_pool);
+    if (!client->start (*server_addr)) {
+        logE_ (_func, "client->start() failed");
+        return NULL;
+    }
+
+    return client;
+}
+
 Result
 startClients (PagePool  * const page_pool,
 	      ServerApp * const server_app,
 	      IpAddress * const server_addr,
 	      bool        const use_main_thread)
 {
-    Byte id_char = 'a';
-    // TODO "Slow start" option.
     for (Uint32 i = 0; i < options.num_clients; ++i) {
-	logD_ (_func, "Starting client, id_char: ", ConstMemory::forObject (id_char));
-
-	// Note that RtmpClient objects are never freed.
-	RtmpClient * const client = new (std::nothrow) RtmpClient (NULL /* coderef_container */, id_char);
-        assert (client);
-
-	CodeDepRef<ServerThreadContext> thread_ctx;
-	if (use_main_thread)
-	    thread_ctx = server_app->getServerContext()->getMainThreadContext();
-	else
-	    thread_ctx = server_app->getServerContext()->selectThreadContext();
-
-	client->init (thread_ctx, page_pool);
-	if (!client->start (*server_addr)) {
-	    logE_ (_func, "client->start() failed");
+        if (!startClient (i, page_pool, server_app, server_addr, use_main_thread))
 	    return Result::Failure;
-	}
-
-	if (id_char == 'z')
-	    id_char = 'a';
-	else
-	    ++id_char;
     }
 
     return Result::Success;
@@ -601,12 +895,334 @@ void clientThreadFunc (void * const _client_thread_data)
     logD_ (_func, "done");
 }
 
+// Starts clients gradually, keeps them running for options.hold_time seconds
+// and prints the summary. All timers fire in the main thread.
+class LoadTest : public Object
+{
+private:
+    enum {
+        RampTickInterval_Millisec = 10,
+        ReportInterval_Sec = 1
+    };
+
+    mt_const DataDepRef<PagePool>  page_pool;
+    mt_const DataDepRef<ServerApp> server_app;
+    mt_const DataDepRef<Timers>    timers;
+    mt_const IpAddress server_addr;
+    mt_const bool use_main_thread;
+
+    mt_const RtmpClient **clients;
+    Count num_clients_started;
+
+    Time ramp_start_time_microsec;
+    Uint64 last_num_frames;
+
+    Timers::TimerKey ramp_timer;
+    Timers::TimerKey report_timer;
+
+    static void startTimerTick  (void *_self);
+    static void rampTimerTick   (void *_self);
+    static void reportTimerTick (void *_self);
+    static void holdTimerTick   (void *_self);
+
+    void startRamp ();
+
+    void printSummary ();
+
+public:
+    void start ();
+
+    void init (PagePool        * mt_nonnull page_pool,
+               ServerApp       * mt_nonnull server_app,
+               IpAddress const &server_addr,
+               bool             use_main_thread);
+
+    LoadTest ();
+
+    ~LoadTest ();
+};
+
+void
+LoadTest::startTimerTick (void * const _self)
+{
+    LoadTest * const self = static_cast <LoadTest*> (_self);
+    self->startRamp ();
+}
+
+void
+LoadTest::startRamp ()
+{
+    logI_ (_func, "starting ", options.num_clients, " clients "
+           "(", options.num_publishers, " publishers, ", options.num_streams, " streams), "
+           "ramp rate ", options.ramp_rate, " clients/sec, hold ", options.hold_time, " sec");
+
+    ramp_start_time_microsec = getTimeMicroseconds();
+
+    ramp_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (rampTimerTick, this, this),
+            RampTickInterval_Millisec * 1000,
+            true /* periodical */);
+
+    report_timer = timers->addTimer (reportTimerTick,
+                                     this /* cb_data */,
+                                     this /* coderef_container */,
+                                     ReportInterval_Sec,
+                                     true /* periodical */);
+
+    rampTimerTick (this);
+}
+
+void
+LoadTest::rampTimerTick (void * const _self)
+{
+    LoadTest * const self = static_cast <LoadTest*> (_self);
+
+    if (!self->ramp_timer)
+        return;
+
+    Uint64 target = options.num_clients;
+    if (options.ramp_rate) {
+        Time const elapsed = getTimeMicroseconds() - self->ramp_start_time_microsec;
+        target = elapsed * options.ramp_rate / 1000000 + 1;
+        if (target > options.num_clients)
+            target = options.num_clients;
+    }
+
+    while (self->num_clients_started < target) {
+        Uint32 const idx = (Uint32) self->num_clients_started;
+        self->clients [idx] = startClient (idx,
+                                           self->page_pool,
+                                           self->server_app,
+                                           &self->server_addr,
+                                           self->use_main_thread);
+        if (!self->clients [idx])
+            LoadTestStats::add (&load_test_stats.num_failed, 1);
+
+        ++self->num_clients_started;
+    }
+
+    if (self->num_clients_started < options.num_clients)
+        return;
+
+    logI_ (_func, "all ", options.num_clients, " clients started, "
+           "holding for ", options.hold_time, " sec");
+
+    self->timers->deleteTimer (self->ramp_timer);
+    self->ramp_timer = NULL;
+
+    self->timers->addTimer (holdTimerTick,
+                            self /* cb_data */,
+                            self /* coderef_container */,
+                            options.hold_time,
+                            false /* periodical */);
+}
+
+void
+LoadTest::reportTimerTick (void * const _self)
+{
+    LoadTest * const self = static_cast <LoadTest*> (_self);
+
+    Uint64 const num_frames = LoadTestStats::get (&load_test_stats.num_frames);
+    Uint64 const fps = (num_frames - self->last_num_frames) / ReportInterval_Sec;
+    self->last_num_frames = num_frames;
+
+    logI_ (_func, "started ",   LoadTestStats::get (&load_test_stats.num_started), ", "
+                  "connected ", LoadTestStats::get (&load_test_stats.num_connected), ", "
+                  "streaming ", LoadTestStats::get (&load_test_stats.num_streaming), ", "
+                  "failed ",    LoadTestStats::get (&load_test_stats.num_failed), ", "
+                  "closed ",    LoadTestStats::get (&load_test_stats.num_closed), ", "
+                  "stalls ",    LoadTestStats::get (&load_test_stats.num_stalls), ", "
+                  "frames/sec ", fps);
+}
+
+void
+LoadTest::holdTimerTick (void * const _self)
+{
+    LoadTest * const self = static_cast <LoadTest*> (_self);
+
+    if (self->report_timer) {
+        self->timers->deleteTimer (self->report_timer);
+        self->report_timer = NULL;
+    }
+
+    self->printSummary ();
+    self->server_app->stop ();
+}
+
+static void printPercentiles (ConstMemory              const name,
+                              LatencyHistogram const &histogram)
+{
+    outs->print ("  ", name, " usec: "
+                 "p50 ", histogram.getPercentile (50.0), ", "
+                 "p95 ", histogram.getPercentile (95.0), ", "
+                 "p99 ", histogram.getPercentile (99.0), ", "
+                 "max ", histogram.getMax(), " "
+                 "(", histogram.getCount(), " samples)\n");
+}
+
+static void printPercentilesJson (ConstMemory              const name,
+                                  LatencyHistogram const &histogram)
+{
+    outs->print ("  \"", name, "_usec\": { "
+                 "\"p50\": ", histogram.getPercentile (50.0), ", "
+                 "\"p95\": ", histogram.getPercentile (95.0), ", "
+                 "\"p99\": ", histogram.getPercentile (99.0), ", "
+                 "\"max\": ", histogram.getMax(), ", "
+                 "\"count\": ", histogram.getCount(), " },\n");
+}
+
+static void printLatencyTestStats ()
+{
+    printPercentiles ("glass to glass", latency_test_stats.latency);
+    outs->print ("  marked frames: ", LoadTestStats::get (&latency_test_stats.num_frames), ", "
+                 "lost: ", LoadTestStats::get (&latency_test_stats.num_lost), ", "
+                 "reordered: ", LoadTestStats::get (&latency_test_stats.num_reordered), "\n");
+}
+
+void
+LoadTest::printSummary ()
+{
+    Time const now = getTimeMicroseconds();
+    Time const duration_microsec = now - ramp_start_time_microsec;
+
+    Uint64 num_stalled = 0;
+    Uint64 num_no_frames = 0;
+    for (Count i = 0; i < num_clients_started; ++i) {
+        if (!clients [i])
+            continue;
+
+        bool stalled;
+        bool no_frames;
+        clients [i]->getLoadTestState (now, &stalled, &no_frames);
+        if (stalled)
+            ++num_stalled;
+        if (no_frames)
+            ++num_no_frames;
+    }
+
+    Uint64 const num_frames = LoadTestStats::get (&load_test_stats.num_frames);
+    Uint64 const num_bytes  = LoadTestStats::get (&load_test_stats.num_bytes);
+    Uint64 const fps  = (duration_microsec ? num_frames * 1000000 / duration_microsec : 0);
+    Uint64 const kbps = (duration_microsec ? num_bytes * 8 * 1000 / duration_microsec : 0);
+
+    Uint32 const num_players = (options.num_clients > options.num_publishers ?
+                                        options.num_clients - options.num_publishers : 0);
+
+    if (options.json_summary) {
+        outs->print ("{\n"
+                     "  \"duration_ms\": ", duration_microsec / 1000, ",\n"
+                     "  \"clients\": ", options.num_clients, ",\n"
+                     "  \"players\": ", num_players, ",\n"
+                     "  \"publishers\": ", options.num_publishers, ",\n"
+                     "  \"streams\": ", options.num_streams, ",\n"
+                     "  \"connected\": ", LoadTestStats::get (&load_test_stats.num_connected), ",\n"
+                     "  \"streaming\": ", LoadTestStats::get (&load_test_stats.num_streaming), ",\n"
+                     "  \"failed\": ", LoadTestStats::get (&load_test_stats.num_failed), ",\n"
+                     "  \"closed\": ", LoadTestStats::get (&load_test_stats.num_closed), ",\n");
+        printPercentilesJson ("connect",     load_test_stats.connect_time);
+        printPercentilesJson ("handshake",   load_test_stats.handshake_time);
+        printPercentilesJson ("first_frame", load_test_stats.first_frame_time);
+        outs->print ("  \"frames\": ", num_frames, ",\n"
+                     "  \"bytes\": ", num_bytes, ",\n"
+                     "  \"fps\": ", fps, ",\n"
+                     "  \"kbps\": ", kbps, ",\n"
+                     "  \"stalls\": ", LoadTestStats::get (&load_test_stats.num_stalls), ",\n"
+                     "  \"stall_time_ms\": ", LoadTestStats::get (&load_test_stats.stall_time_microsec) / 1000, ",\n"
+                     "  \"stalled_at_end\": ", num_stalled, ",\n"
+                     "  \"no_frames\": ", num_no_frames);
+        if (options.measure_latency) {
+            outs->print (",\n");
+            printPercentilesJson ("glass_to_glass", latency_test_stats.latency);
+            outs->print ("  \"marked_frames\": ", LoadTestStats::get (&latency_test_stats.num_frames), ",\n"
+                         "  \"lost_frames\": ", LoadTestStats::get (&latency_test_stats.num_lost), ",\n"
+                         "  \"reordered_frames\": ", LoadTestStats::get (&latency_test_stats.num_reordered));
+        }
+        outs->print ("\n}\n");
+    } else {
+        outs->print ("Load test summary\n"
+                     "  duration: ", duration_microsec / 1000, " ms\n"
+                     "  clients: ", options.num_clients, " "
+                         "(", num_players, " players, ", options.num_publishers, " publishers, ",
+                         options.num_streams, " streams)\n"
+                     "  connected: ", LoadTestStats::get (&load_test_stats.num_connected), ", "
+                         "streaming: ", LoadTestStats::get (&load_test_stats.num_streaming), ", "
+                         "failed: ", LoadTestStats::get (&load_test_stats.num_failed), ", "
+                         "closed: ", LoadTestStats::get (&load_test_stats.num_closed), "\n");
+        printPercentiles ("connect",     load_test_stats.connect_time);
+        printPercentiles ("handshake",   load_test_stats.handshake_time);
+        printPercentiles ("first frame", load_test_stats.first_frame_time);
+        outs->print ("  received: ", num_frames, " frames, ", num_bytes, " bytes, ",
+                         fps, " frames/sec, ", kbps, " kbit/sec\n"
+                     "  stalls: ", LoadTestStats::get (&load_test_stats.num_stalls), ", "
+                         "stall time ", LoadTestStats::get (&load_test_stats.stall_time_microsec) / 1000, " ms\n"
+                     "  at the end: ", num_stalled, " players stalled, ",
+                         num_no_frames, " players without frames\n");
+        if (options.measure_latency)
+            printLatencyTestStats ();
+    }
+    outs->flush ();
+}
+
+void
+LoadTest::start ()
+{
+    if (use_main_thread) {
+        startRamp ();
+        return;
+    }
+
+    // TODO Wait for ServerApp threads to spawn, reliably (same as clientThreadFunc).
+    timers->addTimer (startTimerTick,
+                      this /* cb_data */,
+                      this /* coderef_container */,
+                      3    /* time_seconds */,
+                      false /* periodical */);
+}
+
+void
+LoadTest::init (PagePool        * const mt_nonnull page_pool,
+                ServerApp       * const mt_nonnull server_app,
+                IpAddress const &server_addr,
+                bool             const use_main_thread)
+{
+    this->page_pool = page_pool;
+    this->server_app = server_app;
+    this->timers = server_app->getServerContext()->getMainThreadContext()->getTimers();
+    this->server_addr = server_addr;
+    this->use_main_thread = use_main_thread;
+
+    clients = new (std::nothrow) RtmpClient* [options.num_clients + 1];
+    assert (clients);
+}
+
+LoadTest::LoadTest ()
+    : page_pool  (this /* coderef_container */),
+      server_app (this /* coderef_container */),
+      timers     (this /* coderef_container */),
+      use_main_thread (true),
+      clients (NULL),
+      num_clients_started (0),
+      ramp_start_time_microsec (0),
+      last_num_frames (0),
+      ramp_timer (NULL),
+      report_timer (NULL)
+{
+}
+
+LoadTest::~LoadTest ()
+{
+    // RtmpClient objects are never freed.
+    delete[] clients;
+}
+
 class RtmptoolInstance : public Object
 {
 private:
     PagePool page_pool;
     ServerApp server_app;
 
+    static void latencyReportTimerTick (void *_self);
+
 public:
     Result run ();
 
@@ -617,6 +1233,14 @@ public:
     }
 };
 
+void
+RtmptoolInstance::latencyReportTimerTick (void * const /* _self */)
+{
+    outs->print ("Latency\n");
+    printLatencyTestStats ();
+    outs->flush ();
+}
+
 Result
 RtmptoolInstance::run (void)
 {
@@ -636,8 +1260,31 @@ RtmptoolInstance::run (void)
 	}
     }
 
+    if (options.replay_file) {
+        replay_read_cache = grab (new (std::nothrow) FileReadCache);
+        // 64 MB: enough to keep a typical capture in memory.
+        replay_read_cache->init (256 /* max_blocks */);
+    }
+
+    Ref<LoadTest> load_test;
 #ifdef LIBMARY_MT_SAFE
     Ref<Thread> client_thread;
+#endif
+    if (options.measure_latency && !options.load_test) {
+        server_app.getServerContext()->getMainThreadContext()->getTimers()->addTimer (
+                latencyReportTimerTick,
+                this /* cb_data */,
+                this /* coderef_container */,
+                5    /* time_seconds */,
+                true /* periodical */);
+    }
+
+    if (options.load_test) {
+        load_test = grab (new (std::nothrow) LoadTest);
+        load_test->init (&page_pool, &server_app, server_addr, options.num_threads == 0 /* use_main_thread */);
+        load_test->start ();
+    } else
+#ifdef LIBMARY_MT_SAFE
     if (options.num_threads == 0) {
 #endif
 	startClients (&page_pool, &server_app, &server_addr, true /* use_main_thread */);
@@ -692,10 +1339,22 @@ printUsage ()
                  "  --start-timestamp              Timestamp of the first generated video message. Default: 0\n"
                  "  --keyframe-interval            Distance between keyframes, in frames. Default: 10 frames.\n"
                  "  --burst-width                  Number of frames to generate in a single iteration. Default: 1.\n"
+                 "  --avc-profile                  Publish AVC/AAC-shaped traffic: sequence headers, I/P/B frames, AAC audio.\n"
+                 "  --replay <file>                Publish frames of an FLV file instead of a generated stream.\n"
+                 "  --replay-speed <number|max>    Replay speed relative to real time, or \"max\" for as fast as possible. Default: 1\n"
+                 "  --loop                         Replay the file in a loop.\n"
 		 "  -t --num-threads <number>      Number of threads to spawn. Default: 0, use a single thread.\n"
                  "  -d --dump-frames               Dump incoming messages.\n"
 		 "  -r --report-interval <number>  Interval between video frame reports. Default: 0, no reports.\n"
 		 "  --nonfatal-errors              Do not exit on the first error.\n"
+                 "  --load-test                    Load test mode: print latency percentiles and throughput at the end.\n"
+                 "  --ramp-rate <number>           Load test: clients to start per second. Default: 0, start all at once.\n"
+                 "  --hold <number>                Load test: seconds to run after all clients have started. Default: 60\n"
+                 "  --publishers <number>          Load test: how many of the clients publish. Default: 0\n"
+                 "  --streams <number>             Number of streams, named <channel>_<N>. Clients are spread across them. Default: 1\n"
+                 "  --stall-timeout <number>       Load test: a gap between frames in milliseconds which counts as a stall. Default: 2000\n"
+                 "  --json                         Load test: print the summary as JSON.\n"
+                 "  --measure-latency              Publishers put timestamps into frames, players measure latency and frame loss.\n"
                  "  --loglevel <loglevel>          Loglevel (same as for 'moment' server).\n"
 		 "  -h --help                      Show this help message.\n"
 //		 "  -o --out-file - Output file name.\n"
@@ -935,6 +1594,160 @@ bool cmdline_burst_width (char const * /* short_name */,
     return true;
 }
 
+bool cmdline_load_test (char const * /* short_name */,
+                        char const * /* long_name */,
+                        char const * /* value */,
+                        void       * /* opt_data */,
+                        void       * /* cb_data */)
+{
+    options.load_test = true;
+    return true;
+}
+
+bool cmdline_ramp_rate (char const * /* short_name */,
+                        char const * const long_name,
+                        char const * const value,
+                        void       * /* opt_data */,
+                        void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, &options.ramp_rate)) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number expected): ", exc->toString());
+	exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_hold (char const * /* short_name */,
+                   char const * const long_name,
+                   char const * const value,
+                   void       * /* opt_data */,
+                   void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, &options.hold_time)) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number expected): ", exc->toString());
+	exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_publishers (char const * /* short_name */,
+                         char const * const long_name,
+                         char const * const value,
+                         void       * /* opt_data */,
+                         void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, &options.num_publishers)) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number expected): ", exc->toString());
+	exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_streams (char const * /* short_name */,
+                      char const * const long_name,
+                      char const * const value,
+                      void       * /* opt_data */,
+                      void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, &options.num_streams) || options.num_streams == 0) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number expected): ", exc->toString());
+	exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_stall_timeout (char const * /* short_name */,
+                            char const * const long_name,
+                            char const * const value,
+                            void       * /* opt_data */,
+                            void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, &options.stall_timeout_millisec)) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number expected): ", exc->toString());
+	exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_measure_latency (char const * /* short_name */,
+                              char const * /* long_name */,
+                              char const * /* value */,
+                              void       * /* opt_data */,
+                              void       * /* cb_data */)
+{
+    options.measure_latency = true;
+    options.gen_opts.embed_timestamps = true;
+    return true;
+}
+
+bool cmdline_avc_profile (char const * /* short_name */,
+                          char const * /* long_name */,
+                          char const * /* value */,
+                          void       * /* opt_data */,
+                          void       * /* cb_data */)
+{
+    options.gen_opts.profile = TestStreamGenerator::Options::Profile_Avc;
+    return true;
+}
+
+bool cmdline_replay (char const * /* short_name */,
+                     char const * /* long_name */,
+                     char const * const value,
+                     void       * /* opt_data */,
+                     void       * /* cb_data */)
+{
+    options.replay_file = grab (new (std::nothrow) String (value));
+    return true;
+}
+
+bool cmdline_replay_speed (char const * /* short_name */,
+                           char const * const long_name,
+                           char const * const value,
+                           void       * /* opt_data */,
+                           void       * /* cb_data */)
+{
+    ConstMemory const value_mem = ConstMemory (value, value ? strlen (value) : 0);
+    if (equal (value_mem, "max")) {
+        options.replay_opts.speed_percent = 0;
+        return true;
+    }
+
+    Uint32 speed;
+    if (!strToUint32_safe (value, &speed) || speed == 0) {
+ 	logE_ (_func, "Invalid value \"", value, "\" "
+	       "for --", long_name, " (number or \"max\" expected)");
+	exit (EXIT_FAILURE);
+    }
+
+    options.replay_opts.speed_percent = speed * 100;
+    return true;
+}
+
+bool cmdline_loop (char const * /* short_name */,
+                   char const * /* long_name */,
+                   char const * /* value */,
+                   void       * /* opt_data */,
+                   void       * /* cb_data */)
+{
+    options.replay_opts.loop = true;
+    return true;
+}
+
+bool cmdline_json (char const * /* short_name */,
+                   char const * /* long_name */,
+                   char const * /* value */,
+                   void       * /* opt_data */,
+                   void       * /* cb_data */)
+{
+    options.json_summary = true;
+    return true;
+}
+
 static bool
 cmdline_loglevel (char const * /* short_name */,
                   char const * /* long_name */,
@@ -957,7 +1770,7 @@ int main (int argc, char **argv)
     libMaryInit ();
 
     {
-	unsigned const num_opts = 20;
+	unsigned const num_opts = 32;
 	CmdlineOption opts [num_opts];
 
 	opts [0].short_name = "h";
@@ -1080,6 +1893,78 @@ int main (int argc, char **argv)
         opts [19].opt_data     = NULL;
         opts [19].opt_callback = cmdline_report_video;
 
+        opts [20].short_name   = NULL;
+        opts [20].long_name    = "load-test";
+        opts [20].with_value   = false;
+        opts [20].opt_data     = NULL;
+        opts [20].opt_callback = cmdline_load_test;
+
+        opts [21].short_name   = NULL;
+        opts [21].long_name    = "ramp-rate";
+        opts [21].with_value   = true;
+        opts [21].opt_data     = NULL;
+        opts [21].opt_callback = cmdline_ramp_rate;
+
+        opts [22].short_name   = NULL;
+        opts [22].long_name    = "hold";
+        opts [22].with_value   = true;
+        opts [22].opt_data     = NULL;
+        opts [22].opt_callback = cmdline_hold;
+
+        opts [23].short_name   = NULL;
+        opts [23].long_name    = "publishers";
+        opts [23].with_value   = true;
+        opts [23].opt_data     = NULL;
+        opts [23].opt_callback = cmdline_publishers;
+
+        opts [24].short_name   = NULL;
+        opts [24].long_name    = "streams";
+        opts [24].with_value   = true;
+        opts [24].opt_data     = NULL;
+        opts [24].opt_callback = cmdline_streams;
+
+        opts [25].short_name   = NULL;
+        opts [25].long_name    = "stall-timeout";
+        opts [25].with_value   = true;
+        opts [25].opt_data     = NULL;
+        opts [25].opt_callback = cmdline_stall_timeout;
+
+        opts [26].short_name   = NULL;
+        opts [26].long_name    = "json";
+        opts [26].with_value   = false;
+        opts [26].opt_data     = NULL;
+        opts [26].opt_callback = cmdline_json;
+
+        opts [27].short_name   = NULL;
+        opts [27].long_name    = "measure-latency";
+        opts [27].with_value   = false;
+        opts [27].opt_data     = NULL;
+        opts [27].opt_callback = cmdline_measure_latency;
+
+        opts [28].short_name   = NULL;
+        opts [28].long_name    = "avc-profile";
+        opts [28].with_value   = false;
+        opts [28].opt_data     = NULL;
+        opts [28].opt_callback = cmdline_avc_profile;
+
+        opts [29].short_name   = NULL;
+        opts [29].long_name    = "replay";
+        opts [29].with_value   = true;
+        opts [29].opt_data     = NULL;
+        opts [29].opt_callback = cmdline_replay;
+
+        opts [30].short_name   = NULL;
+        opts [30].long_name    = "replay-speed";
+        opts [30].with_value   = true;
+        opts [30].opt_data     = NULL;
+        opts [30].opt_callback = cmdline_replay_speed;
+
+        opts [31].short_name   = NULL;
+        opts [31].long_name    = "loop";
+        opts [31].with_value   = false;
+        opts [31].opt_data     = NULL;
+        opts [31].opt_callback = cmdline_loop;
+
 	ArrayIterator<CmdlineOption> opts_iter (opts, num_opts);
 	parseCmdline (&argc, &argv, opts_iter, NULL /* callback */, NULL /* callback_data */);
     }
@@ -1091,6 +1976,11 @@ int main (int argc, char **argv)
 
     setGlobalLogLevel (options.loglevel);
 
+    if (options.load_test && options.num_publishers > options.num_clients) {
+        logE_ (_func, "--publishers exceeds --num-clients");
+        return EXIT_FAILURE;
+    }
+
     Ref<RtmptoolInstance> const rtmptool_instance = grab (new (std::nothrow) RtmptoolInstance);
     if (rtmptool_instance->run ())
 	return 0;
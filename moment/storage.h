@@ -42,6 +42,41 @@ public:
 
     virtual mt_throws Ref<StorageFile> openFile (ConstMemory        filename,
                                                  DeferredProcessor * mt_nonnull deferred_processor) = 0;
+
+    // Positioned asynchronous writes. Used by RecordingWriter.
+    class AsyncFile : public Object
+    {
+    public:
+        struct Frontend
+        {
+            // Called in the thread of the deferred processor which was passed
+            // to openAsyncFile().
+            void (*writeComplete) (Result  res,
+                                   void   *write_data,
+                                   void   *cb_data);
+        };
+
+        // Should be called in the thread of the deferred processor.
+        // 'mem' should stay valid until writeComplete() is called.
+        virtual mt_throws Result write (ConstMemory  mem,
+                                        Uint64       offset,
+                                        void        *write_data) = 0;
+
+        virtual void preallocate (Uint64 offset,
+                                  Uint64 len) = 0;
+
+        virtual mt_throws Result truncate (Uint64 len) = 0;
+
+        virtual void close () = 0;
+    };
+
+    // Returns NULL if asynchronous writes are not supported.
+    virtual mt_throws Ref<AsyncFile> openAsyncFile (ConstMemory        /* filename */,
+                                                    bool               /* direct_io */,
+                                                    DeferredProcessor * mt_nonnull /* deferred_processor */,
+                                                    PollGroup         * mt_nonnull /* poll_group */,
+                                                    CbDesc<AsyncFile::Frontend> const & /* frontend */)
+        { return NULL; }
 };
 
 }
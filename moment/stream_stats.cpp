@@ -0,0 +1,157 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/stream_stats.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+void
+StreamStats::advance (Time const now_millisec)
+{
+    Time const now_sec = now_millisec / 1000;
+    if (now_sec == cur_sec)
+        return;
+
+    Time num_passed = now_sec - cur_sec;
+    if (now_sec < cur_sec || num_passed > NumSlots)
+        num_passed = NumSlots;
+
+    for (Time i = 0; i < num_passed; ++i) {
+        cur_slot = (cur_slot + 1) % NumSlots;
+        memset (&slots [cur_slot], 0, sizeof (slots [cur_slot]));
+
+        if (num_complete_slots < NumSlots - 1)
+            ++num_complete_slots;
+    }
+
+    cur_sec = now_sec;
+}
+
+void
+StreamStats::processFrame (Uint64 const timestamp_nanosec,
+                           Time   const now_millisec)
+{
+    advance (now_millisec);
+
+    if (!got_first_frame) {
+        got_first_frame = true;
+        first_time_millisec = now_millisec;
+        first_timestamp_nanosec = timestamp_nanosec;
+        // The window starts with the first frame.
+        cur_sec = now_millisec / 1000;
+        num_complete_slots = 0;
+        return;
+    }
+
+    Int64 const stream_elapsed = ((Int64) timestamp_nanosec - (Int64) first_timestamp_nanosec) / 1000000;
+    Int64 const wall_elapsed   = (Int64) now_millisec - (Int64) first_time_millisec;
+    timestamp_drift_millisec = stream_elapsed - wall_elapsed;
+}
+
+void
+StreamStats::processAudioFrame (Size   const msg_len,
+                                Uint64 const timestamp_nanosec,
+                                Count  const num_watchers)
+{
+    processFrame (timestamp_nanosec, getTimeMilliseconds());
+
+    Slot * const slot = &slots [cur_slot];
+    slot->audio_bytes  += msg_len;
+    slot->egress_bytes += (Uint64) msg_len * num_watchers;
+}
+
+void
+StreamStats::processVideoFrame (Size   const msg_len,
+                                Uint64 const timestamp_nanosec,
+                                bool   const is_keyframe,
+                                Count  const num_watchers)
+{
+    Time const now_millisec = getTimeMilliseconds();
+    processFrame (timestamp_nanosec, now_millisec);
+
+    Slot * const slot = &slots [cur_slot];
+    slot->video_bytes  += msg_len;
+    slot->video_frames += 1;
+    slot->egress_bytes += (Uint64) msg_len * num_watchers;
+
+    if (is_keyframe) {
+        if (got_keyframe)
+            keyframe_interval_millisec = now_millisec - last_keyframe_millisec;
+
+        got_keyframe = true;
+        last_keyframe_millisec = now_millisec;
+    }
+}
+
+void
+StreamStats::getInfo (Info * const mt_nonnull ret_info)
+{
+    advance (getTimeMilliseconds());
+
+    ret_info->keyframe_interval_millisec = keyframe_interval_millisec;
+    ret_info->timestamp_drift_millisec = timestamp_drift_millisec;
+
+    if (num_complete_slots == 0) {
+        ret_info->audio_bitrate = 0;
+        ret_info->video_bitrate = 0;
+        ret_info->video_fps_x100 = 0;
+        ret_info->avg_video_frame_size = 0;
+        ret_info->egress_bitrate = 0;
+        return;
+    }
+
+    Uint64 audio_bytes  = 0;
+    Uint64 video_bytes  = 0;
+    Uint64 video_frames = 0;
+    Uint64 egress_bytes = 0;
+    for (Count i = 1; i <= num_complete_slots; ++i) {
+        Slot * const slot = &slots [(cur_slot + NumSlots - i) % NumSlots];
+        audio_bytes  += slot->audio_bytes;
+        video_bytes  += slot->video_bytes;
+        video_frames += slot->video_frames;
+        egress_bytes += slot->egress_bytes;
+    }
+
+    ret_info->audio_bitrate  = audio_bytes  * 8 / num_complete_slots;
+    ret_info->video_bitrate  = video_bytes  * 8 / num_complete_slots;
+    ret_info->egress_bitrate = egress_bytes * 8 / num_complete_slots;
+    ret_info->video_fps_x100 = video_frames * 100 / num_complete_slots;
+    ret_info->avg_video_frame_size = (video_frames ? video_bytes / video_frames : 0);
+}
+
+StreamStats::StreamStats ()
+    : cur_sec (0),
+      cur_slot (0),
+      num_complete_slots (0),
+      got_first_frame (false),
+      first_time_millisec (0),
+      first_timestamp_nanosec (0),
+      timestamp_drift_millisec (0),
+      got_keyframe (false),
+      last_keyframe_millisec (0),
+      keyframe_interval_millisec (0)
+{
+    memset (slots, 0, sizeof (slots));
+}
+
+}
+
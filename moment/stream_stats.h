@@ -0,0 +1,132 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__STREAM_STATS__H__
+#define MOMENT__STREAM_STATS__H__
+
+
+#include <libmary/libmary.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Rolling window statistics of a single stream.
+//
+// Counters are accumulated in one-second slots. A slot is reset when the
+// window wraps around to it, so that updating the stats for a frame takes
+// a few additions and never walks the window. Rates are computed over the
+// completed slots only.
+//
+// Not thread-safe: VideoStream updates and reads its StreamStats with
+// VideoStream::mutex held.
+//
+class StreamStats
+{
+public:
+    // Snapshot of the stats, returned by getInfo().
+    struct Info
+    {
+        Uint64 audio_bitrate;
+        Uint64 video_bitrate;
+        // Frames per second multiplied by 100.
+        Uint64 video_fps_x100;
+        Uint64 avg_video_frame_size;
+        // Time between the last two keyframes.
+        Uint64 keyframe_interval_millisec;
+        // How much stream timestamps ran ahead of the wall clock (positive)
+        // or behind it (negative) since the first frame.
+        Int64  timestamp_drift_millisec;
+        // Outgoing bitrate, summed across all watchers of the stream.
+        Uint64 egress_bitrate;
+
+        Count  num_watchers;
+
+        Info ()
+            : audio_bitrate (0),
+              video_bitrate (0),
+              video_fps_x100 (0),
+              avg_video_frame_size (0),
+              keyframe_interval_millisec (0),
+              timestamp_drift_millisec (0),
+              egress_bitrate (0),
+              num_watchers (0)
+        {
+        }
+    };
+
+private:
+    enum {
+        // 10 seconds of complete slots plus the current one.
+        NumSlots = 11
+    };
+
+    struct Slot
+    {
+        Uint64 audio_bytes;
+        Uint64 video_bytes;
+        Uint64 video_frames;
+        Uint64 egress_bytes;
+    };
+
+    Slot slots [NumSlots];
+
+    // Wall clock second which 'cur_slot' corresponds to.
+    Time  cur_sec;
+    Count cur_slot;
+    // Number of valid complete slots, up to NumSlots - 1.
+    Count num_complete_slots;
+
+    bool   got_first_frame;
+    Time   first_time_millisec;
+    Uint64 first_timestamp_nanosec;
+    Int64  timestamp_drift_millisec;
+
+    bool got_keyframe;
+    Time last_keyframe_millisec;
+    Time keyframe_interval_millisec;
+
+    void advance (Time now_millisec);
+
+    void processFrame (Uint64 timestamp_nanosec,
+                       Time   now_millisec);
+
+public:
+    // 'num_watchers' is the number of watchers that the frame is about to
+    // be sent to.
+    void processAudioFrame (Size   msg_len,
+                            Uint64 timestamp_nanosec,
+                            Count  num_watchers);
+
+    void processVideoFrame (Size   msg_len,
+                            Uint64 timestamp_nanosec,
+                            bool   is_keyframe,
+                            Count  num_watchers);
+
+    void getInfo (Info * mt_nonnull ret_info);
+
+    StreamStats ();
+};
+
+}
+
+
+#endif /* MOMENT__STREAM_STATS__H__ */
+
@@ -17,6 +17,12 @@
 */
 
 
+#ifndef LIBMARY_PLATFORM_WIN32
+#include <sys/time.h>
+#endif
+
+#include <moment/amf_encoder.h>
+#include <moment/flv_util.h>
 #include <moment/test_stream_generator.h>
 
 
@@ -25,14 +31,99 @@ using namespace M;
 namespace Moment {
 
 TestStreamGenerator::Options::Options ()
-    : frame_duration    (40),
+    : profile           (Profile_Uniform),
+      frame_duration    (40),
       frame_size        (2500),
       prechunk_size     (65536),
       keyframe_interval (10),
       start_timestamp   (0),
       burst_width       (1),
-      use_same_pages    (true)
+      use_same_pages    (true),
+      embed_timestamps  (false),
+      keyframe_size     (40000),
+      pframe_size       (8000),
+      bframe_size       (3000),
+      num_bframes       (2),
+      size_jitter_percent (20),
+      audio             (true),
+      audio_rate        (44100),
+      // ~128 kbit/sec at 44.1 kHz
+      audio_frame_size  (372),
+      metadata          (true),
+      random_seed       (1)
+{
+}
+
+static char const frame_mark_signature [4] = { 'M', 'T', 's', 'g' };
+
+static Size getFlvHeaderLen (VideoStream::VideoMessage * const mt_nonnull video_msg)
 {
+    if (video_msg->frame_type == VideoStream::VideoFrameType::RtmpSetMetaData)
+        return 0;
+
+    Byte flv_header [FlvVideoHeader_MaxLen];
+    return fillFlvVideoHeader (video_msg, Memory::forObject (flv_header));
+}
+
+static Size getFlvHeaderLen (VideoStream::AudioMessage * const mt_nonnull audio_msg)
+{
+    Byte flv_header [FlvAudioHeader_MaxLen];
+    return fillFlvAudioHeader (audio_msg, Memory::forObject (flv_header));
+}
+
+Time
+TestStreamGenerator::getWallClockMicroseconds ()
+{
+#ifndef LIBMARY_PLATFORM_WIN32
+    struct timeval tv;
+    gettimeofday (&tv, NULL /* tz */);
+    return (Time) tv.tv_sec * 1000000 + (Time) tv.tv_usec;
+#else
+    return (Time) getUnixtime() * 1000000;
+#endif
+}
+
+void
+TestStreamGenerator::writeFrameMark (Byte      * const mt_nonnull buf,
+                                     Size        const offset,
+                                     FrameMark * const mt_nonnull mark)
+{
+    Byte * const p = buf + offset;
+
+    memcpy (p, frame_mark_signature, sizeof (frame_mark_signature));
+
+    for (unsigned i = 0; i < 4; ++i)
+        p [4 + i] = (Byte) (mark->seq >> (8 * (3 - i)));
+
+    for (unsigned i = 0; i < 8; ++i)
+        p [8 + i] = (Byte) (mark->wallclock_microsec >> (8 * (7 - i)));
+}
+
+bool
+TestStreamGenerator::parseFrameMark (VideoStream::VideoMessage * const mt_nonnull msg,
+                                     FrameMark                 * const mt_nonnull ret_mark)
+{
+    Size const offset = (msg->codec_id == VideoStream::VideoCodecId::AVC ? FrameMark::AvcOffset
+                                                                         : FrameMark::Offset);
+    if (msg->msg_len < offset + FrameMark::Len)
+        return false;
+
+    Byte buf [FrameMark::Len];
+    PagePool::PageListArray pl_array (msg->page_list.first, msg->msg_offset, msg->msg_len);
+    pl_array.get (offset, Memory::forObject (buf));
+
+    if (memcmp (buf, frame_mark_signature, sizeof (frame_mark_signature)))
+        return false;
+
+    ret_mark->seq = 0;
+    for (unsigned i = 0; i < 4; ++i)
+        ret_mark->seq = (ret_mark->seq << 8) | buf [4 + i];
+
+    ret_mark->wallclock_microsec = 0;
+    for (unsigned i = 0; i < 8; ++i)
+        ret_mark->wallclock_microsec = (ret_mark->wallclock_microsec << 8) | buf [8 + i];
+
+    return true;
 }
 
 void
@@ -48,6 +139,47 @@ TestStreamGenerator::init (PagePool    * const mt_nonnull page_pool,
     if (init_opts)
         opts = *init_opts;
 
+    if (opts.size_jitter_percent > 100)
+        opts.size_jitter_percent = 100;
+
+    random_state = opts.random_seed;
+
+    if (opts.profile == Options::Profile_Avc) {
+        Uint64 max_size = opts.keyframe_size;
+        if (opts.pframe_size > max_size)
+            max_size = opts.pframe_size;
+        if (opts.bframe_size > max_size)
+            max_size = opts.bframe_size;
+        if (opts.audio && opts.audio_frame_size > max_size)
+            max_size = opts.audio_frame_size;
+
+        max_size = max_size * (100 + opts.size_jitter_percent) / 100;
+        if (max_size < FrameMark::AvcOffset + FrameMark::Len)
+            max_size = FrameMark::AvcOffset + FrameMark::Len;
+
+        if (opts.audio && opts.audio_rate == 0) {
+            logW_ (_func, "zero audio rate, audio disabled");
+            opts.audio = false;
+        }
+
+        frame_buf_size = max_size;
+        frame_buf = new Byte [frame_buf_size];
+        memset (frame_buf, 0, frame_buf_size);
+        return;
+    }
+
+    if (opts.embed_timestamps) {
+        if (opts.frame_size < FrameMark::Offset + FrameMark::Len) {
+            logW_ (_func, "frame_size ", opts.frame_size, " is too small for timestamps, "
+                   "at least ", FrameMark::Offset + FrameMark::Len, " bytes required");
+            opts.embed_timestamps = false;
+        } else {
+            frame_buf_size = opts.frame_size;
+            frame_buf = new Byte [frame_buf_size];
+            memset (frame_buf, 0, frame_buf_size);
+        }
+    }
+
     {
         Byte *frame_buf = NULL;
         if (opts.frame_size > 0) {
@@ -56,15 +188,20 @@ TestStreamGenerator::init (PagePool    * const mt_nonnull page_pool,
         }
 
         if (opts.prechunk_size > 0) {
-#warning Deal with prechunk offsets here
-            RtmpConnection::PrechunkContext prechunk_ctx;
+            // Same header length for keyframes and interframes.
+            VideoStream::VideoMessage video_msg;
+            video_msg.frame_type = VideoStream::VideoFrameType::KeyFrame;
+            video_msg.codec_id = VideoStream::VideoCodecId::SorensonH263;
+
+            RtmpConnection::PrechunkContext prechunk_ctx (getFlvHeaderLen (&video_msg));
             RtmpConnection::fillPrechunkedPages (&prechunk_ctx,
                                                  ConstMemory (frame_buf, opts.frame_size),
                                                  page_pool,
                                                  &page_list,
                                                  RtmpConnection::DefaultVideoChunkStreamId,
                                                  opts.start_timestamp,
-                                                 true /* first_chunk */);
+                                                 true /* first_chunk */,
+                                                 opts.prechunk_size);
         } else {
             page_pool->getFillPages (&page_list, ConstMemory (frame_buf, opts.frame_size));
         }
@@ -76,80 +213,451 @@ TestStreamGenerator::init (PagePool    * const mt_nonnull page_pool,
 void
 TestStreamGenerator::start ()
 {
-    timers->addTimer_microseconds (
+    tick_mutex.lock ();
+    assert (!frame_timer);
+    frame_timer = timers->addTimer_microseconds (
             CbDesc<Timers::TimerCallback> (
                     frameTimerTick,
                     this,
                     this),
             (Time) (opts.frame_duration * 1000 * opts.burst_width),
             true /* periodical */);
+    tick_mutex.unlock ();
+}
+
+void
+TestStreamGenerator::stop ()
+{
+    tick_mutex.lock ();
+    if (frame_timer) {
+        timers->deleteTimer (frame_timer);
+        frame_timer = NULL;
+    }
+    tick_mutex.unlock ();
+}
+
+mt_mutex (tick_mutex) Uint64
+TestStreamGenerator::getFrameTimestamp ()
+{
+    if (first_frame) {
+        timestamp_offset = getTimeMilliseconds();
+        first_frame = false;
+        return opts.start_timestamp * 1000000;
+    }
+
+    Time timestamp = getTimeMilliseconds();
+    if (timestamp >= timestamp_offset)
+        timestamp -= timestamp_offset;
+    else
+        timestamp = 0;
+
+    timestamp += opts.start_timestamp;
+
+    return timestamp * 1000000;
+}
+
+mt_mutex (tick_mutex) void
+TestStreamGenerator::fillFramePages (ConstMemory              const mem,
+                                     Uint32                   const chunk_stream_id,
+                                     Uint64                   const timestamp_nanosec,
+                                     Size                     const flv_header_len,
+                                     PagePool::PageListHead * const mt_nonnull page_list)
+{
+    if (opts.prechunk_size > 0) {
+        RtmpConnection::PrechunkContext prechunk_ctx (flv_header_len);
+        RtmpConnection::fillPrechunkedPages (&prechunk_ctx,
+                                             mem,
+                                             page_pool,
+                                             page_list,
+                                             chunk_stream_id,
+                                             timestamp_nanosec / 1000000,
+                                             true /* first_chunk */,
+                                             opts.prechunk_size);
+    } else {
+        page_pool->getFillPages (page_list, mem);
+    }
+}
+
+// Deterministic for a given random_seed, so that runs are reproducible.
+mt_mutex (tick_mutex) Size
+TestStreamGenerator::jitterSize (Uint64 const size)
+{
+    if (opts.size_jitter_percent == 0)
+        return size;
+
+    random_state = random_state * 1103515245 + 12345;
+    Uint64 const r = (random_state >> 16) % (2 * opts.size_jitter_percent + 1);
+    return size * (100 - opts.size_jitter_percent + r) / 100;
+}
+
+mt_mutex (tick_mutex) void
+TestStreamGenerator::fireUniformFrame (Uint64 const timestamp_nanosec)
+{
+    VideoStream::VideoMessage video_msg;
+
+    if (keyframe_counter == 0) {
+        video_msg.frame_type = VideoStream::VideoFrameType::KeyFrame;
+        keyframe_counter = opts.keyframe_interval;
+    } else {
+        video_msg.frame_type = VideoStream::VideoFrameType::InterFrame;
+        --keyframe_counter;
+    }
+
+    video_msg.timestamp_nanosec = timestamp_nanosec;
+    video_msg.prechunk_size = opts.prechunk_size;
+    video_msg.codec_id = VideoStream::VideoCodecId::/* Unknown */ SorensonH263;
+
+    PagePool::PageListHead *page_list_ptr = &page_list;
+    PagePool::PageListHead tmp_page_list;
+    if (opts.embed_timestamps) {
+        FrameMark mark;
+        mark.seq = frame_seq;
+        mark.wallclock_microsec = getWallClockMicroseconds ();
+        writeFrameMark (frame_buf, FrameMark::Offset, &mark);
+        ++frame_seq;
+
+        fillFramePages (ConstMemory (frame_buf, opts.frame_size),
+                        RtmpConnection::DefaultVideoChunkStreamId,
+                        video_msg.timestamp_nanosec,
+                        getFlvHeaderLen (&video_msg),
+                        &tmp_page_list);
+
+        page_list_ptr = &tmp_page_list;
+    } else
+    if (!opts.use_same_pages) {
+        page_pool->getPages (&tmp_page_list, opts.frame_size);
+
+        {
+            PagePool::Page *page = tmp_page_list.first;
+            while (page) {
+                memset (page->getData(), (int) page_fill_counter, page->data_len);
+                page = page->getNextMsgPage();
+            }
+        }
+
+        if (page_fill_counter < 255)
+            ++page_fill_counter;
+        else
+            page_fill_counter = 0;
+
+        page_list_ptr = &tmp_page_list;
+    }
+
+    video_msg.page_pool  = page_pool;
+    video_msg.page_list  = *page_list_ptr;
+    video_msg.msg_len    = opts.frame_size;
+    video_msg.msg_offset = 0;
+
+    video_stream->fireVideoMessage (&video_msg);
+
+    if (page_list_ptr == &tmp_page_list)
+        page_pool->msgUnref (tmp_page_list.first);
+}
+
+// SPS and PPS of a 1280x720 High profile stream, as produced by x264.
+static Byte const avc_sps [] = { 0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40, 0x50,
+                                 0x05, 0xbb, 0x01, 0x10, 0x00, 0x00, 0x03, 0x00,
+                                 0x10, 0x00, 0x00, 0x03, 0x03, 0xc0, 0xf1, 0x83,
+                                 0x19, 0x60 };
+static Byte const avc_pps [] = { 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 };
+
+static Uint32 const avc_width  = 1280;
+static Uint32 const avc_height = 720;
+
+mt_mutex (tick_mutex) void
+TestStreamGenerator::fireAvcHeaders ()
+{
+    Uint64 const timestamp_nanosec = opts.start_timestamp * 1000000;
+
+    if (opts.metadata) {
+        // Average bitrates, for players which show them.
+        Uint64 gop_bytes = 0;
+        for (Uint64 i = 0; i <= opts.keyframe_interval; ++i) {
+            if (i == 0)
+                gop_bytes += opts.keyframe_size;
+            else
+            if (opts.num_bframes == 0 || (i - 1) % (opts.num_bframes + 1) == 0)
+                gop_bytes += opts.pframe_size;
+            else
+                gop_bytes += opts.bframe_size;
+        }
+        Uint64 const frame_rate = (opts.frame_duration > 0 ? 1000 / opts.frame_duration : 0);
+        Uint64 const video_kbps = gop_bytes / (opts.keyframe_interval + 1) * 8 * frame_rate / 1000;
+
+        AmfAtom atoms [64];
+        AmfEncoder encoder (atoms);
+
+        encoder.addString ("onMetaData");
+
+        encoder.beginEcmaArray (0 /* num_entries */);
+        AmfAtom * const toplevel_array_atom = encoder.getLastAtom ();
+        Uint32 num_entries = 0;
+
+        encoder.addFieldName ("videocodecid");
+        encoder.addNumber (VideoStream::VideoCodecId (VideoStream::VideoCodecId::AVC).toFlvCodecId());
+        encoder.addFieldName ("width");
+        encoder.addNumber (avc_width);
+        encoder.addFieldName ("height");
+        encoder.addNumber (avc_height);
+        encoder.addFieldName ("framerate");
+        encoder.addNumber (frame_rate);
+        encoder.addFieldName ("videodatarate");
+        encoder.addNumber (video_kbps);
+        num_entries += 5;
+
+        if (opts.audio) {
+            encoder.addFieldName ("audiocodecid");
+            encoder.addNumber (VideoStream::AudioCodecId (VideoStream::AudioCodecId::AAC).toFlvCodecId());
+            encoder.addFieldName ("audiosamplerate");
+            encoder.addNumber (opts.audio_rate);
+            encoder.addFieldName ("audiosamplesize");
+            encoder.addNumber (16);
+            encoder.addFieldName ("stereo");
+            encoder.addBoolean (true);
+            encoder.addFieldName ("audiodatarate");
+            encoder.addNumber (opts.audio_frame_size * 8 * opts.audio_rate / 1024 / 1000);
+            num_entries += 5;
+        }
+
+        encoder.endObject ();
+
+        toplevel_array_atom->setEcmaArraySize (num_entries);
+
+        Byte msg_buf [1024];
+        Size msg_len;
+        if (!encoder.encode (Memory::forObject (msg_buf), AmfEncoding::AMF0, &msg_len)) {
+            logE_ (_func, "encode() failed");
+        } else {
+            VideoStream::VideoMessage video_msg;
+            video_msg.frame_type = VideoStream::VideoFrameType::RtmpSetMetaData;
+            video_msg.codec_id = VideoStream::VideoCodecId::Unknown;
+            video_msg.timestamp_nanosec = 0;
+            video_msg.prechunk_size = opts.prechunk_size;
+
+            video_msg.page_pool = page_pool;
+            fillFramePages (ConstMemory (msg_buf, msg_len),
+                            RtmpConnection::DefaultDataChunkStreamId,
+                            0 /* timestamp_nanosec */,
+                            0 /* flv_header_len */,
+                            &video_msg.page_list);
+            video_msg.msg_len = msg_len;
+            video_msg.msg_offset = 0;
+
+            video_stream->fireVideoMessage (&video_msg);
+            page_pool->msgUnref (video_msg.page_list.first);
+        }
+    }
+
+    {
+      // AVCDecoderConfigurationRecord
+
+        Byte avc_seq_hdr [11 + sizeof (avc_sps) + sizeof (avc_pps)];
+        Byte *p = avc_seq_hdr;
+        *p++ = 1;             // configurationVersion
+        *p++ = avc_sps [1];   // AVCProfileIndication
+        *p++ = avc_sps [2];   // profile_compatibility
+        *p++ = avc_sps [3];   // AVCLevelIndication
+        *p++ = 0xff;          // lengthSizeMinusOne: 4-byte NAL unit lengths
+        *p++ = 0xe1;          // numOfSequenceParameterSets: 1
+        *p++ = (Byte) (sizeof (avc_sps) >> 8);
+        *p++ = (Byte) (sizeof (avc_sps) & 0xff);
+        memcpy (p, avc_sps, sizeof (avc_sps));
+        p += sizeof (avc_sps);
+        *p++ = 1;             // numOfPictureParameterSets
+        *p++ = (Byte) (sizeof (avc_pps) >> 8);
+        *p++ = (Byte) (sizeof (avc_pps) & 0xff);
+        memcpy (p, avc_pps, sizeof (avc_pps));
+
+        VideoStream::VideoMessage video_msg;
+        video_msg.frame_type = VideoStream::VideoFrameType::AvcSequenceHeader;
+        video_msg.codec_id = VideoStream::VideoCodecId::AVC;
+        video_msg.timestamp_nanosec = timestamp_nanosec;
+        video_msg.prechunk_size = opts.prechunk_size;
+
+        video_msg.page_pool = page_pool;
+        fillFramePages (ConstMemory::forObject (avc_seq_hdr),
+                        RtmpConnection::DefaultVideoChunkStreamId,
+                        timestamp_nanosec,
+                        getFlvHeaderLen (&video_msg),
+                        &video_msg.page_list);
+        video_msg.msg_len = sizeof (avc_seq_hdr);
+        video_msg.msg_offset = 0;
+
+        video_stream->fireVideoMessage (&video_msg);
+        page_pool->msgUnref (video_msg.page_list.first);
+    }
+
+    if (opts.audio) {
+      // AudioSpecificConfig: AAC LC, stereo.
+
+        Byte const freq_idx = (opts.audio_rate == 48000 ? 3 : 4 /* 44100 */);
+        Byte const channel_config = 2;
+        Byte const aac_seq_hdr [2] = {
+            (Byte) ((2 /* AAC LC */ << 3) | (freq_idx >> 1)),
+            (Byte) (((freq_idx & 1) << 7) | (channel_config << 3))
+        };
+
+        VideoStream::AudioMessage audio_msg;
+        audio_msg.frame_type = VideoStream::AudioFrameType::AacSequenceHeader;
+        audio_msg.codec_id = VideoStream::AudioCodecId::AAC;
+        audio_msg.rate = opts.audio_rate;
+        audio_msg.channels = 2;
+        audio_msg.timestamp_nanosec = timestamp_nanosec;
+        audio_msg.prechunk_size = opts.prechunk_size;
+
+        audio_msg.page_pool = page_pool;
+        fillFramePages (ConstMemory::forObject (aac_seq_hdr),
+                        RtmpConnection::DefaultAudioChunkStreamId,
+                        timestamp_nanosec,
+                        getFlvHeaderLen (&audio_msg),
+                        &audio_msg.page_list);
+        audio_msg.msg_len = sizeof (aac_seq_hdr);
+        audio_msg.msg_offset = 0;
+
+        video_stream->fireAudioMessage (&audio_msg);
+        page_pool->msgUnref (audio_msg.page_list.first);
+    }
+}
+
+// Generates AAC frames to catch up with video. An AAC frame is 1024 samples
+// long, i.e. ~23.2 ms at 44.1 kHz and ~21.3 ms at 48 kHz.
+mt_mutex (tick_mutex) void
+TestStreamGenerator::fireAudioFrames (Uint64 const up_to_nanosec)
+{
+    for (;;) {
+        Uint64 const timestamp_nanosec =
+                opts.start_timestamp * 1000000 + audio_samples * 1000000000 / opts.audio_rate;
+        if (timestamp_nanosec > up_to_nanosec)
+            break;
+
+        Size frame_size = jitterSize (opts.audio_frame_size);
+        if (frame_size < 1)
+            frame_size = 1;
+        if (frame_size > frame_buf_size)
+            frame_size = frame_buf_size;
+
+        VideoStream::AudioMessage audio_msg;
+        audio_msg.frame_type = VideoStream::AudioFrameType::RawData;
+        audio_msg.codec_id = VideoStream::AudioCodecId::AAC;
+        audio_msg.rate = opts.audio_rate;
+        audio_msg.channels = 2;
+        audio_msg.timestamp_nanosec = timestamp_nanosec;
+        audio_msg.prechunk_size = opts.prechunk_size;
+
+        audio_msg.page_pool = page_pool;
+        fillFramePages (ConstMemory (frame_buf, frame_size),
+                        RtmpConnection::DefaultAudioChunkStreamId,
+                        timestamp_nanosec,
+                        getFlvHeaderLen (&audio_msg),
+                        &audio_msg.page_list);
+        audio_msg.msg_len = frame_size;
+        audio_msg.msg_offset = 0;
+
+        video_stream->fireAudioMessage (&audio_msg);
+        page_pool->msgUnref (audio_msg.page_list.first);
+
+        audio_samples += 1024;
+    }
+}
+
+// Frames are generated in decoding order: I P B B P B B ...
+// Composition time offsets are not set, as in the rest of the server.
+// Frame contents are a single length-prefixed NAL unit of filler data.
+mt_mutex (tick_mutex) void
+TestStreamGenerator::fireAvcFrame (Uint64 const timestamp_nanosec)
+{
+    if (!sent_headers) {
+        fireAvcHeaders ();
+        sent_headers = true;
+    }
+
+    if (opts.audio)
+        fireAudioFrames (timestamp_nanosec);
+
+    VideoStream::VideoMessage video_msg;
+
+    Uint64 avg_size;
+    Byte nal_hdr;
+    if (gop_pos == 0) {
+        video_msg.frame_type = VideoStream::VideoFrameType::KeyFrame;
+        avg_size = opts.keyframe_size;
+        nal_hdr = 0x65; // IDR slice
+    } else
+    if (opts.num_bframes == 0 || (gop_pos - 1) % (opts.num_bframes + 1) == 0) {
+        video_msg.frame_type = VideoStream::VideoFrameType::InterFrame;
+        avg_size = opts.pframe_size;
+        nal_hdr = 0x41; // non-IDR slice
+    } else {
+        video_msg.frame_type = VideoStream::VideoFrameType::DisposableInterFrame;
+        avg_size = opts.bframe_size;
+        nal_hdr = 0x01; // non-IDR slice, nal_ref_idc 0
+    }
+
+    // Same as for Profile_Uniform: a keyframe and 'keyframe_interval' frames after it.
+    ++gop_pos;
+    if (gop_pos > opts.keyframe_interval)
+        gop_pos = 0;
+
+    Size const min_size = (opts.embed_timestamps ? FrameMark::AvcOffset + FrameMark::Len : 5);
+    Size frame_size = jitterSize (avg_size);
+    if (frame_size < min_size)
+        frame_size = min_size;
+    if (frame_size > frame_buf_size)
+        frame_size = frame_buf_size;
+
+    {
+        Uint32 const nal_len = frame_size - 4;
+        frame_buf [0] = (Byte) (nal_len >> 24);
+        frame_buf [1] = (Byte) (nal_len >> 16);
+        frame_buf [2] = (Byte) (nal_len >>  8);
+        frame_buf [3] = (Byte) (nal_len >>  0);
+        frame_buf [4] = nal_hdr;
+    }
+
+    if (opts.embed_timestamps) {
+        // The length prefix and the NAL unit header are kept intact,
+        // the mark goes into the slice data.
+        FrameMark mark;
+        mark.seq = frame_seq;
+        mark.wallclock_microsec = getWallClockMicroseconds ();
+        writeFrameMark (frame_buf, FrameMark::AvcOffset, &mark);
+        ++frame_seq;
+    }
+
+    video_msg.codec_id = VideoStream::VideoCodecId::AVC;
+    video_msg.timestamp_nanosec = timestamp_nanosec;
+    video_msg.prechunk_size = opts.prechunk_size;
+
+    video_msg.page_pool = page_pool;
+    fillFramePages (ConstMemory (frame_buf, frame_size),
+                    RtmpConnection::DefaultVideoChunkStreamId,
+                    timestamp_nanosec,
+                    getFlvHeaderLen (&video_msg),
+                    &video_msg.page_list);
+    video_msg.msg_len = frame_size;
+    video_msg.msg_offset = 0;
+
+    video_stream->fireVideoMessage (&video_msg);
+    page_pool->msgUnref (video_msg.page_list.first);
 }
 
 void
 TestStreamGenerator::doFrameTimerTick ()
 {
     tick_mutex.lock ();
+    if (!frame_timer) {
+        // stop() has been called while the timer was firing.
+        tick_mutex.unlock ();
+        return;
+    }
 
     for (Uint64 i = 0; i < opts.burst_width; ++i) {
-	VideoStream::VideoMessage video_msg;
-
-	if (keyframe_counter == 0) {
-	    video_msg.frame_type = VideoStream::VideoFrameType::KeyFrame;
-	    keyframe_counter = opts.keyframe_interval;
-	} else {
-	    video_msg.frame_type = VideoStream::VideoFrameType::InterFrame;
-	    --keyframe_counter;
-	}
-
-	if (first_frame) {
-	    timestamp_offset = getTimeMilliseconds();
-	    video_msg.timestamp_nanosec = opts.start_timestamp * 1000000;
-	    first_frame = false;
-	} else {
-	    Time timestamp = getTimeMilliseconds();
-	    if (timestamp >= timestamp_offset)
-		timestamp -= timestamp_offset;
-	    else
-		timestamp = 0;
-
-	    timestamp += opts.start_timestamp;
-
-	    video_msg.timestamp_nanosec = timestamp * 1000000;
-	}
-
-	video_msg.prechunk_size = opts.prechunk_size;
-	video_msg.codec_id = VideoStream::VideoCodecId::/* Unknown */ SorensonH263;
-
-	PagePool::PageListHead *page_list_ptr = &page_list;
-	PagePool::PageListHead tmp_page_list;
-	if (!opts.use_same_pages) {
-	    page_pool->getPages (&tmp_page_list, opts.frame_size);
-
-	    {
-		PagePool::Page *page = tmp_page_list.first;
-		while (page) {
-		    memset (page->getData(), (int) page_fill_counter, page->data_len);
-		    page = page->getNextMsgPage();
-		}
-	    }
-
-	    if (page_fill_counter < 255)
-		++page_fill_counter;
-	    else
-		page_fill_counter = 0;
-
-	    page_list_ptr = &tmp_page_list;
-	}
-
-	video_msg.page_pool  = page_pool;
-	video_msg.page_list  = *page_list_ptr;
-	video_msg.msg_len    = opts.frame_size;
-	video_msg.msg_offset = 0;
-
-	video_stream->fireVideoMessage (&video_msg);
-
-	if (!opts.use_same_pages)
-	    page_pool->msgUnref (tmp_page_list.first);
+        Uint64 const timestamp_nanosec = getFrameTimestamp ();
+
+        if (opts.profile == Options::Profile_Avc)
+            fireAvcFrame (timestamp_nanosec);
+        else
+            fireUniformFrame (timestamp_nanosec);
     }
 
     tick_mutex.unlock ();
@@ -165,16 +673,26 @@ TestStreamGenerator::frameTimerTick (void * const _self)
 TestStreamGenerator::TestStreamGenerator ()
     : page_pool (this /* coderef_container */),
       timers    (this /* coderef_container */),
+      frame_timer       (NULL),
       keyframe_counter  (0),
       first_frame       (true),
       timestamp_offset  (0),
-      page_fill_counter (0)
+      page_fill_counter (0),
+      frame_buf         (NULL),
+      frame_buf_size    (0),
+      frame_seq         (0),
+      sent_headers      (false),
+      gop_pos           (0),
+      audio_samples     (0),
+      random_state      (1)
 {
 }
 
 TestStreamGenerator::~TestStreamGenerator ()
 {
     logD_ (_this_func);
+
+    delete[] frame_buf;
 }
 
 } // namespace Moment
@@ -36,9 +36,45 @@ private:
     Mutex tick_mutex;
 
 public:
+    // Frame mark for measuring end-to-end latency and frame loss. It follows
+    // the first byte of the message (FLV video tag header):
+    //
+    //     4 bytes - "MTsg" signature;
+    //     4 bytes - sequence number of the frame, big endian;
+    //     8 bytes - wall clock time of generation in microseconds, big endian.
+    //
+    // In AVC frames, the mark follows the NAL unit length prefix and the NAL
+    // unit header instead ('AvcOffset').
+    //
+    struct FrameMark
+    {
+        enum { Offset = 1, AvcOffset = 5, Len = 16 };
+
+        Uint32 seq;
+        Time   wallclock_microsec;
+    };
+
+    // Wall clock time in microseconds. Unlike getTimeMicroseconds(), it is
+    // comparable between processes and between hosts with synchronized clocks.
+    static Time getWallClockMicroseconds ();
+
+    // Returns false if the message carries no frame mark.
+    static bool parseFrameMark (VideoStream::VideoMessage * mt_nonnull msg,
+                                FrameMark                 * mt_nonnull ret_mark);
+
     class Options
     {
     public:
+        enum Profile {
+            // Video frames of 'frame_size' bytes, no audio.
+            Profile_Uniform,
+            // AVC/AAC-shaped traffic: onMetaData, sequence headers,
+            // I/P/B frames of varying size, AAC audio.
+            Profile_Avc
+        };
+
+        Profile profile;
+
         Uint64 frame_duration;
         Uint64 frame_size;
         Uint64 prechunk_size;
@@ -46,6 +82,29 @@ public:
         Uint64 start_timestamp;
         Uint64 burst_width;
         bool use_same_pages;
+        // Put a FrameMark into every frame. Implies !use_same_pages.
+        bool embed_timestamps;
+
+      // Profile_Avc
+
+        // Average sizes of I, P and B frames.
+        Uint64 keyframe_size;
+        Uint64 pframe_size;
+        Uint64 bframe_size;
+        // Number of B-frames between P-frames.
+        Uint64 num_bframes;
+        // Frame sizes vary by up to +/- this many percent.
+        Uint64 size_jitter_percent;
+
+        bool   audio;
+        // 44100 or 48000. AAC frames are 1024 samples long.
+        Uint64 audio_rate;
+        Uint64 audio_frame_size;
+
+        bool metadata;
+
+        // Streams with different seeds get different frame sizes.
+        Uint32 random_seed;
 
         Options ();
     };
@@ -57,6 +116,8 @@ private:
     mt_const DataDepRef<Timers>   timers;
     mt_const Ref<VideoStream>     video_stream;
 
+    mt_mutex (tick_mutex) Timers::TimerKey frame_timer;
+
     mt_mutex (tick_mutex) Uint64 keyframe_counter;
 
     mt_mutex (tick_mutex) PagePool::PageListHead page_list;
@@ -66,6 +127,41 @@ private:
 
     mt_mutex (tick_mutex) Uint32 page_fill_counter;
 
+    // Frame contents for 'embed_timestamps' mode and for Profile_Avc.
+    mt_mutex (tick_mutex) Byte   *frame_buf;
+    mt_mutex (tick_mutex) Size    frame_buf_size;
+    mt_mutex (tick_mutex) Uint32  frame_seq;
+
+    // Profile_Avc state.
+    mt_mutex (tick_mutex) bool   sent_headers;
+    mt_mutex (tick_mutex) Uint64 gop_pos;
+    mt_mutex (tick_mutex) Uint64 audio_samples;
+    mt_mutex (tick_mutex) Uint32 random_state;
+
+    static void writeFrameMark (Byte      * mt_nonnull buf,
+                                Size       offset,
+                                FrameMark * mt_nonnull mark);
+
+    mt_mutex (tick_mutex) Uint64 getFrameTimestamp ();
+
+    // 'flv_header_len' bytes of the first chunk are taken by FLV tag header
+    // which RtmpConnection puts in front of the message.
+    mt_mutex (tick_mutex) void fillFramePages (ConstMemory             mem,
+                                               Uint32                  chunk_stream_id,
+                                               Uint64                  timestamp_nanosec,
+                                               Size                    flv_header_len,
+                                               PagePool::PageListHead * mt_nonnull page_list);
+
+    mt_mutex (tick_mutex) Size jitterSize (Uint64 size);
+
+    mt_mutex (tick_mutex) void fireUniformFrame (Uint64 timestamp_nanosec);
+
+    mt_mutex (tick_mutex) void fireAvcHeaders ();
+
+    mt_mutex (tick_mutex) void fireAudioFrames (Uint64 up_to_nanosec);
+
+    mt_mutex (tick_mutex) void fireAvcFrame (Uint64 timestamp_nanosec);
+
     void doFrameTimerTick ();
 
     static void frameTimerTick (void *_self);
@@ -78,6 +174,10 @@ public:
 
     void start ();
 
+    // The generator may not be started again. Another generator with
+    // 'start_timestamp' set may continue the stream.
+    void stop ();
+
     TestStreamGenerator ();
 
     ~TestStreamGenerator ();
@@ -0,0 +1,240 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/thread_monitor.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_thread_monitor ("moment.thread_monitor", LogLevel::I);
+
+mt_mutex (mutex) bool
+ThreadMonitor::getThreadCpuTime (ThreadEntry * const mt_nonnull entry,
+                                 Time        * const mt_nonnull ret_cpu_microsec)
+{
+    *ret_cpu_microsec = 0;
+
+#ifndef LIBMARY_PLATFORM_WIN32
+    if (!entry->valid)
+        return false;
+
+    struct timespec ts;
+    if (clock_gettime (entry->cpu_clock, &ts) == -1) {
+        logD (thread_monitor, _func, "thread ", entry->name, " has exited: ", errnoString (errno));
+        entry->valid = false;
+        return false;
+    }
+
+    *ret_cpu_microsec = (Time) ts.tv_sec * 1000000 + (Time) ts.tv_nsec / 1000;
+    return true;
+#else
+    return false;
+#endif
+}
+
+mt_mutex (mutex) void
+ThreadMonitor::sampleThreads (Time const now_microsec)
+{
+    for (Count i = 0; i < num_threads; ++i) {
+        ThreadEntry * const entry = &threads [i];
+
+        Time cpu_microsec;
+        if (!getThreadCpuTime (entry, &cpu_microsec))
+            continue;
+
+        Time const wall_delta = now_microsec - entry->last_wall_microsec;
+        Time const cpu_delta  = (cpu_microsec > entry->last_cpu_microsec ? cpu_microsec - entry->last_cpu_microsec : 0);
+
+        entry->recent_busy_permille = (wall_delta > 0 ? (Uint32) (cpu_delta * 1000 / wall_delta) : 0);
+        if (entry->recent_busy_permille > 1000)
+            entry->recent_busy_permille = 1000;
+
+        entry->last_wall_microsec = now_microsec;
+        entry->last_cpu_microsec  = cpu_microsec;
+    }
+}
+
+void
+ThreadMonitor::probeTimerTick (void * const _self)
+{
+    ThreadMonitor * const self = static_cast <ThreadMonitor*> (_self);
+
+    Time const now_microsec = getTimeMicroseconds ();
+
+    self->mutex.lock ();
+    if (self->last_tick_microsec) {
+        Time const expected = self->last_tick_microsec + ProbeInterval_Millisec * 1000;
+        Time const lag = (now_microsec > expected ? now_microsec - expected : 0);
+        self->loop_lag.record (lag);
+
+        if (lag > self->cur_max_lag_microsec)
+            self->cur_max_lag_microsec = lag;
+    }
+    self->last_tick_microsec = now_microsec;
+
+    ++self->tick_counter;
+    if (self->tick_counter >= TicksPerSample) {
+        self->tick_counter = 0;
+        self->recent_max_lag_microsec = self->cur_max_lag_microsec;
+        self->cur_max_lag_microsec = 0;
+
+        self->sampleThreads (now_microsec);
+    }
+    self->mutex.unlock ();
+}
+
+void
+ThreadMonitor::registerCurrentThread (ConstMemory const name)
+{
+#ifndef LIBMARY_PLATFORM_WIN32
+    clockid_t cpu_clock;
+    {
+        int const res = pthread_getcpuclockid (pthread_self (), &cpu_clock);
+        if (res != 0) {
+            logE (thread_monitor, _func, "pthread_getcpuclockid() failed: ", errnoString (res));
+            return;
+        }
+    }
+
+    mutex.lock ();
+    if (num_threads >= MaxThreads) {
+        mutex.unlock ();
+        logW (thread_monitor, _func, "too many threads, not monitoring thread ", name);
+        return;
+    }
+
+    ThreadEntry * const entry = &threads [num_threads];
+    ++num_threads;
+
+    entry->name = st_grab (new (std::nothrow) String (name));
+    entry->cpu_clock = cpu_clock;
+    entry->valid = true;
+
+    Time cpu_microsec;
+    getThreadCpuTime (entry, &cpu_microsec);
+    Time const now_microsec = getTimeMicroseconds ();
+
+    entry->start_wall_microsec = now_microsec;
+    entry->start_cpu_microsec  = cpu_microsec;
+    entry->last_wall_microsec  = now_microsec;
+    entry->last_cpu_microsec   = cpu_microsec;
+    entry->recent_busy_permille = 0;
+    mutex.unlock ();
+#else
+    (void) name;
+#endif
+}
+
+void
+ThreadMonitor::start (Timers * const mt_nonnull timers)
+{
+    this->timers = timers;
+
+    mutex.lock ();
+    assert (!probe_timer);
+    last_tick_microsec = 0;
+    probe_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (probeTimerTick, this, this),
+            ProbeInterval_Millisec * 1000,
+            true /* periodical */);
+    mutex.unlock ();
+}
+
+void
+ThreadMonitor::stop ()
+{
+    mutex.lock ();
+    if (probe_timer) {
+        timers->deleteTimer (probe_timer);
+        probe_timer = NULL;
+    }
+    mutex.unlock ();
+}
+
+static void printPermille (PagePool               * const mt_nonnull page_pool,
+                           PagePool::PageListHead * const mt_nonnull page_list,
+                           Uint32                   const permille)
+{
+    page_pool->printToPages (page_list, permille / 10, ".", permille % 10, "%");
+}
+
+void
+ThreadMonitor::printReport (PagePool               * const mt_nonnull page_pool,
+                            PagePool::PageListHead * const mt_nonnull page_list)
+{
+    Time const now_microsec = getTimeMicroseconds ();
+
+    mutex.lock ();
+
+    page_pool->printToPages (page_list, "threads (busy over the last second, busy since start):\n");
+    for (Count i = 0; i < num_threads; ++i) {
+        ThreadEntry * const entry = &threads [i];
+
+        Time cpu_microsec;
+        if (!getThreadCpuTime (entry, &cpu_microsec)) {
+            page_pool->printToPages (page_list, "  ", i, " ", entry->name, ": exited\n");
+            continue;
+        }
+
+        Time const wall_total = now_microsec - entry->start_wall_microsec;
+        Time const cpu_total  = (cpu_microsec > entry->start_cpu_microsec ? cpu_microsec - entry->start_cpu_microsec : 0);
+        Uint32 total_permille = (wall_total > 0 ? (Uint32) (cpu_total * 1000 / wall_total) : 0);
+        if (total_permille > 1000)
+            total_permille = 1000;
+
+        page_pool->printToPages (page_list, "  ", i, " ", entry->name, ": busy ");
+        printPermille (page_pool, page_list, entry->recent_busy_permille);
+        page_pool->printToPages (page_list, ", ");
+        printPermille (page_pool, page_list, total_permille);
+        page_pool->printToPages (page_list, ", cpu ", cpu_total / 1000, " ms\n");
+    }
+
+    Time const recent_max_lag = recent_max_lag_microsec;
+    mutex.unlock ();
+
+    page_pool->printToPages (
+            page_list,
+            "main event loop lag, usec: count ", loop_lag.getCount(), " "
+            "p50 ",   loop_lag.getPercentile (50.0), " "
+            "p99 ",   loop_lag.getPercentile (99.0), " "
+            "p99.9 ", loop_lag.getPercentile (99.9), " "
+            "max ",   loop_lag.getMax(), " "
+            "max_last_second ", recent_max_lag, "\n");
+}
+
+ThreadMonitor::ThreadMonitor ()
+    : num_threads (0),
+      timers (this /* coderef_container */),
+      probe_timer (NULL),
+      last_tick_microsec (0),
+      tick_counter (0),
+      cur_max_lag_microsec (0),
+      recent_max_lag_microsec (0)
+{
+}
+
+ThreadMonitor::~ThreadMonitor ()
+{
+    stop ();
+}
+
+}
+
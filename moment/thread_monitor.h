@@ -0,0 +1,122 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__THREAD_MONITOR__H__
+#define MOMENT__THREAD_MONITOR__H__
+
+
+#include <libmary/libmary.h>
+
+#ifndef LIBMARY_PLATFORM_WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include <moment/latency_stats.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Lightweight always-on view of where server threads spend their time.
+//
+// Busy/idle ratio of a thread is the share of wall clock time which the thread
+// spent on CPU, as reported by its CPU time clock. Idle time is time spent
+// waiting for events in the poll group.
+//
+// Event loop iteration latency is measured with a periodical timer: the later
+// the timer fires, the longer the loop has been stuck in a single iteration.
+//
+class ThreadMonitor : public Object
+{
+private:
+    StateMutex mutex;
+
+    enum {
+        MaxThreads = 256,
+        ProbeInterval_Millisec = 100,
+        // Busy ratios are sampled once a second.
+        TicksPerSample = 10
+    };
+
+    struct ThreadEntry
+    {
+        StRef<String> name;
+
+#ifndef LIBMARY_PLATFORM_WIN32
+        clockid_t cpu_clock;
+#endif
+        // False if the thread has exited.
+        bool valid;
+
+        Time start_wall_microsec;
+        Time start_cpu_microsec;
+
+        Time last_wall_microsec;
+        Time last_cpu_microsec;
+
+        // Per mille of the last sample period spent on CPU.
+        Uint32 recent_busy_permille;
+    };
+
+    mt_mutex (mutex) ThreadEntry threads [MaxThreads];
+    mt_mutex (mutex) Count num_threads;
+
+    mt_const DataDepRef<Timers> timers;
+    mt_mutex (mutex) Timers::TimerKey probe_timer;
+
+    mt_mutex (mutex) Time  last_tick_microsec;
+    mt_mutex (mutex) Count tick_counter;
+    mt_mutex (mutex) Time  cur_max_lag_microsec;
+    mt_mutex (mutex) Time  recent_max_lag_microsec;
+
+    LatencyHistogram loop_lag;
+
+    // Returns false if the thread has exited.
+    mt_mutex (mutex) bool getThreadCpuTime (ThreadEntry * mt_nonnull entry,
+                                            Time        * mt_nonnull ret_cpu_microsec);
+
+    mt_mutex (mutex) void sampleThreads (Time now_microsec);
+
+    static void probeTimerTick (void *_self);
+
+public:
+    // Should be called by the thread being registered.
+    void registerCurrentThread (ConstMemory name);
+
+    // Starts measuring event loop iteration latency of the thread which
+    // 'timers' belong to, usually the main server thread.
+    void start (Timers * mt_nonnull timers);
+
+    void stop ();
+
+    void printReport (PagePool               * mt_nonnull page_pool,
+                      PagePool::PageListHead * mt_nonnull page_list);
+
+    ThreadMonitor ();
+
+    ~ThreadMonitor ();
+};
+
+}
+
+
+#endif /* MOMENT__THREAD_MONITOR__H__ */
+
@@ -0,0 +1,1187 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <moment/moment_server.h>
+#include <moment/rtmp_connection.h>
+
+#include <moment/timeshift_buffer.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_timeshift ("moment.timeshift", LogLevel::I);
+
+static Byte* putUint32Be (Byte * const p, Uint32 const value)
+{
+    p [0] = (Byte) (value >> 24);
+    p [1] = (Byte) (value >> 16);
+    p [2] = (Byte) (value >>  8);
+    p [3] = (Byte) (value >>  0);
+    return p + 4;
+}
+
+static Byte* putUint64Be (Byte * const p, Uint64 const value)
+{
+    putUint32Be (p, (Uint32) (value >> 32));
+    return putUint32Be (p + 4, (Uint32) value);
+}
+
+static Uint32 getUint32Be (Byte const * const p)
+{
+    return ((Uint32) p [0] << 24) |
+           ((Uint32) p [1] << 16) |
+           ((Uint32) p [2] <<  8) |
+           ((Uint32) p [3] <<  0);
+}
+
+static Uint64 getUint64Be (Byte const * const p)
+{
+    return ((Uint64) getUint32Be (p) << 32) | (Uint64) getUint32Be (p + 4);
+}
+
+static bool isHeaderFrame (MediaReader::Frame const &frame)
+{
+    if (frame.is_audio)
+        return frame.audio_msg.frame_type == VideoStream::AudioFrameType::AacSequenceHeader;
+
+    return frame.video_msg.frame_type == VideoStream::VideoFrameType::AvcSequenceHeader;
+}
+
+static bool isKeyframe (MediaReader::Frame const &frame)
+{
+    return !frame.is_audio && frame.video_msg.frame_type.isKeyFrame();
+}
+
+// Replaces prechunked data of the frame with a plain copy. Done when frames
+// leave the buffer: in flush() and in TimeshiftReader::readFrame().
+static void normalizeFrame (MediaReader::Frame * const mt_nonnull frame,
+                            PagePool           * const mt_nonnull page_pool)
+{
+    VideoStream::Message * const msg = frame->getMessage ();
+    if (msg->prechunk_size == 0)
+        return;
+
+    PagePool *norm_page_pool;
+    PagePool::PageListHead norm_page_list;
+    Size norm_msg_offs;
+    RtmpConnection::normalizePrechunkedData (msg,
+                                             page_pool,
+                                             &norm_page_pool,
+                                             &norm_page_list,
+                                             &norm_msg_offs);
+    msg->release ();
+
+    msg->page_pool = norm_page_pool;
+    msg->page_list = norm_page_list;
+    msg->msg_offset = norm_msg_offs;
+    msg->prechunk_size = 0;
+}
+
+TimeshiftBuffer::Segment::Segment ()
+    : first_seq (0),
+      start_timestamp_millisec (0),
+      got_audio_hdr (false),
+      got_video_hdr (false),
+      end_seq (0),
+      end_timestamp_millisec (0)
+{
+}
+
+TimeshiftBuffer::Segment::~Segment ()
+{
+    if (got_audio_hdr)
+        audio_hdr.release ();
+
+    if (got_video_hdr)
+        video_hdr.release ();
+}
+
+VideoStream::EventHandler const TimeshiftBuffer::stream_handler = {
+    streamAudioMessage,
+    streamVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
+void
+TimeshiftBuffer::streamAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                                     void                      * const _self)
+{
+    TimeshiftBuffer * const self = static_cast <TimeshiftBuffer*> (_self);
+
+    if (msg->frame_type != VideoStream::AudioFrameType::RawData &&
+        msg->frame_type != VideoStream::AudioFrameType::AacSequenceHeader)
+    {
+        return;
+    }
+
+    self->addFrame (msg, true /* is_audio */);
+}
+
+void
+TimeshiftBuffer::streamVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                                     void                      * const _self)
+{
+    TimeshiftBuffer * const self = static_cast <TimeshiftBuffer*> (_self);
+
+    if (!msg->frame_type.isVideoData() &&
+        msg->frame_type != VideoStream::VideoFrameType::AvcSequenceHeader)
+    {
+        return;
+    }
+
+    self->addFrame (msg, false /* is_audio */);
+}
+
+mt_mutex (mutex) Uint64
+TimeshiftBuffer::getFirstSeq ()
+{
+    if (!segments.isEmpty())
+        return segments.getFirst()->first_seq;
+
+    return mem_first_seq;
+}
+
+mt_mutex (mutex) void
+TimeshiftBuffer::growMemFrames ()
+{
+    Count const new_capacity = (mem_capacity > 0 ? mem_capacity * 2 : 1024);
+    Frame * const new_frames = new (std::nothrow) Frame [new_capacity];
+    assert (new_frames);
+
+    for (Count i = 0; i < mem_count; ++i)
+        new_frames [i] = mem_frames [(mem_head + i) % mem_capacity];
+
+    delete[] mem_frames;
+    mem_frames = new_frames;
+    mem_capacity = new_capacity;
+    mem_head = 0;
+}
+
+void
+TimeshiftBuffer::addFrame (VideoStream::Message * const mt_nonnull msg,
+                           bool                   const is_audio)
+{
+    Frame frame;
+    frame.is_audio = is_audio;
+    if (is_audio)
+        frame.audio_msg = *static_cast <VideoStream::AudioMessage*> (msg);
+    else
+        frame.video_msg = *static_cast <VideoStream::VideoMessage*> (msg);
+
+    // Pages are stored as is, prechunked data included: this is called for
+    // every frame of the stream. See normalizeFrame().
+    VideoStream::Message * const frame_msg = frame.getMessage ();
+    frame_msg->seize ();
+
+    Uint64 const src_timestamp_millisec = msg->timestamp_nanosec / 1000000;
+
+    mutex.lock ();
+
+    Uint64 timestamp_millisec = last_timestamp_millisec;
+    if (!isHeaderFrame (frame)) {
+        if (!got_timestamp) {
+            got_timestamp = true;
+            timestamp_offset = 0;
+        } else
+        if (rebase_timestamps
+            || (Int64) src_timestamp_millisec + timestamp_offset + 1000 < (Int64) last_timestamp_millisec)
+        {
+            // New source or a jump back in time: continue from the last timestamp.
+            timestamp_offset = (Int64) last_timestamp_millisec - (Int64) src_timestamp_millisec;
+        }
+        rebase_timestamps = false;
+
+        Int64 const ts = (Int64) src_timestamp_millisec + timestamp_offset;
+        timestamp_millisec = (ts > 0 ? (Uint64) ts : 0);
+        if (timestamp_millisec > last_timestamp_millisec)
+            last_timestamp_millisec = timestamp_millisec;
+    }
+
+    frame.timestamp_millisec = timestamp_millisec;
+    frame_msg->timestamp_nanosec = timestamp_millisec * 1000000;
+
+    if (mem_count == mem_capacity)
+        growMemFrames ();
+
+    mem_frames [(mem_head + mem_count) % mem_capacity] = frame;
+    ++mem_count;
+
+    mutex.unlock ();
+}
+
+mt_mutex (mutex) TimeshiftBuffer::Segment*
+TimeshiftBuffer::findSegment (Uint64 const seq)
+{
+    SegmentList::iter iter (segments);
+    while (!segments.iter_done (iter)) {
+        Segment * const segment = segments.iter_next (iter)->data;
+        if (seq >= segment->first_seq && seq < segment->end_seq)
+            return segment;
+    }
+
+    return NULL;
+}
+
+mt_mutex (mutex) bool
+TimeshiftBuffer::findKeyframe (Time       const timestamp_millisec,
+                               Uint64   * const mt_nonnull ret_seq,
+                               Segment ** const ret_segment,
+                               Uint64   * const mt_nonnull ret_offset,
+                               Uint64   * const mt_nonnull ret_timestamp_millisec)
+{
+    for (Count i = mem_count; i > 0; --i) {
+        Uint64 const seq = mem_first_seq + i - 1;
+        Frame * const frame = getMemFrame (seq);
+        if (isKeyframe (*frame) && frame->timestamp_millisec <= timestamp_millisec) {
+            *ret_seq = seq;
+            *ret_segment = NULL;
+            *ret_offset = 0;
+            *ret_timestamp_millisec = frame->timestamp_millisec;
+            return true;
+        }
+    }
+
+    bool found = false;
+    SegmentList::iter iter (segments);
+    while (!segments.iter_done (iter)) {
+        Segment * const segment = segments.iter_next (iter)->data;
+        if (segment->start_timestamp_millisec > timestamp_millisec && found)
+            break;
+
+        List<KeyframeEntry>::iter kf_iter (segment->keyframes);
+        while (!segment->keyframes.iter_done (kf_iter)) {
+            KeyframeEntry * const entry = &segment->keyframes.iter_next (kf_iter)->data;
+            if (entry->timestamp_millisec > timestamp_millisec && found)
+                break;
+
+            *ret_seq = entry->seq;
+            *ret_segment = segment;
+            *ret_offset = entry->offset;
+            *ret_timestamp_millisec = entry->timestamp_millisec;
+            found = true;
+        }
+    }
+
+    if (found)
+        return true;
+
+    return findNextKeyframe (getFirstSeq(), ret_seq, ret_segment, ret_offset, ret_timestamp_millisec);
+}
+
+mt_mutex (mutex) bool
+TimeshiftBuffer::findNextKeyframe (Uint64     const seq,
+                                   Uint64   * const mt_nonnull ret_seq,
+                                   Segment ** const ret_segment,
+                                   Uint64   * const mt_nonnull ret_offset,
+                                   Uint64   * const mt_nonnull ret_timestamp_millisec)
+{
+    SegmentList::iter iter (segments);
+    while (!segments.iter_done (iter)) {
+        Segment * const segment = segments.iter_next (iter)->data;
+        if (segment->end_seq <= seq)
+            continue;
+
+        List<KeyframeEntry>::iter kf_iter (segment->keyframes);
+        while (!segment->keyframes.iter_done (kf_iter)) {
+            KeyframeEntry * const entry = &segment->keyframes.iter_next (kf_iter)->data;
+            if (entry->seq >= seq) {
+                *ret_seq = entry->seq;
+                *ret_segment = segment;
+                *ret_offset = entry->offset;
+                *ret_timestamp_millisec = entry->timestamp_millisec;
+                return true;
+            }
+        }
+    }
+
+    for (Uint64 cur_seq = (seq > mem_first_seq ? seq : mem_first_seq); cur_seq < getEndSeq(); ++cur_seq) {
+        Frame * const frame = getMemFrame (cur_seq);
+        if (isKeyframe (*frame)) {
+            *ret_seq = cur_seq;
+            *ret_segment = NULL;
+            *ret_offset = 0;
+            *ret_timestamp_millisec = frame->timestamp_millisec;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+mt_mutex (mutex) void
+TimeshiftBuffer::getMemHeaders (Uint64   const seq,
+                                Frame  * const mt_nonnull ret_audio_hdr,
+                                bool   * const mt_nonnull ret_got_audio_hdr,
+                                Frame  * const mt_nonnull ret_video_hdr,
+                                bool   * const mt_nonnull ret_got_video_hdr)
+{
+    *ret_got_audio_hdr = false;
+    *ret_got_video_hdr = false;
+
+    for (Uint64 cur_seq = seq; cur_seq > mem_first_seq; --cur_seq) {
+        Frame * const frame = getMemFrame (cur_seq - 1);
+        if (!isHeaderFrame (*frame))
+            continue;
+
+        if (frame->is_audio) {
+            if (!*ret_got_audio_hdr) {
+                *ret_audio_hdr = *frame;
+                *ret_got_audio_hdr = true;
+            }
+        } else {
+            if (!*ret_got_video_hdr) {
+                *ret_video_hdr = *frame;
+                *ret_got_video_hdr = true;
+            }
+        }
+
+        if (*ret_got_audio_hdr && *ret_got_video_hdr)
+            return;
+    }
+
+    if (!*ret_got_audio_hdr && got_mem_audio_hdr) {
+        *ret_audio_hdr = mem_audio_hdr;
+        *ret_got_audio_hdr = true;
+    }
+
+    if (!*ret_got_video_hdr && got_mem_video_hdr) {
+        *ret_video_hdr = mem_video_hdr;
+        *ret_got_video_hdr = true;
+    }
+}
+
+void
+TimeshiftBuffer::setHeader (Frame       * const mt_nonnull hdr,
+                            bool        * const mt_nonnull got_hdr,
+                            Frame const &frame)
+{
+    if (*got_hdr)
+        hdr->release ();
+
+    *hdr = frame;
+    hdr->getMessage()->seize ();
+    *got_hdr = true;
+}
+
+Result
+TimeshiftBuffer::openWriteSegment (Uint64 const first_seq,
+                                   Uint64 const timestamp_millisec)
+{
+    Ref<String> const filename = makeString (dir->mem(), "/", stream_name->mem(), "_",
+                                             getUnixtime(), "_", next_segment_id, ".timeshift");
+    ++next_segment_id;
+
+    int const fd = ::open (filename->cstr(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        logE (timeshift, _func, "could not open ", filename->mem(), ": ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    Ref<Segment> const segment = grab (new (std::nothrow) Segment);
+    segment->filename = st_grab (new (std::nothrow) String (filename->mem()));
+    segment->first_seq = first_seq;
+    segment->end_seq = first_seq;
+    segment->start_timestamp_millisec = timestamp_millisec;
+    segment->end_timestamp_millisec = timestamp_millisec;
+
+    if (got_write_audio_hdr)
+        setHeader (&segment->audio_hdr, &segment->got_audio_hdr, write_audio_hdr);
+
+    if (got_write_video_hdr)
+        setHeader (&segment->video_hdr, &segment->got_video_hdr, write_video_hdr);
+
+    write_segment = segment;
+    write_fd = fd;
+    write_offset = 0;
+
+    logD (timeshift, _func, filename->mem());
+    return Result::Success;
+}
+
+void
+TimeshiftBuffer::closeWriteSegment ()
+{
+    if (write_fd != -1) {
+        if (::close (write_fd) == -1)
+            logE (timeshift, _func, "close() failed: ", errnoString (errno));
+
+        write_fd = -1;
+    }
+
+    write_segment = NULL;
+    write_offset = 0;
+}
+
+// Frames written to a segment file by one flush().
+struct TimeshiftBuffer::SegmentUpdate
+{
+    Ref<Segment> segment;
+    bool   is_new;
+    bool   failed;
+    Uint64 end_seq;
+    Uint64 end_timestamp_millisec;
+    List<KeyframeEntry> keyframes;
+
+    SegmentUpdate ()
+        : is_new (false),
+          failed (false),
+          end_seq (0),
+          end_timestamp_millisec (0)
+    {}
+};
+
+void
+TimeshiftBuffer::flushTimerTick (void * const _self)
+{
+    TimeshiftBuffer * const self = static_cast <TimeshiftBuffer*> (_self);
+    self->flush ();
+}
+
+void
+TimeshiftBuffer::flush ()
+{
+    write_mutex.lock ();
+    if (released) {
+        write_mutex.unlock ();
+        return;
+    }
+
+    mutex.lock ();
+
+    Uint64 const newest_millisec = last_timestamp_millisec;
+
+    Count num_frames = 0;
+    while (num_frames < mem_count) {
+        Frame * const frame = &mem_frames [(mem_head + num_frames) % mem_capacity];
+        if (frame->timestamp_millisec + memory_window_millisec > newest_millisec)
+            break;
+
+        ++num_frames;
+    }
+
+    // The frames stay referenced by the ring until they are removed below,
+    // and only this timer removes frames.
+    Frame *frames = NULL;
+    if (num_frames > 0) {
+        frames = new (std::nothrow) Frame [num_frames];
+        assert (frames);
+        for (Count i = 0; i < num_frames; ++i)
+            frames [i] = mem_frames [(mem_head + i) % mem_capacity];
+    }
+    Uint64 const first_seq = mem_first_seq;
+
+    mutex.unlock ();
+
+    List<SegmentUpdate> updates;
+    SegmentUpdate *update = NULL;
+
+    Byte *buf = NULL;
+    Size  buf_len = 0;
+    Size  buf_size = 0;
+
+    for (Count i = 0; i <= num_frames; ++i) {
+        Frame * const frame = (i < num_frames ? &frames [i] : NULL);
+
+        bool rotate = false;
+        if (frame) {
+            // 'frames' hold the references of the ring, which are released below.
+            normalizeFrame (frame, page_pool);
+
+            if (isHeaderFrame (*frame)) {
+                if (frame->is_audio)
+                    setHeader (&write_audio_hdr, &got_write_audio_hdr, *frame);
+                else
+                    setHeader (&write_video_hdr, &got_write_video_hdr, *frame);
+
+                // Codec headers stay the same for all frames of a segment.
+                rotate = true;
+            }
+
+            if (write_segment
+                && frame->timestamp_millisec >= write_segment->start_timestamp_millisec)
+            {
+                Uint64 const duration = frame->timestamp_millisec - write_segment->start_timestamp_millisec;
+                if (duration >= SegmentDuration_Millisec
+                    && (isKeyframe (*frame) || duration >= 2 * SegmentDuration_Millisec))
+                {
+                    rotate = true;
+                }
+            }
+        }
+
+        if ((rotate || !frame) && buf_len > 0) {
+            assert (update && write_fd != -1);
+
+            Size pos = 0;
+            while (pos < buf_len) {
+                ssize_t const res = pwrite (write_fd, buf + pos, buf_len - pos, (off_t) (write_offset + pos));
+                if (res == -1) {
+                    if (errno == EINTR)
+                        continue;
+
+                    logE (timeshift, _func, "pwrite() failed: ", errnoString (errno));
+                    update->failed = true;
+                    break;
+                }
+
+                pos += (Size) res;
+            }
+
+            if (update->failed)
+                closeWriteSegment ();
+            else
+                write_offset += buf_len;
+
+            buf_len = 0;
+            update = NULL;
+        }
+
+        if (!frame)
+            break;
+
+        if (!dir || dir->len() == 0)
+            continue;
+
+        if (rotate && write_segment) {
+            closeWriteSegment ();
+            update = NULL;
+        }
+
+        if (!write_segment) {
+            if (!openWriteSegment (first_seq + i, frame->timestamp_millisec))
+                continue;
+
+            update = &updates.appendEmpty()->data;
+            update->segment = write_segment;
+            update->is_new = true;
+        } else
+        if (!update) {
+            update = &updates.appendEmpty()->data;
+            update->segment = write_segment;
+        }
+
+        VideoStream::Message * const msg = frame->getMessage ();
+        Size const record_len = RecordHeaderLen + msg->msg_len;
+        if (buf_size - buf_len < record_len) {
+            Size new_size = (buf_size > 0 ? buf_size : (1 << 16));
+            while (new_size - buf_len < record_len)
+                new_size *= 2;
+
+            Byte * const new_buf = new (std::nothrow) Byte [new_size];
+            assert (new_buf);
+            if (buf_len > 0)
+                memcpy (new_buf, buf, buf_len);
+
+            delete[] buf;
+            buf = new_buf;
+            buf_size = new_size;
+        }
+
+        if (isKeyframe (*frame)) {
+            KeyframeEntry * const entry = &update->keyframes.appendEmpty()->data;
+            entry->seq = first_seq + i;
+            entry->timestamp_millisec = frame->timestamp_millisec;
+            entry->offset = write_offset + buf_len;
+        }
+
+        Byte *p = buf + buf_len;
+        if (frame->is_audio) {
+            p [0] = 0;
+            p [1] = (Byte) (VideoStream::AudioFrameType::Value) frame->audio_msg.frame_type;
+            p [2] = (Byte) (VideoStream::AudioCodecId::Value) frame->audio_msg.codec_id;
+            p [3] = (Byte) frame->audio_msg.channels;
+            putUint32Be (p + 4, (Uint32) frame->audio_msg.rate);
+        } else {
+            p [0] = 1;
+            p [1] = (Byte) (VideoStream::VideoFrameType::Value) frame->video_msg.frame_type;
+            p [2] = (Byte) (VideoStream::VideoCodecId::Value) frame->video_msg.codec_id;
+            p [3] = 0;
+            putUint32Be (p + 4, 0);
+        }
+        putUint64Be (p + 8, frame->timestamp_millisec);
+        putUint32Be (p + 16, (Uint32) msg->msg_len);
+
+        PagePool::PageListArray pl_array (msg->page_list.first, msg->msg_offset, msg->msg_len);
+        pl_array.get (0, Memory (p + RecordHeaderLen, msg->msg_len));
+
+        buf_len += record_len;
+
+        update->end_seq = first_seq + i + 1;
+        update->end_timestamp_millisec = frame->timestamp_millisec;
+    }
+
+    delete[] buf;
+
+    List< Ref<String> > expired_filenames;
+
+    mutex.lock ();
+
+    {
+        List<SegmentUpdate>::iter iter (updates);
+        while (!updates.iter_done (iter)) {
+            SegmentUpdate * const update = &updates.iter_next (iter)->data;
+            if (update->failed) {
+                if (update->is_new)
+                    expired_filenames.append (grab (new (std::nothrow) String (update->segment->filename->mem())));
+
+                continue;
+            }
+
+            Segment * const segment = update->segment;
+            segment->end_seq = update->end_seq;
+            segment->end_timestamp_millisec = update->end_timestamp_millisec;
+
+            List<KeyframeEntry>::iter kf_iter (update->keyframes);
+            while (!update->keyframes.iter_done (kf_iter))
+                segment->keyframes.append (update->keyframes.iter_next (kf_iter)->data);
+
+            if (update->is_new)
+                segments.append (segment);
+        }
+    }
+
+    mem_head = (mem_capacity > 0 ? (mem_head + num_frames) % mem_capacity : 0);
+    mem_count -= num_frames;
+    mem_first_seq += num_frames;
+
+    if (got_write_audio_hdr)
+        setHeader (&mem_audio_hdr, &got_mem_audio_hdr, write_audio_hdr);
+
+    if (got_write_video_hdr)
+        setHeader (&mem_video_hdr, &got_mem_video_hdr, write_video_hdr);
+
+    while (!segments.isEmpty()) {
+        Segment * const segment = segments.getFirst();
+        if (segment == write_segment
+            || segment->end_timestamp_millisec + window_millisec > newest_millisec)
+        {
+            break;
+        }
+
+        // Readers which still hold the segment keep reading from the open
+        // file. Those which have not opened it yet skip to the oldest keyframe,
+        // see TimeshiftReader::readSegmentRecord().
+        expired_filenames.append (grab (new (std::nothrow) String (segment->filename->mem())));
+        segments.remove (segments.getFirstElement());
+    }
+
+    mutex.unlock ();
+
+    for (Count i = 0; i < num_frames; ++i)
+        frames [i].release ();
+
+    delete[] frames;
+
+    {
+        List< Ref<String> >::iter iter (expired_filenames);
+        while (!expired_filenames.iter_done (iter)) {
+            Ref<String> const &filename = expired_filenames.iter_next (iter)->data;
+            logD (timeshift, _func, "removing ", filename->mem());
+            if (unlink (filename->cstr()) == -1)
+                logE (timeshift, _func, "could not remove ", filename->mem(), ": ", errnoString (errno));
+        }
+    }
+
+    write_mutex.unlock ();
+}
+
+void
+TimeshiftBuffer::setVideoStream (VideoStream * const video_stream)
+{
+    mutex.lock ();
+    Ref<VideoStream> const old_stream = this->video_stream;
+    GenericInformer::SubscriptionKey const old_sbn = stream_sbn;
+    this->video_stream = video_stream;
+    stream_sbn = NULL;
+    rebase_timestamps = true;
+    mutex.unlock ();
+
+    // Subscriptions are changed without 'mutex' held, since stream events
+    // are delivered with the stream locked and take 'mutex' in addFrame().
+    if (old_stream && old_sbn)
+        old_stream->getEventInformer()->unsubscribe (old_sbn);
+
+    if (video_stream) {
+        GenericInformer::SubscriptionKey const sbn =
+                video_stream->getEventInformer()->subscribe (
+                        CbDesc<VideoStream::EventHandler> (&stream_handler, this, this));
+
+        mutex.lock ();
+        stream_sbn = sbn;
+        mutex.unlock ();
+    }
+}
+
+bool
+TimeshiftBuffer::getTimestampRange (Uint64 * const mt_nonnull ret_start_millisec,
+                                    Uint64 * const mt_nonnull ret_end_millisec)
+{
+    mutex.lock ();
+
+    if (getFirstSeq() == getEndSeq()) {
+        mutex.unlock ();
+        return false;
+    }
+
+    if (!segments.isEmpty())
+        *ret_start_millisec = segments.getFirst()->start_timestamp_millisec;
+    else
+        *ret_start_millisec = getMemFrame (mem_first_seq)->timestamp_millisec;
+
+    *ret_end_millisec = last_timestamp_millisec;
+
+    mutex.unlock ();
+    return true;
+}
+
+MediaReader*
+TimeshiftBuffer::createReader ()
+{
+    return new (std::nothrow) TimeshiftReader (this);
+}
+
+void
+TimeshiftBuffer::release ()
+{
+    mutex.lock ();
+    if (flush_timer) {
+        timers->deleteTimer (flush_timer);
+        flush_timer = NULL;
+    }
+    mutex.unlock ();
+
+    setVideoStream (NULL);
+
+    write_mutex.lock ();
+    released = true;
+    closeWriteSegment ();
+    write_mutex.unlock ();
+
+    mutex.lock ();
+    while (!segments.isEmpty()) {
+        Segment * const segment = segments.getFirst();
+        if (unlink (segment->filename->cstr()) == -1)
+            logE (timeshift, _func, "could not remove ", segment->filename->mem(), ": ", errnoString (errno));
+
+        segments.remove (segments.getFirstElement());
+    }
+    mutex.unlock ();
+}
+
+mt_const void
+TimeshiftBuffer::init (MomentServer * const mt_nonnull moment,
+                       ConstMemory    const stream_name,
+                       ConstMemory    const dir,
+                       Time           const window_sec,
+                       Time           const memory_window_sec)
+{
+    thread_pool = moment->getRecorderThreadPool();
+    ServerThreadContext *ctx = thread_pool->grabThreadContext ("timeshift");
+    if (ctx) {
+        thread_ctx = ctx;
+    } else {
+        logE (timeshift, _func, "Couldn't get recorder thread context: ", exc->toString());
+        ctx = moment->getServerApp()->getServerContext()->getMainThreadContext();
+    }
+
+    init (moment->getPagePool(), ctx->getTimers(), stream_name, dir, window_sec, memory_window_sec);
+}
+
+mt_const void
+TimeshiftBuffer::init (PagePool    * const mt_nonnull page_pool,
+                       Timers      * const mt_nonnull timers,
+                       ConstMemory   const stream_name,
+                       ConstMemory   const dir,
+                       Time          const window_sec,
+                       Time          const memory_window_sec)
+{
+    this->stream_name = st_grab (new (std::nothrow) String (stream_name));
+    this->dir = st_grab (new (std::nothrow) String (dir));
+    this->memory_window_millisec = memory_window_sec * 1000;
+    this->window_millisec = window_sec * 1000;
+    if (this->window_millisec < this->memory_window_millisec)
+        this->window_millisec = this->memory_window_millisec;
+
+    this->page_pool = page_pool;
+    this->timers = timers;
+
+    flush_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (flushTimerTick, this, this),
+            FlushInterval_Millisec * 1000,
+            true /* periodical */);
+
+    logD (timeshift, _func, stream_name, ": window ", window_sec, " s, in memory ", memory_window_sec, " s, "
+          "dir ", dir);
+}
+
+TimeshiftBuffer::TimeshiftBuffer ()
+    : page_pool (this /* coderef_container */),
+      timers    (this /* coderef_container */),
+      thread_pool (NULL),
+      thread_ctx  (NULL),
+      window_millisec (0),
+      memory_window_millisec (0),
+      got_timestamp (false),
+      rebase_timestamps (false),
+      timestamp_offset (0),
+      last_timestamp_millisec (0),
+      mem_frames (NULL),
+      mem_capacity (0),
+      mem_head  (0),
+      mem_count (0),
+      mem_first_seq (0),
+      got_mem_audio_hdr (false),
+      got_mem_video_hdr (false),
+      released (false),
+      write_fd (-1),
+      write_offset (0),
+      next_segment_id (0),
+      got_write_audio_hdr (false),
+      got_write_video_hdr (false)
+{
+}
+
+TimeshiftBuffer::~TimeshiftBuffer ()
+{
+    write_mutex.lock ();
+    closeWriteSegment ();
+    write_mutex.unlock ();
+
+    mutex.lock ();
+
+    for (Count i = 0; i < mem_count; ++i)
+        mem_frames [(mem_head + i) % mem_capacity].release ();
+
+    delete[] mem_frames;
+    mem_frames = NULL;
+    mem_count = 0;
+
+    if (got_mem_audio_hdr)
+        mem_audio_hdr.release ();
+    if (got_mem_video_hdr)
+        mem_video_hdr.release ();
+    if (got_write_audio_hdr)
+        write_audio_hdr.release ();
+    if (got_write_video_hdr)
+        write_video_hdr.release ();
+
+    segments.clear ();
+
+    mutex.unlock ();
+
+    if (thread_ctx) {
+        thread_pool->releaseThreadContext (thread_ctx);
+        thread_ctx = NULL;
+    }
+}
+
+
+void
+TimeshiftReader::closeSegment ()
+{
+    if (segment_fd != -1) {
+        if (::close (segment_fd) == -1)
+            logE (timeshift, _func, "close() failed: ", errnoString (errno));
+
+        segment_fd = -1;
+    }
+
+    segment = NULL;
+    segment_offset = 0;
+}
+
+mt_mutex (buffer->mutex) void
+TimeshiftReader::setPosition (Uint64                     const seq,
+                              TimeshiftBuffer::Segment * const new_segment,
+                              Uint64                     const offset,
+                              Uint64                     const timestamp_millisec)
+{
+    releaseQueuedFrames ();
+
+    if (segment != new_segment)
+        closeSegment ();
+
+    segment = new_segment;
+    segment_offset = offset;
+    next_seq = seq;
+
+    TimeshiftBuffer::Frame audio_hdr;
+    bool got_audio_hdr = false;
+    TimeshiftBuffer::Frame video_hdr;
+    bool got_video_hdr = false;
+    if (new_segment) {
+        if (new_segment->got_audio_hdr) {
+            audio_hdr = new_segment->audio_hdr;
+            got_audio_hdr = true;
+        }
+
+        if (new_segment->got_video_hdr) {
+            video_hdr = new_segment->video_hdr;
+            got_video_hdr = true;
+        }
+    } else {
+        buffer->getMemHeaders (seq, &audio_hdr, &got_audio_hdr, &video_hdr, &got_video_hdr);
+    }
+
+    if (got_audio_hdr) {
+        audio_hdr.getMessage()->seize ();
+        audio_hdr.timestamp_millisec = timestamp_millisec;
+        audio_hdr.audio_msg.timestamp_nanosec = timestamp_millisec * 1000000;
+        queueFrame (audio_hdr);
+    }
+
+    if (got_video_hdr) {
+        video_hdr.getMessage()->seize ();
+        video_hdr.timestamp_millisec = timestamp_millisec;
+        video_hdr.video_msg.timestamp_nanosec = timestamp_millisec * 1000000;
+        queueFrame (video_hdr);
+    }
+}
+
+mt_mutex (buffer->mutex) void
+TimeshiftReader::skipToNextKeyframe ()
+{
+    Uint64 seq = 0;
+    TimeshiftBuffer::Segment *new_segment = NULL;
+    Uint64 offset = 0;
+    Uint64 timestamp_millisec = 0;
+    if (!buffer->findNextKeyframe (next_seq, &seq, &new_segment, &offset, &timestamp_millisec)) {
+        seq = buffer->getEndSeq ();
+        new_segment = NULL;
+        timestamp_millisec = buffer->last_timestamp_millisec;
+    }
+
+    logD (timeshift, _func, "skipping from ", next_seq, " to ", seq);
+    setPosition (seq, new_segment, offset, timestamp_millisec);
+}
+
+mt_throws IoResult
+TimeshiftReader::readSegmentRecord (Frame * const mt_nonnull ret_frame)
+{
+    if (segment_fd == -1) {
+        segment_fd = ::open (segment->filename->cstr(), O_RDONLY);
+        if (segment_fd == -1) {
+            int const err = errno;
+            if (err == ENOENT) {
+                buffer->mutex.lock ();
+                if (buffer->findSegment (next_seq) != segment) {
+                    // The segment has expired before the reader got to it.
+                    skipToNextKeyframe ();
+                    buffer->mutex.unlock ();
+                    return readFrame (ret_frame);
+                }
+                buffer->mutex.unlock ();
+            }
+
+            exc_throw (PosixException, err);
+            return IoResult::Error;
+        }
+    }
+
+    Byte hdr [TimeshiftBuffer::RecordHeaderLen];
+    Size nread = 0;
+    if (!FileReadCache::readFull (segment_fd, Memory::forObject (hdr), segment_offset, &nread))
+        return IoResult::Error;
+
+    if (nread < sizeof (hdr)) {
+        exc_throw (InternalException, InternalException::BadInput);
+        return IoResult::Error;
+    }
+
+    Size const data_len = getUint32Be (hdr + 16);
+    if (read_buf_size < data_len) {
+        delete[] read_buf;
+        read_buf_size = data_len;
+        read_buf = new (std::nothrow) Byte [read_buf_size];
+        assert (read_buf);
+    }
+
+    if (!FileReadCache::readFull (segment_fd, Memory (read_buf, data_len), segment_offset + sizeof (hdr), &nread))
+        return IoResult::Error;
+
+    if (nread < data_len) {
+        exc_throw (InternalException, InternalException::BadInput);
+        return IoResult::Error;
+    }
+
+    if (hdr [0] == 0) {
+        ret_frame->is_audio = true;
+        VideoStream::AudioMessage * const audio_msg = &ret_frame->audio_msg;
+        *audio_msg = VideoStream::AudioMessage ();
+        audio_msg->frame_type = (VideoStream::AudioFrameType::Value) hdr [1];
+        audio_msg->codec_id = (VideoStream::AudioCodecId::Value) hdr [2];
+        audio_msg->channels = hdr [3];
+        audio_msg->rate = getUint32Be (hdr + 4);
+    } else {
+        ret_frame->is_audio = false;
+        VideoStream::VideoMessage * const video_msg = &ret_frame->video_msg;
+        *video_msg = VideoStream::VideoMessage ();
+        video_msg->frame_type = (VideoStream::VideoFrameType::Value) hdr [1];
+        video_msg->codec_id = (VideoStream::VideoCodecId::Value) hdr [2];
+    }
+
+    Uint64 const timestamp_millisec = getUint64Be (hdr + 8);
+
+    PagePool::PageListHead page_list;
+    page_pool->getFillPages (&page_list, ConstMemory (read_buf, data_len));
+
+    VideoStream::Message * const msg = ret_frame->getMessage ();
+    msg->timestamp_nanosec = timestamp_millisec * 1000000;
+    msg->page_pool = page_pool;
+    msg->page_list = page_list;
+    msg->msg_offset = 0;
+    msg->msg_len = data_len;
+
+    ret_frame->timestamp_millisec = timestamp_millisec;
+    ret_frame->file_len = sizeof (hdr) + data_len;
+
+    segment_offset += sizeof (hdr) + data_len;
+    ++next_seq;
+
+    return IoResult::Normal;
+}
+
+mt_throws Result
+TimeshiftReader::open (ConstMemory const /* filename */)
+{
+    buffer->mutex.lock ();
+    Uint64 const end_seq = buffer->getEndSeq ();
+    setPosition (end_seq, NULL /* new_segment */, 0 /* offset */, buffer->last_timestamp_millisec);
+    buffer->mutex.unlock ();
+
+    return Result::Success;
+}
+
+void
+TimeshiftReader::close ()
+{
+    releaseQueuedFrames ();
+    closeSegment ();
+}
+
+mt_throws Result
+TimeshiftReader::seek (Time const timestamp_millisec)
+{
+    buffer->mutex.lock ();
+
+    Uint64 seq = 0;
+    TimeshiftBuffer::Segment *new_segment = NULL;
+    Uint64 offset = 0;
+    Uint64 keyframe_timestamp_millisec = 0;
+    if (!buffer->findKeyframe (timestamp_millisec, &seq, &new_segment, &offset, &keyframe_timestamp_millisec)) {
+        // No keyframes yet: wait for new frames.
+        seq = buffer->getEndSeq ();
+        new_segment = NULL;
+        keyframe_timestamp_millisec = buffer->last_timestamp_millisec;
+    }
+
+    setPosition (seq, new_segment, offset, keyframe_timestamp_millisec);
+
+    buffer->mutex.unlock ();
+
+    logD (timeshift, _func, timestamp_millisec, " -> ", keyframe_timestamp_millisec);
+    return Result::Success;
+}
+
+mt_throws IoResult
+TimeshiftReader::readFrame (Frame * const mt_nonnull ret_frame)
+{
+    // Codec headers and frames of the memory tier may be prechunked.
+    if (popQueuedFrame (ret_frame)) {
+        normalizeFrame (ret_frame, page_pool);
+        return IoResult::Normal;
+    }
+
+    buffer->mutex.lock ();
+
+    if (next_seq >= buffer->mem_first_seq) {
+        if (next_seq >= buffer->getEndSeq()) {
+            buffer->mutex.unlock ();
+            return IoResult::Eof;
+        }
+
+        *ret_frame = *buffer->getMemFrame (next_seq);
+        ret_frame->getMessage()->seize ();
+        ++next_seq;
+        buffer->mutex.unlock ();
+
+        normalizeFrame (ret_frame, page_pool);
+
+        if (segment)
+            closeSegment ();
+
+        return IoResult::Normal;
+    }
+
+    if (!segment || next_seq < segment->first_seq || next_seq >= segment->end_seq) {
+        TimeshiftBuffer::Segment * const next_segment = buffer->findSegment (next_seq);
+        if (next_segment && next_seq == next_segment->first_seq) {
+            closeSegment ();
+            segment = next_segment;
+            segment_offset = 0;
+        } else {
+            // Fell out of the window, or the frames were lost to a write error.
+            skipToNextKeyframe ();
+            buffer->mutex.unlock ();
+
+            return readFrame (ret_frame);
+        }
+    }
+
+    buffer->mutex.unlock ();
+
+    return readSegmentRecord (ret_frame);
+}
+
+Time
+TimeshiftReader::getDurationMillisec ()
+{
+    buffer->mutex.lock ();
+    Time const duration_millisec = buffer->last_timestamp_millisec;
+    buffer->mutex.unlock ();
+
+    return duration_millisec;
+}
+
+TimeshiftReader::TimeshiftReader (TimeshiftBuffer * const mt_nonnull buffer)
+    : buffer (buffer),
+      next_seq (0),
+      segment_fd (-1),
+      segment_offset (0),
+      read_buf (NULL),
+      read_buf_size (0)
+{
+}
+
+TimeshiftReader::~TimeshiftReader ()
+{
+    close ();
+    delete[] read_buf;
+}
+
+}
+
@@ -0,0 +1,318 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__TIMESHIFT_BUFFER__H__
+#define MOMENT__TIMESHIFT_BUFFER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/video_stream.h>
+#include <moment/media_reader.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+class MomentServer;
+class TimeshiftReader;
+
+// Keeps the last 'window' seconds of a live stream for timeshifted playback.
+//
+// The most recent 'memory_window' seconds are held in memory as references
+// to the pages of the stream's messages, so that the stream's thread only
+// takes a lock and appends to a ring of frames. Older frames are moved by
+// a timer to append-only segment files with an in-memory index of video
+// keyframes. Segments which fall out of the window are deleted.
+//
+// Frames are numbered sequentially, which lets TimeshiftReader keep its
+// position while frames move from memory to disk. Stored timestamps are
+// kept monotonic when the channel's source restarts.
+//
+class TimeshiftBuffer : public Object
+{
+    friend class TimeshiftReader;
+
+private:
+    StateMutex mutex;
+
+    // Held by flush() for its whole duration and by release(), so that the
+    // segment file writer is never used after release(). Taken before 'mutex'.
+    Mutex write_mutex;
+
+public:
+    enum {
+        SegmentDuration_Millisec = 60000,
+        FlushInterval_Millisec   = 1000
+    };
+
+private:
+    typedef MediaReader::Frame Frame;
+
+    // Segment file record header. All numbers are big-endian.
+    //
+    //     1 byte  - 0 for audio, 1 for video
+    //     1 byte  - frame type
+    //     1 byte  - codec id
+    //     1 byte  - number of audio channels
+    //     4 bytes - audio sampling rate
+    //     8 bytes - timestamp in milliseconds
+    //     4 bytes - data length
+    //
+    enum {
+        RecordHeaderLen = 20
+    };
+
+    struct KeyframeEntry
+    {
+        Uint64 seq;
+        Uint64 timestamp_millisec;
+        Uint64 offset;
+    };
+
+    class Segment : public Referenced
+    {
+    public:
+        mt_const StRef<String> filename;
+        mt_const Uint64 first_seq;
+        mt_const Uint64 start_timestamp_millisec;
+
+        // Codec headers in effect for all frames of the segment.
+        mt_const Frame audio_hdr;
+        mt_const bool  got_audio_hdr;
+        mt_const Frame video_hdr;
+        mt_const bool  got_video_hdr;
+
+        mt_mutex (TimeshiftBuffer::mutex) Uint64 end_seq;
+        mt_mutex (TimeshiftBuffer::mutex) Uint64 end_timestamp_millisec;
+        mt_mutex (TimeshiftBuffer::mutex) List<KeyframeEntry> keyframes;
+
+         Segment ();
+        ~Segment ();
+    };
+
+    typedef List< Ref<Segment> > SegmentList;
+
+    struct SegmentUpdate;
+
+    mt_const DataDepRef<PagePool> page_pool;
+    mt_const DataDepRef<Timers>   timers;
+
+    mt_const ServerThreadPool    *thread_pool;
+    mt_const ServerThreadContext *thread_ctx;
+
+    mt_const StRef<String> stream_name;
+    mt_const StRef<String> dir;
+    mt_const Time window_millisec;
+    mt_const Time memory_window_millisec;
+
+    mt_mutex (mutex) Timers::TimerKey flush_timer;
+
+    mt_mutex (mutex) Ref<VideoStream> video_stream;
+    mt_mutex (mutex) GenericInformer::SubscriptionKey stream_sbn;
+
+    // Source timestamps plus 'timestamp_offset' give stored timestamps.
+    mt_mutex (mutex) bool   got_timestamp;
+    mt_mutex (mutex) bool   rebase_timestamps;
+    mt_mutex (mutex) Int64  timestamp_offset;
+    mt_mutex (mutex) Uint64 last_timestamp_millisec;
+
+    // Memory tier: a ring of 'mem_count' frames starting at 'mem_head'.
+    mt_mutex (mutex) Frame  *mem_frames;
+    mt_mutex (mutex) Count   mem_capacity;
+    mt_mutex (mutex) Count   mem_head;
+    mt_mutex (mutex) Count   mem_count;
+    // Sequence number of mem_frames [mem_head].
+    mt_mutex (mutex) Uint64  mem_first_seq;
+
+    // Codec headers in effect for 'mem_first_seq'.
+    mt_mutex (mutex) Frame mem_audio_hdr;
+    mt_mutex (mutex) bool  got_mem_audio_hdr;
+    mt_mutex (mutex) Frame mem_video_hdr;
+    mt_mutex (mutex) bool  got_mem_video_hdr;
+
+    // Disk tier, oldest segments first.
+    mt_mutex (mutex) SegmentList segments;
+
+    // Segment file writer state.
+    mt_mutex (write_mutex) bool         released;
+    mt_mutex (write_mutex) Ref<Segment> write_segment;
+    mt_mutex (write_mutex) int          write_fd;
+    mt_mutex (write_mutex) Uint64       write_offset;
+    mt_mutex (write_mutex) Uint64       next_segment_id;
+    mt_mutex (write_mutex) Frame        write_audio_hdr;
+    mt_mutex (write_mutex) bool         got_write_audio_hdr;
+    mt_mutex (write_mutex) Frame        write_video_hdr;
+    mt_mutex (write_mutex) bool         got_write_video_hdr;
+
+    mt_mutex (mutex) Frame* getMemFrame (Uint64 const seq)
+        { return &mem_frames [(mem_head + (Count) (seq - mem_first_seq)) % mem_capacity]; }
+
+    mt_mutex (mutex) Uint64 getEndSeq () const
+        { return mem_first_seq + mem_count; }
+
+    mt_mutex (mutex) Uint64 getFirstSeq ();
+
+    mt_mutex (mutex) void growMemFrames ();
+
+    void addFrame (VideoStream::Message * mt_nonnull msg,
+                   bool                   is_audio);
+
+    mt_mutex (mutex) Segment* findSegment (Uint64 seq);
+
+    // Finds the last keyframe which is not later than 'timestamp_millisec',
+    // or the first keyframe of the window if there's no such keyframe.
+    mt_mutex (mutex) bool findKeyframe (Time     timestamp_millisec,
+                                        Uint64  * mt_nonnull ret_seq,
+                                        Segment **ret_segment,
+                                        Uint64  * mt_nonnull ret_offset,
+                                        Uint64  * mt_nonnull ret_timestamp_millisec);
+
+    // Finds the first keyframe at or after 'seq'.
+    mt_mutex (mutex) bool findNextKeyframe (Uint64   seq,
+                                            Uint64  * mt_nonnull ret_seq,
+                                            Segment **ret_segment,
+                                            Uint64  * mt_nonnull ret_offset,
+                                            Uint64  * mt_nonnull ret_timestamp_millisec);
+
+    // Codec headers in effect for 'seq' in the memory tier.
+    mt_mutex (mutex) void getMemHeaders (Uint64   seq,
+                                         Frame  * mt_nonnull ret_audio_hdr,
+                                         bool   * mt_nonnull ret_got_audio_hdr,
+                                         Frame  * mt_nonnull ret_video_hdr,
+                                         bool   * mt_nonnull ret_got_video_hdr);
+
+    static void setHeader (Frame       * mt_nonnull hdr,
+                           bool        * mt_nonnull got_hdr,
+                           Frame const &frame);
+
+    mt_mutex (write_mutex) Result openWriteSegment (Uint64 first_seq,
+                                                    Uint64 timestamp_millisec);
+
+    mt_mutex (write_mutex) void closeWriteSegment ();
+
+    static void flushTimerTick (void *_self);
+
+    mt_iface (VideoStream::EventHandler)
+      static VideoStream::EventHandler const stream_handler;
+
+      static void streamAudioMessage (VideoStream::AudioMessage * mt_nonnull msg,
+                                      void                      *_self);
+
+      static void streamVideoMessage (VideoStream::VideoMessage * mt_nonnull msg,
+                                      void                      *_self);
+    mt_iface_end
+
+public:
+    // Should be called every time the channel creates a new video stream.
+    void setVideoStream (VideoStream *video_stream);
+
+    // Timestamps of the oldest and the newest frames in the buffer.
+    // Returns false if the buffer is empty.
+    bool getTimestampRange (Uint64 * mt_nonnull ret_start_millisec,
+                            Uint64 * mt_nonnull ret_end_millisec);
+
+    // The caller is responsible for deleting the reader.
+    MediaReader* createReader ();
+
+    // Moves frames which are older than the memory window to segment files
+    // and removes segments which fall out of the window. Called every
+    // FlushInterval_Millisec by a timer. Does nothing after release().
+    void flush ();
+
+    // Waits for flush() in progress, if any, and removes segment files.
+    void release ();
+
+    mt_const void init (MomentServer * mt_nonnull moment,
+                        ConstMemory   stream_name,
+                        ConstMemory   dir,
+                        Time          window_sec,
+                        Time          memory_window_sec);
+
+    // flush() is called by a timer of 'timers'.
+    mt_const void init (PagePool    * mt_nonnull page_pool,
+                        Timers      * mt_nonnull timers,
+                        ConstMemory  stream_name,
+                        ConstMemory  dir,
+                        Time         window_sec,
+                        Time         memory_window_sec);
+
+     TimeshiftBuffer ();
+    ~TimeshiftBuffer ();
+};
+
+// Reads frames of a TimeshiftBuffer. readFrame() returns IoResult::Eof when
+// there are no new frames yet, isLive() is true. If the position falls
+// out of the window, including when the segment file being read has been
+// removed, reading continues from the oldest keyframe.
+//
+mt_unsafe class TimeshiftReader : public MediaReader
+{
+private:
+    mt_const Ref<TimeshiftBuffer> buffer;
+
+    Uint64 next_seq;
+
+    // Set when reading from the disk tier.
+    Ref<TimeshiftBuffer::Segment> segment;
+    int    segment_fd;
+    Uint64 segment_offset;
+
+    Byte *read_buf;
+    Size  read_buf_size;
+
+    void closeSegment ();
+
+    // Queues the codec headers in effect at the new position.
+    mt_mutex (buffer->mutex) void setPosition (Uint64                    seq,
+                                               TimeshiftBuffer::Segment *new_segment,
+                                               Uint64                    offset,
+                                               Uint64                    timestamp_millisec);
+
+    // Continues from the first keyframe at or after 'next_seq'.
+    mt_mutex (buffer->mutex) void skipToNextKeyframe ();
+
+    mt_throws IoResult readSegmentRecord (Frame * mt_nonnull ret_frame);
+
+public:
+  mt_iface (MediaReader)
+    // 'filename' is ignored.
+    mt_throws Result open (ConstMemory filename);
+
+    void close ();
+
+    mt_throws Result seek (Time timestamp_millisec);
+
+    mt_throws IoResult readFrame (Frame * mt_nonnull ret_frame);
+
+    Time getDurationMillisec ();
+
+    bool isLive () { return true; }
+  mt_iface_end
+
+     TimeshiftReader (TimeshiftBuffer * mt_nonnull buffer);
+    ~TimeshiftReader ();
+};
+
+}
+
+
+#endif /* MOMENT__TIMESHIFT_BUFFER__H__ */
+
@@ -0,0 +1,530 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include <moment/uring_storage.h>
+
+
+// IORING_OP_FTRUNCATE is available since liburing 2.7 (Linux 6.9).
+#if defined (IO_URING_VERSION_MAJOR) && \
+    (IO_URING_VERSION_MAJOR > 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR >= 7))
+#define MOMENT__URING_STORAGE__FTRUNCATE
+#endif
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_uring ("uring_storage", LogLevel::I);
+
+mt_throws Result
+UringStorage::UringFile::write (ConstMemory   const mem,
+                                Uint64        const offset,
+                                void        * const write_data)
+{
+    Request * const req = new (std::nothrow) Request;
+    assert (req);
+    req->op = Request::Write;
+    req->file = this;
+    req->mem = mem;
+    req->offset = offset;
+    req->write_data = write_data;
+
+    ++num_requests;
+    ring->queueRequest (req);
+
+    return Result::Success;
+}
+
+void
+UringStorage::UringFile::preallocate (Uint64 const offset,
+                                      Uint64 const len)
+{
+    Request * const req = new (std::nothrow) Request;
+    assert (req);
+    req->op = Request::Fallocate;
+    req->file = this;
+    req->offset = offset;
+    req->len = len;
+
+    ++num_requests;
+    ring->queueRequest (req);
+}
+
+mt_throws Result
+UringStorage::UringFile::truncate (Uint64 const len)
+{
+    truncate_pending = true;
+    truncate_len = len;
+    return Result::Success;
+}
+
+void
+UringStorage::UringFile::close ()
+{
+    if (fd == -1 || close_pending)
+        return;
+
+    close_pending = true;
+    if (num_requests == 0)
+        ring->fileIdle (this);
+}
+
+UringStorage::UringFile::~UringFile ()
+{
+    // close() has not been called.
+    if (fd != -1) {
+        if (truncate_pending) {
+            if (ftruncate (fd, (off_t) truncate_len) == -1)
+                logE (uring, _func, "ftruncate() failed: ", errnoString (errno));
+        }
+
+        if (::close (fd) == -1)
+            logE (uring, _func, "close() failed: ", errnoString (errno));
+    }
+}
+
+void
+UringStorage::Ring::queueRequest (Request * const mt_nonnull req)
+{
+    if (backlog.isEmpty() && num_inflight < max_inflight) {
+        if (prepareRequest (req))
+            return;
+    }
+
+    backlog.append (req);
+}
+
+bool
+UringStorage::Ring::prepareRequest (Request * const mt_nonnull req)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&uring);
+    if (!sqe) {
+        // Submission queue is full.
+        submit ();
+        sqe = io_uring_get_sqe (&uring);
+        if (!sqe)
+            return false;
+    }
+
+    switch (req->op) {
+        case Request::Write:
+            io_uring_prep_write (sqe,
+                                 req->file->fd,
+                                 req->mem.mem() + req->done,
+                                 req->mem.len() - req->done,
+                                 req->offset + req->done);
+            break;
+        case Request::Fallocate:
+            io_uring_prep_fallocate (sqe, req->file->fd, FALLOC_FL_KEEP_SIZE, req->offset, req->len);
+            break;
+        case Request::Truncate:
+#ifdef MOMENT__URING_STORAGE__FTRUNCATE
+            io_uring_prep_ftruncate (sqe, req->file->fd, (loff_t) req->len);
+#else
+            unreachable ();
+#endif
+            break;
+        case Request::Close:
+            io_uring_prep_close (sqe, req->fd);
+            break;
+    }
+    io_uring_sqe_set_data (sqe, req);
+
+    ++num_inflight;
+    ++num_pending;
+    if (num_pending == 1) {
+        // Requests queued by other recordings in the meantime
+        // go to the kernel with the same io_uring_submit() call.
+        submit_reg.scheduleTask (&submit_task, false /* permanent */);
+    }
+
+    return true;
+}
+
+void
+UringStorage::Ring::queueBacklog ()
+{
+    while (!backlog.isEmpty() && num_inflight < max_inflight) {
+        Request * const req = backlog.getFirst();
+        if (!prepareRequest (req))
+            break;
+
+        backlog.remove (backlog.getFirstElement());
+    }
+}
+
+void
+UringStorage::Ring::submit ()
+{
+    if (num_pending == 0)
+        return;
+
+    int const res = io_uring_submit (&uring);
+    if (res < 0) {
+        logE (uring, _func, "io_uring_submit() failed: ", errnoString (-res));
+        return;
+    }
+
+    if ((Count) res >= num_pending)
+        num_pending = 0;
+    else
+        num_pending -= (Count) res;
+}
+
+void
+UringStorage::Ring::reap ()
+{
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe (&uring, &cqe) == 0) {
+        Request * const req = static_cast <Request*> (io_uring_cqe_get_data (cqe));
+        int const res = cqe->res;
+        io_uring_cqe_seen (&uring, cqe);
+
+        --num_inflight;
+        completeRequest (req, res);
+    }
+
+    queueBacklog ();
+}
+
+void
+UringStorage::Ring::completeRequest (Request * const mt_nonnull req,
+                                     int       const res)
+{
+    switch (req->op) {
+        case Request::Write: {
+            if (res < 0) {
+                if (res == -EINTR || res == -EAGAIN) {
+                    queueRequest (req);
+                    return;
+                }
+
+                logE (uring, _func, "write failed: ", errnoString (-res));
+            } else {
+                req->done += (Size) res;
+                if (res > 0 && req->done < req->mem.len()) {
+                    // Short write
+                    queueRequest (req);
+                    return;
+                }
+            }
+
+            Result const result = (req->done == req->mem.len() ? Result::Success : Result::Failure);
+            req->file->frontend.call (req->file->frontend->writeComplete,
+                                      /*(*/ result, req->write_data /*)*/);
+        } break;
+        case Request::Fallocate: {
+            if (res < 0)
+                logD (uring, _func, "fallocate() failed: ", errnoString (-res));
+        } break;
+        case Request::Truncate: {
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // Not supported by the kernel.
+                if (ftruncate (req->file->fd, (off_t) req->len) == -1)
+                    logE (uring, _func, "ftruncate() failed: ", errnoString (errno));
+            } else
+            if (res < 0) {
+                logE (uring, _func, "ftruncate() failed: ", errnoString (-res));
+            }
+        } break;
+        case Request::Close: {
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // Not supported by the kernel.
+                if (::close (req->fd) == -1)
+                    logE (uring, _func, "close() failed: ", errnoString (errno));
+            } else
+            if (res < 0) {
+                logE (uring, _func, "close() failed: ", errnoString (-res));
+            }
+        } break;
+    }
+
+    Ref<UringFile> const file = req->file;
+    delete req;
+
+    --file->num_requests;
+    if (file->num_requests == 0)
+        fileIdle (file);
+}
+
+void
+UringStorage::Ring::fileIdle (UringFile * const mt_nonnull file)
+{
+    if (!file->close_pending)
+        return;
+
+    if (file->truncate_pending) {
+        file->truncate_pending = false;
+
+#ifdef MOMENT__URING_STORAGE__FTRUNCATE
+        Request * const req = new (std::nothrow) Request;
+        assert (req);
+        req->op = Request::Truncate;
+        req->file = file;
+        req->len = file->truncate_len;
+
+        ++file->num_requests;
+        queueRequest (req);
+        return;
+#else
+        if (ftruncate (file->fd, (off_t) file->truncate_len) == -1)
+            logE (uring, _func, "ftruncate() failed: ", errnoString (errno));
+#endif
+    }
+
+    file->close_pending = false;
+
+    Request * const req = new (std::nothrow) Request;
+    assert (req);
+    req->op = Request::Close;
+    req->file = file;
+    req->fd = file->fd;
+    file->fd = -1;
+
+    ++file->num_requests;
+    queueRequest (req);
+}
+
+bool
+UringStorage::Ring::submitTask (void * const _ring)
+{
+    Ring * const ring = static_cast <Ring*> (_ring);
+
+    ring->submit ();
+    ring->reap ();
+
+    return false /* Do not reschedule */;
+}
+
+PollGroup::Pollable const UringStorage::Ring::pollable = {
+    processEvents,
+    setFeedback,
+    getFd
+};
+
+void
+UringStorage::Ring::processEvents (Uint32   const event_flags,
+                                   void   * const _ring)
+{
+    Ring * const ring = static_cast <Ring*> (_ring);
+
+    if (event_flags & (PollGroup::Error | PollGroup::Hup))
+        logE (uring, _func, "eventfd error");
+
+    if (event_flags & PollGroup::Input) {
+        // The counter is reset by a single read.
+        Uint64 value;
+        while (read (ring->event_fd, &value, sizeof (value)) == -1) {
+            if (errno != EINTR) {
+                if (errno != EAGAIN)
+                    logE (uring, _func, "read() failed: ", errnoString (errno));
+
+                break;
+            }
+        }
+    }
+
+    ring->submit ();
+    ring->reap ();
+}
+
+void
+UringStorage::Ring::setFeedback (Cb<PollGroup::Feedback> const & /* feedback */,
+                                 void * /* _ring */)
+{
+}
+
+int
+UringStorage::Ring::getFd (void * const _ring)
+{
+    Ring * const ring = static_cast <Ring*> (_ring);
+    return ring->event_fd;
+}
+
+mt_mutex (mutex) UringStorage::Ring*
+UringStorage::getRing (DeferredProcessor * const mt_nonnull deferred_processor,
+                       PollGroup         * const mt_nonnull poll_group)
+{
+    {
+        List<Ring*>::iter iter (ring_list);
+        while (!ring_list.iter_done (iter)) {
+            Ring * const ring = ring_list.iter_next (iter)->data;
+            if (ring->deferred_processor == deferred_processor)
+                return ring;
+        }
+    }
+
+    Ring * const ring = new (std::nothrow) Ring;
+    assert (ring);
+
+    {
+        int const res = io_uring_queue_init ((unsigned) queue_depth, &ring->uring, 0 /* flags */);
+        if (res < 0) {
+            logE (uring, _func, "io_uring_queue_init() failed: ", errnoString (-res));
+            delete ring;
+            return NULL;
+        }
+    }
+
+    // The completion queue is at least as large as the submission queue.
+    ring->max_inflight = queue_depth;
+
+    ring->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd == -1) {
+        logE (uring, _func, "eventfd() failed: ", errnoString (errno));
+        io_uring_queue_exit (&ring->uring);
+        delete ring;
+        return NULL;
+    }
+
+    {
+        int const res = io_uring_register_eventfd (&ring->uring, ring->event_fd);
+        if (res < 0) {
+            logE (uring, _func, "io_uring_register_eventfd() failed: ", errnoString (-res));
+            ::close (ring->event_fd);
+            io_uring_queue_exit (&ring->uring);
+            delete ring;
+            return NULL;
+        }
+    }
+
+    ring->deferred_processor = deferred_processor;
+    ring->poll_group = poll_group;
+
+    ring->submit_task.cb = CbDesc<DeferredProcessor::TaskCallback> (Ring::submitTask, ring, getCoderefContainer());
+    ring->submit_reg.setDeferredProcessor (deferred_processor);
+
+    ring->pollable_key = poll_group->addPollable (
+            CbDesc<PollGroup::Pollable> (&Ring::pollable, ring, getCoderefContainer()),
+            true /* activate */);
+    if (!ring->pollable_key) {
+        logE (uring, _func, "addPollable() failed: ", exc->toString());
+        ring->submit_reg.release ();
+        ::close (ring->event_fd);
+        io_uring_queue_exit (&ring->uring);
+        delete ring;
+        return NULL;
+    }
+
+    ring_list.append (ring);
+
+    logD (uring, _func, "new ring 0x", fmt_hex, (UintPtr) ring);
+    return ring;
+}
+
+mt_throws Ref<Storage::AsyncFile>
+UringStorage::openAsyncFile (ConstMemory         const filename,
+                             bool                const direct_io,
+                             DeferredProcessor * const mt_nonnull deferred_processor,
+                             PollGroup         * const mt_nonnull poll_group,
+                             CbDesc<AsyncFile::Frontend> const &frontend)
+{
+    mutex.lock ();
+    Ring * const ring = getRing (deferred_processor, poll_group);
+    mutex.unlock ();
+
+    if (!ring) {
+        // Not an error: the caller falls back to synchronous writes.
+        return NULL;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (direct_io)
+        flags |= O_DIRECT;
+#endif
+
+    Ref<UringFile> const file = grab (new (std::nothrow) UringFile);
+    file->fd = ::open (String (filename).cstr(), flags, 0644);
+    if (file->fd == -1) {
+        exc_throw (PosixException, errno);
+        logE (uring, _func, "open() failed for ", filename, ": ", errnoString (errno));
+        return NULL;
+    }
+
+    file->ring = ring;
+    file->frontend = frontend;
+
+    return file;
+}
+
+// Recorder threads are stopped by the time UringStorage is destroyed,
+// so completions are delivered from the calling thread.
+void
+UringStorage::drainRing (Ring * const mt_nonnull ring)
+{
+    for (;;) {
+        ring->queueBacklog ();
+        ring->submit ();
+        if (ring->num_inflight == 0)
+            break;
+
+        struct io_uring_cqe *cqe;
+        int const res = io_uring_wait_cqe (&ring->uring, &cqe);
+        if (res < 0) {
+            if (res == -EINTR)
+                continue;
+
+            logE (uring, _func, "io_uring_wait_cqe() failed: ", errnoString (-res));
+            break;
+        }
+
+        ring->reap ();
+    }
+}
+
+UringStorage::UringStorage (Object * const coderef_container)
+    : LocalStorage (coderef_container),
+      queue_depth (256)
+{
+}
+
+UringStorage::~UringStorage ()
+{
+    mutex.lock ();
+    {
+        List<Ring*>::iter iter (ring_list);
+        while (!ring_list.iter_done (iter)) {
+            Ring * const ring = ring_list.iter_next (iter)->data;
+
+            ring->poll_group->removePollable (ring->pollable_key);
+
+            // Otherwise requests would leak and writeComplete() would
+            // never be called for them.
+            drainRing (ring);
+
+            ring->submit_reg.release ();
+
+            io_uring_queue_exit (&ring->uring);
+            ::close (ring->event_fd);
+            delete ring;
+        }
+    }
+    ring_list.clear ();
+    mutex.unlock ();
+}
+
+}
+
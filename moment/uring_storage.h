@@ -0,0 +1,220 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__URING_STORAGE__H__
+#define MOMENT__URING_STORAGE__H__
+
+
+#include <liburing.h>
+
+#include <libmary/libmary.h>
+
+#include <moment/local_storage.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// LocalStorage with asynchronous recording writes via io_uring.
+// There's one ring per recorder thread (per deferred processor). Writes from
+// all recordings on a thread are submitted to the kernel in batches, and
+// completions are reaped from the same thread without blocking it: the ring
+// signals an eventfd which is polled by the thread's poll group.
+//
+class UringStorage : public LocalStorage
+{
+private:
+    Mutex mutex;
+
+    class Ring;
+
+    // Accessed only from the thread of the ring.
+    class UringFile : public Storage::AsyncFile
+    {
+    public:
+        int fd;
+        mt_const Ring *ring;
+        mt_const Cb<AsyncFile::Frontend> frontend;
+
+        // Requests of the file which have not completed yet.
+        Count  num_requests;
+
+        // truncate() and close() are done once all preceding requests
+        // of the file have completed.
+        bool   truncate_pending;
+        Uint64 truncate_len;
+        bool   close_pending;
+
+      mt_iface (Storage::AsyncFile)
+        mt_throws Result write (ConstMemory  mem,
+                                Uint64       offset,
+                                void        *write_data);
+
+        void preallocate (Uint64 offset,
+                          Uint64 len);
+
+        // Errors are logged, the result is always Success.
+        mt_throws Result truncate (Uint64 len);
+
+        void close ();
+      mt_iface_end
+
+        UringFile ()
+            : fd (-1),
+              ring (NULL),
+              num_requests (0),
+              truncate_pending (false),
+              truncate_len (0),
+              close_pending (false)
+        {}
+
+        ~UringFile ();
+    };
+
+    struct Request
+    {
+        enum Op {
+            Write,
+            Fallocate,
+            Truncate,
+            Close
+        };
+
+        Op             op;
+        Ref<UringFile> file;
+        // 'fd' of the file for Close requests.
+        int            fd;
+        ConstMemory    mem;
+        Uint64         offset;
+        // Length for Fallocate and Truncate requests.
+        Uint64         len;
+        Size           done;
+        void          *write_data;
+
+        Request ()
+            : op (Write),
+              fd (-1),
+              offset (0),
+              len (0),
+              done (0),
+              write_data (NULL)
+        {}
+    };
+
+    // All fields except 'deferred_processor' are accessed only from
+    // the thread of 'deferred_processor'.
+    class Ring
+    {
+    public:
+        mt_const DeferredProcessor *deferred_processor;
+        mt_const PollGroup *poll_group;
+
+        struct io_uring uring;
+
+        // Completions are signalled through 'event_fd'.
+        mt_const int event_fd;
+        mt_const PollGroup::PollableKey pollable_key;
+
+        // Limits requests in the kernel, so that the completion queue
+        // never overflows.
+        mt_const Count max_inflight;
+
+        // Prepared but not yet submitted.
+        Count num_pending;
+        // Prepared, submitted or not.
+        Count num_inflight;
+
+        // Requests which did not fit into the ring, in order of arrival.
+        List<Request*> backlog;
+
+        DeferredProcessor::Task submit_task;
+        DeferredProcessor::Registration submit_reg;
+
+        // Queues the request or puts it to 'backlog'.
+        void queueRequest (Request * mt_nonnull req);
+
+        // Returns false if the submission queue is full.
+        bool prepareRequest (Request * mt_nonnull req);
+
+        void queueBacklog ();
+
+        void submit ();
+
+        void reap ();
+
+        void completeRequest (Request * mt_nonnull req,
+                              int       res);
+
+        // Called when all requests of the file have completed.
+        void fileIdle (UringFile * mt_nonnull file);
+
+        static bool submitTask (void *_ring);
+
+      mt_iface (PollGroup::Pollable)
+        static PollGroup::Pollable const pollable;
+
+        static void processEvents (Uint32  event_flags,
+                                   void   *_ring);
+
+        static void setFeedback (Cb<PollGroup::Feedback> const &feedback,
+                                 void *_ring);
+
+        static int getFd (void *_ring);
+      mt_iface_end
+
+        Ring ()
+            : deferred_processor (NULL),
+              poll_group (NULL),
+              event_fd (-1),
+              pollable_key (NULL),
+              max_inflight (0),
+              num_pending (0),
+              num_inflight (0)
+        {}
+    };
+
+    mt_const Count queue_depth;
+
+    mt_mutex (mutex) List<Ring*> ring_list;
+
+    mt_mutex (mutex) Ring* getRing (DeferredProcessor * mt_nonnull deferred_processor,
+                                    PollGroup         * mt_nonnull poll_group);
+
+    // Waits for all requests of the ring to complete.
+    static void drainRing (Ring * mt_nonnull ring);
+
+public:
+    mt_throws Ref<AsyncFile> openAsyncFile (ConstMemory        filename,
+                                            bool               direct_io,
+                                            DeferredProcessor * mt_nonnull deferred_processor,
+                                            PollGroup         * mt_nonnull poll_group,
+                                            CbDesc<AsyncFile::Frontend> const &frontend);
+
+    mt_const void setQueueDepth (Count const queue_depth)
+        { this->queue_depth = queue_depth; }
+
+     UringStorage (Object *coderef_container);
+    ~UringStorage ();
+};
+
+}
+
+
+#endif /* MOMENT__URING_STORAGE__H__ */
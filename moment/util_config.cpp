@@ -93,6 +93,11 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
     char const opt_name__connect_on_demand_timeout[] = "connect_on_demand_timeout";
     char const opt_name__no_video_timeout[]          = "no_video_timeout";
     char const opt_name__min_playlist_duration[]     = "min_playlist_duration";
+    char const opt_name__preroll_time[]              = "preroll_time";
+    char const opt_name__timeshift[]                 = "timeshift";
+    char const opt_name__timeshift_window[]          = "timeshift_window";
+    char const opt_name__timeshift_memory[]          = "timeshift_memory";
+    char const opt_name__timeshift_path[]            = "timeshift_path";
     char const opt_name__no_audio[]                  = "no_audio";
     char const opt_name__no_video[]                  = "no_video";
     char const opt_name__force_transcode[]           = "force_transcode";
@@ -254,6 +259,57 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
         return Result::Failure;
     }
 
+    Uint64 preroll_time = default_opts->preroll_time_sec;
+    if (!configSectionGetUint64 (section,
+                                 opt_name__preroll_time,
+                                 &preroll_time,
+                                 preroll_time))
+    {
+        return Result::Failure;
+    }
+
+    // Prerolled items are spliced in through a bind stream, which only
+    // continuous playback has.
+    if (preroll_time > 0 && !continuous_playback) {
+        logW_ (_func, opt_name__preroll_time, " is ignored without ", opt_name__continuous_playback);
+        preroll_time = 0;
+    }
+
+    bool timeshift = default_opts->timeshift;
+    if (!configSectionGetBoolean (section,
+                                  opt_name__timeshift,
+                                  &timeshift,
+                                  timeshift))
+    {
+        return Result::Failure;
+    }
+    logD_ (_func, opt_name__timeshift, ": ", timeshift);
+
+    Uint64 timeshift_window = default_opts->timeshift_window_sec;
+    if (!configSectionGetUint64 (section,
+                                 opt_name__timeshift_window,
+                                 &timeshift_window,
+                                 timeshift_window))
+    {
+        return Result::Failure;
+    }
+
+    Uint64 timeshift_memory = default_opts->timeshift_memory_sec;
+    if (!configSectionGetUint64 (section,
+                                 opt_name__timeshift_memory,
+                                 &timeshift_memory,
+                                 timeshift_memory))
+    {
+        return Result::Failure;
+    }
+
+    ConstMemory timeshift_path = default_opts->timeshift_path->mem();
+    if (MConfig::Option * const opt = section->getOption (opt_name__timeshift_path)) {
+        if (opt->getValue())
+            timeshift_path = opt->getValue()->mem();
+    }
+    logD_ (_func, opt_name__timeshift_path, ": ", timeshift_path);
+
 // TODO PushAgent    ConstMmeory push_uri;
 
     bool no_audio = default_opts->default_item->no_audio;
@@ -351,6 +407,12 @@ parseChannelConfig (MConfig::Section * const mt_nonnull section,
 
     opts->no_video_timeout = no_video_timeout;
     opts->min_playlist_duration_sec = min_playlist_duration;
+    opts->preroll_time_sec = preroll_time;
+
+    opts->timeshift = timeshift;
+    opts->timeshift_window_sec = timeshift_window;
+    opts->timeshift_memory_sec = timeshift_memory;
+    opts->timeshift_path = st_grab (new (std::nothrow) String (timeshift_path));
 
     item->stream_spec = st_grab (new (std::nothrow) String (stream_spec));
     item->spec_kind = spec_kind;
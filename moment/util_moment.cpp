@@ -17,6 +17,15 @@
 */
 
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#endif
+
 #include <moment/util_moment.h>
 
 
@@ -124,5 +133,256 @@ parseMomentRtmpUri (ConstMemory   const uri,
     return Result::Success;
 }
 
+static mt_throws Result
+writeFull (int         const fd,
+           ConstMemory       mem,
+           Uint64            offset)
+{
+    while (mem.len() > 0) {
+        ssize_t const res = pwrite (fd, mem.mem(), mem.len(), (off_t) offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            logE_ (_func, "pwrite() failed: ", errnoString (errno));
+            return Result::Failure;
+        }
+
+        mem = mem.region ((Size) res);
+        offset += (Uint64) res;
+    }
+
+    return Result::Success;
 }
 
+static mt_throws Result
+doWriteFileAtomically (ConstMemory      const filename,
+                       ConstMemory      const data,
+                       PagePool::Page * const first_page)
+{
+    Ref<String> const tmp_filename = makeString (filename, ".tmp");
+
+    int const fd = ::open (tmp_filename->cstr(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "open() failed for ", tmp_filename->mem(), ": ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    Result res = writeFull (fd, data, 0 /* offset */);
+
+    Uint64 offset = data.len();
+    PagePool::Page *page = first_page;
+    while (res && page) {
+        res = writeFull (fd, page->mem(), offset);
+        offset += page->data_len;
+        page = page->getNextMsgPage();
+    }
+
+    if (::close (fd) == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "close() failed: ", errnoString (errno));
+        res = Result::Failure;
+    }
+
+    if (!res) {
+        unlink (tmp_filename->cstr());
+        return Result::Failure;
+    }
+
+    if (rename (tmp_filename->cstr(), String (filename).cstr()) == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "rename() failed for ", filename, ": ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+mt_throws Result
+writeFileAtomically (ConstMemory const filename,
+                     ConstMemory const data)
+{
+    return doWriteFileAtomically (filename, data, NULL /* first_page */);
+}
+
+mt_throws Result
+writeFileAtomically (ConstMemory      const filename,
+                     PagePool::Page * const first_page)
+{
+    return doWriteFileAtomically (filename, ConstMemory(), first_page);
+}
+
+mt_throws Result
+patchFile (ConstMemory const filename,
+           Uint64      const offset,
+           ConstMemory const data)
+{
+    int const fd = ::open (String (filename).cstr(), O_WRONLY);
+    if (fd == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "open() failed for ", filename, ": ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    Result res = writeFull (fd, data, offset);
+
+    if (::close (fd) == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "close() failed: ", errnoString (errno));
+        res = Result::Failure;
+    }
+
+    return res;
+}
+
+// Copies file data without passing it through userspace. copy_file_range()
+// may share extents on filesystems which support that and avoid copying
+// altogether, sendfile() is the fallback for older kernels.
+static mt_throws Result
+copyFileData (int    const in_fd,
+              Uint64       in_offset,
+              int    const out_fd,
+              Uint64       out_offset,
+              Uint64       len)
+{
+#ifdef __linux__
+  #ifdef SYS_copy_file_range
+    bool use_copy_file_range = true;
+  #else
+    bool const use_copy_file_range = false;
+  #endif
+
+    while (len > 0) {
+        Size const chunk_len = (Size) (len < (1 << 30) ? len : (1 << 30));
+
+        ssize_t res;
+        if (use_copy_file_range) {
+  #ifdef SYS_copy_file_range
+            loff_t in_off  = (loff_t) in_offset;
+            loff_t out_off = (loff_t) out_offset;
+            res = syscall (SYS_copy_file_range, in_fd, &in_off, out_fd, &out_off, chunk_len, 0 /* flags */);
+            if (res == -1
+                && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                use_copy_file_range = false;
+                continue;
+            }
+  #endif
+        } else {
+            if (lseek (out_fd, (off_t) out_offset, SEEK_SET) == (off_t) -1) {
+                exc_throw (PosixException, errno);
+                logE_ (_func, "lseek() failed: ", errnoString (errno));
+                return Result::Failure;
+            }
+
+            off_t in_off = (off_t) in_offset;
+            res = sendfile (out_fd, in_fd, &in_off, chunk_len);
+        }
+
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            logE_ (_func, (use_copy_file_range ? "copy_file_range()" : "sendfile()"), " failed: ",
+                   errnoString (errno));
+            return Result::Failure;
+        }
+
+        if (res == 0) {
+            exc_throw (InternalException, InternalException::BackendMalfunction);
+            logE_ (_func, "unexpected end of file");
+            return Result::Failure;
+        }
+
+        in_offset  += (Uint64) res;
+        out_offset += (Uint64) res;
+        len        -= (Uint64) res;
+    }
+
+    return Result::Success;
+#else
+    Byte buf [1 << 16];
+    while (len > 0) {
+        Size const chunk_len = (Size) (len < sizeof (buf) ? len : sizeof (buf));
+        ssize_t const res = pread (in_fd, buf, chunk_len, (off_t) in_offset);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            exc_throw (PosixException, errno);
+            logE_ (_func, "pread() failed: ", errnoString (errno));
+            return Result::Failure;
+        }
+
+        if (res == 0) {
+            exc_throw (InternalException, InternalException::BackendMalfunction);
+            logE_ (_func, "unexpected end of file");
+            return Result::Failure;
+        }
+
+        if (!writeFull (out_fd, ConstMemory (buf, (Size) res), out_offset))
+            return Result::Failure;
+
+        in_offset  += (Uint64) res;
+        out_offset += (Uint64) res;
+        len        -= (Uint64) res;
+    }
+
+    return Result::Success;
+#endif
+}
+
+mt_throws Result
+rewriteFileWithHeader (ConstMemory const filename,
+                       ConstMemory const header,
+                       Uint64      const data_offset,
+                       Uint64      const data_len)
+{
+    Ref<String> const tmp_filename = makeString (filename, ".tmp");
+
+    int const in_fd = ::open (String (filename).cstr(), O_RDONLY);
+    if (in_fd == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "open() failed for ", filename, ": ", errnoString (errno));
+        return Result::Failure;
+    }
+
+    int const out_fd = ::open (tmp_filename->cstr(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "open() failed for ", tmp_filename->mem(), ": ", errnoString (errno));
+        ::close (in_fd);
+        return Result::Failure;
+    }
+
+    Result res = writeFull (out_fd, header, 0 /* offset */);
+    if (res)
+        res = copyFileData (in_fd, data_offset, out_fd, header.len(), data_len);
+
+    ::close (in_fd);
+
+    if (::close (out_fd) == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "close() failed: ", errnoString (errno));
+        res = Result::Failure;
+    }
+
+    if (!res) {
+        unlink (tmp_filename->cstr());
+        return Result::Failure;
+    }
+
+    if (rename (tmp_filename->cstr(), String (filename).cstr()) == -1) {
+        exc_throw (PosixException, errno);
+        logE_ (_func, "rename() failed for ", filename, ": ", errnoString (errno));
+        unlink (tmp_filename->cstr());
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+}
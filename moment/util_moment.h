@@ -34,6 +34,28 @@ Result parseMomentRtmpUri (ConstMemory  uri,
                            ConstMemory * mt_nonnull ret_stream_name,
                            bool        * mt_nonnull ret_momentrtmp_proto);
 
+// Writes 'data' to a temporary file and renames it to 'filename',
+// so that readers never see a partially written file.
+mt_throws Result writeFileAtomically (ConstMemory filename,
+                                      ConstMemory data);
+
+// Same as above for data in a page list.
+mt_throws Result writeFileAtomically (ConstMemory     filename,
+                                      PagePool::Page *first_page);
+
+// Overwrites a region of an existing file.
+mt_throws Result patchFile (ConstMemory filename,
+                            Uint64      offset,
+                            ConstMemory data);
+
+// Replaces the contents of 'filename' with 'header' followed by 'data_len'
+// bytes of the original file starting at 'data_offset'. The data is copied
+// inside the kernel, the new file is renamed over the original one.
+mt_throws Result rewriteFileWithHeader (ConstMemory filename,
+                                        ConstMemory header,
+                                        Uint64      data_offset,
+                                        Uint64      data_len);
+
 }
 
 
@@ -621,13 +621,36 @@ namespace {
     struct InformAudioMessage_Data {
 	VideoStream::AudioMessage *msg;
 
+        // Set for sampled messages.
+        bool          sampled;
+        LatencyStats *latency_stats;
+
 	InformAudioMessage_Data (VideoStream::AudioMessage * const msg)
-	    : msg (msg)
+	    : msg (msg),
+              sampled (false),
+              latency_stats (NULL)
 	{
 	}
     };
 }
 
+// Each handler is timed separately. Only handlers which have queued the frame
+// to a socket (see LatencyStats::markFrameQueued()) are counted.
+static void recordSendLatency (Time           const handler_time_microsec,
+                               LatencyStats * const latency_stats)
+{
+    Time const queued_time_microsec = LatencyStats::getFrameQueuedTime ();
+    if (!queued_time_microsec)
+        return;
+
+    Time const latency = (queued_time_microsec > handler_time_microsec ?
+                                  queued_time_microsec - handler_time_microsec : 0);
+
+    LatencyStats::getGlobal()->fanout_to_send.record (latency);
+    if (latency_stats)
+        latency_stats->fanout_to_send.record (latency);
+}
+
 void
 VideoStream::informAudioMessage (EventHandler * const event_handler,
 				 void * const cb_data,
@@ -637,7 +660,15 @@ VideoStream::informAudioMessage (EventHandler * const event_handler,
         InformAudioMessage_Data * const inform_data =
                 static_cast <InformAudioMessage_Data*> (_inform_data);
         logS_ (_func, "handler 0x", fmt_hex, (UintPtr) event_handler, " ts ", fmt_def, inform_data->msg->timestamp_nanosec);
+        if (!inform_data->sampled) {
+            event_handler->audioMessage (inform_data->msg, cb_data);
+            return;
+        }
+
+        LatencyStats::resetFrameQueued ();
+        Time const handler_time_microsec = LatencyStats::getMonotonicMicroseconds ();
 	event_handler->audioMessage (inform_data->msg, cb_data);
+        recordSendLatency (handler_time_microsec, inform_data->latency_stats);
     }
 }
 
@@ -645,8 +676,14 @@ namespace {
     struct InformVideoMessage_Data {
 	VideoStream::VideoMessage *msg;
 
+        // Set for sampled messages.
+        bool          sampled;
+        LatencyStats *latency_stats;
+
 	InformVideoMessage_Data (VideoStream::VideoMessage * const msg)
-	    : msg (msg)
+	    : msg (msg),
+              sampled (false),
+              latency_stats (NULL)
 	{
 	}
     };
@@ -661,7 +698,15 @@ VideoStream::informVideoMessage (EventHandler * const event_handler,
         InformVideoMessage_Data * const inform_data =
                 static_cast <InformVideoMessage_Data*> (_inform_data);
         logS_ (_func, "handler 0x", fmt_hex, (UintPtr) event_handler, " ts ", fmt_def, inform_data->msg->timestamp_nanosec);
+        if (!inform_data->sampled) {
+            event_handler->videoMessage (inform_data->msg, cb_data);
+            return;
+        }
+
+        LatencyStats::resetFrameQueued ();
+        Time const handler_time_microsec = LatencyStats::getMonotonicMicroseconds ();
 	event_handler->videoMessage (inform_data->msg, cb_data);
+        recordSendLatency (handler_time_microsec, inform_data->latency_stats);
     }
 }
 
@@ -724,12 +769,22 @@ VideoStream::reportPendingFrames ()
                 PendingAudioFrame * const audio_frame = static_cast <PendingAudioFrame*> (pending_frame);
                 frame_saver.processAudioFrame (&audio_frame->audio_msg);
                 InformAudioMessage_Data inform_data (&audio_frame->audio_msg);
+                if (audio_frame->audio_msg.ingest_time_microsec) {
+                    beginLatencySample (&audio_frame->audio_msg);
+                    inform_data.sampled = true;
+                    inform_data.latency_stats = latency_stats;
+                }
                 mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informAudioMessage, &inform_data);
             } break;
             case PendingFrame::t_Video: {
                 PendingVideoFrame * const video_frame = static_cast <PendingVideoFrame*> (pending_frame);
                 frame_saver.processVideoFrame (&video_frame->video_msg);
                 InformVideoMessage_Data inform_data (&video_frame->video_msg);
+                if (video_frame->video_msg.ingest_time_microsec) {
+                    beginLatencySample (&video_frame->video_msg);
+                    inform_data.sampled = true;
+                    inform_data.latency_stats = latency_stats;
+                }
                 mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informVideoMessage, &inform_data);
             } break;
         }
@@ -751,11 +806,55 @@ VideoStream::firePendingFrames_unlocked ()
     }
 }
 
+mt_mutex (mutex) void
+VideoStream::beginLatencySample (Message * const mt_nonnull msg)
+{
+    Time const now_microsec = LatencyStats::getMonotonicMicroseconds ();
+    Time const latency = (now_microsec > msg->ingest_time_microsec ? now_microsec - msg->ingest_time_microsec : 0);
+
+    if (!latency_stats) {
+        latency_stats = new (std::nothrow) LatencyStats;
+        assert (latency_stats);
+    }
+
+    LatencyStats::getGlobal()->ingest_to_fanout.record (latency);
+    latency_stats->ingest_to_fanout.record (latency);
+}
+
+bool
+VideoStream::printLatencyStats (PagePool               * const mt_nonnull page_pool,
+                                PagePool::PageListHead * const mt_nonnull page_list)
+{
+    mutex.lock ();
+    LatencyStats * const stats = latency_stats;
+    mutex.unlock ();
+
+    if (!stats)
+        return false;
+
+    // 'latency_stats' is not deleted until the stream is destroyed.
+    stats->printStats (page_pool, page_list);
+    return true;
+}
+
+void
+VideoStream::getStreamStats (StreamStats::Info * const mt_nonnull ret_info)
+{
+    mutex.lock ();
+    stream_stats.getInfo (ret_info);
+    ret_info->num_watchers = num_watchers;
+    mutex.unlock ();
+}
+
 mt_unlocks_locks (mutex) void
 VideoStream::fireAudioMessage_unlocked (AudioMessage * const mt_nonnull audio_msg)
 {
     logS_ (_this_func, "ts ", audio_msg->timestamp_nanosec, " ", audio_msg->frame_type);
 
+    stream_stats.processAudioFrame (audio_msg->msg_len,
+                                    audio_msg->timestamp_nanosec,
+                                    num_watchers);
+
     if (pending_report_in_progress) {
         PendingAudioFrame * const audio_frame = new (std::nothrow) PendingAudioFrame (audio_msg);
         assert (audio_frame);
@@ -769,6 +868,11 @@ VideoStream::fireAudioMessage_unlocked (AudioMessage * const mt_nonnull audio_ms
     frame_saver.processAudioFrame (audio_msg);
     {
         InformAudioMessage_Data inform_data (audio_msg);
+        if (audio_msg->ingest_time_microsec) {
+            beginLatencySample (audio_msg);
+            inform_data.sampled = true;
+            inform_data.latency_stats = latency_stats;
+        }
         mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informAudioMessage, &inform_data);
     }
 
@@ -784,6 +888,11 @@ VideoStream::fireVideoMessage_unlocked (VideoMessage * const mt_nonnull video_ms
 {
     logS_ (_this_func, "ts ", video_msg->timestamp_nanosec, " ", video_msg->frame_type);
 
+    stream_stats.processVideoFrame (video_msg->msg_len,
+                                    video_msg->timestamp_nanosec,
+                                    video_msg->frame_type.isKeyFrame(),
+                                    num_watchers);
+
     if (pending_report_in_progress) {
         PendingVideoFrame * const video_frame = new (std::nothrow) PendingVideoFrame (video_msg);
         assert (video_frame);
@@ -797,6 +906,11 @@ VideoStream::fireVideoMessage_unlocked (VideoMessage * const mt_nonnull video_ms
     frame_saver.processVideoFrame (video_msg);
     {
         InformVideoMessage_Data inform_data (video_msg);
+        if (video_msg->ingest_time_microsec) {
+            beginLatencySample (video_msg);
+            inform_data.sampled = true;
+            inform_data.latency_stats = latency_stats;
+        }
         mt_unlocks_locks (mutex) event_informer.informAll_unlocked (informVideoMessage, &inform_data);
     }
 
@@ -1133,6 +1247,7 @@ VideoStream::bind_savedAudioFrame (AudioMessage * const mt_nonnull audio_msg,
     assert (audio_frame);
     audio_frame->audio_msg = *audio_msg;
     audio_frame->audio_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
+    audio_frame->audio_msg.ingest_time_microsec = 0;
     self->pending_frame_list.append (audio_frame);
 
     return Result::Success;
@@ -1156,6 +1271,7 @@ VideoStream::bind_savedVideoFrame (VideoMessage * const mt_nonnull video_msg,
     assert (video_frame);
     video_frame->video_msg = *video_msg;
     video_frame->video_msg.timestamp_nanosec = self->stream_timestamp_nanosec;
+    video_frame->video_msg.ingest_time_microsec = 0;
     self->pending_frame_list.append (video_frame);
 
     return Result::Success;
@@ -1193,6 +1309,8 @@ VideoStream::bind_audioMessage (AudioMessage * const mt_nonnull audio_msg,
         self->bind_messageBegin (&self->abind, audio_msg);
 
         AudioMessage tmp_audio_msg = *audio_msg;
+        // Latency is sampled for the source stream only.
+        tmp_audio_msg.ingest_time_microsec = 0;
         if (self->abind.got_timestamp_offs)
             tmp_audio_msg.timestamp_nanosec += self->abind.timestamp_offs;
         else
@@ -1217,6 +1335,8 @@ VideoStream::bind_videoMessage (VideoMessage * const mt_nonnull video_msg,
         self->bind_messageBegin (&self->vbind, video_msg);
 
         VideoMessage tmp_video_msg = *video_msg;
+        // Latency is sampled for the source stream only.
+        tmp_video_msg.ingest_time_microsec = 0;
         if (self->vbind.got_timestamp_offs)
             tmp_video_msg.timestamp_nanosec += self->vbind.timestamp_offs;
         else
@@ -1548,7 +1668,8 @@ VideoStream::VideoStream ()
       event_informer (this, &mutex),
       stream_timestamp_nanosec (0),
       pending_report_in_progress (false),
-      msg_inform_counter (0)
+      msg_inform_counter (0),
+      latency_stats (NULL)
 {
 }
 
@@ -1579,6 +1700,9 @@ VideoStream::~VideoStream ()
             mutex.lock ();
         }
     }
+
+    delete latency_stats;
+    latency_stats = NULL;
 }
 
 }
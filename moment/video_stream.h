@@ -24,6 +24,8 @@
 #include <libmary/libmary.h>
 
 #include <moment/amf_decoder.h>
+#include <moment/latency_stats.h>
+#include <moment/stream_stats.h>
 
 
 namespace Moment {
@@ -238,6 +240,11 @@ public:
 	// Greater than zero for prechunked messages.
 	Uint32 prechunk_size;
 
+        // LatencyStats::getMonotonicMicroseconds() at which the message has been
+        // received, set for frames sampled by LatencyStats::sampleFrame().
+        // 0 otherwise, and for messages relayed from another stream.
+        Time ingest_time_microsec;
+
         void seize ()
         {
             if (page_pool)
@@ -253,7 +260,10 @@ public:
             page_list.reset ();
         }
 
-        Message () : msg_type (Type_None) {}
+        Message ()
+            : msg_type (Type_None),
+              ingest_time_microsec (0)
+        {}
 
 	Message (Type const msg_type)
 	    : msg_type          (msg_type),
@@ -261,7 +271,8 @@ public:
 	      page_pool         (NULL),
 	      msg_len           (0),
 	      msg_offset        (0),
-	      prechunk_size     (0)
+	      prechunk_size     (0),
+              ingest_time_microsec (0)
 	{}
     };
 
@@ -636,6 +647,14 @@ private:
     mt_mutex (mutex) Count msg_inform_counter;
     mt_mutex (mutex) PendingFrameList pending_frame_list;
 
+    // Allocated when the first sampled frame is fired.
+    mt_mutex (mutex) LatencyStats *latency_stats;
+
+    mt_mutex (mutex) StreamStats stream_stats;
+
+    // Records ingest->fanout latency for a sampled message.
+    mt_mutex (mutex) void beginLatencySample (Message * mt_nonnull msg);
+
     mt_mutex (mutex) void bind_messageBegin (BindInfo * mt_nonnull bind_info,
                                              Message  * mt_nonnull msg);
 
@@ -695,6 +714,14 @@ public:
 
     mt_mutex (mutex) bool isClosed_unlocked () { return is_closed; }
 
+    // Prints latencies of sampled frames. Returns false if no frames have
+    // been sampled for this stream.
+    bool printLatencyStats (PagePool               * mt_nonnull page_pool,
+                            PagePool::PageListHead * mt_nonnull page_list);
+
+    // Rolling window statistics of incoming frames and of outgoing traffic.
+    void getStreamStats (StreamStats::Info * mt_nonnull ret_info);
+
     void lock   () { mutex.lock   (); }
     void unlock () { mutex.unlock (); }
 
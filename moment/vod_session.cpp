@@ -0,0 +1,329 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <moment/vod_session.h>
+
+
+using namespace M;
+
+namespace Moment {
+
+static LogGroup libMary_logGroup_vod ("moment.vod", LogLevel::I);
+
+mt_mutex (mutex) Uint64
+VodSession::getPlayPosition (Time const now_millisec)
+{
+    if (paused || now_millisec < play_start_millisec)
+        return play_timestamp_millisec;
+
+    return play_timestamp_millisec + (now_millisec - play_start_millisec);
+}
+
+mt_mutex (mutex) void
+VodSession::stopTimer ()
+{
+    if (tick_timer) {
+        timers->deleteTimer (tick_timer);
+        tick_timer = NULL;
+    }
+}
+
+void
+VodSession::tickTimerTick (void * const _self)
+{
+    VodSession * const self = static_cast <VodSession*> (_self);
+
+    bool eos = false;
+    bool error = false;
+
+    for (Count i = 0; i < FramePacer::MaxFramesPerTick; ++i) {
+        self->mutex.lock ();
+        if (self->stopped || self->paused || self->overloaded) {
+            self->mutex.unlock ();
+            break;
+        }
+
+        if (!self->opened) {
+            if (!self->reader->open (self->filename->mem())) {
+                logE (vod, _func, "could not open ", self->filename->mem(), ": ", exc->toString());
+                self->stopTimer ();
+                self->mutex.unlock ();
+                error = true;
+                break;
+            }
+
+            self->opened = true;
+        }
+
+        if (self->seek_requested) {
+            self->seek_requested = false;
+
+            self->pacer.reset ();
+
+            if (!self->reader->seek (self->seek_millisec)) {
+                logE (vod, _func, "seek failed: ", exc->toString(), ", file: ", self->filename->mem());
+                self->stopTimer ();
+                self->mutex.unlock ();
+                error = true;
+                break;
+            }
+
+            self->got_play_position = false;
+        }
+
+        IoResult res;
+        MediaReader::Frame * const next_frame = self->pacer.peekFrame (&res);
+        if (!next_frame) {
+            if (res == IoResult::Error) {
+                logE (vod, _func, "read error: ", exc->toString(), ", file: ", self->filename->mem());
+                self->stopTimer ();
+                self->mutex.unlock ();
+                error = true;
+                break;
+            }
+
+            if (self->reader->isLive()) {
+                // Caught up with the live stream, waiting for new frames.
+                self->mutex.unlock ();
+                break;
+            }
+
+            logD (vod, _func, "end of file: ", self->filename->mem());
+            self->stopTimer ();
+            self->mutex.unlock ();
+            eos = true;
+            break;
+        }
+
+        Time const now_millisec = getTimeMilliseconds();
+        if (!self->got_play_position) {
+            self->got_play_position = true;
+            self->play_timestamp_millisec = next_frame->timestamp_millisec;
+            self->play_start_millisec = now_millisec;
+        }
+
+        if (next_frame->timestamp_millisec >
+                    self->getPlayPosition (now_millisec) + self->buffer_len_millisec)
+        {
+            // The client's buffer is full.
+            self->mutex.unlock ();
+            break;
+        }
+
+        MediaReader::Frame frame;
+        self->pacer.takeFrame (&frame);
+        self->last_timestamp_millisec = frame.timestamp_millisec;
+        self->mutex.unlock ();
+
+        // A seek may happen while the frame is being sent. The client drops
+        // such frames after NetStream.Seek.Notify.
+        if (self->frontend) {
+            if (frame.is_audio)
+                self->frontend.call (self->frontend->audioMessage, /*(*/ &frame.audio_msg /*)*/);
+            else
+                self->frontend.call (self->frontend->videoMessage, /*(*/ &frame.video_msg /*)*/);
+        }
+
+        frame.release ();
+    }
+
+    if (!self->frontend)
+        return;
+
+    if (error)
+        self->frontend.call (self->frontend->error);
+    else
+    if (eos)
+        self->frontend.call (self->frontend->eos);
+}
+
+mt_throws Result
+VodSession::start (Time const start_millisec)
+{
+    mutex.lock ();
+    if (started || stopped) {
+        mutex.unlock ();
+        exc_throw (InternalException, InternalException::IncorrectUsage);
+        return Result::Failure;
+    }
+    started = true;
+
+    seek_requested = true;
+    seek_millisec = start_millisec;
+
+    tick_timer = timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (tickTimerTick, this, this),
+            FramePacer::TickInterval_Millisec * 1000,
+            true /* periodical */);
+    mutex.unlock ();
+
+    logD (vod, _func, "playing ", filename->mem(), ", start ", start_millisec);
+    return Result::Success;
+}
+
+void
+VodSession::stop ()
+{
+    mutex.lock ();
+    stopped = true;
+    stopTimer ();
+
+    pacer.reset ();
+
+    if (opened) {
+        reader->close ();
+        opened = false;
+    }
+    mutex.unlock ();
+}
+
+void
+VodSession::seek (Time const timestamp_millisec)
+{
+    mutex.lock ();
+    seek_requested = true;
+    seek_millisec = timestamp_millisec;
+
+    if (paused)
+        play_timestamp_millisec = timestamp_millisec;
+    mutex.unlock ();
+
+    logD (vod, _func, filename->mem(), ": ", timestamp_millisec);
+}
+
+void
+VodSession::pause ()
+{
+    mutex.lock ();
+    if (!paused) {
+        Uint64 position = getPlayPosition (getTimeMilliseconds());
+        if (position > last_timestamp_millisec)
+            position = last_timestamp_millisec;
+
+        play_timestamp_millisec = position;
+        paused = true;
+    }
+    mutex.unlock ();
+}
+
+void
+VodSession::resume ()
+{
+    mutex.lock ();
+    if (paused) {
+        paused = false;
+        play_start_millisec = getTimeMilliseconds();
+    }
+    mutex.unlock ();
+}
+
+void
+VodSession::setBufferLength (Time const buffer_len_millisec)
+{
+    mutex.lock ();
+    this->buffer_len_millisec = buffer_len_millisec;
+    mutex.unlock ();
+}
+
+void
+VodSession::setOverloaded (bool const overloaded)
+{
+    mutex.lock ();
+    this->overloaded = overloaded;
+    mutex.unlock ();
+}
+
+Time
+VodSession::getDurationMillisec ()
+{
+    mutex.lock ();
+    Time const duration_millisec = (opened ? reader->getDurationMillisec() : 0);
+    mutex.unlock ();
+
+    return duration_millisec;
+}
+
+void
+VodSession::init (MomentServer * const mt_nonnull moment,
+                  MediaReader  * const mt_nonnull reader,
+                  ConstMemory    const filename,
+                  Time           const buffer_len_millisec,
+                  CbDesc<Frontend> const &frontend)
+{
+    this->reader = reader;
+    this->filename = grab (new (std::nothrow) String (filename));
+    this->buffer_len_millisec = buffer_len_millisec;
+    this->frontend = frontend;
+
+    reader->setPagePool (moment->getPagePool());
+
+    {
+        FramePacer::Options pacer_opts;
+        pacer_opts.speed_percent = 0;
+        // Timestamps of the file are sent as is for seeking to work.
+        pacer_opts.rebase_timestamps = false;
+        pacer.init (reader, pacer_opts);
+    }
+
+    reader_thread_pool = moment->getReaderThreadPool();
+    ServerThreadContext *thread_ctx = reader_thread_pool->grabThreadContext ("vod");
+    if (thread_ctx) {
+        reader_thread_ctx = thread_ctx;
+    } else {
+        logE (vod, _func, "Couldn't get reader thread context: ", exc->toString());
+        thread_ctx = moment->getServerApp()->getServerContext()->getMainThreadContext();
+    }
+
+    timers = thread_ctx->getTimers();
+}
+
+VodSession::VodSession ()
+    : timers (this /* coderef_container */),
+      reader_thread_pool (NULL),
+      reader_thread_ctx  (NULL),
+      reader (NULL),
+      started (false),
+      stopped (false),
+      opened  (false),
+      paused  (false),
+      overloaded (false),
+      buffer_len_millisec (0),
+      seek_requested (false),
+      seek_millisec  (0),
+      got_play_position (false),
+      play_timestamp_millisec (0),
+      play_start_millisec (0),
+      last_timestamp_millisec (0)
+{
+}
+
+VodSession::~VodSession ()
+{
+    stop ();
+
+    delete reader;
+
+    if (reader_thread_ctx) {
+        reader_thread_pool->releaseThreadContext (reader_thread_ctx);
+        reader_thread_ctx = NULL;
+    }
+}
+
+}
+
@@ -0,0 +1,140 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MOMENT__VOD_SESSION__H__
+#define MOMENT__VOD_SESSION__H__
+
+
+#include <libmary/libmary.h>
+
+#include <moment/media_reader.h>
+#include <moment/moment_server.h>
+#include <moment/frame_pacer.h>
+
+
+namespace Moment {
+
+using namespace M;
+
+// Plays a recorded file to a single client with seek and pause. Frames are
+// read on a thread from the reader thread pool.
+//
+// Unlike FileSource, which paces frames to the clock, VodSession keeps
+// the client's buffer full: a frame is sent once it's no further than
+// 'buffer_len' ahead of the estimated playback position of the client,
+// unless the connection is overloaded.
+//
+class VodSession : public Object
+{
+private:
+    StateMutex mutex;
+
+public:
+    struct Frontend
+    {
+        void (*audioMessage) (VideoStream::AudioMessage * mt_nonnull msg,
+                              void                      *cb_data);
+
+        void (*videoMessage) (VideoStream::VideoMessage * mt_nonnull msg,
+                              void                      *cb_data);
+
+        void (*eos) (void *cb_data);
+
+        void (*error) (void *cb_data);
+    };
+
+private:
+    mt_const DataDepRef<Timers> timers;
+
+    mt_const ServerThreadPool    *reader_thread_pool;
+    // NULL if the main thread context is used.
+    mt_const ServerThreadContext *reader_thread_ctx;
+
+    // Used with 'mutex' held.
+    mt_const MediaReader *reader;
+
+    mt_const Cb<Frontend> frontend;
+    mt_const Ref<String> filename;
+
+    mt_mutex (mutex) Timers::TimerKey tick_timer;
+
+    mt_mutex (mutex) bool started;
+    mt_mutex (mutex) bool stopped;
+    // The file is opened by the first tick to keep the caller's thread free.
+    mt_mutex (mutex) bool opened;
+    mt_mutex (mutex) bool paused;
+    mt_mutex (mutex) bool overloaded;
+
+    mt_mutex (mutex) Time buffer_len_millisec;
+
+    mt_mutex (mutex) bool seek_requested;
+    mt_mutex (mutex) Time seek_millisec;
+
+    // The playback position of the client is estimated as
+    // 'play_timestamp_millisec' + (now - 'play_start_millisec').
+    mt_mutex (mutex) bool   got_play_position;
+    mt_mutex (mutex) Uint64 play_timestamp_millisec;
+    mt_mutex (mutex) Time   play_start_millisec;
+
+    mt_mutex (mutex) Uint64 last_timestamp_millisec;
+
+    // Not paced to the clock: frames are held back by the buffer check.
+    mt_mutex (mutex) FramePacer pacer;
+
+    mt_mutex (mutex) Uint64 getPlayPosition (Time now_millisec);
+
+    mt_mutex (mutex) void stopTimer ();
+
+    static void tickTimerTick (void *_self);
+
+public:
+    // Starts sending from 'start_millisec'. Errors are reported to frontend->error().
+    mt_throws Result start (Time start_millisec);
+
+    void stop ();
+
+    // Seeks to the last keyframe before 'timestamp_millisec'.
+    void seek (Time timestamp_millisec);
+
+    void pause ();
+
+    void resume ();
+
+    void setBufferLength (Time buffer_len_millisec);
+
+    void setOverloaded (bool overloaded);
+
+    Time getDurationMillisec ();
+
+    // Takes ownership of 'reader'.
+    void init (MomentServer * mt_nonnull moment,
+               MediaReader  * mt_nonnull reader,
+               ConstMemory   filename,
+               Time          buffer_len_millisec,
+               CbDesc<Frontend> const &frontend);
+
+     VodSession ();
+    ~VodSession ();
+};
+
+}
+
+
+#endif /* MOMENT__VOD_SESSION__H__ */
+
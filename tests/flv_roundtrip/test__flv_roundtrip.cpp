@@ -0,0 +1,473 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// test__flv_roundtrip: records AAC/AVC frames, plain and prechunked, with
+// FlvMuxer and reads the file back with FlvFileReader, checking codec
+// headers, timestamps, payloads and tag sizes.
+
+
+#include <libmary/types.h>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <moment/libmoment.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace {
+
+enum {
+    NumFrames      = 40,
+    KeyframePeriod = 10,
+    PrechunkSize   = 128,
+    FrameDuration  = 40,
+    MaxPayloadLen  = 4096
+};
+
+// Writes muxed data to a file descriptor.
+class FileSender : public Sender
+{
+private:
+    int fd;
+    bool write_error;
+
+public:
+  mt_iface (Sender)
+    void sendMessage (Sender::MessageEntry * const mt_nonnull msg_entry,
+                      bool                   const do_flush)
+        { sendMessage_unlocked (msg_entry, do_flush); }
+
+    void sendMessage_unlocked (Sender::MessageEntry * const mt_nonnull msg_entry,
+                               bool                   const /* do_flush */)
+    {
+        assert (msg_entry->type == Sender::MessageEntry::Pages);
+        Sender::MessageEntry_Pages * const msg_pages =
+                static_cast <Sender::MessageEntry_Pages*> (msg_entry);
+
+        writeData (ConstMemory (msg_pages->getHeaderData(), msg_pages->header_len));
+
+        PagePool::Page *page = msg_pages->getFirstPage();
+        Size msg_offset = msg_pages->msg_offset;
+        while (page) {
+            if (page->data_len > msg_offset)
+                writeData (page->mem().region (msg_offset));
+
+            msg_offset = 0;
+            page = page->getNextMsgPage();
+        }
+
+        Sender::deleteMessageEntry (msg_entry);
+    }
+
+    void flush () {}
+    void flush_unlocked () {}
+    void closeAfterFlush () {}
+    void close () {}
+    bool isClosed_unlocked () { return false; }
+    SendState getSendState_unlocked () { return SendState::ConnectionReady; }
+    void lock () {}
+    void unlock () {}
+  mt_iface_end
+
+    void writeData (ConstMemory const mem)
+    {
+        if (mem.len() == 0)
+            return;
+
+        if (write (fd, mem.mem(), mem.len()) != (ssize_t) mem.len())
+            write_error = true;
+    }
+
+    bool gotWriteError () const { return write_error; }
+
+    FileSender (Object * const coderef_container,
+                int      const fd)
+        : Sender (coderef_container),
+          fd (fd),
+          write_error (false)
+    {}
+};
+
+struct ExpectedFrame
+{
+    bool   is_audio;
+    bool   is_seq_hdr;
+    bool   is_keyframe;
+    Uint64 timestamp_millisec;
+    Size   codec_hdr_len;
+    Size   payload_len;
+    Byte   payload_seed;
+};
+
+void fillPayload (Memory const mem,
+                  Byte   const seed)
+{
+    for (Size i = 0; i < mem.len(); ++i)
+        mem.mem() [i] = (Byte) (seed + i * 7);
+}
+
+class TestInstance : public Object
+{
+private:
+    PagePool page_pool;
+
+    ExpectedFrame expected [2 * NumFrames + 2];
+    Count num_expected;
+    Size  script_tags_len;
+
+    void fillPages (VideoStream::Message * const mt_nonnull msg,
+                    ConstMemory            const mem,
+                    Size                   const codec_hdr_len,
+                    Uint32                 const chunk_stream_id,
+                    bool                   const prechunked)
+    {
+        msg->page_pool = &page_pool;
+        msg->msg_offset = 0;
+        msg->msg_len = mem.len();
+
+        if (prechunked) {
+            RtmpConnection::PrechunkContext prechunk_ctx (codec_hdr_len);
+            RtmpConnection::fillPrechunkedPages (&prechunk_ctx,
+                                                 mem,
+                                                 &page_pool,
+                                                 &msg->page_list,
+                                                 chunk_stream_id,
+                                                 msg->timestamp_nanosec / 1000000,
+                                                 true /* first_chunk */,
+                                                 PrechunkSize);
+            msg->prechunk_size = PrechunkSize;
+        } else {
+            page_pool.getFillPages (&msg->page_list, mem);
+            msg->prechunk_size = 0;
+        }
+    }
+
+    void muxAudio (FlvMuxer * const mt_nonnull muxer,
+                   Uint64     const timestamp_millisec,
+                   bool       const is_seq_hdr,
+                   Size       const payload_len,
+                   bool       const prechunked)
+    {
+        ExpectedFrame * const exp = &expected [num_expected++];
+        exp->is_audio = true;
+        exp->is_seq_hdr = is_seq_hdr;
+        exp->is_keyframe = false;
+        exp->timestamp_millisec = timestamp_millisec;
+        exp->codec_hdr_len = 2;
+        exp->payload_len = payload_len;
+        exp->payload_seed = (Byte) num_expected;
+
+        assert (payload_len <= MaxPayloadLen);
+        Byte payload [MaxPayloadLen];
+        fillPayload (Memory (payload, payload_len), exp->payload_seed);
+
+        VideoStream::AudioMessage msg;
+        msg.codec_id = VideoStream::AudioCodecId::AAC;
+        msg.frame_type = (is_seq_hdr ? VideoStream::AudioFrameType::AacSequenceHeader
+                                     : VideoStream::AudioFrameType::RawData);
+        msg.rate = 44100;
+        msg.channels = 2;
+        msg.timestamp_nanosec = timestamp_millisec * 1000000;
+        fillPages (&msg, ConstMemory (payload, payload_len), exp->codec_hdr_len,
+                   RtmpConnection::DefaultAudioChunkStreamId, prechunked);
+
+        muxer->muxAudioMessage (&msg);
+        msg.release ();
+    }
+
+    void muxVideo (FlvMuxer * const mt_nonnull muxer,
+                   Uint64     const timestamp_millisec,
+                   bool       const is_seq_hdr,
+                   bool       const is_keyframe,
+                   Size       const payload_len,
+                   bool       const prechunked)
+    {
+        ExpectedFrame * const exp = &expected [num_expected++];
+        exp->is_audio = false;
+        exp->is_seq_hdr = is_seq_hdr;
+        exp->is_keyframe = is_keyframe;
+        exp->timestamp_millisec = timestamp_millisec;
+        exp->codec_hdr_len = 5;
+        exp->payload_len = payload_len;
+        exp->payload_seed = (Byte) num_expected;
+
+        assert (payload_len <= MaxPayloadLen);
+        Byte payload [MaxPayloadLen];
+        fillPayload (Memory (payload, payload_len), exp->payload_seed);
+
+        VideoStream::VideoMessage msg;
+        msg.codec_id = VideoStream::VideoCodecId::AVC;
+        if (is_seq_hdr)
+            msg.frame_type = VideoStream::VideoFrameType::AvcSequenceHeader;
+        else
+            msg.frame_type = (is_keyframe ? VideoStream::VideoFrameType::KeyFrame
+                                          : VideoStream::VideoFrameType::InterFrame);
+        msg.timestamp_nanosec = timestamp_millisec * 1000000;
+        fillPages (&msg, ConstMemory (payload, payload_len), exp->codec_hdr_len,
+                   RtmpConnection::DefaultVideoChunkStreamId, prechunked);
+
+        muxer->muxVideoMessage (&msg);
+        msg.release ();
+    }
+
+    // Written as a script data tag, which the reader skips.
+    void muxMetaData (FlvMuxer * const mt_nonnull muxer)
+    {
+        Byte payload [32];
+        fillPayload (Memory::forObject (payload), 0x55);
+
+        VideoStream::VideoMessage msg;
+        msg.frame_type = VideoStream::VideoFrameType::RtmpSetMetaData;
+        msg.timestamp_nanosec = 0;
+        fillPages (&msg, ConstMemory::forObject (payload), 0 /* codec_hdr_len */,
+                   RtmpConnection::DefaultDataChunkStreamId, false /* prechunked */);
+
+        muxer->muxVideoMessage (&msg);
+        msg.release ();
+
+        script_tags_len += 11 + sizeof (payload) + 4;
+    }
+
+    Result record (int const fd)
+    {
+        FileSender sender (this /* coderef_container */, fd);
+
+        FlvMuxer muxer;
+        muxer.setPagePool (&page_pool);
+        muxer.setSender (&sender);
+
+        if (!muxer.beginMuxing ()) {
+            errs->print ("beginMuxing() failed: ", exc->toString(), "\n");
+            return Result::Failure;
+        }
+
+        muxMetaData (&muxer);
+        muxAudio (&muxer, 0, true /* is_seq_hdr */, 2, false /* prechunked */);
+        muxVideo (&muxer, 0, true /* is_seq_hdr */, false /* is_keyframe */, 30, false /* prechunked */);
+
+        for (Count i = 0; i < NumFrames; ++i) {
+            Uint64 const timestamp_millisec = i * FrameDuration;
+            bool const prechunked = (i % 2 == 1);
+
+            // Odd sizes around PrechunkSize so that chunk boundaries fall
+            // at different offsets.
+            muxVideo (&muxer,
+                      timestamp_millisec,
+                      false /* is_seq_hdr */,
+                      i % KeyframePeriod == 0 /* is_keyframe */,
+                      (i % KeyframePeriod == 0 ? 1000 + i * 13 : 50 + i * 11),
+                      prechunked);
+
+            muxAudio (&muxer,
+                      timestamp_millisec + 5,
+                      false /* is_seq_hdr */,
+                      100 + i * 3,
+                      prechunked);
+        }
+
+        if (!muxer.endMuxing ()) {
+            errs->print ("endMuxing() failed: ", exc->toString(), "\n");
+            return Result::Failure;
+        }
+
+        if (sender.gotWriteError ()) {
+            errs->print ("write error\n");
+            return Result::Failure;
+        }
+
+        return Result::Success;
+    }
+
+    Result checkFrame (MediaReader::Frame * const mt_nonnull frame,
+                       ExpectedFrame      * const mt_nonnull exp,
+                       Count                const idx)
+    {
+        if (frame->is_audio != exp->is_audio) {
+            errs->print ("frame ", idx, ": is_audio mismatch\n");
+            return Result::Failure;
+        }
+
+        if (frame->timestamp_millisec != exp->timestamp_millisec) {
+            errs->print ("frame ", idx, ": timestamp ", frame->timestamp_millisec, ", "
+                         "expected ", exp->timestamp_millisec, "\n");
+            return Result::Failure;
+        }
+
+        if (frame->is_audio) {
+            VideoStream::AudioMessage * const msg = &frame->audio_msg;
+            if (msg->codec_id != VideoStream::AudioCodecId::AAC
+                || msg->rate != 44100
+                || msg->channels != 2
+                || (msg->frame_type == VideoStream::AudioFrameType::AacSequenceHeader) != exp->is_seq_hdr)
+            {
+                errs->print ("frame ", idx, ": bad audio header\n");
+                return Result::Failure;
+            }
+        } else {
+            VideoStream::VideoMessage * const msg = &frame->video_msg;
+            bool const frame_type_ok =
+                    exp->is_seq_hdr ? msg->frame_type == VideoStream::VideoFrameType::AvcSequenceHeader :
+                    exp->is_keyframe ? msg->frame_type == VideoStream::VideoFrameType::KeyFrame :
+                                       msg->frame_type == VideoStream::VideoFrameType::InterFrame;
+            if (msg->codec_id != VideoStream::VideoCodecId::AVC || !frame_type_ok) {
+                errs->print ("frame ", idx, ": bad video header\n");
+                return Result::Failure;
+            }
+        }
+
+        VideoStream::Message * const msg = frame->getMessage ();
+        if (msg->msg_len != exp->payload_len) {
+            errs->print ("frame ", idx, ": payload length ", msg->msg_len, ", "
+                         "expected ", exp->payload_len, "\n");
+            return Result::Failure;
+        }
+
+        if (frame->file_len != 11 + exp->codec_hdr_len + exp->payload_len + 4) {
+            errs->print ("frame ", idx, ": bad tag size ", frame->file_len, "\n");
+            return Result::Failure;
+        }
+
+        Byte payload [MaxPayloadLen];
+        Byte expected_payload [MaxPayloadLen];
+        PagePool::PageListArray pl_array (msg->page_list.first, msg->msg_offset, msg->msg_len);
+        pl_array.get (0, Memory (payload, exp->payload_len));
+        fillPayload (Memory (expected_payload, exp->payload_len), exp->payload_seed);
+        if (memcmp (payload, expected_payload, exp->payload_len)) {
+            errs->print ("frame ", idx, ": payload mismatch\n");
+            return Result::Failure;
+        }
+
+        return Result::Success;
+    }
+
+    Result readBack (ConstMemory const filename,
+                     Uint64      const file_size)
+    {
+        FlvFileReader reader;
+        reader.setPagePool (&page_pool);
+        if (!reader.open (filename)) {
+            errs->print ("open() failed: ", exc->toString(), "\n");
+            return Result::Failure;
+        }
+
+        Uint64 total_len = 9 /* FLV header */ + 4 /* PreviousTagSize0 */ + script_tags_len;
+        Count idx = 0;
+        for (;;) {
+            MediaReader::Frame frame;
+            IoResult const res = reader.readFrame (&frame);
+            if (res == IoResult::Error) {
+                errs->print ("readFrame() failed: ", exc->toString(), "\n");
+                return Result::Failure;
+            }
+
+            if (res == IoResult::Eof)
+                break;
+
+            if (idx >= num_expected) {
+                errs->print ("extra frame at ", idx, "\n");
+                frame.release ();
+                return Result::Failure;
+            }
+
+            Result const check_res = checkFrame (&frame, &expected [idx], idx);
+            total_len += frame.file_len;
+            frame.release ();
+            if (!check_res)
+                return Result::Failure;
+
+            ++idx;
+        }
+
+        reader.close ();
+
+        if (idx != num_expected) {
+            errs->print ("read ", idx, " frames, expected ", num_expected, "\n");
+            return Result::Failure;
+        }
+
+        if (total_len != file_size) {
+            errs->print ("file size ", file_size, ", sum of tags ", total_len, "\n");
+            return Result::Failure;
+        }
+
+        return Result::Success;
+    }
+
+public:
+    Result run ()
+    {
+        char filename [] = "/tmp/test__flv_roundtrip_XXXXXX";
+        int const fd = mkstemp (filename);
+        if (fd == -1) {
+            errs->print ("mkstemp() failed: ", errnoString (errno), "\n");
+            return Result::Failure;
+        }
+
+        Result res = record (fd);
+
+        struct stat st;
+        if (fstat (fd, &st) == -1) {
+            errs->print ("fstat() failed: ", errnoString (errno), "\n");
+            res = Result::Failure;
+        }
+        ::close (fd);
+
+        if (res)
+            res = readBack (ConstMemory (filename, strlen (filename)), st.st_size);
+
+        unlink (filename);
+        return res;
+    }
+
+    TestInstance ()
+        : page_pool (this /* coderef_container */, 4096 /* page_size */, 4096 /* min_pages */),
+          num_expected (0),
+          script_tags_len (0)
+    {}
+};
+
+} // namespace {}
+
+int main (void)
+{
+    libMaryInit ();
+
+    Result res = Result::Failure;
+    {
+        Ref<TestInstance> const test_instance = grab (new (std::nothrow) TestInstance);
+        res = test_instance->run ();
+    }
+
+    if (!res) {
+        errs->print ("FAILED\n");
+        errs->flush ();
+        return EXIT_FAILURE;
+    }
+
+    outs->print ("PASSED\n");
+    outs->flush ();
+    return 0;
+}
+
@@ -0,0 +1,183 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// test__playlist: checks the ordinal index and the expiry max-tree of
+// Playlist against a linear walk over the item list on random playlists.
+
+
+#include <libmary/types.h>
+
+#include <moment/libmoment.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace {
+
+enum {
+    NumRounds   = 1000,
+    MaxNumItems = 40,
+    CurTime     = 1000
+};
+
+Uint32 rand_state = 1;
+
+Uint32 randomUint32 (Uint32 const limit)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) % limit;
+}
+
+// The conditions under which getNextItem() used to skip an item while
+// walking the list, before the expiry index was introduced.
+bool isPlayable (Playlist::Item * const mt_nonnull item,
+                 Int64            const now)
+{
+    if (item->duration_full)
+        return true;
+
+    if (item->start_immediate) {
+        if (item->got_end_time && (Int64) item->end_time - now <= 0)
+            return false;
+
+        return true;
+    }
+
+    Int64 const start_rel = (Int64) item->start_time - now;
+    if (!item->duration_default
+        && start_rel < 0
+        && (Time) -start_rel >= item->duration)
+    {
+        return false;
+    }
+
+    if (item->got_end_time
+        && (item->end_time <= item->start_time || (Int64) item->end_time - now <= 0))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+Playlist::Item* linearNextItem (Playlist       * const mt_nonnull playlist,
+                                Playlist::Item * const prv_item,
+                                Int64            const now)
+{
+    Playlist::Item *item = prv_item;
+    for (;;) {
+        item = (item ? Playlist::ItemList::getNext (item) : playlist->item_list.getFirst());
+        if (!item || isPlayable (item, now))
+            return item;
+    }
+}
+
+void fillRandomItem (Playlist::Item * const mt_nonnull item)
+{
+    item->start_immediate = (randomUint32 (4) == 0);
+    item->start_time = CurTime - 100 + randomUint32 (200);
+
+    item->got_end_time = (randomUint32 (2) == 0);
+    item->end_time = CurTime - 200 + randomUint32 (400);
+
+    item->duration_full = (randomUint32 (8) == 0);
+    item->duration_default = (randomUint32 (3) == 0);
+    item->duration = randomUint32 (200);
+}
+
+Result runRound ()
+{
+    Playlist playlist;
+
+    Count const num_items = randomUint32 (MaxNumItems + 1);
+    for (Count i = 0; i < num_items; ++i) {
+        Playlist::Item * const item = new (std::nothrow) Playlist::Item;
+        assert (item);
+        fillRandomItem (item);
+        playlist.item_list.append (item);
+    }
+    playlist.buildIndex ();
+
+    {
+        Count i = 1;
+        Playlist::ItemList::iterator iter (playlist.item_list);
+        while (!iter.done()) {
+            Playlist::Item * const item = iter.next ();
+            if (playlist.getNthItem (i) != item) {
+                errs->print ("getNthItem (", i, ") mismatch\n");
+                return Result::Failure;
+            }
+            ++i;
+        }
+
+        if (playlist.getNthItem (0) || playlist.getNthItem (i)) {
+            errs->print ("getNthItem() out of range\n");
+            return Result::Failure;
+        }
+    }
+
+    for (Count i = 0; i < 8; ++i) {
+        Int64 const time_offset = (Int64) randomUint32 (400) - 200;
+        Int64 const now = CurTime + time_offset;
+
+        Playlist::Item *expected = NULL;
+        Playlist::Item *prv_item = NULL;
+        for (;;) {
+            expected = linearNextItem (&playlist, prv_item, now);
+
+            Time start_rel, seek, duration;
+            bool duration_full;
+            Playlist::Item * const item = playlist.getNextItem (prv_item, CurTime, time_offset,
+                                                                &start_rel, &seek, &duration, &duration_full);
+            if (item != expected) {
+                errs->print ("getNextItem() mismatch: now ", now, ", "
+                             "got #", (item ? item->index : (Count) -1), ", "
+                             "expected #", (expected ? expected->index : (Count) -1), "\n");
+                return Result::Failure;
+            }
+
+            if (!item)
+                break;
+
+            prv_item = item;
+        }
+    }
+
+    return Result::Success;
+}
+
+} // namespace {}
+
+int main (void)
+{
+    libMaryInit ();
+
+    for (Count i = 0; i < NumRounds; ++i) {
+        if (!runRound ()) {
+            errs->print ("FAILED in round ", i, "\n");
+            errs->flush ();
+            return EXIT_FAILURE;
+        }
+    }
+
+    outs->print ("PASSED\n");
+    outs->flush ();
+    return 0;
+}
@@ -1,152 +1,1826 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// test__server: integration test of the RTMP server.
+//
+// RtmpService runs on loopback with a minimal application on top of it,
+// which maps stream names to VideoStreams the same way mod_rtmp does.
+// Scripted scenarios are run against it one after another with RtmpClient
+// publishers and players in the same process:
+//
+//     connect_storm     - many players connect at once;
+//     slow_readers      - some players read slower than the stream bitrate;
+//     publisher_restart - the publisher reconnects mid-stream every second;
+//     chunk_size        - the publisher changes RTMP chunk size mid-stream.
+//
+// Publishers put frame marks into frames, so that players measure
+// publish->play latency. At the end of each scenario delivered throughput,
+// latency and memory growth are checked against thresholds. The exit status
+// is non-zero if any check fails.
+
+
+#include <libmary/types.h>
+#include <cstdio>
+#include <cerrno>
+
+#ifndef LIBMARY_PLATFORM_WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 #include <moment/libmoment.h>
 
 
+// Slow readers are plain blocking sockets, one thread each.
+#if defined (LIBMARY_MT_SAFE) && !defined (LIBMARY_PLATFORM_WIN32)
+#define TEST_SERVER__SLOW_READERS
+#endif
+
+
 using namespace M;
 using namespace Moment;
 
-
 namespace {
 
-DefaultPollGroup poll_group;
-Timers timers;
+class Options
+{
+public:
+    bool help;
+
+    Uint32 port;
+    Uint32 num_threads;
+    Ref<String> scenario;
+
+    Uint32 num_players;
+    Uint32 num_storm_players;
+    Uint32 num_slow_readers;
+    // Bytes per second.
+    Uint32 slow_read_rate;
 
-PagePool page_pool (4096 /* page_size */, 128 /* min_pages */);
+    Uint32 frame_size;
+    Uint32 frame_duration;
 
-TcpServer tcp_server;
+    Uint32 warmup_sec;
+    Uint32 duration_sec;
 
-// TODO Support several simultaneous connections
-TcpConnection tcp_conn;
-RtmpConnection rtmp_conn (&timers, &page_pool);
-RtmpDirectBackend rtmp_be (&rtmp_conn, &tcp_conn);
-RtmpServer rtmp_server (&rtmp_conn);
+    // Thresholds
+    Uint32 min_delivery_percent;
+    Uint32 max_latency_millisec;
+    Uint32 max_memory_growth_mb;
 
-void accepted (void * const)
+    LogLevel loglevel;
+
+    Options ()
+        : help (false),
+          port (19350),
+          num_threads (0),
+          num_players (10),
+          num_storm_players (200),
+          num_slow_readers (5),
+          slow_read_rate (16384),
+          frame_size (2500),
+          frame_duration (40),
+          warmup_sec (2),
+          duration_sec (5),
+          min_delivery_percent (95),
+          max_latency_millisec (100),
+          max_memory_growth_mb (256),
+          loglevel (LogLevel::Warning)
+    {
+    }
+};
+
+mt_const Options options;
+
+enum {
+    TickInterval_Millisec = 100,
+    // Time for connections of the previous scenario to close.
+    SettleTime_Millisec   = 500,
+    RestartInterval_Millisec   = 1000,
+    ChunkSizeInterval_Millisec = 1000
+};
+
+// Chunk sizes which the publisher cycles through in chunk_size scenario.
+Uint32 const chunk_sizes [] = { 128, 4096, 1000, 65536 };
+
+// Results of a single scenario. Updated concurrently from all threads.
+class ScenarioStats : public Object
 {
-    logD_ (_func_);
+public:
+    // Microseconds between generation of a frame and its arrival to a player.
+    LatencyHistogram latency;
+
+    // Set for the measurement period which follows the warmup.
+    Uint64 measuring;
 
-    for (;;) {
-	{
-	    TcpServer::AcceptResult const res = tcp_server.accept (&tcp_conn);
-	    if (res == TcpServer::AcceptResult::Error) {
-		logE_ (_func, "accept() failed: ", exc->toString ());
-		return;
-	    }
+    // Video frames fired into the stream by the server.
+    Uint64 num_frames_published;
 
-	    if (res == TcpServer::AcceptResult::NotAccepted)
-		break;
+    // Regular players. Frames and bytes are counted while measuring.
+    Uint64 num_players_streaming;
+    Uint64 num_player_disconnects;
+    Uint64 num_frames;
+    Uint64 num_bytes;
+    // Frames of unexpected length or without a frame mark.
+    Uint64 num_bad_frames;
 
-	    assert (res == TcpServer::AcceptResult::Accepted);
-	}
+    Uint64 num_slow_bytes;
+    Uint64 num_slow_disconnects;
 
-	rtmp_conn.setWritevFd (tcp_conn.getFd ());
+    Uint64 num_queue_soft_limit;
+    Uint64 num_queue_hard_limit;
 
-	if (!poll_group.addPollable (&tcp_conn)) {
-	    logE_ (_func, "addPollable() failed: ", exc->toString ());
-	    return;
-	}
+    static void add (Uint64 * const mt_nonnull counter,
+                     Uint64   const value)
+        { __sync_fetch_and_add (counter, value); }
 
-	rtmp_conn.startServer ();
+    static Uint64 get (Uint64 const * const mt_nonnull counter)
+        { return *(Uint64 const volatile *) counter; }
+
+    bool isMeasuring () const
+        { return get (&measuring) != 0; }
+
+    ScenarioStats ()
+        : measuring (0),
+          num_frames_published (0),
+          num_players_streaming (0),
+          num_player_disconnects (0),
+          num_frames (0),
+          num_bytes (0),
+          num_bad_frames (0),
+          num_slow_bytes (0),
+          num_slow_disconnects (0),
+          num_queue_soft_limit (0),
+          num_queue_hard_limit (0)
+    {
     }
+};
+
+// Resident set size of the process. PagePool keeps no usage counters,
+// so memory is watched at the process level.
+Size getRssBytes ()
+{
+#ifndef LIBMARY_PLATFORM_WIN32
+    FILE * const file = fopen ("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    int const res = fscanf (file, "%lu %lu", &size, &resident);
+    fclose (file);
+    if (res != 2)
+        return 0;
+
+    return (Size) resident * (Size) sysconf (_SC_PAGESIZE);
+#else
+    return 0;
+#endif
 }
 
-TcpServer::Frontend const tcp_server_frontend = {
-    accepted
+
+// _________________________________ Server __________________________________
+
+class StreamEntry : public Object
+{
+public:
+    mt_const Ref<String> name;
+    mt_const Ref<VideoStream> stream;
+    mt_const Ref<ScenarioStats> stats;
+};
+
+class ServerSession : public Object
+{
+public:
+    StateMutex mutex;
+
+    mt_mutex (mutex) bool valid;
+
+    mt_const DataDepRef<RtmpConnection> rtmp_conn;
+    RtmpServer rtmp_server;
+
+    // Synchronized by rtmp_server.
+    Ref<StreamEntry> publish_entry;
+    Ref<StreamEntry> watch_entry;
+
+    mt_mutex (mutex) GenericInformer::SubscriptionKey watch_sbn;
+
+    // Frames are dropped while the connection is overloaded, and then
+    // until the next keyframe.
+    mt_mutex (mutex) bool overloaded;
+    mt_mutex (mutex) bool keyframe_sent;
+
+    ServerSession ()
+        : valid (true),
+          rtmp_conn   (this /* coderef_container */),
+          rtmp_server (this /* coderef_container */),
+          overloaded (false),
+          keyframe_sent (false)
+    {
+    }
+};
+
+class TestServer : public Object
+{
+private:
+    StateMutex mutex;
+
+    mt_const DataDepRef<PagePool> page_pool;
+
+    RtmpService rtmp_service;
+
+    mt_mutex (mutex) List< Ref<StreamEntry> > stream_list;
+
+    static void destroySession (ServerSession * mt_nonnull session);
+
+  mt_iface (VideoStream::EventHandler)
+    static VideoStream::EventHandler const watcher_handler;
+
+    static void watcherAudioMessage (VideoStream::AudioMessage * mt_nonnull msg,
+                                     void                      *_session);
+
+    static void watcherVideoMessage (VideoStream::VideoMessage * mt_nonnull msg,
+                                     void                      *_session);
+  mt_iface_end
+
+  mt_iface (RtmpServer::Frontend)
+    static RtmpServer::Frontend const rtmp_server_frontend;
+
+    static Result connect (ConstMemory const &app_name,
+                           void              *_session);
+
+    static bool startRtmpStreaming (ConstMemory    stream_name,
+                                    RecordingMode  rec_mode,
+                                    bool           momentrtmp_proto,
+                                    CbDesc<RtmpServer::StartRtmpStreamingCallback> const &cb,
+                                    Result        * mt_nonnull ret_res,
+                                    void          *_session);
+
+    static bool startRtmpWatching (ConstMemory    stream_name,
+                                   Int64          start_millisec,
+                                   CbDesc<RtmpServer::StartRtmpWatchingCallback> const &cb,
+                                   Result        * mt_nonnull ret_res,
+                                   void          *_session);
+
+    static RtmpServer::CommandResult serverCommandMessage (RtmpConnection       * mt_nonnull conn,
+                                                           Uint32                msg_stream_id,
+                                                           ConstMemory const    &method_name,
+                                                           VideoStream::Message * mt_nonnull msg,
+                                                           AmfDecoder           * mt_nonnull amf_decoder,
+                                                           void                 *_session);
+
+    static Result pause (void *_session);
+
+    static Result resume (void *_session);
+
+    static Result seek (Time  timestamp_millisec,
+                        void *_session);
+  mt_iface_end
+
+  mt_iface (RtmpConnection::Frontend)
+    static RtmpConnection::Frontend const rtmp_frontend;
+
+    static Result commandMessage (VideoStream::Message * mt_nonnull msg,
+                                  Uint32                msg_stream_id,
+                                  AmfEncoding           amf_encoding,
+                                  RtmpConnection::ConnectionInfo * mt_nonnull conn_info,
+                                  void                 *_session);
+
+    static Result audioMessage (VideoStream::AudioMessage * mt_nonnull msg,
+                                void                      *_session);
+
+    static Result videoMessage (VideoStream::VideoMessage * mt_nonnull msg,
+                                void                      *_session);
+
+    static void sendStateChanged (Sender::SendState  send_state,
+                                  void              *_session);
+
+    static void closed (Exception *exc_,
+                        void      *_session);
+  mt_iface_end
+
+  mt_iface (RtmpVideoService::Frontend)
+    static RtmpVideoService::Frontend const rtmp_video_service_frontend;
+
+    static Result clientConnected (RtmpConnection  * mt_nonnull rtmp_conn,
+                                   IpAddress const &client_addr,
+                                   void            *_self);
+  mt_iface_end
+
+public:
+    // Publishers and players may use only the streams which have been added.
+    void addStream (StreamEntry * mt_nonnull entry);
+
+    Ref<StreamEntry> getStream (ConstMemory stream_name);
+
+    mt_throws Result start (ServerApp * mt_nonnull server_app,
+                            PagePool  * mt_nonnull page_pool,
+                            IpAddress  addr);
+
+    TestServer ()
+        : page_pool    (this /* coderef_container */),
+          rtmp_service (this /* coderef_container */)
+    {
+    }
 };
 
+// Current server instance for session callbacks.
+mt_const TestServer *test_server = NULL;
+
 void
-doTimerIteration ()
+TestServer::destroySession (ServerSession * const mt_nonnull session)
 {
-    updateTime ();
-    timers.processTimers ();
+    session->mutex.lock ();
+    if (!session->valid) {
+        session->mutex.unlock ();
+        return;
+    }
+    session->valid = false;
+
+    GenericInformer::SubscriptionKey const watch_sbn = session->watch_sbn;
+    session->watch_sbn = GenericInformer::SubscriptionKey ();
+    session->mutex.unlock ();
+
+    // Streams outlive their publishers, so that a publisher may reconnect.
+    if (watch_sbn)
+        session->watch_entry->stream->getEventInformer()->unsubscribe (watch_sbn);
+
+    session->unref ();
 }
 
+VideoStream::EventHandler const TestServer::watcher_handler = {
+    watcherAudioMessage,
+    watcherVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
 void
-pollIterationBegin (void * const)
+TestServer::watcherAudioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                                 void                      * const _session)
 {
-    logD_ (_func_);
-    doTimerIteration ();
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    session->mutex.lock ();
+    if (session->overloaded && msg->frame_type == VideoStream::AudioFrameType::RawData) {
+        session->mutex.unlock ();
+        return;
+    }
+    session->mutex.unlock ();
+
+    session->rtmp_conn->sendAudioMessage (msg);
 }
 
 void
-pollIterationEnd (void * const)
+TestServer::watcherVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                                 void                      * const _session)
 {
-    logD_ (_func_);
-    RtmpConnection::pollIterationEnd ();
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    session->mutex.lock ();
+    if (msg->frame_type.isVideoData()) {
+        if (session->overloaded) {
+            session->keyframe_sent = false;
+            session->mutex.unlock ();
+            return;
+        }
+
+        if (!session->keyframe_sent) {
+            if (!msg->frame_type.isKeyFrame()) {
+                session->mutex.unlock ();
+                return;
+            }
+            session->keyframe_sent = true;
+        }
+    }
+    session->mutex.unlock ();
+
+    session->rtmp_conn->sendVideoMessage (msg);
 }
 
-PollGroup::Frontend const poll_frontend = {
-    pollIterationBegin,
-    pollIterationEnd
+RtmpServer::Frontend const TestServer::rtmp_server_frontend = {
+    connect,
+    startRtmpStreaming,
+    startRtmpWatching,
+    serverCommandMessage,
+    pause,
+    resume,
+    seek
 };
 
 Result
-doTest ()
+TestServer::connect (ConstMemory const & /* app_name */,
+                     void              * /* _session */)
+{
+    return Result::Success;
+}
+
+bool
+TestServer::startRtmpStreaming (ConstMemory    const stream_name,
+                                RecordingMode  const /* rec_mode */,
+                                bool           const /* momentrtmp_proto */,
+                                CbDesc<RtmpServer::StartRtmpStreamingCallback> const & /* cb */,
+                                Result       * const mt_nonnull ret_res,
+                                void         * const _session)
 {
-    updateTime ();
+    ServerSession * const session = static_cast <ServerSession*> (_session);
 
-    if (!tcp_server.open ()) {
-	logE_ (_func, "TcpServer::open() failed: ", exc->toString ());
-	return Result::Failure;
+    Ref<StreamEntry> const entry = test_server->getStream (stream_name);
+    if (!entry || session->publish_entry) {
+        logE_ (_func, "cannot publish stream \"", stream_name, "\"");
+        *ret_res = Result::Failure;
+        return true;
     }
 
-    tcp_server.setFrontend (&tcp_server_frontend, NULL /* frontend_cb_data */);
+    session->publish_entry = entry;
 
-    IpAddress addr;
-    if (!setIpAddress (ConstMemory(), 8080, &addr)) {
-	logE_ (_func, "setIpAddress() failed");
-	return Result::Failure;
+    *ret_res = Result::Success;
+    return true;
+}
+
+bool
+TestServer::startRtmpWatching (ConstMemory    const stream_name,
+                               Int64          const /* start_millisec */,
+                               CbDesc<RtmpServer::StartRtmpWatchingCallback> const & /* cb */,
+                               Result       * const mt_nonnull ret_res,
+                               void         * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    Ref<StreamEntry> const entry = test_server->getStream (stream_name);
+    if (!entry || session->watch_entry) {
+        logE_ (_func, "cannot play stream \"", stream_name, "\"");
+        *ret_res = Result::Failure;
+        return true;
+    }
+
+    session->watch_entry = entry;
+
+    GenericInformer::SubscriptionKey const sbn =
+            entry->stream->getEventInformer()->subscribe (
+                    CbDesc<VideoStream::EventHandler> (&watcher_handler, session, session));
+
+    session->mutex.lock ();
+    if (!session->valid) {
+        session->mutex.unlock ();
+        entry->stream->getEventInformer()->unsubscribe (sbn);
+        *ret_res = Result::Failure;
+        return true;
+    }
+    session->watch_sbn = sbn;
+    session->mutex.unlock ();
+
+    *ret_res = Result::Success;
+    return true;
+}
+
+RtmpServer::CommandResult
+TestServer::serverCommandMessage (RtmpConnection       * const mt_nonnull /* conn */,
+                                  Uint32                 const /* msg_stream_id */,
+                                  ConstMemory const     &method_name,
+                                  VideoStream::Message * const mt_nonnull /* msg */,
+                                  AmfDecoder           * const mt_nonnull /* amf_decoder */,
+                                  void                 * const /* _session */)
+{
+    logD_ (_func, "unknown method: ", method_name);
+    return RtmpServer::CommandResult::UnknownCommand;
+}
+
+Result
+TestServer::pause (void * const /* _session */)
+{
+    return Result::Success;
+}
+
+Result
+TestServer::resume (void * const /* _session */)
+{
+    return Result::Success;
+}
+
+Result
+TestServer::seek (Time   const /* timestamp_millisec */,
+                  void * const /* _session */)
+{
+    return Result::Success;
+}
+
+RtmpConnection::Frontend const TestServer::rtmp_frontend = {
+    NULL /* handshakeComplete */,
+    commandMessage,
+    audioMessage,
+    videoMessage,
+    sendStateChanged,
+    closed
+};
+
+Result
+TestServer::commandMessage (VideoStream::Message * const mt_nonnull msg,
+                            Uint32                 const msg_stream_id,
+                            AmfEncoding            const amf_encoding,
+                            RtmpConnection::ConnectionInfo * const mt_nonnull conn_info,
+                            void                 * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+    return session->rtmp_server.commandMessage (msg, msg_stream_id, amf_encoding, conn_info);
+}
+
+Result
+TestServer::audioMessage (VideoStream::AudioMessage * const mt_nonnull msg,
+                          void                      * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    // 'publish_entry' is set in startRtmpStreaming(), which is synchronized
+    // with audioMessage().
+    if (session->publish_entry)
+        session->publish_entry->stream->fireAudioMessage (msg);
+
+    return Result::Success;
+}
+
+Result
+TestServer::videoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                          void                      * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    StreamEntry * const entry = session->publish_entry;
+    if (entry) {
+        if (msg->frame_type.isVideoData() && entry->stats->isMeasuring())
+            ScenarioStats::add (&entry->stats->num_frames_published, 1);
+
+        entry->stream->fireVideoMessage (msg);
+    }
+
+    return Result::Success;
+}
+
+void
+TestServer::sendStateChanged (Sender::SendState   const send_state,
+                              void              * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    // 'watch_entry' is never reset once set.
+    ScenarioStats * const stats = (session->watch_entry ? session->watch_entry->stats.ptr() : NULL);
+
+    switch (send_state) {
+        case Sender::ConnectionReady:
+            session->mutex.lock ();
+            session->overloaded = false;
+            session->mutex.unlock ();
+            break;
+        case Sender::ConnectionOverloaded:
+            break;
+        case Sender::QueueSoftLimit:
+            session->mutex.lock ();
+            session->overloaded = true;
+            session->mutex.unlock ();
+
+            if (stats)
+                ScenarioStats::add (&stats->num_queue_soft_limit, 1);
+            break;
+        case Sender::QueueHardLimit:
+            if (stats)
+                ScenarioStats::add (&stats->num_queue_hard_limit, 1);
+
+            session->rtmp_conn->close ();
+            break;
+        default:
+            unreachable ();
     }
+}
+
+void
+TestServer::closed (Exception * const exc_,
+                    void      * const _session)
+{
+    ServerSession * const session = static_cast <ServerSession*> (_session);
+
+    if (exc_)
+        logD_ (_func, exc_->toString());
+
+    destroySession (session);
+}
+
+RtmpVideoService::Frontend const TestServer::rtmp_video_service_frontend = {
+    clientConnected
+};
+
+Result
+TestServer::clientConnected (RtmpConnection  * const mt_nonnull rtmp_conn,
+                             IpAddress const & /* client_addr */,
+                             void            * const /* _self */)
+{
+    Ref<ServerSession> const session = grab (new (std::nothrow) ServerSession);
+    session->rtmp_conn = rtmp_conn;
+
+    session->rtmp_server.setFrontend (CbDesc<RtmpServer::Frontend> (
+            &rtmp_server_frontend, session, session));
+    session->rtmp_server.setRtmpConnection (rtmp_conn);
+
+    rtmp_conn->setFrontend (CbDesc<RtmpConnection::Frontend> (
+            &rtmp_frontend, session, session));
+
+    rtmp_conn->startServer ();
 
-    if (!tcp_server.bind (addr))
-	goto exc_;
+    // Released in destroySession().
+    session->ref ();
+    return Result::Success;
+}
 
-    if (!tcp_server.listen ())
-	goto exc_;
+void
+TestServer::addStream (StreamEntry * const mt_nonnull entry)
+{
+    mutex.lock ();
+    stream_list.append (entry);
+    mutex.unlock ();
+}
 
-    if (!poll_group.open ())
-	goto exc_;
+Ref<StreamEntry>
+TestServer::getStream (ConstMemory const stream_name)
+{
+    mutex.lock ();
+    List< Ref<StreamEntry> >::iter iter (stream_list);
+    while (!stream_list.iter_done (iter)) {
+        Ref<StreamEntry> &entry = stream_list.iter_next (iter)->data;
+        if (equal (entry->name->mem(), stream_name)) {
+            Ref<StreamEntry> const res = entry;
+            mutex.unlock ();
+            return res;
+        }
+    }
+    mutex.unlock ();
 
-    if (!poll_group.addPollable (&tcp_server))
-	goto exc_;
+    return NULL;
+}
 
-    poll_group.setFrontend (&poll_frontend, NULL /* cb_data */);
+mt_throws Result
+TestServer::start (ServerApp * const mt_nonnull server_app,
+                   PagePool  * const mt_nonnull page_pool,
+                   IpAddress   const addr)
+{
+    this->page_pool = page_pool;
 
-    for (;;) {
-	if (!poll_group.poll (timers.getSleepTime_microseconds ()))
-	    goto exc_;
+    rtmp_service.setFrontend (CbDesc<RtmpVideoService::Frontend> (
+            &rtmp_video_service_frontend, this, this));
 
-	doTimerIteration ();
+    if (!rtmp_service.init (server_app->getServerContext(),
+                            page_pool,
+                            0      /* send_delay_millisec */,
+                            300000 /* rtmp_ping_timeout_millisec */,
+                            true   /* prechunking_enabled */,
+                            0      /* accept_watchdog_timeout_sec */))
+    {
+        return Result::Failure;
     }
 
+    if (!rtmp_service.bind (addr))
+        return Result::Failure;
+
+    if (!rtmp_service.start ())
+        return Result::Failure;
+
     return Result::Success;
+}
+
+
+// _________________________________ Clients _________________________________
+
+class TestPublisher : public Object
+{
+public:
+    mt_const ServerThreadContext *thread_ctx;
+    mt_const DataDepRef<PagePool> page_pool;
+
+    // Generated frames go to the server from this stream.
+    mt_const Ref<VideoStream> stream;
+
+    RtmpClient rtmp_client;
+
+    // Accessed from the main thread only.
+    Ref<TestStreamGenerator> generator;
+
+    mt_const Time start_time_millisec;
+
+    // Replaces the generator. Timestamps continue from where the previous
+    // generator has stopped.
+    void startGenerator (Uint32 prechunk_size,
+                         Uint64 start_timestamp_millisec);
+
+    void stop ();
+
+    TestPublisher ()
+        : thread_ctx (NULL),
+          page_pool   (this /* coderef_container */),
+          rtmp_client (this /* coderef_container */),
+          start_time_millisec (0)
+    {
+    }
+};
 
-exc_:
-    logE_ (_func, exc->toString());
-    return Result::Failure;
+void
+TestPublisher::startGenerator (Uint32 const prechunk_size,
+                               Uint64 const start_timestamp_millisec)
+{
+    if (generator)
+        generator->stop ();
+
+    TestStreamGenerator::Options gen_opts;
+    gen_opts.frame_duration    = options.frame_duration;
+    gen_opts.frame_size        = options.frame_size;
+    gen_opts.prechunk_size     = prechunk_size;
+    gen_opts.start_timestamp   = start_timestamp_millisec;
+    gen_opts.embed_timestamps  = true;
+
+    generator = grab (new (std::nothrow) TestStreamGenerator);
+    generator->init (page_pool, thread_ctx->getTimers(), stream, &gen_opts);
+    generator->start ();
 }
 
+void
+TestPublisher::stop ()
+{
+    if (generator) {
+        generator->stop ();
+        generator = NULL;
+    }
 }
 
-class Foo
+class TestPlayer : public Object
 {
 public:
-    static void bar ()
+    mt_const Ref<ScenarioStats> stats;
+
+    // Received frames are fired into this stream.
+    mt_const Ref<VideoStream> stream;
+
+    RtmpClient rtmp_client;
+
+    mt_sync_domain (rtmp_client) bool got_frame;
+
+    TestPlayer ()
+        : rtmp_client (this /* coderef_container */),
+          got_frame (false)
     {
-	errs->print (__PRETTY_FUNCTION__).print ("\n");
-	errs->print (__func__).print ("\n");
-	errs->print (__FUNCTION__).print ("\n");
     }
 };
 
-int main (void)
+void playerVideoMessage (VideoStream::VideoMessage * const mt_nonnull msg,
+                         void                      * const _player)
 {
-    libMaryInit ();
+    TestPlayer * const player = static_cast <TestPlayer*> (_player);
+    ScenarioStats * const stats = player->stats;
 
-    Foo::bar ();
+    if (!msg->frame_type.isVideoData())
+        return;
 
-    if (!doTest ())
-	return EXIT_FAILURE;
+    if (!player->got_frame) {
+        player->got_frame = true;
+        ScenarioStats::add (&stats->num_players_streaming, 1);
+    }
 
-    return 0;
+    if (!stats->isMeasuring())
+        return;
+
+    ScenarioStats::add (&stats->num_frames, 1);
+    ScenarioStats::add (&stats->num_bytes, msg->msg_len);
+
+    TestStreamGenerator::FrameMark mark;
+    if (msg->msg_len != options.frame_size
+        || !TestStreamGenerator::parseFrameMark (msg, &mark))
+    {
+        ScenarioStats::add (&stats->num_bad_frames, 1);
+        return;
+    }
+
+    Time const now = TestStreamGenerator::getWallClockMicroseconds ();
+    stats->latency.record (now > mark.wallclock_microsec ? now - mark.wallclock_microsec : 0);
+}
+
+VideoStream::EventHandler const player_stream_handler = {
+    NULL /* audioMessage */,
+    playerVideoMessage,
+    NULL /* rtmpCommandMessage */,
+    NULL /* closed */,
+    NULL /* numWatchersChanged */
+};
+
+void playerClosed (void * const _player)
+{
+    TestPlayer * const player = static_cast <TestPlayer*> (_player);
+
+    logD_ (_func_);
+
+    if (player->stats->isMeasuring())
+        ScenarioStats::add (&player->stats->num_player_disconnects, 1);
+}
+
+RtmpClient::Frontend const player_frontend = {
+    playerClosed
+};
+
+void publisherClosed (void * const /* _publisher */)
+{
+    logD_ (_func_);
 }
 
+RtmpClient::Frontend const publisher_frontend = {
+    publisherClosed
+};
+
+#ifdef TEST_SERVER__SLOW_READERS
+// A player which reads from its socket at a limited rate, like a viewer on
+// a slow link. It speaks just enough RTMP to start playing: the server does
+// not check handshake data, and every command fits into a single chunk.
+class SlowReader : public Object
+{
+private:
+    mt_const Ref<String> stream_name;
+    mt_const Ref<ScenarioStats> stats;
+
+    mt_const Ref<Thread> thread;
+
+    Uint64 stop_flag;
+
+    static void appendCommand (Byte        * mt_nonnull buf,
+                               Size        * mt_nonnull pos,
+                               Uint32       msg_stream_id,
+                               AmfEncoder  * mt_nonnull encoder);
+
+    Result writeAll (int fd, ConstMemory mem);
+
+    void doRun ();
+
+    static void threadFunc (void *_self);
+
+public:
+    mt_throws Result start (ConstMemory    stream_name,
+                            ScenarioStats * mt_nonnull stats);
+
+    void stop ();
+
+    SlowReader ()
+        : stop_flag (0)
+    {
+    }
+};
+
+void
+SlowReader::appendCommand (Byte       * const mt_nonnull buf,
+                           Size       * const mt_nonnull pos,
+                           Uint32       const msg_stream_id,
+                           AmfEncoder * const mt_nonnull encoder)
+{
+    Byte msg_buf [RtmpConnection::DefaultChunkSize];
+    Size msg_len;
+    if (!encoder->encode (Memory::forObject (msg_buf), AmfEncoding::AMF0, &msg_len))
+        unreachable ();
+
+    Byte * const hdr = buf + *pos;
+    // Type 0 chunk header on chunk stream 3.
+    hdr [0] = 0x03;
+    // Timestamp
+    hdr [1] = 0;
+    hdr [2] = 0;
+    hdr [3] = 0;
+    // Message length
+    hdr [4] = (Byte) (msg_len >> 16);
+    hdr [5] = (Byte) (msg_len >>  8);
+    hdr [6] = (Byte) (msg_len >>  0);
+    hdr [7] = RtmpConnection::RtmpMessageType::Command_AMF0;
+    // Message stream id, little endian
+    hdr [8]  = (Byte) (msg_stream_id >>  0);
+    hdr [9]  = (Byte) (msg_stream_id >>  8);
+    hdr [10] = (Byte) (msg_stream_id >> 16);
+    hdr [11] = (Byte) (msg_stream_id >> 24);
+
+    memcpy (hdr + 12, msg_buf, msg_len);
+    *pos += 12 + msg_len;
+}
+
+Result
+SlowReader::writeAll (int const fd,
+                      ConstMemory const mem)
+{
+    Size written = 0;
+    while (written < mem.len()) {
+        ssize_t const res = ::write (fd, mem.mem() + written, mem.len() - written);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+
+            logE_ (_func, "write() failed: ", errnoString (errno));
+            return Result::Failure;
+        }
+
+        written += (Size) res;
+    }
+
+    return Result::Success;
+}
+
+void
+SlowReader::doRun ()
+{
+    int const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        logE_ (_func, "socket() failed: ", errnoString (errno));
+        return;
+    }
+
+    {
+        struct sockaddr_in addr;
+        memset (&addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons ((unsigned short) options.port);
+        addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+        if (::connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == -1) {
+            logE_ (_func, "connect() failed: ", errnoString (errno));
+            ::close (fd);
+            return;
+        }
+    }
+
+    {
+      // C0, C1, C2
+        Byte handshake [1 + 1536 * 2];
+        memset (handshake, 0, sizeof (handshake));
+        handshake [0] = 3;
+
+        if (!writeAll (fd, ConstMemory::forObject (handshake))) {
+            ::close (fd);
+            return;
+        }
+    }
+
+    {
+        Byte cmd_buf [4096];
+        Size cmd_len = 0;
+
+        {
+            AmfAtom atoms [8];
+            AmfEncoder encoder (atoms);
+            encoder.addString ("connect");
+            encoder.addNumber (1.0);
+            encoder.beginObject ();
+            encoder.addFieldName ("app");
+            encoder.addString ("test");
+            encoder.endObject ();
+            appendCommand (cmd_buf, &cmd_len, RtmpConnection::CommandMessageStreamId, &encoder);
+        }
+
+        {
+            AmfAtom atoms [3];
+            AmfEncoder encoder (atoms);
+            encoder.addString ("createStream");
+            encoder.addNumber (2.0);
+            encoder.addNullObject ();
+            appendCommand (cmd_buf, &cmd_len, RtmpConnection::CommandMessageStreamId, &encoder);
+        }
+
+        {
+            AmfAtom atoms [4];
+            AmfEncoder encoder (atoms);
+            encoder.addString ("play");
+            encoder.addNumber (3.0);
+            encoder.addNullObject ();
+            encoder.addString (stream_name->mem());
+            appendCommand (cmd_buf, &cmd_len, RtmpConnection::DefaultMessageStreamId, &encoder);
+        }
+
+        if (!writeAll (fd, ConstMemory (cmd_buf, cmd_len))) {
+            ::close (fd);
+            return;
+        }
+    }
+
+    Time const start_microsec = getTimeMicroseconds();
+    Uint64 total_read = 0;
+    Byte buf [4096];
+    while (!ScenarioStats::get (&stop_flag)) {
+        Uint64 const allowed = (getTimeMicroseconds() - start_microsec) * options.slow_read_rate / 1000000;
+        if (allowed <= total_read) {
+            usleep (10000);
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (::poll (&pfd, 1, 100 /* timeout, millisec */) <= 0)
+            continue;
+
+        Size toread = sizeof (buf);
+        if (allowed - total_read < toread)
+            toread = (Size) (allowed - total_read);
+
+        ssize_t const res = ::read (fd, buf, toread);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR)
+                continue;
+
+            logD_ (_func, "disconnected");
+            ScenarioStats::add (&stats->num_slow_disconnects, 1);
+            break;
+        }
+
+        total_read += (Uint64) res;
+        ScenarioStats::add (&stats->num_slow_bytes, (Uint64) res);
+    }
+
+    ::close (fd);
+}
+
+void
+SlowReader::threadFunc (void * const _self)
+{
+    SlowReader * const self = static_cast <SlowReader*> (_self);
+    self->doRun ();
+}
+
+mt_throws Result
+SlowReader::start (ConstMemory     const stream_name,
+                   ScenarioStats * const mt_nonnull stats)
+{
+    this->stream_name = grab (new (std::nothrow) String (stream_name));
+    this->stats = stats;
+
+    thread = grab (new (std::nothrow) Thread (
+            CbDesc<Thread::ThreadFunc> (threadFunc,
+                                        this /* cb_data */,
+                                        NULL /* coderef_container */,
+                                        this /* ref_data */)));
+    if (!thread->spawn (true /* joinable */))
+        return Result::Failure;
+
+    return Result::Success;
+}
+
+void
+SlowReader::stop ()
+{
+    __sync_fetch_and_add (&stop_flag, 1);
+
+    if (thread) {
+        if (!thread->join ())
+            logE_ (_func, "join() failed: ", exc->toString());
+        thread = NULL;
+    }
+}
+#endif // TEST_SERVER__SLOW_READERS
+
+
+// ________________________________ Scenarios ________________________________
+
+enum ScenarioId {
+    Scenario_ConnectStorm,
+    Scenario_SlowReaders,
+    Scenario_PublisherRestart,
+    Scenario_ChunkSize,
+    Scenario_Num
+};
+
+char const * const scenario_names [Scenario_Num] = {
+    "connect_storm",
+    "slow_readers",
+    "publisher_restart",
+    "chunk_size"
+};
+
+// Runs scenarios one after another. Everything happens in the main thread
+// on 'tick_timer', except for callbacks of clients with num_threads > 0.
+class ScenarioRunner : public Object
+{
+private:
+    mt_const DataDepRef<PagePool>  page_pool;
+    mt_const DataDepRef<ServerApp> server_app;
+    mt_const Timers *timers;
+    mt_const IpAddress server_addr;
+
+    Timers::TimerKey tick_timer;
+
+    // Scenario_Num if all scenarios are done.
+    Count cur_scenario;
+    bool  cur_running;
+    Time  cur_start_millisec;
+    Time  settle_start_millisec;
+    Ref<ScenarioStats> cur_stats;
+    Ref<StreamEntry>   cur_entry;
+    Count cur_num_players;
+
+    Ref<TestPublisher> publisher;
+    List< Ref<TestPlayer> > player_list;
+#ifdef TEST_SERVER__SLOW_READERS
+    List< Ref<SlowReader> > slow_reader_list;
+#endif
+
+    // Time of the last publisher restart or chunk size change.
+    Time  last_change_millisec;
+    Count chunk_size_idx;
+    Count num_restarts;
+
+    Size rss_baseline;
+    Size rss_max;
+
+    Count num_failed_checks;
+
+    ServerThreadContext* selectThreadContext ();
+
+    void startPublisher (Uint32 prechunk_size);
+
+    void startPlayer ();
+
+    bool shouldRun (Count scenario);
+
+    void beginScenario ();
+
+    void scenarioTick (Time elapsed_millisec);
+
+    void endScenario ();
+
+    void checkMin (ConstMemory name,
+                   Uint64      value,
+                   Uint64      limit,
+                   ConstMemory unit);
+
+    void checkMax (ConstMemory name,
+                   Uint64      value,
+                   Uint64      limit,
+                   ConstMemory unit);
+
+    void printResults ();
+
+    static void startTimerTick (void *_self);
+
+    static void tickTimerTick (void *_self);
+
+public:
+    bool failed () const
+        { return num_failed_checks > 0; }
+
+    void start ();
+
+    void init (PagePool        * mt_nonnull page_pool,
+               ServerApp       * mt_nonnull server_app,
+               IpAddress const &server_addr);
+
+    ScenarioRunner ();
+};
+
+ServerThreadContext*
+ScenarioRunner::selectThreadContext ()
+{
+    if (options.num_threads == 0)
+        return server_app->getServerContext()->getMainThreadContext();
+
+    return server_app->getServerContext()->selectThreadContext();
+}
+
+void
+ScenarioRunner::startPublisher (Uint32 const prechunk_size)
+{
+    Ref<TestPublisher> const new_publisher = grab (new (std::nothrow) TestPublisher);
+    new_publisher->thread_ctx = selectThreadContext ();
+    new_publisher->page_pool = page_pool;
+    new_publisher->stream = grab (new (std::nothrow) VideoStream);
+    new_publisher->start_time_millisec = getTimeMilliseconds();
+
+    new_publisher->rtmp_client.init (new_publisher->thread_ctx,
+                                     page_pool,
+                                     new_publisher->stream,
+                                     server_addr,
+                                     "test"             /* app_name */,
+                                     cur_entry->name->mem(),
+                                     true               /* publish */,
+                                     false              /* momentrtmp_proto */,
+                                     300000             /* ping_timeout_millisec */,
+                                     0                  /* send_delay_millisec */,
+                                     CbDesc<RtmpClient::Frontend> (&publisher_frontend,
+                                                                   new_publisher,
+                                                                   new_publisher));
+    if (!new_publisher->rtmp_client.start ()) {
+        logE_ (_func, "publisher start failed");
+        return;
+    }
+
+    // Timestamps go on across publisher restarts, as with a real encoder.
+    new_publisher->startGenerator (prechunk_size, new_publisher->start_time_millisec - cur_start_millisec);
+
+    if (publisher)
+        publisher->stop ();
+
+    publisher = new_publisher;
+}
+
+void
+ScenarioRunner::startPlayer ()
+{
+    Ref<TestPlayer> const player = grab (new (std::nothrow) TestPlayer);
+    player->stats = cur_stats;
+    player->stream = grab (new (std::nothrow) VideoStream);
+    player->stream->getEventInformer()->subscribe (
+            CbDesc<VideoStream::EventHandler> (&player_stream_handler, player, player));
+
+    player->rtmp_client.init (selectThreadContext (),
+                              page_pool,
+                              player->stream,
+                              server_addr,
+                              "test"             /* app_name */,
+                              cur_entry->name->mem(),
+                              false              /* publish */,
+                              false              /* momentrtmp_proto */,
+                              300000             /* ping_timeout_millisec */,
+                              0                  /* send_delay_millisec */,
+                              CbDesc<RtmpClient::Frontend> (&player_frontend, player, player));
+    if (!player->rtmp_client.start ()) {
+        logE_ (_func, "player start failed");
+        return;
+    }
+
+    player_list.append (player);
+}
+
+bool
+ScenarioRunner::shouldRun (Count const scenario)
+{
+    if (!options.scenario || equal (options.scenario->mem(), "all"))
+        return true;
+
+    return equal (options.scenario->mem(), scenario_names [scenario]);
+}
+
+void
+ScenarioRunner::beginScenario ()
+{
+    ConstMemory const name = scenario_names [cur_scenario];
+    outs->print ("scenario ", name, "\n");
+    outs->flush ();
+
+    cur_running = true;
+    cur_start_millisec = getTimeMilliseconds();
+    last_change_millisec = cur_start_millisec;
+    chunk_size_idx = 0;
+    num_restarts = 0;
+
+    cur_stats = grab (new (std::nothrow) ScenarioStats);
+
+    cur_entry = grab (new (std::nothrow) StreamEntry);
+    cur_entry->name = grab (new (std::nothrow) String (name));
+    cur_entry->stream = grab (new (std::nothrow) VideoStream);
+    cur_entry->stats = cur_stats;
+    test_server->addStream (cur_entry);
+
+    rss_baseline = getRssBytes ();
+    rss_max = rss_baseline;
+
+    cur_num_players = (cur_scenario == Scenario_ConnectStorm ? options.num_storm_players : options.num_players);
+
+    startPublisher (cur_scenario == Scenario_ChunkSize ? chunk_sizes [0] : RtmpConnection::PrechunkSize);
+
+    // Connect storm: all players in the same event loop iteration.
+    for (Count i = 0; i < cur_num_players; ++i)
+        startPlayer ();
+
+    if (cur_scenario == Scenario_SlowReaders) {
+#ifdef TEST_SERVER__SLOW_READERS
+        for (Count i = 0; i < options.num_slow_readers; ++i) {
+            Ref<SlowReader> const slow_reader = grab (new (std::nothrow) SlowReader);
+            if (!slow_reader->start (name, cur_stats)) {
+                logE_ (_func, "could not start slow reader: ", exc->toString());
+                continue;
+            }
+            slow_reader_list.append (slow_reader);
+        }
+#else
+        logW_ (_func, "slow readers are not supported on this platform");
+#endif
+    }
+}
+
+void
+ScenarioRunner::scenarioTick (Time const elapsed_millisec)
+{
+    Time const now = getTimeMilliseconds();
+
+    if (elapsed_millisec >= options.warmup_sec * 1000 && !cur_stats->isMeasuring()) {
+        rss_baseline = getRssBytes ();
+        rss_max = rss_baseline;
+        ScenarioStats::add (&cur_stats->measuring, 1);
+    }
+
+    {
+        Size const rss = getRssBytes ();
+        if (rss > rss_max)
+            rss_max = rss;
+    }
+
+    switch (cur_scenario) {
+        case Scenario_PublisherRestart: {
+            if (now - last_change_millisec >= RestartInterval_Millisec) {
+                last_change_millisec = now;
+                ++num_restarts;
+                startPublisher (RtmpConnection::PrechunkSize);
+            }
+        } break;
+        case Scenario_ChunkSize: {
+            if (now - last_change_millisec >= ChunkSizeInterval_Millisec) {
+                last_change_millisec = now;
+                chunk_size_idx = (chunk_size_idx + 1) % (sizeof (chunk_sizes) / sizeof (chunk_sizes [0]));
+                // Same connection, so that SetChunkSize goes mid-stream.
+                publisher->startGenerator (chunk_sizes [chunk_size_idx], now - cur_start_millisec);
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+void
+ScenarioRunner::checkMin (ConstMemory const name,
+                          Uint64      const value,
+                          Uint64      const limit,
+                          ConstMemory const unit)
+{
+    bool const ok = (value >= limit);
+    if (!ok)
+        ++num_failed_checks;
+
+    outs->print ("  ", (ok ? "[ OK ] " : "[FAIL] "), name, ": ", value, unit, " (min ", limit, unit, ")\n");
+}
+
+void
+ScenarioRunner::checkMax (ConstMemory const name,
+                          Uint64      const value,
+                          Uint64      const limit,
+                          ConstMemory const unit)
+{
+    bool const ok = (value <= limit);
+    if (!ok)
+        ++num_failed_checks;
+
+    outs->print ("  ", (ok ? "[ OK ] " : "[FAIL] "), name, ": ", value, unit, " (max ", limit, unit, ")\n");
+}
+
+void
+ScenarioRunner::printResults ()
+{
+    ScenarioStats * const stats = cur_stats;
+
+    Uint64 const published = ScenarioStats::get (&stats->num_frames_published);
+    Uint64 const frames    = ScenarioStats::get (&stats->num_frames);
+    Uint64 const bytes     = ScenarioStats::get (&stats->num_bytes);
+    Uint64 const expected  = published * cur_num_players;
+    Uint64 const duration  = (options.duration_sec > 0 ? options.duration_sec : 1);
+
+    outs->print ("  throughput: ", frames / duration, " frames/sec, ",
+                 bytes * 8 / duration / 1000, " kbit/sec "
+                 "(", published, " frames published, ", frames, " of ", expected, " delivered)\n");
+    outs->print ("  latency usec: "
+                 "p50 ", stats->latency.getPercentile (50.0), ", "
+                 "p99 ", stats->latency.getPercentile (99.0), ", "
+                 "max ", stats->latency.getMax(), "\n");
+    outs->print ("  send queue limits: soft ", ScenarioStats::get (&stats->num_queue_soft_limit), ", "
+                 "hard ", ScenarioStats::get (&stats->num_queue_hard_limit), "\n");
+    if (cur_scenario == Scenario_SlowReaders) {
+        outs->print ("  slow readers: ", ScenarioStats::get (&stats->num_slow_bytes), " bytes read, ",
+                     ScenarioStats::get (&stats->num_slow_disconnects), " disconnected\n");
+    }
+    if (cur_scenario == Scenario_PublisherRestart)
+        outs->print ("  publisher restarts: ", num_restarts, "\n");
+
+    checkMin ("players streaming", ScenarioStats::get (&stats->num_players_streaming), cur_num_players, "");
+    checkMax ("player disconnects", ScenarioStats::get (&stats->num_player_disconnects), 0, "");
+    checkMin ("frames published", published, 1, "");
+    checkMin ("delivered", (expected > 0 ? frames * 100 / expected : 0), options.min_delivery_percent, "%");
+    checkMax ("bad frames", ScenarioStats::get (&stats->num_bad_frames), 0, "");
+    checkMax ("latency p99", stats->latency.getPercentile (99.0) / 1000, options.max_latency_millisec, " ms");
+    if (rss_baseline > 0) {
+        checkMax ("memory growth", (rss_max > rss_baseline ? rss_max - rss_baseline : 0) / (1024 * 1024),
+                  options.max_memory_growth_mb, " MB");
+    }
+
+    outs->flush ();
+}
+
+void
+ScenarioRunner::endScenario ()
+{
+    // Stop counting before disconnecting anyone.
+    ScenarioStats::add (&cur_stats->measuring, (Uint64) -1);
+
+    printResults ();
+
+    if (publisher) {
+        publisher->stop ();
+        publisher = NULL;
+    }
+
+    player_list.clear ();
+
+#ifdef TEST_SERVER__SLOW_READERS
+    {
+        List< Ref<SlowReader> >::iter iter (slow_reader_list);
+        while (!slow_reader_list.iter_done (iter)) {
+            Ref<SlowReader> &slow_reader = slow_reader_list.iter_next (iter)->data;
+            slow_reader->stop ();
+        }
+        slow_reader_list.clear ();
+    }
+#endif
+
+    cur_running = false;
+    settle_start_millisec = getTimeMilliseconds();
+}
+
+void
+ScenarioRunner::tickTimerTick (void * const _self)
+{
+    ScenarioRunner * const self = static_cast <ScenarioRunner*> (_self);
+
+    Time const now = getTimeMilliseconds();
+
+    if (self->cur_running) {
+        Time const elapsed = now - self->cur_start_millisec;
+        if (elapsed < (options.warmup_sec + options.duration_sec) * 1000) {
+            self->scenarioTick (elapsed);
+            return;
+        }
+
+        self->endScenario ();
+        ++self->cur_scenario;
+        return;
+    }
+
+    if (now - self->settle_start_millisec < SettleTime_Millisec)
+        return;
+
+    while (self->cur_scenario < Scenario_Num && !self->shouldRun (self->cur_scenario))
+        ++self->cur_scenario;
+
+    if (self->cur_scenario < Scenario_Num) {
+        self->beginScenario ();
+        return;
+    }
+
+    self->timers->deleteTimer (self->tick_timer);
+    self->tick_timer = NULL;
+
+    if (self->num_failed_checks > 0)
+        outs->print ("FAILED: ", self->num_failed_checks, " checks\n");
+    else
+        outs->print ("PASSED\n");
+    outs->flush ();
+
+    self->server_app->stop ();
+}
+
+void
+ScenarioRunner::startTimerTick (void * const _self)
+{
+    ScenarioRunner * const self = static_cast <ScenarioRunner*> (_self);
+
+    self->tick_timer = self->timers->addTimer_microseconds (
+            CbDesc<Timers::TimerCallback> (tickTimerTick, self, self),
+            TickInterval_Millisec * 1000,
+            true /* periodical */);
+}
+
+void
+ScenarioRunner::start ()
+{
+    if (options.num_threads == 0) {
+        startTimerTick (this);
+        return;
+    }
+
+    // TODO Wait for ServerApp threads to spawn, reliably (same as in rtmptool).
+    timers->addTimer (startTimerTick,
+                      this  /* cb_data */,
+                      this  /* coderef_container */,
+                      3     /* time_seconds */,
+                      false /* periodical */);
+}
+
+void
+ScenarioRunner::init (PagePool        * const mt_nonnull page_pool,
+                      ServerApp       * const mt_nonnull server_app,
+                      IpAddress const &server_addr)
+{
+    this->page_pool = page_pool;
+    this->server_app = server_app;
+    this->timers = server_app->getServerContext()->getMainThreadContext()->getTimers();
+    this->server_addr = server_addr;
+}
+
+ScenarioRunner::ScenarioRunner ()
+    : page_pool  (this /* coderef_container */),
+      server_app (this /* coderef_container */),
+      timers (NULL),
+      tick_timer (NULL),
+      cur_scenario (0),
+      cur_running (false),
+      cur_start_millisec (0),
+      settle_start_millisec (0),
+      cur_num_players (0),
+      last_change_millisec (0),
+      chunk_size_idx (0),
+      num_restarts (0),
+      rss_baseline (0),
+      rss_max (0),
+      num_failed_checks (0)
+{
+}
+
+class TestServerInstance : public Object
+{
+private:
+    PagePool page_pool;
+    ServerApp server_app;
+
+public:
+    // Returns Failure if the test could not be run or if any check failed.
+    Result run ();
+
+    TestServerInstance ()
+        : page_pool  (this /* coderef_container */, 4096 /* page_size */, 4096 /* min_pages */),
+          server_app (this /* coderef_container */)
+    {
+    }
+};
+
+Result
+TestServerInstance::run ()
+{
+    if (!server_app.init ()) {
+        logE_ (_func, "server_app.init() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    server_app.setNumThreads (options.num_threads);
+
+    IpAddress addr;
+    if (!setIpAddress (makeString ("127.0.0.1:", options.port)->mem(), &addr)) {
+        logE_ (_func, "setIpAddress() failed");
+        return Result::Failure;
+    }
+
+    Ref<TestServer> const server = grab (new (std::nothrow) TestServer);
+    test_server = server;
+    if (!server->start (&server_app, &page_pool, addr)) {
+        logE_ (_func, "could not start RTMP service on port ", options.port, ": ", exc->toString());
+        return Result::Failure;
+    }
+
+    Ref<ScenarioRunner> const runner = grab (new (std::nothrow) ScenarioRunner);
+    runner->init (&page_pool, &server_app, addr);
+    runner->start ();
+
+    if (!server_app.run ()) {
+        logE_ (_func, "server_app.run() failed: ", exc->toString());
+        return Result::Failure;
+    }
+
+    if (runner->failed ())
+        return Result::Failure;
+
+    return Result::Success;
+}
+
+void printUsage ()
+{
+    outs->print ("Usage: test__server [options]\n"
+                 "Options:\n"
+                 "  --port <number>              Port to run the RTMP service on, on 127.0.0.1 (default: 19350)\n"
+                 "  -t --threads <number>        Number of server threads (default: 0, use a single thread)\n"
+                 "  --scenario <name>            Run a single scenario: connect_storm, slow_readers,\n"
+                 "                               publisher_restart, chunk_size (default: all)\n"
+                 "  --players <number>           Number of players (default: 10)\n"
+                 "  --storm-players <number>     Number of players in connect_storm scenario (default: 200)\n"
+                 "  --slow-readers <number>      Number of slow readers in slow_readers scenario (default: 5)\n"
+                 "  --slow-rate <number>         Read rate of slow readers, bytes/sec (default: 16384)\n"
+                 "  -s --frame-size <number>     Video frame size in bytes (default: 2500)\n"
+                 "  --frame-duration <number>    Video frame duration in milliseconds (default: 40)\n"
+                 "  --warmup <number>            Seconds before measurement starts (default: 2)\n"
+                 "  -d --duration <number>       Measurement time for each scenario in seconds (default: 5)\n"
+                 "  --min-delivery <number>      Min percentage of published frames delivered to players (default: 95)\n"
+                 "  --max-latency <number>       Max 99th percentile of publish->play latency, milliseconds (default: 100)\n"
+                 "  --max-memory <number>        Max growth of resident memory over a scenario, MB (default: 256)\n"
+                 "  --loglevel <loglevel>        Loglevel, one of A/D/I/W/E/H/F/N (default: W)\n"
+                 "  -h --help                    Show this help message.\n");
+    outs->flush ();
+}
+
+bool cmdline_help (char const * /* short_name */,
+                   char const * /* long_name */,
+                   char const * /* value */,
+                   void       * /* opt_data */,
+                   void       * /* cb_data */)
+{
+    options.help = true;
+    return true;
+}
+
+bool cmdline_uint32 (char const * /* short_name */,
+                     char const * const long_name,
+                     char const * const value,
+                     void       * const opt_data,
+                     void       * /* cb_data */)
+{
+    if (!strToUint32_safe (value, static_cast <Uint32*> (opt_data))) {
+        logE_ (_func, "Invalid value \"", value, "\" "
+               "for --", long_name, " (number expected): ", exc->toString());
+        exit (EXIT_FAILURE);
+    }
+    return true;
+}
+
+bool cmdline_scenario (char const * /* short_name */,
+                       char const * /* long_name */,
+                       char const * const value,
+                       void       * /* opt_data */,
+                       void       * /* cb_data */)
+{
+    ConstMemory const value_mem = ConstMemory (value, value ? strlen (value) : 0);
+
+    bool found = equal (value_mem, "all");
+    for (unsigned i = 0; i < Scenario_Num && !found; ++i) {
+        if (equal (value_mem, scenario_names [i]))
+            found = true;
+    }
+
+    if (!found) {
+        logE_ (_func, "Unknown scenario \"", value_mem, "\"");
+        exit (EXIT_FAILURE);
+    }
+
+    options.scenario = grab (new (std::nothrow) String (value_mem));
+    return true;
+}
+
+bool cmdline_loglevel (char const * /* short_name */,
+                       char const * /* long_name */,
+                       char const * const value,
+                       void       * /* opt_data */,
+                       void       * /* cb_data */)
+{
+    ConstMemory const value_mem = ConstMemory (value, value ? strlen (value) : 0);
+    if (!LogLevel::fromString (value_mem, &options.loglevel)) {
+        logE_ (_func, "Invalid loglevel name \"", value_mem, "\", using \"Warning\"");
+        options.loglevel = LogLevel::Warning;
+    }
+    return true;
+}
+
+} // namespace {}
+
+int main (int argc, char **argv)
+{
+    libMaryInit ();
+
+    {
+        unsigned const num_opts = 17;
+        CmdlineOption opts [num_opts];
+
+        opts [0].short_name = "h";
+        opts [0].long_name  = "help";
+        opts [0].with_value = false;
+        opts [0].opt_data   = NULL;
+        opts [0].opt_callback = cmdline_help;
+
+        opts [1].short_name = NULL;
+        opts [1].long_name  = "port";
+        opts [1].with_value = true;
+        opts [1].opt_data   = &options.port;
+        opts [1].opt_callback = cmdline_uint32;
+
+        opts [2].short_name = "t";
+        opts [2].long_name  = "threads";
+        opts [2].with_value = true;
+        opts [2].opt_data   = &options.num_threads;
+        opts [2].opt_callback = cmdline_uint32;
+
+        opts [3].short_name = NULL;
+        opts [3].long_name  = "scenario";
+        opts [3].with_value = true;
+        opts [3].opt_data   = NULL;
+        opts [3].opt_callback = cmdline_scenario;
+
+        opts [4].short_name = NULL;
+        opts [4].long_name  = "players";
+        opts [4].with_value = true;
+        opts [4].opt_data   = &options.num_players;
+        opts [4].opt_callback = cmdline_uint32;
+
+        opts [5].short_name = NULL;
+        opts [5].long_name  = "storm-players";
+        opts [5].with_value = true;
+        opts [5].opt_data   = &options.num_storm_players;
+        opts [5].opt_callback = cmdline_uint32;
+
+        opts [6].short_name = NULL;
+        opts [6].long_name  = "slow-readers";
+        opts [6].with_value = true;
+        opts [6].opt_data   = &options.num_slow_readers;
+        opts [6].opt_callback = cmdline_uint32;
+
+        opts [7].short_name = NULL;
+        opts [7].long_name  = "slow-rate";
+        opts [7].with_value = true;
+        opts [7].opt_data   = &options.slow_read_rate;
+        opts [7].opt_callback = cmdline_uint32;
+
+        opts [8].short_name = "s";
+        opts [8].long_name  = "frame-size";
+        opts [8].with_value = true;
+        opts [8].opt_data   = &options.frame_size;
+        opts [8].opt_callback = cmdline_uint32;
+
+        opts [9].short_name = NULL;
+        opts [9].long_name  = "frame-duration";
+        opts [9].with_value = true;
+        opts [9].opt_data   = &options.frame_duration;
+        opts [9].opt_callback = cmdline_uint32;
+
+        opts [10].short_name = NULL;
+        opts [10].long_name  = "warmup";
+        opts [10].with_value = true;
+        opts [10].opt_data   = &options.warmup_sec;
+        opts [10].opt_callback = cmdline_uint32;
+
+        opts [11].short_name = "d";
+        opts [11].long_name  = "duration";
+        opts [11].with_value = true;
+        opts [11].opt_data   = &options.duration_sec;
+        opts [11].opt_callback = cmdline_uint32;
+
+        opts [12].short_name = NULL;
+        opts [12].long_name  = "min-delivery";
+        opts [12].with_value = true;
+        opts [12].opt_data   = &options.min_delivery_percent;
+        opts [12].opt_callback = cmdline_uint32;
+
+        opts [13].short_name = NULL;
+        opts [13].long_name  = "max-latency";
+        opts [13].with_value = true;
+        opts [13].opt_data   = &options.max_latency_millisec;
+        opts [13].opt_callback = cmdline_uint32;
+
+        opts [14].short_name = NULL;
+        opts [14].long_name  = "max-memory";
+        opts [14].with_value = true;
+        opts [14].opt_data   = &options.max_memory_growth_mb;
+        opts [14].opt_callback = cmdline_uint32;
+
+        opts [15].short_name = NULL;
+        opts [15].long_name  = "loglevel";
+        opts [15].with_value = true;
+        opts [15].opt_data   = NULL;
+        opts [15].opt_callback = cmdline_loglevel;
+
+        ArrayIterator<CmdlineOption> opts_iter (opts, num_opts - 1);
+        parseCmdline (&argc, &argv, opts_iter, NULL /* callback */, NULL /* callbackData */);
+    }
+
+    if (options.help) {
+        printUsage ();
+        return 0;
+    }
+
+    setGlobalLogLevel (options.loglevel);
+
+    if (options.frame_size < TestStreamGenerator::FrameMark::Offset + TestStreamGenerator::FrameMark::Len) {
+        logE_ (_func, "--frame-size is too small for frame marks");
+        return EXIT_FAILURE;
+    }
+
+    Ref<TestServerInstance> const test_instance = grab (new (std::nothrow) TestServerInstance);
+    if (test_instance->run ())
+        return 0;
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+/*  Moment Video Server - High performance media server
+    Copyright (C) 2013 Dmitry Shatrov
+    e-mail: shatrov@gmail.com
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// test__timeshift: a TimeshiftReader which falls behind segment expiry.
+//
+// The reader seeks to the start of the first segment file without reading
+// from it. The stream then goes on until that segment is removed, and the
+// reader is expected to continue from the oldest keyframe left in the
+// window. After TimeshiftBuffer::release(), flush() must not create any
+// new segment files.
+//
+// The event loop is never run: flush() is called directly.
+
+
+#include <libmary/types.h>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <moment/libmoment.h>
+
+
+using namespace M;
+using namespace Moment;
+
+namespace {
+
+enum {
+    Window_Sec         = 120,
+    FrameSize          = 1000,
+    KeyframePeriod_Sec = 10,
+    // One frame per second.
+    NumFrames          = 300
+};
+
+class TestInstance : public Object
+{
+private:
+    PagePool  page_pool;
+    ServerApp server_app;
+
+    void feedFrames (VideoStream * const mt_nonnull stream,
+                     Uint64        const from_sec,
+                     Uint64        const to_sec)
+    {
+        Byte payload [FrameSize];
+        for (Uint64 sec = from_sec; sec < to_sec; ++sec) {
+            memset (payload, (Byte) sec, sizeof (payload));
+
+            VideoStream::VideoMessage msg;
+            msg.codec_id = VideoStream::VideoCodecId::AVC;
+            msg.frame_type = (sec % KeyframePeriod_Sec == 0 ? VideoStream::VideoFrameType::KeyFrame
+                                                            : VideoStream::VideoFrameType::InterFrame);
+            msg.timestamp_nanosec = sec * 1000000000;
+            msg.prechunk_size = 0;
+            msg.page_pool = &page_pool;
+            msg.page_list.reset ();
+            page_pool.getFillPages (&msg.page_list, ConstMemory (payload, sizeof (payload)));
+            msg.msg_offset = 0;
+            msg.msg_len = sizeof (payload);
+
+            stream->fireVideoMessage (&msg);
+            msg.release ();
+        }
+    }
+
+    static Count countFiles (char const * const dirname)
+    {
+        DIR * const dir = opendir (dirname);
+        if (!dir)
+            return 0;
+
+        Count num_files = 0;
+        while (struct dirent * const entry = readdir (dir)) {
+            if (strcmp (entry->d_name, ".") && strcmp (entry->d_name, ".."))
+                ++num_files;
+        }
+
+        closedir (dir);
+        return num_files;
+    }
+
+    Result checkReader (TimeshiftBuffer * const mt_nonnull buffer,
+                        VideoStream     * const mt_nonnull stream)
+    {
+        MediaReader * const reader = buffer->createReader ();
+        reader->setPagePool (&page_pool);
+
+        Result res = Result::Failure;
+        do {
+            if (!reader->open (ConstMemory())) {
+                errs->print ("open() failed: ", exc->toString(), "\n");
+                break;
+            }
+
+            // Positions the reader at the start of the first segment file.
+            if (!reader->seek (0)) {
+                errs->print ("seek() failed: ", exc->toString(), "\n");
+                break;
+            }
+
+            feedFrames (stream, NumFrames / 5, NumFrames);
+            buffer->flush ();
+
+            MediaReader::Frame frame;
+            IoResult const io_res = reader->readFrame (&frame);
+            if (io_res == IoResult::Error) {
+                errs->print ("readFrame() after expiry failed: ", exc->toString(), "\n");
+                break;
+            }
+
+            if (io_res == IoResult::Eof) {
+                errs->print ("readFrame() after expiry: no frames\n");
+                break;
+            }
+
+            // Segments of [0, 60), [60, 120) and [120, 180) are out of the window.
+            Uint64 const expected_millisec = (NumFrames - Window_Sec) * 1000;
+
+            Byte first_byte = 0;
+            VideoStream::Message * const msg = frame.getMessage ();
+            PagePool::PageListArray pl_array (msg->page_list.first, msg->msg_offset, msg->msg_len);
+            pl_array.get (0, Memory::forObject (first_byte));
+
+            bool const ok = !frame.is_audio
+                            && frame.video_msg.frame_type == VideoStream::VideoFrameType::KeyFrame
+                            && frame.timestamp_millisec == expected_millisec
+                            && msg->msg_len == FrameSize
+                            && first_byte == (Byte) (expected_millisec / 1000);
+            if (!ok) {
+                errs->print ("unexpected frame after expiry: ts ", frame.timestamp_millisec,
+                             " (expected ", expected_millisec, "), len ", msg->msg_len, "\n");
+                frame.release ();
+                break;
+            }
+
+            frame.release ();
+            res = Result::Success;
+        } while (0);
+
+        reader->close ();
+        delete reader;
+
+        return res;
+    }
+
+public:
+    Result run ()
+    {
+        if (!server_app.init ()) {
+            errs->print ("server_app.init() failed: ", exc->toString(), "\n");
+            return Result::Failure;
+        }
+
+        char dirname [] = "/tmp/test__timeshift_XXXXXX";
+        if (!mkdtemp (dirname)) {
+            errs->print ("mkdtemp() failed: ", errnoString (errno), "\n");
+            return Result::Failure;
+        }
+
+        Ref<VideoStream> const stream = grab (new (std::nothrow) VideoStream);
+
+        Ref<TimeshiftBuffer> const buffer = grab (new (std::nothrow) TimeshiftBuffer);
+        buffer->init (&page_pool,
+                      server_app.getServerContext()->getMainThreadContext()->getTimers(),
+                      ConstMemory ("test"),
+                      ConstMemory (dirname, strlen (dirname)),
+                      Window_Sec,
+                      0 /* memory_window_sec */);
+        buffer->setVideoStream (stream);
+
+        feedFrames (stream, 0, NumFrames / 5);
+        buffer->flush ();
+
+        Result res = checkReader (buffer, stream);
+
+        buffer->release ();
+        buffer->flush ();
+
+        Count const num_files = countFiles (dirname);
+        if (num_files != 0) {
+            errs->print (num_files, " segment files left after release()\n");
+            res = Result::Failure;
+        }
+
+        rmdir (dirname);
+        return res;
+    }
+
+    TestInstance ()
+        : page_pool  (this /* coderef_container */, 4096 /* page_size */, 4096 /* min_pages */),
+          server_app (this /* coderef_container */)
+    {}
+};
+
+} // namespace {}
+
+int main (void)
+{
+    libMaryInit ();
+
+    Result res = Result::Failure;
+    {
+        Ref<TestInstance> const test_instance = grab (new (std::nothrow) TestInstance);
+        res = test_instance->run ();
+    }
+
+    if (!res) {
+        errs->print ("FAILED\n");
+        errs->flush ();
+        return EXIT_FAILURE;
+    }
+
+    outs->print ("PASSED\n");
+    outs->flush ();
+    return 0;
+}
+